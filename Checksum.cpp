@@ -0,0 +1,152 @@
+#include "Checksum.h"
+#include <cstring>
+
+#define ADLER_MOD 65521u
+
+// Most bytes that can be summed before 'b' could overflow 32 bits
+#define ADLER_NMAX 5552
+
+uint32_t adler32(uint32_t adler, const char* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (length > 0) {
+        size_t block = length < ADLER_NMAX ? length : ADLER_NMAX;
+        length -= block;
+        while (block >= 8) {
+            a += p[0]; b += a;
+            a += p[1]; b += a;
+            a += p[2]; b += a;
+            a += p[3]; b += a;
+            a += p[4]; b += a;
+            a += p[5]; b += a;
+            a += p[6]; b += a;
+            a += p[7]; b += a;
+            p += 8;
+            block -= 8;
+        }
+        while (block > 0) {
+            a += *p++;
+            b += a;
+            block--;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return (b << 16) | a;
+}
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME5 0x27D4EB2F165667C5ull
+
+static uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read64(const unsigned char* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static uint64_t read32(const unsigned char* p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static uint64_t xxhRound(uint64_t lane, uint64_t input) {
+    lane += input * XXH_PRIME2;
+    return rotateLeft(lane, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxhMerge(uint64_t hash, uint64_t lane) {
+    hash ^= xxhRound(0, lane);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+Hash64::Hash64() : pendingLength(0), totalLength(0) {
+    lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    lanes[1] = XXH_PRIME2;
+    lanes[2] = 0;
+    lanes[3] = 0 - XXH_PRIME1;
+}
+
+void Hash64::update(const char* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    totalLength += length;
+    if (pendingLength + length < 32) {
+        memcpy(pending + pendingLength, p, length);
+        pendingLength += length;
+        return;
+    }
+    if (pendingLength > 0) {
+        size_t fill = 32 - pendingLength;
+        memcpy(pending + pendingLength, p, fill);
+        for (int i = 0; i < 4; i++) {
+            lanes[i] = xxhRound(lanes[i], read64(pending + 8 * i));
+        }
+        p += fill;
+        length -= fill;
+        pendingLength = 0;
+    }
+    while (length >= 32) {
+        lanes[0] = xxhRound(lanes[0], read64(p));
+        lanes[1] = xxhRound(lanes[1], read64(p + 8));
+        lanes[2] = xxhRound(lanes[2], read64(p + 16));
+        lanes[3] = xxhRound(lanes[3], read64(p + 24));
+        p += 32;
+        length -= 32;
+    }
+    memcpy(pending, p, length);
+    pendingLength = length;
+}
+
+uint64_t Hash64::digest() const {
+    uint64_t hash;
+    if (totalLength >= 32) {
+        hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxhMerge(hash, lanes[i]);
+        }
+    } else {
+        hash = lanes[2] + XXH_PRIME5;
+    }
+    hash += totalLength;
+
+    const unsigned char* p = pending;
+    size_t length = pendingLength;
+    while (length >= 8) {
+        hash ^= xxhRound(0, read64(p));
+        hash = rotateLeft(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+        length -= 8;
+    }
+    if (length >= 4) {
+        hash ^= read32(p) * XXH_PRIME1;
+        hash = rotateLeft(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        hash ^= *p++ * XXH_PRIME5;
+        hash = rotateLeft(hash, 11) * XXH_PRIME1;
+        length--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t hash64(const char* data, size_t length) {
+    Hash64 hash;
+    hash.update(data, length);
+    return hash.digest();
+}
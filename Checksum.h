@@ -0,0 +1,69 @@
+#pragma once
+
+// Checksums for file transfer and delta sync.
+//
+// Adler-32 (RFC 1950) checks file transfers. The value after some bytes is
+// the state for the bytes that follow, so a receiver checks data as it
+// arrives and either end can pick a transfer up from a checksum it kept.
+//
+// Delta sync matches blocks the way rsync does: a cheap checksum that can
+// slide along a file a byte at a time finds candidate blocks, and a strong
+// hash (XXH64) confirms them and checks each rebuilt file as a whole.
+
+#include <cstdint>
+#include <cstddef>
+
+#define ADLER32_INIT 1u
+
+uint32_t adler32(uint32_t adler, const char* data, size_t length);
+
+// Added to every byte, so runs of zeros still change the sums
+#define ROLLING_CHAR_OFFSET 31
+
+// rsync's weak checksum of a fixed-size window
+class RollingChecksum {
+private:
+    uint32_t a;
+    uint32_t b;
+    uint32_t length;
+
+public:
+    RollingChecksum() : a(0), b(0), length(0) {}
+
+    void reset(const char* data, size_t size) {
+        a = 0;
+        b = 0;
+        length = (uint32_t)size;
+        for (size_t i = 0; i < size; i++) {
+            a += (unsigned char)data[i] + ROLLING_CHAR_OFFSET;
+            b += a;
+        }
+    }
+
+    // Moves the window on by a byte: 'out' leaves at the front, 'in' joins
+    // at the back
+    void roll(unsigned char out, unsigned char in) {
+        a += (uint32_t)in - out;
+        b += a - length * (out + ROLLING_CHAR_OFFSET);
+    }
+
+    uint32_t value() const {
+        return (a & 0xFFFF) | (b << 16);
+    }
+};
+
+// XXH64, fed in pieces of any size
+class Hash64 {
+private:
+    uint64_t lanes[4];
+    unsigned char pending[32];
+    size_t pendingLength;
+    uint64_t totalLength;
+
+public:
+    Hash64();
+    void update(const char* data, size_t length);
+    uint64_t digest() const;
+};
+
+uint64_t hash64(const char* data, size_t length);
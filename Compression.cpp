@@ -0,0 +1,234 @@
+#include "Compression.h"
+#include <cstring>
+#include <algorithm>
+
+#define HASH_BITS 14
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     // Never start a match this close to the end of a block
+
+static uint32_t read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hashPosition(const char* p) {
+    return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void writeLength(std::string& out, size_t length) {
+    while (length >= 255) {
+        out += (char)255;
+        length -= 255;
+    }
+    out += (char)length;
+}
+
+static void writeSequence(std::string& out, const char* literals, size_t literalLength, size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength ? matchLength - MIN_MATCH : 0;
+    unsigned char token = (unsigned char)(((literalLength < 15 ? literalLength : 15) << 4) |
+                                          (matchCode < 15 ? matchCode : 15));
+    out += (char)token;
+    if (literalLength >= 15) {
+        writeLength(out, literalLength - 15);
+    }
+    out.append(literals, literalLength);
+    if (matchLength == 0) {
+        return;
+    }
+    out += (char)(offset & 0xFF);
+    out += (char)(offset >> 8);
+    if (matchCode >= 15) {
+        writeLength(out, matchCode - 15);
+    }
+}
+
+StreamCompressor::StreamCompressor() : windowLength(0), hashTable((size_t)1 << HASH_BITS, 0) {
+}
+
+size_t StreamCompressor::reserve(size_t length) {
+    // Slide the window so only the last COMPRESSION_WINDOW bytes are kept
+    // ahead of the new data, rebasing the hash table to match
+    if (windowLength + length > window.size()) {
+        size_t keep = windowLength < COMPRESSION_WINDOW ? windowLength : COMPRESSION_WINDOW;
+        size_t shift = windowLength - keep;
+        if (shift > 0) {
+            memmove(&window[0], &window[shift], keep);
+            for (size_t i = 0; i < hashTable.size(); i++) {
+                hashTable[i] = hashTable[i] > shift ? (uint32_t)(hashTable[i] - shift) : 0;
+            }
+            windowLength = keep;
+        }
+        if (windowLength + length > window.size()) {
+            window.resize(windowLength + length + COMPRESSION_WINDOW);
+        }
+    }
+
+    size_t start = windowLength;
+    windowLength += length;
+    return start;
+}
+
+void StreamCompressor::reset() {
+    windowLength = 0;
+    std::fill(hashTable.begin(), hashTable.end(), 0);
+}
+
+bool StreamCompressor::compress(const char* data, size_t length, std::string& out) {
+    CompressInput piece = { data, length };
+    return compress(&piece, 1, out);
+}
+
+bool StreamCompressor::compress(const CompressInput* pieces, size_t count, std::string& out) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        length += pieces[i].length;
+    }
+
+    // The block is compressed from its copy in the history window
+    size_t start = reserve(length);
+    size_t copied = start;
+    for (size_t i = 0; i < count; i++) {
+        if (pieces[i].length > 0) {
+            memcpy(&window[copied], pieces[i].data, pieces[i].length);
+            copied += pieces[i].length;
+        }
+    }
+    if (length < COMPRESSION_MIN_INPUT) {
+        return false;
+    }
+
+    const char* base = window.data();
+    size_t end = start + length;
+    size_t matchLimit = end - LAST_LITERALS;
+    size_t anchor = start;
+    size_t ip = start;
+
+    out.clear();
+    out.reserve(length + length / 255 + 16);
+
+    while (ip + MIN_MATCH <= matchLimit) {
+        uint32_t& slot = hashTable[hashPosition(base + ip)];
+        size_t candidate = slot;
+        slot = (uint32_t)(ip + 1);
+
+        if (candidate == 0 || ip - (candidate - 1) > COMPRESSION_WINDOW ||
+            read32(base + candidate - 1) != read32(base + ip)) {
+            ip++;
+            continue;
+        }
+
+        size_t ref = candidate - 1;
+        size_t matchLength = MIN_MATCH;
+        while (ip + matchLength < matchLimit && base[ref + matchLength] == base[ip + matchLength]) {
+            matchLength++;
+        }
+
+        writeSequence(out, base + anchor, ip - anchor, ip - ref, matchLength);
+        ip += matchLength;
+        anchor = ip;
+
+        // Give up early on data that isn't compressing
+        if (out.length() >= length) {
+            return false;
+        }
+    }
+
+    writeSequence(out, base + anchor, end - anchor, 0, 0);
+    return out.length() < length;
+}
+
+StreamDecompressor::StreamDecompressor() : windowLength(0) {
+}
+
+void StreamDecompressor::reset() {
+    windowLength = 0;
+}
+
+void StreamDecompressor::slide() {
+    if (windowLength > 2 * COMPRESSION_WINDOW) {
+        size_t shift = windowLength - COMPRESSION_WINDOW;
+        memmove(&window[0], &window[shift], COMPRESSION_WINDOW);
+        windowLength = COMPRESSION_WINDOW;
+    }
+}
+
+void StreamDecompressor::appendHistory(const char* data, size_t length) {
+    slide();
+    if (windowLength + length > window.size()) {
+        window.resize(windowLength + length + COMPRESSION_WINDOW);
+    }
+    memcpy(&window[windowLength], data, length);
+    windowLength += length;
+}
+
+static bool readLength(const unsigned char*& p, const unsigned char* end, size_t& length) {
+    unsigned char byte;
+    do {
+        if (p >= end) {
+            return false;
+        }
+        byte = *p++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool StreamDecompressor::decompress(const char* data, size_t length, const char*& out, size_t& outLength, size_t maxOutput) {
+    slide();
+
+    size_t start = windowLength;
+    if (window.size() < start + maxOutput) {
+        window.resize(start + maxOutput + COMPRESSION_WINDOW);
+    }
+    char* base = &window[0];
+    size_t limit = start + maxOutput;
+    size_t op = start;
+
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + length;
+    while (p < end) {
+        unsigned char token = *p++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(p, end, literalLength)) {
+            return false;
+        }
+        if (literalLength > (size_t)(end - p) || op + literalLength > limit) {
+            return false;
+        }
+        memcpy(base + op, p, literalLength);
+        p += literalLength;
+        op += literalLength;
+
+        if (p == end) {
+            break;  // Last sequence has no match
+        }
+
+        if (end - p < 2) {
+            return false;
+        }
+        size_t offset = p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(p, end, matchLength)) {
+            return false;
+        }
+        matchLength += MIN_MATCH;
+        if (offset == 0 || offset > op || op + matchLength > limit) {
+            return false;
+        }
+
+        // Byte by byte: the match may overlap the bytes it produces
+        const char* match = base + op - offset;
+        for (size_t i = 0; i < matchLength; i++) {
+            base[op + i] = match[i];
+        }
+        op += matchLength;
+    }
+
+    windowLength = op;
+    out = base + start;
+    outLength = op - start;
+    return true;
+}
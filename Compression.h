@@ -0,0 +1,69 @@
+#pragma once
+
+// Streaming LZ77 compression for shell output frames.
+//
+// The block format follows LZ4: a sequence is a token byte (literal length
+// in the high nibble, match length - 4 in the low nibble, 15 meaning "more
+// bytes follow"), the literals, then a 2-byte little-endian match offset.
+// The last sequence of a block carries literals only.
+//
+// Both ends keep the last COMPRESSION_WINDOW bytes of the connection's
+// output as history, so a block can reference text from earlier frames
+// (repeated compiler command lines, paths, prompts). Every block is complete
+// on its own given that history: nothing is held back waiting for more
+// input, so compression adds no latency to interactive output.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define COMPRESSION_WINDOW 65535
+#define COMPRESSION_MIN_INPUT 64    // Smaller payloads are sent uncompressed
+
+// One piece of a block that is stored in several buffers
+struct CompressInput {
+    const char* data;
+    size_t length;
+};
+
+class StreamCompressor {
+private:
+    std::vector<char> window;
+    size_t windowLength;
+    std::vector<uint32_t> hashTable;    // Window position + 1 of the last occurrence, 0 if none
+
+    size_t reserve(size_t length);
+
+public:
+    StreamCompressor();
+
+    // Adds 'data' to the history and compresses it into 'out'. Returns false
+    // if compression didn't pay off; the caller then sends 'data' as is.
+    bool compress(const char* data, size_t length, std::string& out);
+
+    // Same, for a block made of the concatenated pieces
+    bool compress(const CompressInput* pieces, size_t count, std::string& out);
+    // Forgets the history, so the next block can be decoded on its own
+    void reset();
+};
+
+class StreamDecompressor {
+private:
+    std::vector<char> window;
+    size_t windowLength;
+
+    void slide();
+
+public:
+    StreamDecompressor();
+
+    // Decodes a compressed block. On success 'out' points into the history
+    // window and stays valid until the next call on this object.
+    bool decompress(const char* data, size_t length, const char*& out, size_t& outLength, size_t maxOutput);
+
+    // Records a payload that was sent uncompressed
+    void appendHistory(const char* data, size_t length);
+    // Forgets the history, to decode a block from a reset compressor
+    void reset();
+};
@@ -0,0 +1,336 @@
+#include "DeltaSync.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+static bool seekFile(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+uint32_t syncBlockSize(uint64_t fileSize) {
+    uint64_t block = (uint64_t)std::sqrt((double)fileSize);
+    uint64_t fewest = (fileSize + SYNC_MAX_BLOCKS - 1) / SYNC_MAX_BLOCKS;
+    block = std::max(std::max(block, fewest), (uint64_t)SYNC_MIN_BLOCK);
+    return (uint32_t)((block + 7) & ~(uint64_t)7);
+}
+
+int syncThreads(size_t files) {
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min(std::min(threads, (size_t)SYNC_MAX_THREADS), files);
+    return (int)std::max(threads, (size_t)1);
+}
+
+int64_t syncWriteTime(std::filesystem::file_time_type time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::file_clock::to_sys(time).time_since_epoch()).count();
+}
+
+std::filesystem::file_time_type syncFileTime(int64_t writeTime) {
+    std::chrono::sys_time<std::chrono::nanoseconds> time{std::chrono::nanoseconds(writeTime)};
+    return std::chrono::time_point_cast<std::filesystem::file_time_type::duration>(std::chrono::file_clock::from_sys(time));
+}
+
+bool computeSignature(FILE* file, uint64_t size, const std::atomic<bool>& cancelled, FileSignature& signature) {
+    signature.blockSize = syncBlockSize(size);
+    signature.size = size;
+    signature.blocks.clear();
+    signature.blocks.reserve((size_t)((size + signature.blockSize - 1) / signature.blockSize));
+
+    std::vector<char> block(signature.blockSize);
+    RollingChecksum weak;
+    for (uint64_t offset = 0; offset < size; offset += signature.blockSize) {
+        if (cancelled) {
+            return false;
+        }
+        size_t length = (size_t)std::min((uint64_t)signature.blockSize, size - offset);
+        if (fread(block.data(), 1, length, file) != length) {
+            return false;
+        }
+        BlockSignature entry;
+        weak.reset(block.data(), length);
+        entry.weak = weak.value();
+        entry.strong = hash64(block.data(), length);
+        signature.blocks.push_back(entry);
+    }
+    return true;
+}
+
+DeltaEncoder::DeltaEncoder(const FileSignature& signature) : signature(signature), weakSeen(65536, false),
+    lastLength(0), bodyPrefix(0), bodyCopyBytes(0), runBlock(0), runCount(0), literalBytes(0), matchedBytes(0),
+    hash(0) {
+    // Only whole blocks can match as the window slides; a short last block
+    // can only match the end of the file
+    uint32_t count = (uint32_t)signature.blocks.size();
+    if (count > 0) {
+        lastLength = (uint32_t)(signature.size - (uint64_t)(count - 1) * signature.blockSize);
+    }
+    fullBlocks.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        if (i + 1 < count || lastLength == signature.blockSize) {
+            fullBlocks.emplace(signature.blocks[i].weak, i);
+            weakSeen[signature.blocks[i].weak & 0xFFFF] = true;
+        }
+    }
+}
+
+int64_t DeltaEncoder::findBlock(const char* window, uint32_t weak) {
+    if (!weakSeen[weak & 0xFFFF]) {
+        return -1;
+    }
+    // The block after the last one copied is the likeliest, and extends the
+    // run
+    uint64_t strong = 0;
+    bool hashed = false;
+    uint32_t next = runBlock + runCount;
+    if (runCount > 0 && next < signature.blocks.size() && signature.blocks[next].weak == weak &&
+        (next + 1 < signature.blocks.size() || lastLength == signature.blockSize)) {
+        strong = hash64(window, signature.blockSize);
+        hashed = true;
+        if (signature.blocks[next].strong == strong) {
+            return next;
+        }
+    }
+    std::pair<std::unordered_multimap<uint32_t, uint32_t>::iterator, std::unordered_multimap<uint32_t, uint32_t>::iterator>
+        candidates = fullBlocks.equal_range(weak);
+    for (std::unordered_multimap<uint32_t, uint32_t>::iterator it = candidates.first; it != candidates.second; ++it) {
+        if (!hashed) {
+            strong = hash64(window, signature.blockSize);
+            hashed = true;
+        }
+        if (signature.blocks[it->second].strong == strong) {
+            return it->second;
+        }
+    }
+    return -1;
+}
+
+bool DeltaEncoder::flushBody() {
+    if (!flushRun()) {
+        return false;
+    }
+    if (body.length() > bodyPrefix && !emit(body)) {
+        return false;
+    }
+    body.resize(bodyPrefix);
+    bodyCopyBytes = 0;
+    return true;
+}
+
+bool DeltaEncoder::flushRun() {
+    if (runCount > 0) {
+        appendSyncCopy(body, runBlock, runCount);
+        runCount = 0;
+    }
+    return true;
+}
+
+bool DeltaEncoder::addCopy(uint32_t block, uint32_t length) {
+    matchedBytes += length;
+    if (runCount > 0 && block == runBlock + runCount && bodyCopyBytes + length <= SYNC_COPY_BYTES) {
+        runCount++;
+        bodyCopyBytes += length;
+        return true;
+    }
+    if (!flushRun()) {
+        return false;
+    }
+    if (bodyCopyBytes + length > SYNC_COPY_BYTES && !flushBody()) {
+        return false;
+    }
+    runBlock = block;
+    runCount = 1;
+    bodyCopyBytes += length;
+    return true;
+}
+
+bool DeltaEncoder::addData(const char* data, size_t length) {
+    if (length == 0) {
+        return true;
+    }
+    literalBytes += length;
+    if (!flushRun()) {
+        return false;
+    }
+    if (body.length() - bodyPrefix + length > SYNC_DATA_BYTES && !flushBody()) {
+        return false;
+    }
+    appendSyncData(body, data, length);
+    return true;
+}
+
+bool DeltaEncoder::encode(FILE* file, std::function<bool(const std::string& body)> emitBody) {
+    emit = emitBody;
+    body = makeSyncFileHeader(signature.file);
+    bodyPrefix = body.length();
+    Hash64 fileHash;
+
+    // The buffer holds the pending new bytes ('start' to 'position', never
+    // more than SYNC_DATA_BYTES) and the window at 'position'; both move to
+    // the front before each read
+    uint32_t blockSize = signature.blockSize;
+    std::vector<char> buffer(2 * ((size_t)SYNC_DATA_BYTES + blockSize));
+    size_t start = 0;
+    size_t position = 0;
+    size_t end = 0;
+    bool atEnd = false;
+    bool rolling = false;
+    RollingChecksum weak;
+
+    while (true) {
+        if (!atEnd && end - position <= blockSize) {
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            position -= start;
+            end -= start;
+            start = 0;
+            size_t bytes = fread(buffer.data() + end, 1, buffer.size() - end, file);
+            if (bytes == 0) {
+                if (ferror(file)) {
+                    return false;
+                }
+                atEnd = true;
+            }
+            fileHash.update(buffer.data() + end, bytes);
+            end += bytes;
+        }
+
+        size_t available = end - position;
+        if (available < blockSize || signature.blocks.empty()) {
+            if (available == 0 || signature.blocks.empty()) {
+                if (atEnd) {
+                    break;
+                }
+                // Nothing to match against: all of it is new
+                if (!addData(buffer.data() + start, end - start)) {
+                    return false;
+                }
+                start = position = end;
+                continue;
+            }
+            if (!atEnd) {
+                continue;
+            }
+            // Only the short last block can match what is left
+            uint32_t last = (uint32_t)signature.blocks.size() - 1;
+            if (available == lastLength && lastLength < blockSize) {
+                weak.reset(buffer.data() + position, available);
+                if (weak.value() == signature.blocks[last].weak &&
+                    hash64(buffer.data() + position, available) == signature.blocks[last].strong) {
+                    if (!addData(buffer.data() + start, position - start) || !addCopy(last, lastLength)) {
+                        return false;
+                    }
+                    start = position = end;
+                }
+            }
+            break;
+        }
+
+        if (!rolling) {
+            weak.reset(buffer.data() + position, blockSize);
+            rolling = true;
+        }
+        int64_t block = findBlock(buffer.data() + position, weak.value());
+        if (block >= 0) {
+            if (!addData(buffer.data() + start, position - start) || !addCopy((uint32_t)block, blockSize)) {
+                return false;
+            }
+            position += blockSize;
+            start = position;
+            rolling = false;
+            continue;
+        }
+
+        // No block starts here: the byte is new, and the window moves on
+        if (position + 1 - start >= SYNC_DATA_BYTES) {
+            if (!addData(buffer.data() + start, position + 1 - start)) {
+                return false;
+            }
+            start = position + 1;
+        }
+        if (available > blockSize) {
+            weak.roll((unsigned char)buffer[position], (unsigned char)buffer[position + blockSize]);
+        } else {
+            rolling = false;
+        }
+        position++;
+    }
+
+    if (!addData(buffer.data() + start, end - start) || !flushBody()) {
+        return false;
+    }
+    hash = fileHash.digest();
+    return true;
+}
+
+DeltaApplier::DeltaApplier(FILE* basis, uint64_t basisSize, uint32_t blockSize, FILE* output) : basis(basis),
+    basisSize(basisSize), blockSize(blockSize), output(output), buffer(SYNC_DATA_BYTES), written(0),
+    literalBytes(0) {
+}
+
+bool DeltaApplier::write(const char* data, size_t length) {
+    if (fwrite(data, 1, length, output) != length) {
+        return false;
+    }
+    hash.update(data, length);
+    written += length;
+    return true;
+}
+
+bool DeltaApplier::copyBlocks(uint32_t block, uint32_t count) {
+    uint64_t blocks = blockSize ? (basisSize + blockSize - 1) / blockSize : 0;
+    if (!basis || count == 0 || block >= blocks || count > blocks - block) {
+        return false;
+    }
+    uint64_t offset = (uint64_t)block * blockSize;
+    uint64_t length = std::min((uint64_t)count * blockSize, basisSize - offset);
+    if (!seekFile(basis, offset)) {
+        return false;
+    }
+    while (length > 0) {
+        size_t piece = (size_t)std::min(length, (uint64_t)buffer.size());
+        if (fread(buffer.data(), 1, piece, basis) != piece || !write(buffer.data(), piece)) {
+            return false;
+        }
+        length -= piece;
+    }
+    return true;
+}
+
+bool DeltaApplier::apply(const char* operations, size_t length) {
+    const char* p = operations;
+    const char* end = operations + length;
+    while (p < end) {
+        uint8_t operation = (uint8_t)*p++;
+        if (end - p < 4) {
+            return false;
+        }
+        const unsigned char* field = (const unsigned char*)p;
+        uint32_t first = (uint32_t)field[0] | ((uint32_t)field[1] << 8) | ((uint32_t)field[2] << 16) | ((uint32_t)field[3] << 24);
+        p += 4;
+        if (operation == SYNC_COPY) {
+            if (end - p < 4) {
+                return false;
+            }
+            field = (const unsigned char*)p;
+            uint32_t count = (uint32_t)field[0] | ((uint32_t)field[1] << 8) | ((uint32_t)field[2] << 16) | ((uint32_t)field[3] << 24);
+            p += 4;
+            if (!copyBlocks(first, count)) {
+                return false;
+            }
+        } else if (operation == SYNC_DATA) {
+            if ((size_t)(end - p) < first || !write(p, first)) {
+                return false;
+            }
+            literalBytes += first;
+            p += first;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+// The delta algorithm behind directory sync (FEATURE_SYNC), rsync's: block
+// signatures of the old copy of a file, a delta of the new copy against
+// them, and the new copy rebuilt from the old one and the delta. How they
+// travel is in FrameProtocol.h.
+
+#include "FrameProtocol.h"
+#include "Checksum.h"
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <unordered_map>
+
+// Blocks are about the square root of the file's size, as in rsync, but no
+// smaller than this, and a file has at most SYNC_MAX_BLOCKS of them so its
+// signature fits in a frame
+#define SYNC_MIN_BLOCK 1024
+#define SYNC_MAX_BLOCKS 65536
+
+// A SYNC_DELTA carries at most this many new bytes and copies at most
+// SYNC_COPY_BYTES of the old file, which bounds the server's work for each
+// frame it applies
+#define SYNC_DATA_BYTES (64 * 1024)
+#define SYNC_COPY_BYTES (1024 * 1024)
+
+// SYNC_FILES and SYNC_SIGNATURES frames are sent once they reach this size
+#define SYNC_BATCH_BYTES (64 * 1024)
+
+// Most threads one sync computes signatures or deltas on
+#define SYNC_MAX_THREADS 8
+
+uint32_t syncBlockSize(uint64_t fileSize);
+int syncThreads(size_t files);
+
+// A file's last write time as SyncFile::writeTime, and back
+int64_t syncWriteTime(std::filesystem::file_time_type time);
+std::filesystem::file_time_type syncFileTime(int64_t writeTime);
+
+// The signature of the first 'size' bytes of 'file'. False if a read fails
+// or 'cancelled' is set meanwhile.
+bool computeSignature(FILE* file, uint64_t size, const std::atomic<bool>& cancelled, FileSignature& signature);
+
+// Scans the new copy of a file for blocks of the old one, as given by its
+// signature, and produces the SYNC_DELTA bodies that rebuild it
+class DeltaEncoder {
+private:
+    const FileSignature& signature;
+    std::unordered_multimap<uint32_t, uint32_t> fullBlocks;    // Weak checksum to block
+    std::vector<bool> weakSeen;         // By the weak checksum's low 16 bits
+    uint32_t lastLength;                // Of the last block
+    std::function<bool(const std::string& body)> emit;
+    std::string body;
+    size_t bodyPrefix;                  // The file index at the front of 'body'
+    uint64_t bodyCopyBytes;
+    uint32_t runBlock;                  // Consecutive blocks not yet added to 'body'
+    uint32_t runCount;
+
+    int64_t findBlock(const char* window, uint32_t weak);
+    bool addCopy(uint32_t block, uint32_t length);
+    bool addData(const char* data, size_t length);
+    bool flushRun();
+    bool flushBody();
+
+public:
+    uint64_t literalBytes;  // New bytes sent
+    uint64_t matchedBytes;  // Bytes taken from the old copy
+    uint64_t hash;          // hash64 of the new copy, once encode() returns
+
+    explicit DeltaEncoder(const FileSignature& signature);
+
+    // Reads 'file' to its end. 'emit' gets each SYNC_DELTA body, file index
+    // included, and returns false to stop.
+    bool encode(FILE* file, std::function<bool(const std::string& body)> emit);
+};
+
+// Rebuilds a file from its old copy ('basis', NULL if there was none) and
+// SYNC_DELTA operations, writing it to 'output' and hashing it as it goes
+class DeltaApplier {
+private:
+    FILE* basis;
+    uint64_t basisSize;
+    uint32_t blockSize;
+    FILE* output;
+    Hash64 hash;
+    std::vector<char> buffer;
+
+    bool write(const char* data, size_t length);
+    bool copyBlocks(uint32_t block, uint32_t count);
+
+public:
+    uint64_t written;
+    uint64_t literalBytes;  // Of 'written', those that came in the delta
+
+    DeltaApplier(FILE* basis, uint64_t basisSize, uint32_t blockSize, FILE* output);
+
+    // The operations of one SYNC_DELTA, after its file index. False if they
+    // are invalid or a read or write fails.
+    bool apply(const char* operations, size_t length);
+    uint64_t digest() const { return hash.digest(); }
+};
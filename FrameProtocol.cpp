@@ -0,0 +1,674 @@
+#include "FrameProtocol.h"
+#include <cstring>
+
+static void writeLE16(char* out, uint16_t value) {
+    out[0] = (char)(value & 0xFF);
+    out[1] = (char)(value >> 8);
+}
+
+static void writeLE32(char* out, uint32_t value) {
+    out[0] = (char)(value & 0xFF);
+    out[1] = (char)((value >> 8) & 0xFF);
+    out[2] = (char)((value >> 16) & 0xFF);
+    out[3] = (char)(value >> 24);
+}
+
+static void writeLE64(char* out, uint64_t value) {
+    writeLE32(out, (uint32_t)value);
+    writeLE32(out + 4, (uint32_t)(value >> 32));
+}
+
+static uint16_t readLE16(const char* in) {
+    const unsigned char* p = (const unsigned char*)in;
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t readLE32(const char* in) {
+    const unsigned char* p = (const unsigned char*)in;
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t readLE64(const char* in) {
+    return (uint64_t)readLE32(in) | ((uint64_t)readLE32(in + 4) << 32);
+}
+
+void encodeFrameHeader(char* out, uint8_t type, uint8_t stream, uint8_t flags, uint32_t length, uint16_t channel) {
+    writeLE16(out, FRAME_MAGIC);
+    out[2] = (char)PROTOCOL_VERSION;
+    out[3] = (char)type;
+    out[4] = (char)stream;
+    out[5] = (char)flags;
+    writeLE16(out + 6, channel);
+    writeLE32(out + 8, length);
+}
+
+std::string makeFrame(uint8_t type, uint8_t stream, const char* payload, size_t length, uint8_t flags, uint16_t channel) {
+    std::string frame(FRAME_HEADER_SIZE + length, '\0');
+    encodeFrameHeader(&frame[0], type, stream, flags, (uint32_t)length, channel);
+    if (length > 0) {
+        memcpy(&frame[FRAME_HEADER_SIZE], payload, length);
+    }
+    return frame;
+}
+
+std::string makeHelloFrame(const HelloPayload& hello) {
+    std::string payload(HELLO_PAYLOAD_SIZE, '\0');
+    writeLE32(&payload[0], hello.version);
+    writeLE32(&payload[4], hello.features);
+    if (!hello.token.empty()) {
+        // Older peers only read the first HELLO_PAYLOAD_SIZE bytes
+        char entry[10];
+        payload.append(hello.token, 0, SESSION_TOKEN_SIZE);
+        writeLE16(entry, (uint16_t)hello.offsets.size());
+        payload.append(entry, 2);
+        for (size_t i = 0; i < hello.offsets.size(); i++) {
+            writeLE16(entry, hello.offsets[i].channel);
+            writeLE64(entry + 2, hello.offsets[i].offset);
+            payload.append(entry, sizeof(entry));
+        }
+    }
+    return makeFrame(FRAME_HELLO, STREAM_CONTROL, payload.data(), payload.length());
+}
+
+bool decodeHello(const char* payload, size_t length, HelloPayload& hello) {
+    if (length < HELLO_PAYLOAD_SIZE) {
+        return false;
+    }
+    hello.version = readLE32(payload);
+    hello.features = readLE32(payload + 4);
+    hello.token.clear();
+    hello.offsets.clear();
+    if (length == HELLO_PAYLOAD_SIZE) {
+        return true;
+    }
+
+    if (length < HELLO_PAYLOAD_SIZE + SESSION_TOKEN_SIZE + 2) {
+        return false;
+    }
+    hello.token.assign(payload + HELLO_PAYLOAD_SIZE, SESSION_TOKEN_SIZE);
+    const char* entry = payload + HELLO_PAYLOAD_SIZE + SESSION_TOKEN_SIZE;
+    size_t count = readLE16(entry);
+    entry += 2;
+    if (length != (size_t)(entry - payload) + count * 10) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++, entry += 10) {
+        StreamOffset offset = { readLE16(entry), readLE64(entry + 2) };
+        hello.offsets.push_back(offset);
+    }
+    return true;
+}
+
+std::string makeWindowFrame(uint16_t channel, uint32_t bytes) {
+    char payload[4];
+    writeLE32(payload, bytes);
+    return makeFrame(FRAME_WINDOW, STREAM_CONTROL, payload, sizeof(payload), 0, channel);
+}
+
+bool decodeWindow(const char* payload, size_t length, uint32_t& bytes) {
+    if (length < 4) {
+        return false;
+    }
+    bytes = readLE32(payload);
+    return true;
+}
+
+std::string makeFileOpenFrame(uint16_t transfer, const FileOpenPayload& open) {
+    std::string payload(FILE_OPEN_PAYLOAD_SIZE, '\0');
+    payload[0] = (char)open.direction;
+    writeLE64(&payload[1], open.size);
+    writeLE64(&payload[9], open.offset);
+    writeLE32(&payload[17], open.checksum);
+    payload += open.path;
+    return makeFrame(FRAME_FILE_OPEN, STREAM_CONTROL, payload.data(), payload.length(), 0, transfer);
+}
+
+bool decodeFileOpen(const char* payload, size_t length, FileOpenPayload& open) {
+    if (length < FILE_OPEN_PAYLOAD_SIZE) {
+        return false;
+    }
+    open.direction = (uint8_t)payload[0];
+    open.size = readLE64(payload + 1);
+    open.offset = readLE64(payload + 9);
+    open.checksum = readLE32(payload + 17);
+    open.path.assign(payload + FILE_OPEN_PAYLOAD_SIZE, length - FILE_OPEN_PAYLOAD_SIZE);
+    return open.direction == FILE_GET || open.direction == FILE_PUT;
+}
+
+std::string makeFileCloseFrame(uint16_t transfer, uint8_t status, uint32_t checksum, const std::string& message) {
+    std::string payload(FILE_CLOSE_PAYLOAD_SIZE, '\0');
+    payload[0] = (char)status;
+    writeLE32(&payload[1], checksum);
+    payload += message;
+    return makeFrame(FRAME_FILE_CLOSE, STREAM_CONTROL, payload.data(), payload.length(), 0, transfer);
+}
+
+bool decodeFileClose(const char* payload, size_t length, FileClosePayload& close) {
+    if (length < FILE_CLOSE_PAYLOAD_SIZE) {
+        return false;
+    }
+    close.status = (uint8_t)payload[0];
+    close.checksum = readLE32(payload + 1);
+    close.message.assign(payload + FILE_CLOSE_PAYLOAD_SIZE, length - FILE_CLOSE_PAYLOAD_SIZE);
+    return true;
+}
+
+void encodeFileDataHeader(char* out, uint16_t transfer, uint64_t offset, size_t length) {
+    encodeFrameHeader(out, FRAME_FILE_DATA, STREAM_CONTROL, 0, (uint32_t)(FILE_DATA_PREFIX_SIZE + length), transfer);
+    writeLE64(out + FRAME_HEADER_SIZE, offset);
+}
+
+bool decodeFileData(const char* payload, size_t length, uint64_t& offset, const char*& data, size_t& dataLength) {
+    if (length < FILE_DATA_PREFIX_SIZE) {
+        return false;
+    }
+    offset = readLE64(payload);
+    data = payload + FILE_DATA_PREFIX_SIZE;
+    dataLength = length - FILE_DATA_PREFIX_SIZE;
+    return true;
+}
+
+void encodeOutputTime(char* out, uint64_t time) {
+    writeLE64(out, time);
+}
+
+bool decodeOutputTime(const char* payload, size_t length, uint64_t& time, const char*& data, size_t& dataLength) {
+    if (length < OUTPUT_TIME_SIZE) {
+        return false;
+    }
+    time = readLE64(payload);
+    data = payload + OUTPUT_TIME_SIZE;
+    dataLength = length - OUTPUT_TIME_SIZE;
+    return true;
+}
+
+std::string makeCommandFrame(uint16_t channel, uint32_t id, const std::string& command) {
+    char prefix[4];
+    writeLE32(prefix, id);
+    std::string payload = std::string(prefix, sizeof(prefix)) + command;
+    return makeFrame(FRAME_COMMAND, STREAM_STDIN, payload.data(), payload.length(), 0, channel);
+}
+
+bool decodeCommand(const char* payload, size_t length, uint32_t& id, std::string& command) {
+    if (length < 4) {
+        return false;
+    }
+    id = readLE32(payload);
+    command.assign(payload + 4, length - 4);
+    return true;
+}
+
+std::string makeCommandResultFrame(uint16_t channel, const CommandResultPayload& result) {
+    char payload[COMMAND_RESULT_PAYLOAD_SIZE];
+    writeLE32(payload, result.id);
+    payload[4] = (char)result.status;
+    writeLE32(payload + 5, (uint32_t)result.exitCode);
+    writeLE64(payload + 9, result.wallMicroseconds);
+    writeLE64(payload + 17, result.firstOutputMicroseconds);
+    writeLE64(payload + 25, result.outputBytes);
+    return makeFrame(FRAME_COMMAND, STREAM_CONTROL, payload, sizeof(payload), 0, channel);
+}
+
+bool decodeCommandResult(const char* payload, size_t length, CommandResultPayload& result) {
+    if (length < COMMAND_RESULT_PAYLOAD_SIZE) {
+        return false;
+    }
+    result.id = readLE32(payload);
+    result.status = (uint8_t)payload[4];
+    result.exitCode = (int32_t)readLE32(payload + 5);
+    result.wallMicroseconds = readLE64(payload + 9);
+    result.firstOutputMicroseconds = readLE64(payload + 17);
+    result.outputBytes = readLE64(payload + 25);
+    return true;
+}
+
+std::string makeSearchRequestFrame(uint16_t channel, const SearchRequest& request) {
+    char prefix[SEARCH_REQUEST_SIZE];
+    writeLE32(prefix, request.id);
+    prefix[4] = (char)request.flags;
+    prefix[5] = (char)request.context;
+    writeLE32(prefix + 6, request.maxMatches);
+    std::string payload = std::string(prefix, sizeof(prefix)) + request.pattern;
+    return makeFrame(FRAME_SEARCH, STREAM_CONTROL, payload.data(), payload.length(), 0, channel);
+}
+
+bool decodeSearchRequest(const char* payload, size_t length, SearchRequest& request) {
+    if (length < SEARCH_REQUEST_SIZE) {
+        return false;
+    }
+    request.id = readLE32(payload);
+    request.flags = (uint8_t)payload[4];
+    request.context = (uint8_t)payload[5];
+    request.maxMatches = readLE32(payload + 6);
+    request.pattern.assign(payload + SEARCH_REQUEST_SIZE, length - SEARCH_REQUEST_SIZE);
+    return true;
+}
+
+std::string makeSearchFrame(uint16_t channel, uint32_t id, uint8_t message, const std::string& body) {
+    std::string payload(5, '\0');
+    writeLE32(&payload[0], id);
+    payload[4] = (char)message;
+    payload += body;
+    return makeFrame(FRAME_SEARCH, STREAM_CONTROL, payload.data(), payload.length(), 0, channel);
+}
+
+bool decodeSearchFrame(const char* payload, size_t length, uint32_t& id, uint8_t& message, const char*& body, size_t& bodyLength) {
+    if (length < 5) {
+        return false;
+    }
+    id = readLE32(payload);
+    message = (uint8_t)payload[4];
+    body = payload + 5;
+    bodyLength = length - 5;
+    return true;
+}
+
+void appendSearchLine(std::string& body, uint64_t number, uint8_t flags, const char* text, size_t length) {
+    char prefix[13];
+    writeLE64(prefix, number);
+    prefix[8] = (char)flags;
+    writeLE32(prefix + 9, (uint32_t)length);
+    body.append(prefix, sizeof(prefix));
+    body.append(text, length);
+}
+
+bool decodeSearchLines(const char* body, size_t length, std::vector<SearchLine>& lines) {
+    size_t offset = 0;
+    while (offset < length) {
+        if (length - offset < 13) {
+            return false;
+        }
+        SearchLine line;
+        line.number = readLE64(body + offset);
+        line.flags = (uint8_t)body[offset + 8];
+        size_t textLength = readLE32(body + offset + 9);
+        offset += 13;
+        if (length - offset < textLength) {
+            return false;
+        }
+        line.text.assign(body + offset, textLength);
+        offset += textLength;
+        lines.push_back(std::move(line));
+    }
+    return true;
+}
+
+std::string makeSearchResult(const SearchResultPayload& result) {
+    char body[50];
+    body[0] = (char)result.status;
+    body[1] = (char)result.complete;
+    writeLE64(body + 2, result.matches);
+    writeLE64(body + 10, result.firstLine);
+    writeLE64(body + 18, result.lastLine);
+    writeLE64(body + 26, result.scannedBytes);
+    writeLE64(body + 34, result.skippedBytes);
+    writeLE64(body + 42, result.microseconds);
+    return std::string(body, sizeof(body)) + result.message;
+}
+
+bool decodeSearchResult(const char* body, size_t length, SearchResultPayload& result) {
+    if (length < 50) {
+        return false;
+    }
+    result.status = (uint8_t)body[0];
+    result.complete = (uint8_t)body[1];
+    result.matches = readLE64(body + 2);
+    result.firstLine = readLE64(body + 10);
+    result.lastLine = readLE64(body + 18);
+    result.scannedBytes = readLE64(body + 26);
+    result.skippedBytes = readLE64(body + 34);
+    result.microseconds = readLE64(body + 42);
+    result.message.assign(body + 50, length - 50);
+    return true;
+}
+
+std::string makeScreenSizeFrame(uint16_t rows, uint16_t columns) {
+    char payload[5];
+    payload[0] = (char)SCREEN_SIZE;
+    writeLE16(payload + 1, rows);
+    writeLE16(payload + 3, columns);
+    return makeFrame(FRAME_SCREEN, STREAM_CONTROL, payload, sizeof(payload));
+}
+
+std::string makeScreenAckFrame(uint32_t sequence) {
+    char payload[5];
+    payload[0] = (char)SCREEN_ACK;
+    writeLE32(payload + 1, sequence);
+    return makeFrame(FRAME_SCREEN, STREAM_CONTROL, payload, sizeof(payload));
+}
+
+void beginScreenUpdate(std::string& payload, uint32_t sequence) {
+    payload.assign(SCREEN_UPDATE_HEADER_SIZE, '\0');
+    payload[0] = (char)SCREEN_UPDATE;
+    writeLE32(&payload[1], sequence);
+}
+
+bool decodeScreenFrame(const char* payload, size_t length, uint8_t& message, const char*& body, size_t& bodyLength) {
+    if (length < 1) {
+        return false;
+    }
+    message = (uint8_t)payload[0];
+    body = payload + 1;
+    bodyLength = length - 1;
+    return true;
+}
+
+bool decodeScreenSize(const char* body, size_t length, uint16_t& rows, uint16_t& columns) {
+    if (length < 4) {
+        return false;
+    }
+    rows = readLE16(body);
+    columns = readLE16(body + 2);
+    return true;
+}
+
+bool decodeScreenSequence(const char* body, size_t length, uint32_t& sequence, const char*& data, size_t& dataLength) {
+    if (length < 4) {
+        return false;
+    }
+    sequence = readLE32(body);
+    data = body + 4;
+    dataLength = length - 4;
+    return true;
+}
+
+bool looksLikeFrame(const char* data, size_t length) {
+    return length >= 2 && readLE16(data) == FRAME_MAGIC;
+}
+
+FrameReader::FrameReader(size_t capacity) : buffer(capacity), readPos(0), writePos(0), scanPos(0) {
+}
+
+void FrameReader::compact() {
+    if (readPos == 0) {
+        return;
+    }
+    size_t remaining = writePos - readPos;
+    if (remaining > 0) {
+        memmove(&buffer[0], &buffer[readPos], remaining);
+    }
+    scanPos -= readPos;
+    readPos = 0;
+    writePos = remaining;
+}
+
+void FrameReader::reserve() {
+    // Keep at least one full recv buffer of room at the end
+    if (buffer.size() - writePos < DEFAULT_BUFLEN) {
+        compact();
+        if (buffer.size() - writePos < DEFAULT_BUFLEN) {
+            buffer.resize(buffer.size() * 2);
+        }
+    }
+}
+
+char* FrameReader::writePtr() {
+    reserve();
+    return &buffer[writePos];
+}
+
+size_t FrameReader::writeSpace() {
+    // Both make room, as they are usually arguments of the same recv() call
+    // and may be evaluated in either order
+    reserve();
+    return buffer.size() - writePos;
+}
+
+void FrameReader::commit(size_t length) {
+    writePos += length;
+}
+
+size_t FrameReader::bufferedBytes() const {
+    return writePos - readPos;
+}
+
+const char* FrameReader::bufferedData() const {
+    return buffer.data() + readPos;
+}
+
+void FrameReader::consume(size_t length) {
+    readPos += length;
+    if (readPos >= writePos) {
+        readPos = writePos = 0;
+    }
+    if (scanPos < readPos) {
+        scanPos = readPos;
+    }
+}
+
+FrameReader::Result FrameReader::nextFrame(FrameHeader& header, const char*& payload) {
+    size_t available = writePos - readPos;
+    if (available < FRAME_HEADER_SIZE) {
+        return FRAME_INCOMPLETE;
+    }
+
+    const char* p = &buffer[readPos];
+    if (readLE16(p) != FRAME_MAGIC) {
+        return FRAME_INVALID;
+    }
+    header.version = (uint8_t)p[2];
+    if (header.version != PROTOCOL_VERSION) {
+        // A newer wire format, which this side can't make sense of
+        return FRAME_INVALID;
+    }
+    header.type = (uint8_t)p[3];
+    header.stream = (uint8_t)p[4];
+    header.flags = (uint8_t)p[5];
+    header.channel = readLE16(p + 6);
+    header.length = readLE32(p + 8);
+    if (header.length > FRAME_MAX_PAYLOAD) {
+        return FRAME_INVALID;
+    }
+
+    if (available < FRAME_HEADER_SIZE + header.length) {
+        // Make sure the whole frame will fit once the rest arrives
+        size_t needed = FRAME_HEADER_SIZE + header.length + DEFAULT_BUFLEN;
+        if (buffer.size() < needed) {
+            compact();
+            buffer.resize(needed);
+        }
+        return FRAME_INCOMPLETE;
+    }
+
+    payload = p + FRAME_HEADER_SIZE;
+    readPos += FRAME_HEADER_SIZE + header.length;
+    if (readPos == writePos) {
+        readPos = writePos = 0;
+    }
+    scanPos = readPos;
+    return FRAME_READY;
+}
+
+bool FrameReader::nextMarkerMessage(const char*& message, size_t& length) {
+    static const char marker[] = END_OF_RESPONSE_MARKER;
+    const size_t markerLength = sizeof(marker) - 1;
+
+    // Resume the search where the previous call left off, backing up just
+    // enough to catch a marker that straddled two recv() calls
+    size_t start = scanPos;
+    if (start < readPos + markerLength) {
+        start = readPos;
+    } else {
+        start -= markerLength - 1;
+    }
+
+    const char* begin = buffer.data();
+    for (size_t i = start; i + markerLength <= writePos; i++) {
+        const char* candidate = (const char*)memchr(begin + i, marker[0], writePos - markerLength + 1 - i);
+        if (!candidate) {
+            break;
+        }
+        i = candidate - begin;
+        if (memcmp(candidate, marker, markerLength) == 0) {
+            message = begin + readPos;
+            length = i - readPos;
+            readPos = i + markerLength;
+            if (readPos == writePos) {
+                readPos = writePos = 0;
+            }
+            scanPos = readPos;
+            return true;
+        }
+    }
+
+    scanPos = writePos;
+    return false;
+}
+
+std::string makeSyncFrame(uint16_t sync, uint8_t message, const std::string& body) {
+    std::string frame(FRAME_HEADER_SIZE + 1, '\0');
+    encodeFrameHeader(&frame[0], FRAME_SYNC, STREAM_CONTROL, 0, (uint32_t)(1 + body.length()), sync);
+    frame[FRAME_HEADER_SIZE] = (char)message;
+    return frame + body;
+}
+
+void appendSyncFile(std::string& body, const SyncFile& file) {
+    char entry[18];
+    writeLE64(entry, file.size);
+    writeLE64(entry + 8, (uint64_t)file.writeTime);
+    writeLE16(entry + 16, (uint16_t)file.path.length());
+    body.append(entry, sizeof(entry));
+    body += file.path;
+}
+
+bool decodeSyncFiles(const char* body, size_t length, std::vector<SyncFile>& files) {
+    size_t offset = 0;
+    while (offset < length) {
+        if (length - offset < 18) {
+            return false;
+        }
+        SyncFile file;
+        file.size = readLE64(body + offset);
+        file.writeTime = (int64_t)readLE64(body + offset + 8);
+        size_t pathLength = readLE16(body + offset + 16);
+        offset += 18;
+        if (length - offset < pathLength) {
+            return false;
+        }
+        file.path.assign(body + offset, pathLength);
+        offset += pathLength;
+        files.push_back(std::move(file));
+    }
+    return true;
+}
+
+void appendFileSignature(std::string& body, const FileSignature& signature) {
+    size_t offset = body.length();
+    body.resize(offset + 16 + 12 * signature.blocks.size());
+    char* out = &body[offset];
+    writeLE32(out, signature.file);
+    writeLE32(out + 4, signature.blockSize);
+    writeLE64(out + 8, signature.size);
+    out += 16;
+    for (size_t i = 0; i < signature.blocks.size(); i++) {
+        writeLE32(out, signature.blocks[i].weak);
+        writeLE64(out + 4, signature.blocks[i].strong);
+        out += 12;
+    }
+}
+
+bool decodeFileSignatures(const char* body, size_t length, std::vector<FileSignature>& signatures) {
+    size_t offset = 0;
+    while (offset < length) {
+        if (length - offset < 16) {
+            return false;
+        }
+        FileSignature signature;
+        signature.file = readLE32(body + offset);
+        signature.blockSize = readLE32(body + offset + 4);
+        signature.size = readLE64(body + offset + 8);
+        offset += 16;
+        uint64_t count = signature.blockSize ? (signature.size + signature.blockSize - 1) / signature.blockSize : 0;
+        if ((length - offset) / 12 < count) {
+            return false;
+        }
+        signature.blocks.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            signature.blocks[i].weak = readLE32(body + offset);
+            signature.blocks[i].strong = readLE64(body + offset + 4);
+            offset += 12;
+        }
+        signatures.push_back(std::move(signature));
+    }
+    return true;
+}
+
+void appendSyncCopy(std::string& body, uint32_t block, uint32_t count) {
+    char operation[9];
+    operation[0] = (char)SYNC_COPY;
+    writeLE32(operation + 1, block);
+    writeLE32(operation + 5, count);
+    body.append(operation, sizeof(operation));
+}
+
+void appendSyncData(std::string& body, const char* data, size_t length) {
+    char operation[5];
+    operation[0] = (char)SYNC_DATA;
+    writeLE32(operation + 1, (uint32_t)length);
+    body.append(operation, sizeof(operation));
+    body.append(data, length);
+}
+
+std::string makeSyncBegin(uint16_t channel, const std::string& directory) {
+    char prefix[2];
+    writeLE16(prefix, channel);
+    return std::string(prefix, sizeof(prefix)) + directory;
+}
+
+bool decodeSyncBegin(const char* body, size_t length, uint16_t& channel, std::string& directory) {
+    if (length < 2) {
+        return false;
+    }
+    channel = readLE16(body);
+    directory.assign(body + 2, length - 2);
+    return true;
+}
+
+std::string makeSyncFileHeader(uint32_t file) {
+    char prefix[4];
+    writeLE32(prefix, file);
+    return std::string(prefix, sizeof(prefix));
+}
+
+std::string makeSyncCommit(uint32_t file, uint64_t hash) {
+    char body[12];
+    writeLE32(body, file);
+    writeLE64(body + 4, hash);
+    return std::string(body, sizeof(body));
+}
+
+bool decodeSyncFileHeader(const char* body, size_t length, uint32_t& file) {
+    if (length < 4) {
+        return false;
+    }
+    file = readLE32(body);
+    return true;
+}
+
+bool decodeSyncCommit(const char* body, size_t length, uint32_t& file, uint64_t& hash) {
+    if (length != 12) {
+        return false;
+    }
+    file = readLE32(body);
+    hash = readLE64(body + 4);
+    return true;
+}
+
+std::string makeSyncResult(const SyncResultPayload& result) {
+    char body[13];
+    body[0] = (char)result.status;
+    writeLE32(body + 1, result.updated);
+    writeLE64(body + 5, result.written);
+    return std::string(body, sizeof(body)) + result.message;
+}
+
+bool decodeSyncResult(const char* body, size_t length, SyncResultPayload& result) {
+    if (length < 13) {
+        return false;
+    }
+    result.status = (uint8_t)body[0];
+    result.updated = readLE32(body + 1);
+    result.written = readLE64(body + 5);
+    result.message.assign(body + 13, length - 13);
+    return true;
+}
@@ -0,0 +1,460 @@
+#pragma once
+
+// Binary framing shared by the remote terminal client and server.
+//
+// Every message on a framed connection starts with a fixed 12-byte header
+// (all fields little-endian):
+//
+//   offset  size  field
+//   0       2     magic     FRAME_MAGIC
+//   2       1     version   PROTOCOL_VERSION
+//   3       1     type      FrameType
+//   4       1     stream    StreamId
+//   5       1     flags     FRAME_FLAG_*
+//   6       2     channel   shell channel, zero unless FEATURE_CHANNELS
+//   8       4     length    payload bytes that follow the header
+//
+// A connection starts in legacy (END_OF_RESPONSE_MARKER) mode. The client
+// opens with a FRAME_HELLO; a server that understands it answers with its
+// own FRAME_HELLO and both sides switch to frames.
+//
+// Channels: every connection has the shell on channel 0. With
+// FEATURE_CHANNELS the client can open more with FRAME_CHANNEL_OPEN on an
+// unused channel id; the server echoes the frame once the shell is running,
+// or answers FRAME_CHANNEL_CLOSE with the reason. Either side closes a
+// channel with FRAME_CHANNEL_CLOSE. The server sends at most CHANNEL_WINDOW
+// bytes of shell output per channel until the client grants more with
+// FRAME_WINDOW, so one flooding shell can't bury the others.
+//
+// Resume: with FEATURE_RESUME a session outlives its connection. The
+// server's hello reply carries the session's token; after a disconnect the
+// shells keep running and their output goes to a scrollback ring. A client
+// reattaches by reconnecting with the token and, per channel, the number of
+// shell output bytes (decoded STDOUT payload) it has received. The server's
+// reply lists the session's channels with the offset each replay starts at,
+// then the missed output follows as ordinary output frames.
+//
+// Output streams: with FEATURE_OUTPUT_STREAMS each output frame carries
+// one stream of the shell's output, STREAM_STDOUT or STREAM_STDERR, and its
+// payload (after decompression) starts with OUTPUT_TIME_SIZE bytes: the u64
+// time the frame's first byte was read from the shell, in microseconds
+// since 1970. The server reads the wall clock once and measures from there
+// on a monotonic clock, so times never go backwards and compare
+// exactly with its own latency metrics. Replayed scrollback comes as
+// STREAM_STDOUT with a time of zero (unknown). The server adds no text
+// timestamps; the client shows the capture time instead. Control messages
+// are unchanged. Resume offsets and window credit count only the bytes
+// after the time.
+//
+// Tracked commands: with FEATURE_COMMANDS the client can send a command line
+// as a FRAME_COMMAND with an id of its choosing instead of a FRAME_INPUT.
+// The server writes it to the channel's shell once the shell's previous
+// command has finished (a FRAME_INPUT still goes straight to the shell, as
+// input for whatever is running), and when the shell next shows its prompt
+// answers with a FRAME_COMMAND carrying a CommandResultPayload: the exit
+// status where the shell reports one, the wall time, the time to the first
+// output and the output's size. The result follows all of the command's
+// output on the channel. A shell that sets a prompt of its own shows no
+// mark for the server to go by: its commands are taken to have finished
+// once their output stops for a while, and answered with COMMAND_UNKNOWN.
+//
+// Raw input: with FEATURE_RAW_INPUT the client is a terminal. FRAME_INPUT
+// payloads are keystrokes, written to the shell's terminal exactly as they
+// arrive (no newline added, no 'exit' handling), and output comes without
+// the server's timestamps. The session ends when channel 0's shell exits;
+// the server then closes channel 0 so the client knows not to reattach.
+//
+// File transfer: with FEATURE_FILE_TRANSFER files move in frames of their
+// own, next to shell output, so binary data is never pushed through a
+// shell. The header's channel field carries a transfer id the client picks
+// (ids are never reused on a connection). The client opens a transfer with
+// FRAME_FILE_OPEN; the server answers with its own FRAME_FILE_OPEN, or with
+// FRAME_FILE_CLOSE and the reason. The file then follows as FRAME_FILE_DATA
+// frames from the sending side, each at most FILE_CHUNK_SIZE bytes of file
+// at an explicit offset, and the sender ends it with FRAME_FILE_CLOSE,
+// carrying the Adler-32 of the bytes it sent. The receiver of an upload
+// confirms with a FRAME_FILE_CLOSE of its own. The client reports a
+// download's progress with FRAME_FILE_DATA frames that carry only an offset,
+// everything before which it has written, and the server sends no more
+// than FILE_WINDOW bytes past that. Any other FRAME_FILE_CLOSE
+// from the client cancels the transfer, and the server answers that with a
+// failed FRAME_FILE_CLOSE once nothing more of it is coming.
+//
+// A transfer resumes where a partial copy left off: a download's request
+// names the bytes the client already has, an upload's reply the bytes the
+// server already has, each with the Adler-32 of the FILE_CHUNK_SIZE bytes
+// (or fewer) before that point. The other side only continues from there
+// if its own bytes give the same checksum; otherwise the data starts at 0.
+//
+// Directory sync: with FEATURE_SYNC the client pushes a tree into a
+// directory relative to one of its shells' current directory, sending only
+// what changed, as rsync does. All of it travels in FRAME_SYNC frames whose
+// payload starts with a SyncMessage, under a sync id the client picks (from
+// the same ids as transfers). The client sends SYNC_BEGIN, its file list in
+// SYNC_FILES and then SYNC_SCAN. For each file the server answers with a
+// FileSignature: nothing, when its copy has the same size and write time;
+// otherwise the rolling and strong checksum of each block of its copy (none
+// if it has no copy). For each file that isn't up to date the client then
+// sends SYNC_DELTA frames, which rebuild the file from blocks of the
+// server's copy and new bytes, and SYNC_COMMIT with the new contents'
+// hash; the server replaces the file once the hash checks out and gives it
+// the client's write time, so an unchanged file is skipped next time.
+// SYNC_END finishes, and the server answers with SYNC_RESULT.
+//
+// Search: with FEATURE_SEARCH the server keeps each channel's output as a
+// searchable history, and finds lines in it so the client doesn't have to
+// fetch the output to look through it. The client sends a FRAME_SEARCH on
+// the channel with a SearchRequest under an id of its choosing. The server
+// answers with FRAME_SEARCH frames on the same channel, each starting with
+// the id and a SearchMessage: SEARCH_LINES with the matching lines and
+// their context, in order, and finally SEARCH_RESULT. Lines are numbered
+// from the channel's first output, so the numbers stay the same as older
+// output falls out of the history; the result says which lines were held.
+//
+// Screen sync: with FEATURE_SCREEN_SYNC (only together with
+// FEATURE_RAW_INPUT) the server keeps channel 0's terminal screen itself
+// and sends the client what changed on it instead of the shell's output.
+// Everything travels in FRAME_SCREEN frames on channel 0, whose payload is
+// a ScreenMessage and its body. After its hello the client sends
+// SCREEN_SIZE with the size of its screen; the server sizes the shell's
+// terminal to match and only then starts channel 0. Each SCREEN_UPDATE
+// carries a sequence number and the VT/ANSI bytes that turn the screen as
+// the previous update left it into the screen as it is now (the first
+// update, and the first after a reattach, draw all of it). The client
+// answers each with a SCREEN_ACK of its sequence number, and the server
+// sends the next update only once the last has been acknowledged, so
+// screens the client would never have had time to show are never sent.
+// Updates are compressed like output. Channel 0 has no output frames, no
+// window and no replay; the server's messages for it are drawn on the
+// screen.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "common.h"
+
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD (1024 * 1024)
+
+enum FrameType : uint8_t {
+    FRAME_HELLO = 1,    // Protocol negotiation, payload is a HelloPayload
+    FRAME_INPUT = 2,    // Client -> server shell input: a command line, or keystrokes with FEATURE_RAW_INPUT
+    FRAME_OUTPUT = 3,   // Server -> client shell or status output
+    FRAME_CHANNEL_OPEN = 4,     // Open a shell on the header's channel (client), or it is ready (server)
+    FRAME_CHANNEL_CLOSE = 5,    // Close the header's channel; payload is an optional reason
+    FRAME_WINDOW = 6,           // Client -> server output credit, payload is a u32 byte count
+    FRAME_FILE_OPEN = 7,        // Start a transfer (client), or it is accepted (server); a FileOpenPayload
+    FRAME_FILE_DATA = 8,        // A u64 file offset, then file bytes (none: download progress)
+    FRAME_FILE_CLOSE = 9,       // End, confirm or abandon a transfer; a FileClosePayload
+    FRAME_SYNC = 10,            // Directory sync, the payload a SyncMessage and its body
+    FRAME_COMMAND = 11,         // A tracked command (client: u32 id, then the line), or how it ended (server: a CommandResultPayload)
+    FRAME_SEARCH = 12,          // A SearchRequest (client), or u32 id, a SearchMessage and its body (server)
+    FRAME_SCREEN = 13,          // A ScreenMessage and its body
+};
+
+enum StreamId : uint8_t {
+    STREAM_STDIN = 0,
+    STREAM_STDOUT = 1,
+    STREAM_STDERR = 2,
+    STREAM_CONTROL = 3, // Messages from the server itself (welcome, errors)
+};
+
+// FEATURE_OUTPUT_STREAMS: the capture time leading each output payload
+#define OUTPUT_TIME_SIZE 8
+
+// Frame flags
+#define FRAME_FLAG_COMPRESSED 0x01  // Payload is a StreamCompressor block
+
+struct FrameHeader {
+    uint8_t version;
+    uint8_t type;
+    uint8_t stream;
+    uint8_t flags;
+    uint16_t channel;
+    uint32_t length;
+};
+
+// Payload of FRAME_HELLO: the version and features, then with FEATURE_RESUME
+// the session token, a u16 count and that many (u16 channel, u64 offset)
+#define HELLO_PAYLOAD_SIZE 8
+#define SESSION_TOKEN_SIZE 16
+
+struct StreamOffset {
+    uint16_t channel;
+    uint64_t offset;    // Bytes of the channel's shell output stream
+};
+
+struct HelloPayload {
+    uint32_t version;   // Highest protocol version the sender speaks
+    uint32_t features;  // FEATURE_* bits the sender supports (or accepts, in a reply)
+    std::string token;  // FEATURE_RESUME: session to reattach (empty for a new one), or the server's token
+    std::vector<StreamOffset> offsets;  // Output received so far (client), or where replay starts (server)
+};
+
+// Payload of FRAME_FILE_OPEN: u8 direction, u64 size, u64 offset, u32
+// checksum, then the path (client only)
+#define FILE_OPEN_PAYLOAD_SIZE 21
+
+enum FileDirection : uint8_t {
+    FILE_GET = 1,   // Server -> client
+    FILE_PUT = 2,   // Client -> server
+};
+
+struct FileOpenPayload {
+    uint8_t direction;
+    uint64_t size;      // PUT request: bytes the client will send; reply: the file's size
+    uint64_t offset;    // Request (GET) or reply (PUT): bytes already there; GET reply: where the data starts
+    uint32_t checksum;  // Adler-32 of the FILE_CHUNK_SIZE bytes (or fewer) before 'offset'
+    std::string path;   // Server side, relative to the server's directory
+};
+
+// FRAME_FILE_DATA starts with the file offset of its bytes
+#define FILE_DATA_PREFIX_SIZE 8
+
+// Payload of FRAME_FILE_CLOSE: u8 status, u32 checksum, then a message
+#define FILE_CLOSE_PAYLOAD_SIZE 5
+
+enum FileStatus : uint8_t {
+    FILE_OK = 0,
+    FILE_FAILED = 1,    // The message says why
+};
+
+struct FileClosePayload {
+    uint8_t status;
+    uint32_t checksum;  // Adler-32 of the bytes sent, from the data's first offset
+    std::string message;
+};
+
+enum SyncMessage : uint8_t {
+    SYNC_BEGIN = 1,         // Client: u16 channel, then the directory (relative to that shell's)
+    SYNC_FILES = 2,         // Client: the next SyncFile entries of the tree
+    SYNC_SCAN = 3,          // Client: the file list is complete
+    SYNC_SIGNATURES = 4,    // Server: FileSignature records
+    SYNC_DELTA = 5,         // Client: u32 file index, then delta operations
+    SYNC_COMMIT = 6,        // Client: u32 file index, u64 hash of the file's new contents
+    SYNC_END = 7,           // Client: nothing more is coming
+    SYNC_RESULT = 8,        // Server: a SyncResultPayload
+};
+
+// A file of the tree being synced: u64 size, i64 write time, u16 path
+// length and the path, relative and with '/' separators
+struct SyncFile {
+    std::string path;
+    uint64_t size;
+    int64_t writeTime;      // Nanoseconds since 1970
+};
+
+struct BlockSignature {
+    uint32_t weak;          // RollingChecksum
+    uint64_t strong;        // hash64
+};
+
+// How the server's copy of a file looks: u32 file index, u32 block size,
+// u64 size, then each block's u32 weak and u64 strong checksum. A block
+// size of 0 means the copy is up to date, and has no blocks; otherwise the
+// size gives the number of blocks, the last of which may be short.
+struct FileSignature {
+    uint32_t file;
+    uint32_t blockSize;
+    uint64_t size;
+    std::vector<BlockSignature> blocks;
+};
+
+// Delta operations: SYNC_COPY, u32 first block and u32 count, copies blocks
+// of the server's copy; SYNC_DATA, u32 length and the bytes, adds new ones
+enum SyncOperation : uint8_t {
+    SYNC_COPY = 1,
+    SYNC_DATA = 2,
+};
+
+struct SyncResultPayload {
+    uint8_t status;         // FileStatus
+    uint32_t updated;       // Files replaced or created
+    uint64_t written;       // Bytes in those files
+    std::string message;    // The first thing that failed
+};
+
+// Payload of a server FRAME_COMMAND: u32 id, u8 status, i32 exit code, then
+// u64 wall time, u64 time to the first output and u64 output bytes
+#define COMMAND_RESULT_PAYLOAD_SIZE 33
+
+enum CommandStatus : uint8_t {
+    COMMAND_EXITED = 0,     // With the exit code
+    COMMAND_FINISHED = 1,   // The shell doesn't report exit codes (cmd.exe)
+    COMMAND_UNKNOWN = 2,    // No prompt was seen; the output stopped, but the command may still be running
+};
+
+struct CommandResultPayload {
+    uint32_t id;
+    uint8_t status;
+    int32_t exitCode;
+    uint64_t wallMicroseconds;          // Written to the shell until its next prompt
+    uint64_t firstOutputMicroseconds;   // Until its first output was read (a terminal's echo of it counts)
+    uint64_t outputBytes;               // Shell output in between
+};
+
+// Payload of a client FRAME_SEARCH: u32 id, u8 flags, u8 context lines, u32
+// most matches, then the pattern
+#define SEARCH_REQUEST_SIZE 10
+
+// SearchRequest flags
+#define SEARCH_IGNORE_CASE 0x01     // ASCII letters match either case
+#define SEARCH_REGEX 0x02           // The pattern is an ECMAScript regular expression, not a string
+
+struct SearchRequest {
+    uint32_t id;
+    uint8_t flags;
+    uint8_t context;        // Lines shown before and after each match
+    uint32_t maxMatches;    // The search stops after this many
+    std::string pattern;    // Matched within a line; never spans lines
+};
+
+enum SearchMessage : uint8_t {
+    SEARCH_LINES = 1,       // SearchLine records
+    SEARCH_RESULT = 2,      // A SearchResultPayload; the search is over
+};
+
+// A line found by a search: u64 line number, u8 SEARCH_LINE_* flags, u32
+// length and the line (without its line break, and cut short with
+// SEARCH_LINE_CUT)
+#define SEARCH_LINE_MATCH 0x01
+#define SEARCH_LINE_CUT 0x02
+
+struct SearchLine {
+    uint64_t number;
+    uint8_t flags;
+    std::string text;
+};
+
+enum ScreenMessage : uint8_t {
+    SCREEN_SIZE = 1,        // Client: u16 rows, u16 columns
+    SCREEN_UPDATE = 2,      // Server: u32 sequence, then the bytes that draw the changes
+    SCREEN_ACK = 3,         // Client: u32 sequence of the update it has applied
+};
+
+// A SCREEN_UPDATE payload up to its bytes: the message and the sequence
+#define SCREEN_UPDATE_HEADER_SIZE 5
+
+struct SearchResultPayload {
+    uint8_t status;         // FileStatus
+    uint8_t complete;       // Zero if the search stopped at its most matches
+    uint64_t matches;
+    uint64_t firstLine;     // Lines held in the history, when the search started
+    uint64_t lastLine;
+    uint64_t scannedBytes;  // Output read and matched
+    uint64_t skippedBytes;  // Output the index ruled out without reading it
+    uint64_t microseconds;
+    std::string message;    // Why it failed
+};
+
+void encodeFrameHeader(char* out, uint8_t type, uint8_t stream, uint8_t flags, uint32_t length, uint16_t channel = 0);
+std::string makeFrame(uint8_t type, uint8_t stream, const char* payload, size_t length, uint8_t flags = 0, uint16_t channel = 0);
+std::string makeHelloFrame(const HelloPayload& hello);
+bool decodeHello(const char* payload, size_t length, HelloPayload& hello);
+std::string makeWindowFrame(uint16_t channel, uint32_t bytes);
+bool decodeWindow(const char* payload, size_t length, uint32_t& bytes);
+std::string makeFileOpenFrame(uint16_t transfer, const FileOpenPayload& open);
+bool decodeFileOpen(const char* payload, size_t length, FileOpenPayload& open);
+std::string makeFileCloseFrame(uint16_t transfer, uint8_t status, uint32_t checksum, const std::string& message = "");
+bool decodeFileClose(const char* payload, size_t length, FileClosePayload& close);
+
+// Writes the header and offset of a FRAME_FILE_DATA carrying 'length' file
+// bytes (FRAME_HEADER_SIZE + FILE_DATA_PREFIX_SIZE bytes), so the file
+// bytes can be sent from wherever they are
+void encodeFileDataHeader(char* out, uint16_t transfer, uint64_t offset, size_t length);
+bool decodeFileData(const char* payload, size_t length, uint64_t& offset, const char*& data, size_t& dataLength);
+
+// FEATURE_OUTPUT_STREAMS: the capture time at the start of an output
+// payload (OUTPUT_TIME_SIZE bytes), and the shell output after it
+void encodeOutputTime(char* out, uint64_t time);
+bool decodeOutputTime(const char* payload, size_t length, uint64_t& time, const char*& data, size_t& dataLength);
+
+// FRAME_SYNC frames. The body of each message is built with the append
+// functions and read back with the matching decode function.
+std::string makeSyncFrame(uint16_t sync, uint8_t message, const std::string& body = "");
+void appendSyncFile(std::string& body, const SyncFile& file);
+bool decodeSyncFiles(const char* body, size_t length, std::vector<SyncFile>& files);
+void appendFileSignature(std::string& body, const FileSignature& signature);
+bool decodeFileSignatures(const char* body, size_t length, std::vector<FileSignature>& signatures);
+void appendSyncCopy(std::string& body, uint32_t block, uint32_t count);
+void appendSyncData(std::string& body, const char* data, size_t length);
+std::string makeSyncBegin(uint16_t channel, const std::string& directory);
+bool decodeSyncBegin(const char* body, size_t length, uint16_t& channel, std::string& directory);
+std::string makeSyncFileHeader(uint32_t file);
+std::string makeSyncCommit(uint32_t file, uint64_t hash);
+bool decodeSyncFileHeader(const char* body, size_t length, uint32_t& file);
+bool decodeSyncCommit(const char* body, size_t length, uint32_t& file, uint64_t& hash);
+std::string makeSyncResult(const SyncResultPayload& result);
+bool decodeSyncResult(const char* body, size_t length, SyncResultPayload& result);
+
+// FRAME_COMMAND, both ways
+std::string makeCommandFrame(uint16_t channel, uint32_t id, const std::string& command);
+bool decodeCommand(const char* payload, size_t length, uint32_t& id, std::string& command);
+std::string makeCommandResultFrame(uint16_t channel, const CommandResultPayload& result);
+bool decodeCommandResult(const char* payload, size_t length, CommandResultPayload& result);
+
+// FRAME_SEARCH, both ways. The server's lines are built into a body with
+// appendSearchLine and sent with makeSearchFrame.
+std::string makeSearchRequestFrame(uint16_t channel, const SearchRequest& request);
+bool decodeSearchRequest(const char* payload, size_t length, SearchRequest& request);
+std::string makeSearchFrame(uint16_t channel, uint32_t id, uint8_t message, const std::string& body);
+bool decodeSearchFrame(const char* payload, size_t length, uint32_t& id, uint8_t& message, const char*& body, size_t& bodyLength);
+void appendSearchLine(std::string& body, uint64_t number, uint8_t flags, const char* text, size_t length);
+bool decodeSearchLines(const char* body, size_t length, std::vector<SearchLine>& lines);
+std::string makeSearchResult(const SearchResultPayload& result);
+bool decodeSearchResult(const char* body, size_t length, SearchResultPayload& result);
+
+// FRAME_SCREEN, both ways. An update's payload is started with
+// beginScreenUpdate, its bytes appended and the whole sent (or compressed)
+// as a FRAME_SCREEN on channel 0.
+std::string makeScreenSizeFrame(uint16_t rows, uint16_t columns);
+std::string makeScreenAckFrame(uint32_t sequence);
+void beginScreenUpdate(std::string& payload, uint32_t sequence);
+bool decodeScreenFrame(const char* payload, size_t length, uint8_t& message, const char*& body, size_t& bodyLength);
+bool decodeScreenSize(const char* body, size_t length, uint16_t& rows, uint16_t& columns);
+// An update's or an acknowledgement's sequence, and an update's bytes
+bool decodeScreenSequence(const char* body, size_t length, uint32_t& sequence, const char*& data, size_t& dataLength);
+
+// Returns true if 'data' starts like a frame header (used to detect a framed peer)
+bool looksLikeFrame(const char* data, size_t length);
+
+// Receive buffer that recv() writes into directly and that hands out complete
+// frames as pointers into itself. Consumed bytes are released by advancing a
+// read offset; only the tail of a partially received frame is ever moved,
+// and only when the free space at the end runs low.
+class FrameReader {
+private:
+    std::vector<char> buffer;
+    size_t readPos;
+    size_t writePos;
+    size_t scanPos; // Legacy mode: bytes already searched for the marker
+
+    void compact();
+    void reserve();
+
+public:
+    enum Result {
+        FRAME_READY,
+        FRAME_INCOMPLETE,
+        FRAME_INVALID,
+    };
+
+    FrameReader(size_t capacity = 64 * 1024);
+
+    // Space that the next recv() may fill; call commit() with the byte count
+    char* writePtr();
+    size_t writeSpace();
+    void commit(size_t length);
+
+    size_t bufferedBytes() const;
+    const char* bufferedData() const;
+    void consume(size_t length);
+
+    // Frame mode. On FRAME_READY, 'payload' points into the buffer and stays
+    // valid until the next call to nextFrame() or writePtr().
+    Result nextFrame(FrameHeader& header, const char*& payload);
+
+    // Legacy mode: next message terminated by END_OF_RESPONSE_MARKER (marker excluded)
+    bool nextMarkerMessage(const char*& message, size_t& length);
+};
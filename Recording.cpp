@@ -0,0 +1,320 @@
+#include "Recording.h"
+#include "Checksum.h"
+#include "Compression.h"
+#include <cstring>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char FILE_MAGIC[] = "KREC";
+static const char CHUNK_MAGIC[] = "KRCH";
+static const char INDEX_MAGIC[] = "KRIX";
+static const char END_MAGIC[] = "KEND";
+
+static void appendLE16(std::string& out, uint16_t value) {
+    out += (char)(value & 0xFF);
+    out += (char)(value >> 8);
+}
+
+static void appendLE32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += (char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+static void appendLE64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out += (char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+static uint16_t readLE16(const char* in) {
+    const unsigned char* p = (const unsigned char*)in;
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t readLE32(const char* in) {
+    const unsigned char* p = (const unsigned char*)in;
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t readLE64(const char* in) {
+    return (uint64_t)readLE32(in) | ((uint64_t)readLE32(in + 4) << 32);
+}
+
+std::string makeRecordingHeader(const RecordingHeader& header) {
+    std::string out(FILE_MAGIC, 4);
+    appendLE32(out, RECORDING_VERSION);
+    appendLE64(out, header.startTime);
+    appendLE32(out, header.session);
+    appendLE32(out, header.part);
+    return out;
+}
+
+std::string makeRecordingChunkHeader(const RecordingChunk& chunk) {
+    std::string out(CHUNK_MAGIC, 4);
+    appendLE32(out, chunk.storedLength);
+    appendLE32(out, chunk.rawLength);
+    appendLE32(out, chunk.records);
+    appendLE64(out, chunk.firstTime);
+    appendLE64(out, chunk.lastTime);
+    appendLE64(out, chunk.recordOffset);
+    appendLE64(out, chunk.lostBytes);
+    appendLE32(out, chunk.checksum);
+    out += (char)(chunk.compressed ? 1 : 0);
+    return out;
+}
+
+void appendRecordingRecord(std::string& raw, uint64_t time, uint16_t channel, uint8_t stream, const char* data,
+                           size_t length) {
+    appendLE64(raw, time);
+    appendLE16(raw, channel);
+    raw += (char)stream;
+    appendLE32(raw, (uint32_t)length);
+    raw.append(data, length);
+}
+
+std::string makeRecordingIndex(const std::vector<RecordingChunk>& chunks, uint64_t indexOffset) {
+    std::string out(INDEX_MAGIC, 4);
+    appendLE32(out, (uint32_t)chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++) {
+        appendLE64(out, chunks[i].fileOffset);
+        appendLE64(out, chunks[i].firstTime);
+        appendLE64(out, chunks[i].lastTime);
+        appendLE64(out, chunks[i].recordOffset);
+    }
+    appendLE64(out, indexOffset);
+    out.append(END_MAGIC, 4);
+    return out;
+}
+
+bool nextRecordingRecord(const std::string& raw, size_t& offset, RecordingRecord& record) {
+    if (raw.length() - offset < RECORDING_RECORD_HEADER_SIZE) {
+        return false;
+    }
+    const char* p = raw.data() + offset;
+    record.time = readLE64(p);
+    record.channel = readLE16(p + 8);
+    record.stream = (uint8_t)p[10];
+    record.length = readLE32(p + 11);
+    if (raw.length() - offset - RECORDING_RECORD_HEADER_SIZE < record.length) {
+        return false;
+    }
+    record.data = p + RECORDING_RECORD_HEADER_SIZE;
+    offset += RECORDING_RECORD_HEADER_SIZE + record.length;
+    return true;
+}
+
+static bool decodeChunkHeader(const char* p, uint64_t fileOffset, RecordingChunk& chunk) {
+    if (memcmp(p, CHUNK_MAGIC, 4) != 0) {
+        return false;
+    }
+    chunk.fileOffset = fileOffset;
+    chunk.storedLength = readLE32(p + 4);
+    chunk.rawLength = readLE32(p + 8);
+    chunk.records = readLE32(p + 12);
+    chunk.firstTime = readLE64(p + 16);
+    chunk.lastTime = readLE64(p + 24);
+    chunk.recordOffset = readLE64(p + 32);
+    chunk.lostBytes = readLE64(p + 40);
+    chunk.checksum = readLE32(p + 48);
+    chunk.compressed = p[52] != 0;
+    return true;
+}
+
+RecordingReader::RecordingReader() : data(NULL), size(0),
+#ifdef _WIN32
+    fileHandle(INVALID_HANDLE_VALUE), mapping(NULL),
+#endif
+    indexed(false) {
+    fileHeader.startTime = 0;
+    fileHeader.session = 0;
+    fileHeader.part = 0;
+}
+
+RecordingReader::~RecordingReader() {
+    unmap();
+}
+
+bool RecordingReader::map(const std::string& path, std::string& error) {
+#ifdef _WIN32
+    fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        error = "Unable to open " + path;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize)) {
+        error = "Unable to read " + path;
+        return false;
+    }
+    size = (size_t)fileSize.QuadPart;
+    if (size == 0) {
+        return true;
+    }
+    mapping = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "Unable to open " + path;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        error = "Unable to read " + path;
+        return false;
+    }
+    size = (size_t)info.st_size;
+    if (size == 0) {
+        ::close(fd);
+        return true;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    data = (mapped == MAP_FAILED) ? NULL : (const char*)mapped;
+    if (data) {
+        // Played from start to end, a chunk at a time
+        madvise(mapped, size, MADV_SEQUENTIAL);
+    }
+#endif
+    if (!data) {
+        error = "Unable to map " + path;
+        return false;
+    }
+    return true;
+}
+
+void RecordingReader::unmap() {
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+    if (fileHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(fileHandle);
+        fileHandle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (data) {
+        munmap((void*)data, size);
+    }
+#endif
+    data = NULL;
+    size = 0;
+}
+
+bool RecordingReader::open(const std::string& path, std::string& error) {
+    unmap();
+    index.clear();
+    indexed = false;
+    if (!map(path, error)) {
+        return false;
+    }
+    if (size < RECORDING_HEADER_SIZE || memcmp(data, FILE_MAGIC, 4) != 0) {
+        error = path + " is not a recording";
+        return false;
+    }
+    if (readLE32(data + 4) != RECORDING_VERSION) {
+        error = path + " is a recording of another version";
+        return false;
+    }
+    fileHeader.startTime = readLE64(data + 8);
+    fileHeader.session = readLE32(data + 16);
+    fileHeader.part = readLE32(data + 20);
+    if (!readIndex()) {
+        scanChunks();
+    }
+    return true;
+}
+
+bool RecordingReader::readIndex() {
+    if (size < RECORDING_HEADER_SIZE + 8 + RECORDING_TRAILER_SIZE ||
+        memcmp(data + size - 4, END_MAGIC, 4) != 0) {
+        return false;
+    }
+    uint64_t indexOffset = readLE64(data + size - RECORDING_TRAILER_SIZE);
+    if (indexOffset < RECORDING_HEADER_SIZE || indexOffset > size - RECORDING_TRAILER_SIZE - 8 ||
+        memcmp(data + indexOffset, INDEX_MAGIC, 4) != 0) {
+        return false;
+    }
+    uint64_t count = readLE32(data + indexOffset + 4);
+    if ((size - RECORDING_TRAILER_SIZE - indexOffset - 8) != count * RECORDING_INDEX_ENTRY_SIZE) {
+        return false;
+    }
+
+    // The index says where each chunk is; its header says the rest
+    const char* entry = data + indexOffset + 8;
+    for (uint64_t i = 0; i < count; i++, entry += RECORDING_INDEX_ENTRY_SIZE) {
+        uint64_t offset = readLE64(entry);
+        RecordingChunk chunk;
+        if (offset + RECORDING_CHUNK_HEADER_SIZE > indexOffset || !decodeChunkHeader(data + offset, offset, chunk) ||
+            offset + RECORDING_CHUNK_HEADER_SIZE + chunk.storedLength > indexOffset) {
+            index.clear();
+            return false;
+        }
+        index.push_back(chunk);
+    }
+    indexed = true;
+    return true;
+}
+
+void RecordingReader::scanChunks() {
+    uint64_t offset = RECORDING_HEADER_SIZE;
+    RecordingChunk chunk;
+    while (offset + RECORDING_CHUNK_HEADER_SIZE <= size && decodeChunkHeader(data + offset, offset, chunk) &&
+           chunk.storedLength <= size - offset - RECORDING_CHUNK_HEADER_SIZE) {
+        index.push_back(chunk);
+        offset += RECORDING_CHUNK_HEADER_SIZE + chunk.storedLength;
+    }
+}
+
+size_t RecordingReader::findChunk(uint64_t time) const {
+    // Chunks are in time order, so the first whose last record is at or
+    // after 'time' is found by a binary search
+    size_t low = 0;
+    size_t high = index.size();
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (index[middle].lastTime < time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool RecordingReader::readChunk(size_t chunk, std::string& raw) const {
+    const RecordingChunk& entry = index[chunk];
+    const char* stored = data + entry.fileOffset + RECORDING_CHUNK_HEADER_SIZE;
+    if (entry.compressed) {
+        StreamDecompressor decompressor;
+        const char* decompressed;
+        size_t length;
+        if (!decompressor.decompress(stored, entry.storedLength, decompressed, length, entry.rawLength) ||
+            length != entry.rawLength) {
+            return false;
+        }
+        raw.assign(decompressed, length);
+    } else {
+        if (entry.storedLength != entry.rawLength) {
+            return false;
+        }
+        raw.assign(stored, entry.storedLength);
+    }
+    return adler32(ADLER32_INIT, raw.data(), raw.length()) == entry.checksum;
+}
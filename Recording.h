@@ -0,0 +1,127 @@
+#pragma once
+
+// Session recordings (kServer --record): every byte a session's shells
+// wrote, and every line or keystroke sent to them, with the time the
+// server read or received it. Written by the server's recorder
+// (kServer/SessionRecorder.h), played back by kClient --replay.
+//
+// A recording is a series of files, its parts, each readable on its own:
+//
+//   File header (RECORDING_HEADER_SIZE): "KREC", u32 version, u64 when the
+//     session started (microseconds since 1970), u32 the session's serial
+//     number, u32 part number (from 1).
+//
+//   Chunks, one after another. A chunk header (RECORDING_CHUNK_HEADER_SIZE)
+//     is "KRCH", u32 stored length, u32 raw length, u32 records, u64 time
+//     of the first and of the last record, u64 record bytes in the
+//     recording before this chunk, u64 bytes lost before it (the recorder
+//     fell behind), u32 Adler-32 of the raw records and u8 compressed. The
+//     stored records follow: an LZ4-style block (Compression.h) decodable
+//     without any other chunk, or the raw records when that didn't pay off.
+//
+//   Records, in a chunk's raw bytes: u64 time, u16 channel, u8 stream
+//     (STREAM_STDOUT or STREAM_STDERR for output, STREAM_STDIN for input),
+//     u32 length, then the bytes.
+//
+//   Index, once the part is complete: "KRIX", u32 chunks, then per chunk
+//     u64 file offset, u64 first time, u64 last time and u64 record bytes
+//     before it; then a trailer of u64 the index's file offset and "KEND".
+//     A part whose writer stopped before the index (a crash, or one still
+//     being written) is indexed by walking its chunk headers instead.
+//
+// All integers are little-endian. Only whole chunks are ever written, so a
+// part that ends in a partial one is read up to it.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define RECORDING_VERSION 1
+#define RECORDING_HEADER_SIZE 24
+#define RECORDING_CHUNK_HEADER_SIZE 53
+#define RECORDING_RECORD_HEADER_SIZE 15
+#define RECORDING_INDEX_ENTRY_SIZE 32
+#define RECORDING_TRAILER_SIZE 12
+#define RECORDING_EXTENSION ".krec"
+
+struct RecordingHeader {
+    uint64_t startTime;
+    uint32_t session;
+    uint32_t part;
+};
+
+// A chunk as its header, and the index, describe it
+struct RecordingChunk {
+    uint64_t fileOffset;        // Of its header
+    uint32_t storedLength;
+    uint32_t rawLength;
+    uint32_t records;
+    uint64_t firstTime;
+    uint64_t lastTime;
+    uint64_t recordOffset;      // Record bytes before it
+    uint64_t lostBytes;
+    uint32_t checksum;
+    bool compressed;
+};
+
+struct RecordingRecord {
+    uint64_t time;
+    uint16_t channel;
+    uint8_t stream;
+    const char* data;
+    size_t length;
+};
+
+std::string makeRecordingHeader(const RecordingHeader& header);
+std::string makeRecordingChunkHeader(const RecordingChunk& chunk);
+void appendRecordingRecord(std::string& raw, uint64_t time, uint16_t channel, uint8_t stream, const char* data,
+                           size_t length);
+std::string makeRecordingIndex(const std::vector<RecordingChunk>& chunks, uint64_t indexOffset);
+
+// The record at 'offset' of a chunk's raw bytes, moving 'offset' past it.
+// False at the end or if the record is cut off.
+bool nextRecordingRecord(const std::string& raw, size_t& offset, RecordingRecord& record);
+
+// One part, memory-mapped. Opening reads the index (or walks the chunk
+// headers), so any time in the part can be found without reading what
+// comes before it.
+class RecordingReader {
+private:
+    const char* data;
+    size_t size;
+#ifdef _WIN32
+    void* fileHandle;
+    void* mapping;
+#endif
+    RecordingHeader fileHeader;
+    std::vector<RecordingChunk> index;
+    bool indexed;               // The part had its index
+
+    RecordingReader(const RecordingReader&) = delete;
+    RecordingReader& operator=(const RecordingReader&) = delete;
+
+    bool map(const std::string& path, std::string& error);
+    void unmap();
+    bool readIndex();
+    void scanChunks();
+
+public:
+    RecordingReader();
+    ~RecordingReader();
+
+    // False, with 'error' saying why, if the file isn't a recording
+    bool open(const std::string& path, std::string& error);
+
+    const RecordingHeader& header() const { return fileHeader; }
+    const std::vector<RecordingChunk>& chunks() const { return index; }
+    bool complete() const { return indexed; }
+
+    // The first chunk with records at or after 'time'; chunks().size() if
+    // there is none
+    size_t findChunk(uint64_t time) const;
+
+    // A chunk's raw records, decompressed and checked. False if it is
+    // damaged.
+    bool readChunk(size_t chunk, std::string& raw) const;
+};
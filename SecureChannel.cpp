@@ -0,0 +1,480 @@
+#include "SecureChannel.h"
+#include <cctype>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#ifdef KTERMINAL_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+#endif
+
+// AES-GCM is only the fastest where the CPU does AES and GHASH itself
+#define TLS_SUITES_AES_FIRST "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS_SUITES_CHACHA_FIRST "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+
+// Lifetime of the self-signed certificate made when none is configured
+#define TLS_EPHEMERAL_CERT_DAYS 365
+
+bool tlsSupported() {
+#ifdef KTERMINAL_TLS
+    return true;
+#else
+    return false;
+#endif
+}
+
+static bool detectAesHardware() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    // CPUID leaf 1, ECX: bit 25 AES-NI, bit 1 PCLMULQDQ (GCM's GHASH)
+    unsigned int ecx;
+#ifdef _MSC_VER
+    int registers[4];
+    __cpuid(registers, 1);
+    ecx = (unsigned int)registers[2];
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+#endif
+    return (ecx & (1u << 25)) && (ecx & (1u << 1));
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#ifdef _WIN32
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL);
+#elif defined(__APPLE__)
+    return true;
+#else
+    return false;
+#endif
+#else
+    return false;
+#endif
+}
+
+bool aesHardware() {
+    static const bool hardware = detectAesHardware();
+    return hardware;
+}
+
+const char* tlsCipherSuites() {
+    return aesHardware() ? TLS_SUITES_AES_FIRST : TLS_SUITES_CHACHA_FIRST;
+}
+
+#ifdef KTERMINAL_TLS
+
+static std::string certificateDigest(X509* certificate) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (!certificate || !X509_digest(certificate, EVP_sha256(), digest, &length)) {
+        return "";
+    }
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned int i = 0; i < length; i++) {
+        out += hex[digest[i] >> 4];
+        out += hex[digest[i] & 0xF];
+    }
+    return out;
+}
+
+static std::string lastError(const std::string& context) {
+    // The oldest error is the one that explains the rest
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) {
+        return context;
+    }
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return context + ": " + text;
+}
+
+static ssl_ctx_st* newContext(const SSL_METHOD* method) {
+    SSL_CTX* context = SSL_CTX_new(method);
+    if (context) {
+        SSL_CTX_set_min_proto_version(context, TLS1_3_VERSION);
+        SSL_CTX_set_ciphersuites(context, tlsCipherSuites());
+    }
+    return context;
+}
+
+static bool useEphemeralCertificate(SSL_CTX* context) {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* certificate = X509_new();
+    bool ok = key && certificate;
+    if (ok) {
+        long serial = 0;
+        RAND_bytes((unsigned char*)&serial, sizeof(serial));
+        X509_set_version(certificate, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), serial & 0x7FFFFFFF);
+        X509_gmtime_adj(X509_getm_notBefore(certificate), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(certificate), (long)TLS_EPHEMERAL_CERT_DAYS * 24 * 3600);
+        X509_set_pubkey(certificate, key);
+        X509_NAME* name = X509_get_subject_name(certificate);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"kServer", -1, -1, 0);
+        X509_set_issuer_name(certificate, name);
+        ok = X509_sign(certificate, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(context, certificate) == 1 &&
+             SSL_CTX_use_PrivateKey(context, key) == 1;
+    }
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+TlsServerContext::TlsServerContext() : context(NULL) {}
+
+TlsServerContext::~TlsServerContext() {
+    SSL_CTX_free(context);
+}
+
+bool TlsServerContext::initialize(const std::string& certificateFile, const std::string& keyFile, std::string& error) {
+    if (certificateFile.empty() != keyFile.empty()) {
+        error = "A certificate needs its key, and a key its certificate";
+        return false;
+    }
+    context = newContext(TLS_server_method());
+    if (!context) {
+        error = lastError("Unable to create TLS context");
+        return false;
+    }
+
+    // Connections resume from stateless tickets, so the server keeps no
+    // session cache. The server's suite order wins, unless the client
+    // asks for ChaCha20 first: it lacks AES hardware.
+    SSL_CTX_set_options(context, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+
+    if (certificateFile.empty()) {
+        if (!useEphemeralCertificate(context)) {
+            error = lastError("Unable to make a certificate");
+            return false;
+        }
+    } else if (SSL_CTX_use_certificate_chain_file(context, certificateFile.c_str()) != 1) {
+        error = lastError("Unable to load " + certificateFile);
+        return false;
+    } else if (SSL_CTX_use_PrivateKey_file(context, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+               SSL_CTX_check_private_key(context) != 1) {
+        error = lastError("Unable to load " + keyFile);
+        return false;
+    }
+    certificateFingerprint = certificateDigest(SSL_CTX_get0_certificate(context));
+    return true;
+}
+
+TlsClientContext::TlsClientContext() : context(NULL), verifyChain(false) {}
+
+TlsClientContext::~TlsClientContext() {
+    clearSessions();
+    SSL_CTX_free(context);
+}
+
+bool TlsClientContext::initialize(const std::string& caFile, const std::string& fingerprint, std::string& error) {
+    pinned.clear();
+    for (size_t i = 0; i < fingerprint.length(); i++) {
+        if (fingerprint[i] != ':') {
+            pinned += (char)tolower((unsigned char)fingerprint[i]);
+        }
+    }
+    if (!pinned.empty() && (pinned.length() != 2 * 32 || pinned.find_first_not_of("0123456789abcdef") != std::string::npos)) {
+        error = "A fingerprint is 64 hex digits (SHA-256)";
+        return false;
+    }
+
+    context = newContext(TLS_client_method());
+    if (!context) {
+        error = lastError("Unable to create TLS context");
+        return false;
+    }
+
+    // Tickets are kept here rather than in OpenSSL's cache, which is keyed
+    // by nothing a reconnect would know
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context, SecureChannel::onNewSession);
+
+    verifyChain = !caFile.empty();
+    if (verifyChain) {
+        if (SSL_CTX_load_verify_locations(context, caFile.c_str(), NULL) != 1) {
+            error = lastError("Unable to load " + caFile);
+            return false;
+        }
+        SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    } else {
+        // A pinned certificate is checked once the handshake is done
+        SSL_CTX_set_verify(context, SSL_VERIFY_NONE, NULL);
+    }
+    return true;
+}
+
+void TlsClientContext::storeSession(const std::string& server, ssl_session_st* session) {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    ssl_session_st*& slot = sessions[server];
+    SSL_SESSION_free(slot);
+    slot = session;
+}
+
+ssl_session_st* TlsClientContext::takeSession(const std::string& server) {
+    // The ticket stays for other connections; the caller gets a reference
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    std::map<std::string, ssl_session_st*>::iterator it = sessions.find(server);
+    if (it == sessions.end() || !SSL_SESSION_is_resumable(it->second)) {
+        return NULL;
+    }
+    SSL_SESSION_up_ref(it->second);
+    return it->second;
+}
+
+void TlsClientContext::clearSessions() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    for (std::map<std::string, ssl_session_st*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        SSL_SESSION_free(it->second);
+    }
+    sessions.clear();
+}
+
+SecureChannel::SecureChannel(TlsServerContext& context)
+    : ssl(NULL), incoming(NULL), outgoing(NULL), client(NULL), established(false) {
+    ssl = SSL_new(context.handle());
+    if (!ssl) {
+        fail(lastError("Unable to start TLS"));
+        return;
+    }
+    incoming = BIO_new(BIO_s_mem());
+    outgoing = BIO_new(BIO_s_mem());
+    BIO_set_mem_eof_return(incoming, -1);
+    SSL_set_bio(ssl, incoming, outgoing);
+    SSL_set_accept_state(ssl);
+}
+
+SecureChannel::SecureChannel(TlsClientContext& context, const std::string& host, const std::string& port)
+    : ssl(NULL), incoming(NULL), outgoing(NULL), client(&context), server(host + ":" + port), established(false) {
+    ssl = SSL_new(context.context);
+    if (!ssl) {
+        fail(lastError("Unable to start TLS"));
+        return;
+    }
+    incoming = BIO_new(BIO_s_mem());
+    outgoing = BIO_new(BIO_s_mem());
+    BIO_set_mem_eof_return(incoming, -1);
+    SSL_set_bio(ssl, incoming, outgoing);
+    SSL_set_app_data(ssl, this);
+    SSL_set_connect_state(ssl);
+
+    // Names are checked and sent (SNI); addresses are only checked
+    ASN1_OCTET_STRING* address = a2i_IPADDRESS(host.c_str());
+    if (address) {
+        ASN1_OCTET_STRING_free(address);
+        if (context.verifyChain) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str());
+        }
+    } else {
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        if (context.verifyChain) {
+            SSL_set1_host(ssl, host.c_str());
+        }
+    }
+
+    ssl_session_st* session = context.takeSession(server);
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+    advance();
+}
+
+SecureChannel::~SecureChannel() {
+    // Connections are dropped rather than shut down, and OpenSSL spoils
+    // the tickets of any that end without close_notify; a reconnect is
+    // what they are kept for, so only a failed connection loses them
+    if (ssl && failure.empty()) {
+        SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+
+    // Frees both BIOs
+    SSL_free(ssl);
+}
+
+int SecureChannel::onNewSession(ssl_st* ssl, ssl_session_st* session) {
+    // Client only: a ticket from the server. Keeping it takes the reference.
+    SecureChannel* channel = (SecureChannel*)SSL_get_app_data(ssl);
+    if (!channel || !channel->client) {
+        return 0;
+    }
+    channel->client->storeSession(channel->server, session);
+    return 1;
+}
+
+bool SecureChannel::fail(const std::string& message) {
+    if (failure.empty()) {
+        failure = message;
+    }
+    return false;
+}
+
+bool SecureChannel::advance() {
+    if (established) {
+        return true;
+    }
+    ERR_clear_error();
+    int result = SSL_do_handshake(ssl);
+    if (result == 1) {
+        established = true;
+        if (client && !client->pinned.empty()) {
+            std::string presented = peerFingerprint();
+            if (presented != client->pinned) {
+                return fail("Server certificate " + presented + " is not the pinned one");
+            }
+        }
+        return true;
+    }
+    int code = SSL_get_error(ssl, result);
+    if (code == SSL_ERROR_WANT_READ || code == SSL_ERROR_WANT_WRITE) {
+        return true;
+    }
+    long verified = SSL_get_verify_result(ssl);
+    if (client && verified != X509_V_OK) {
+        ERR_clear_error();
+        return fail(std::string("Server certificate rejected: ") + X509_verify_cert_error_string(verified));
+    }
+    return fail(lastError("TLS handshake failed"));
+}
+
+bool SecureChannel::receive(const char* data, size_t length) {
+    if (!ssl || !failure.empty()) {
+        return false;
+    }
+    if (BIO_write(incoming, data, (int)length) != (int)length) {
+        return fail("Out of memory");
+    }
+    return advance();
+}
+
+size_t SecureChannel::read(char* out, size_t space) {
+    if (!established || !failure.empty()) {
+        return 0;
+    }
+    ERR_clear_error();
+    size_t got = 0;
+    int result = SSL_read_ex(ssl, out, space, &got);
+    if (result == 1) {
+        return got;
+    }
+    int code = SSL_get_error(ssl, result);
+    if (code == SSL_ERROR_ZERO_RETURN) {
+        fail("Connection closed");
+    } else if (code != SSL_ERROR_WANT_READ && code != SSL_ERROR_WANT_WRITE) {
+        fail(lastError("Unable to decrypt"));
+    }
+    return 0;
+}
+
+bool SecureChannel::write(const char* data, size_t length) {
+    if (!established || !failure.empty()) {
+        return false;
+    }
+    ERR_clear_error();
+    size_t written = 0;
+    if (length > 0 && SSL_write_ex(ssl, data, length, &written) != 1) {
+        return fail(lastError("Unable to encrypt"));
+    }
+    return true;
+}
+
+size_t SecureChannel::takeOutput(std::string& out) {
+    size_t pending = outgoing ? BIO_ctrl_pending(outgoing) : 0;
+    if (pending > 0) {
+        size_t start = out.length();
+        out.resize(start + pending);
+        BIO_read(outgoing, &out[start], (int)pending);
+    }
+    return pending;
+}
+
+bool SecureChannel::hasOutput() const {
+    return outgoing && BIO_ctrl_pending(outgoing) > 0;
+}
+
+bool SecureChannel::resumed() const {
+    return established && SSL_session_reused(ssl) == 1;
+}
+
+std::string SecureChannel::describe() const {
+    if (!established) {
+        return "";
+    }
+    std::string description = SSL_get_version(ssl);
+    description += ", ";
+    description += SSL_CIPHER_get_name(SSL_get_current_cipher(ssl));
+    if (resumed()) {
+        description += ", resumed";
+    }
+    return description;
+}
+
+std::string SecureChannel::peerFingerprint() const {
+    return ssl ? certificateDigest(SSL_get0_peer_certificate(ssl)) : "";
+}
+
+#else
+
+#define TLS_UNSUPPORTED "Built without TLS support"
+
+TlsServerContext::TlsServerContext() : context(NULL) {}
+TlsServerContext::~TlsServerContext() {}
+
+bool TlsServerContext::initialize(const std::string&, const std::string&, std::string& error) {
+    error = TLS_UNSUPPORTED;
+    return false;
+}
+
+TlsClientContext::TlsClientContext() : context(NULL), verifyChain(false) {}
+TlsClientContext::~TlsClientContext() {}
+
+bool TlsClientContext::initialize(const std::string&, const std::string&, std::string& error) {
+    error = TLS_UNSUPPORTED;
+    return false;
+}
+
+void TlsClientContext::storeSession(const std::string&, ssl_session_st*) {}
+ssl_session_st* TlsClientContext::takeSession(const std::string&) { return NULL; }
+void TlsClientContext::clearSessions() {}
+
+SecureChannel::SecureChannel(TlsServerContext&)
+    : ssl(NULL), incoming(NULL), outgoing(NULL), client(NULL), established(false), failure(TLS_UNSUPPORTED) {}
+
+SecureChannel::SecureChannel(TlsClientContext& context, const std::string&, const std::string&)
+    : ssl(NULL), incoming(NULL), outgoing(NULL), client(&context), established(false), failure(TLS_UNSUPPORTED) {}
+
+SecureChannel::~SecureChannel() {}
+
+int SecureChannel::onNewSession(ssl_st*, ssl_session_st*) { return 0; }
+bool SecureChannel::fail(const std::string& message) { failure = message; return false; }
+bool SecureChannel::advance() { return false; }
+bool SecureChannel::receive(const char*, size_t) { return false; }
+size_t SecureChannel::read(char*, size_t) { return 0; }
+bool SecureChannel::write(const char*, size_t) { return false; }
+size_t SecureChannel::takeOutput(std::string&) { return 0; }
+bool SecureChannel::hasOutput() const { return false; }
+bool SecureChannel::resumed() const { return false; }
+std::string SecureChannel::describe() const { return ""; }
+std::string SecureChannel::peerFingerprint() const { return ""; }
+
+#endif
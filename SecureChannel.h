@@ -0,0 +1,174 @@
+#pragma once
+
+// Transport encryption (--tls): TLS 1.3 spoken directly on the terminal
+// connection, so no SSH tunnel is needed.
+//
+// A SecureChannel never touches a socket. Ciphertext read from the
+// connection goes in through receive() and comes back out of read() as
+// plaintext; plaintext goes in through write() and the records to send
+// come out of takeOutput(). That suits the server's completion-based
+// event loops as well as the client's blocking sockets, and leaves the
+// framing untouched: an encrypted connection carries exactly the bytes a
+// plain one would, hello included.
+//
+// The server tells the two apart by the first byte, which on a TLS
+// connection is a handshake record (TLS_HANDSHAKE_RECORD) and never the
+// first byte of a frame or of a printable legacy command.
+//
+// Cipher order follows the CPU. With AES in hardware (AES-NI and CLMUL on
+// x86, the ARMv8 crypto extensions) AES-128-GCM is the fastest suite;
+// without it ChaCha20-Poly1305 is several times faster than AES in
+// software, so it goes first. The server prefers its own order, except that
+// a client that asks for ChaCha20 first gets it: it is the one that would
+// be slow otherwise.
+//
+// Reconnects resume: the server hands out stateless session tickets, and a
+// client context keeps the latest one per server, so a resumed handshake
+// skips the certificate and the server's signature. Early data (0-RTT) is
+// not used; the hello that would ride in it is a replayable request to
+// take over a session.
+//
+// Built without OpenSSL (KTERMINAL_TLS undefined) the classes are still
+// there, but every context fails to initialize.
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+struct bio_st;
+
+// The first byte of every TLS connection
+#define TLS_HANDSHAKE_RECORD 0x16
+
+// Longest the server waits for a TLS client to finish its handshake and
+// send its hello
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+
+// False when built without OpenSSL
+bool tlsSupported();
+
+// The CPU encrypts AES in hardware
+bool aesHardware();
+
+// TLS 1.3 cipher suites, fastest on this CPU first
+const char* tlsCipherSuites();
+
+// The server's certificate and key, shared by all its connections
+class TlsServerContext {
+private:
+    ssl_ctx_st* context;
+    std::string certificateFingerprint;
+
+    TlsServerContext(const TlsServerContext&) = delete;
+    TlsServerContext& operator=(const TlsServerContext&) = delete;
+
+public:
+    TlsServerContext();
+    ~TlsServerContext();
+
+    // Loads a PEM certificate (chain) and its private key; with neither,
+    // makes a self-signed certificate that lasts as long as the process.
+    // False, with 'error' saying why, if they can't be used.
+    bool initialize(const std::string& certificateFile, const std::string& keyFile, std::string& error);
+
+    // SHA-256 of the certificate, in hex, for clients to pin
+    const std::string& fingerprint() const { return certificateFingerprint; }
+
+    ssl_ctx_st* handle() const { return context; }
+};
+
+// How a client checks servers, and the session tickets they have issued.
+// One context may be shared by any number of connections and threads.
+class TlsClientContext {
+private:
+    ssl_ctx_st* context;
+    std::string pinned;         // Expected fingerprint, if any
+    bool verifyChain;
+
+    std::mutex sessionMutex;
+    std::map<std::string, ssl_session_st*> sessions;   // Latest ticket per "host:port"
+
+    TlsClientContext(const TlsClientContext&) = delete;
+    TlsClientContext& operator=(const TlsClientContext&) = delete;
+
+    friend class SecureChannel;
+    void storeSession(const std::string& server, ssl_session_st* session);
+    ssl_session_st* takeSession(const std::string& server);
+
+public:
+    TlsClientContext();
+    ~TlsClientContext();
+
+    // Servers are checked against the PEM certificates in 'caFile' and the
+    // name they were reached by, or must present the certificate with the
+    // given fingerprint (hex, colons optional). With neither any
+    // certificate is accepted, and the caller should show the fingerprint
+    // so the user can pin it.
+    bool initialize(const std::string& caFile, const std::string& fingerprint, std::string& error);
+
+    // Servers are checked at all
+    bool verifies() const { return verifyChain || !pinned.empty(); }
+
+    // Forgets every ticket, so the next handshakes are full ones (kBench)
+    void clearSessions();
+};
+
+class SecureChannel {
+private:
+    ssl_st* ssl;
+    bio_st* incoming;           // Ciphertext received, not yet decrypted
+    bio_st* outgoing;           // Ciphertext to send
+    TlsClientContext* client;   // NULL on the server
+    std::string server;         // "host:port", which the client's tickets are kept under
+    bool established;
+    std::string failure;
+
+    SecureChannel(const SecureChannel&) = delete;
+    SecureChannel& operator=(const SecureChannel&) = delete;
+
+    friend class TlsClientContext;
+    bool advance();
+    bool fail(const std::string& message);
+    static int onNewSession(ssl_st* ssl, ssl_session_st* session);
+
+public:
+    // The server's end of a connection that has just been accepted
+    explicit SecureChannel(TlsServerContext& context);
+
+    // The client's end; the ClientHello is ready in the output at once.
+    // A ticket kept for the server is offered.
+    SecureChannel(TlsClientContext& context, const std::string& host, const std::string& port);
+    ~SecureChannel();
+
+    // Ciphertext from the connection. Moves the handshake on; false once
+    // the connection has failed (error() says why).
+    bool receive(const char* data, size_t length);
+
+    // Decrypted bytes, at most 'space' of them; 0 if none are ready or the
+    // connection has failed
+    size_t read(char* out, size_t space);
+
+    // Encrypts 'data' into the output
+    bool write(const char* data, size_t length);
+
+    // Appends the ciphertext waiting to be sent (handshake messages and
+    // records) to 'out', returning how much there was
+    size_t takeOutput(std::string& out);
+    bool hasOutput() const;
+
+    bool handshakeDone() const { return established; }
+    bool failed() const { return !failure.empty(); }
+    const std::string& error() const { return failure; }
+
+    // Once the handshake is done: whether a ticket was used, and a
+    // description such as "TLSv1.3, TLS_AES_128_GCM_SHA256, resumed"
+    bool resumed() const;
+    std::string describe() const;
+
+    // SHA-256 of the peer's certificate, in hex
+    std::string peerFingerprint() const;
+};
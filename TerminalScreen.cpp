@@ -0,0 +1,768 @@
+#include "TerminalScreen.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+TerminalScreen::TerminalScreen(int rows, int columns) : rowCount(0), columnCount(0), damaged(false), overlayRow(0),
+    overlayColumn(0) {
+    resize(rows, columns);
+}
+
+void TerminalScreen::resize(int rows, int columns) {
+    rowCount = rows > 0 ? rows : SCREEN_DEFAULT_ROWS;
+    columnCount = columns > 0 ? columns : SCREEN_DEFAULT_COLUMNS;
+    ScreenLine line;
+    line.cells.resize(columnCount);
+    line.used = columnCount;
+    lines.assign(rowCount, line);
+    damageFirst.assign(rowCount, 0);
+    damageLast.assign(rowCount, -1);
+    damageRowsFirst = 0;
+    damageRowsLast = -1;
+    paintedRow = -1;
+    paintedColumn = -1;
+    paintedCursorVisible = false;
+    scrolledLines = 0;
+    overlay.clear();
+    reset();
+}
+
+void TerminalScreen::reset() {
+    pen.ch = 0;
+    pen.fg = SCREEN_COLOR_DEFAULT;
+    pen.bg = SCREEN_COLOR_DEFAULT;
+    pen.attributes = 0;
+    savedPen = pen;
+    row = 0;
+    column = 0;
+    savedRow = 0;
+    savedColumn = 0;
+    wrapPending = false;
+    cursorVisible = true;
+    scrollTop = 0;
+    scrollBottom = rowCount - 1;
+    state = STATE_GROUND;
+    params.clear();
+    codePoint = 0;
+    utf8Remaining = 0;
+    for (int r = 0; r < rowCount; r++) {
+        clearCells(r, 0, columnCount - 1);
+    }
+}
+
+void TerminalScreen::damage(int r, int first, int last) {
+    if (damageFirst[r] > damageLast[r]) {
+        damageFirst[r] = first;
+        damageLast[r] = last;
+    } else {
+        damageFirst[r] = std::min(damageFirst[r], first);
+        damageLast[r] = std::max(damageLast[r], last);
+    }
+    damaged = true;
+}
+
+void TerminalScreen::damageRows(int top, int bottom) {
+    if (damageRowsFirst > damageRowsLast) {
+        damageRowsFirst = top;
+        damageRowsLast = bottom;
+    } else if (top <= damageRowsLast + 1 && bottom >= damageRowsFirst - 1) {
+        damageRowsFirst = std::min(damageRowsFirst, top);
+        damageRowsLast = std::max(damageRowsLast, bottom);
+    } else {
+        for (int r = top; r <= bottom; r++) {
+            damage(r, 0, columnCount - 1);
+        }
+    }
+    damaged = true;
+}
+
+void TerminalScreen::damageAll() {
+    damageRows(0, rowCount - 1);
+}
+
+ScreenCell TerminalScreen::blank() const {
+    // Erasing fills with the current background, as terminals do
+    ScreenCell cell;
+    cell.ch = 0;
+    cell.fg = SCREEN_COLOR_DEFAULT;
+    cell.bg = pen.bg;
+    cell.attributes = 0;
+    return cell;
+}
+
+void TerminalScreen::clearCells(int r, int first, int last) {
+    first = std::max(first, 0);
+    last = std::min(last, columnCount - 1);
+    if (first > last) {
+        return;
+    }
+    ScreenLine& line = lines[r];
+    ScreenCell cell = blank();
+    if (cell.bg == SCREEN_COLOR_DEFAULT) {
+        // Only the part of the row that was ever written needs clearing
+        int end = std::min(last, line.used - 1);
+        if (first <= end) {
+            std::fill(line.cells.begin() + first, line.cells.begin() + end + 1, cell);
+        }
+        if (last >= line.used - 1) {
+            line.used = std::min(line.used, first);
+        }
+    } else {
+        std::fill(line.cells.begin() + first, line.cells.begin() + last + 1, cell);
+        line.used = std::max(line.used, last + 1);
+    }
+    damage(r, first, last);
+}
+
+void TerminalScreen::print(uint32_t ch) {
+    if (wrapPending) {
+        wrapPending = false;
+        column = 0;
+        lineFeed();
+    }
+    ScreenLine& line = lines[row];
+    ScreenCell& cell = line.cells[column];
+    line.used = std::max(line.used, column + 1);
+    cell = pen;
+    cell.ch = ch;
+    damage(row, column, column);
+    if (column == columnCount - 1) {
+        wrapPending = true;
+    } else {
+        column++;
+    }
+}
+
+void TerminalScreen::printRun(const char* text, size_t count) {
+    // print() for a run of ASCII, a row's worth of cells at a time
+    while (count > 0) {
+        if (wrapPending) {
+            wrapPending = false;
+            column = 0;
+            lineFeed();
+        }
+        int n = (int)std::min(count, (size_t)(columnCount - column));
+        ScreenLine& line = lines[row];
+        ScreenCell* cells = &line.cells[column];
+        line.used = std::max(line.used, column + n);
+        for (int i = 0; i < n; i++) {
+            cells[i] = pen;
+            cells[i].ch = (unsigned char)text[i];
+        }
+        damage(row, column, column + n - 1);
+        column += n;
+        text += n;
+        count -= n;
+        if (column == columnCount) {
+            column = columnCount - 1;
+            wrapPending = true;
+        }
+    }
+}
+
+void TerminalScreen::lineFeed() {
+    if (row == scrollBottom) {
+        scrollUp(scrollTop, scrollBottom, 1);
+        if (scrollTop == 0) {
+            scrolledLines++;
+        }
+    } else if (row < rowCount - 1) {
+        row++;
+    }
+}
+
+void TerminalScreen::reverseIndex() {
+    if (row == scrollTop) {
+        scrollDown(scrollTop, scrollBottom, 1);
+    } else if (row > 0) {
+        row--;
+    }
+}
+
+void TerminalScreen::scrollUp(int top, int bottom, int count) {
+    // Rows are separate vectors, so scrolling moves pointers, not cells
+    count = std::min(count, bottom - top + 1);
+    if (count <= 0) {
+        return;
+    }
+    std::rotate(lines.begin() + top, lines.begin() + top + count, lines.begin() + bottom + 1);
+    for (int r = bottom - count + 1; r <= bottom; r++) {
+        clearCells(r, 0, columnCount - 1);
+    }
+    damageRows(top, bottom);
+}
+
+void TerminalScreen::scrollDown(int top, int bottom, int count) {
+    count = std::min(count, bottom - top + 1);
+    if (count <= 0) {
+        return;
+    }
+    std::rotate(lines.begin() + top, lines.begin() + bottom + 1 - count, lines.begin() + bottom + 1);
+    for (int r = top; r < top + count; r++) {
+        clearCells(r, 0, columnCount - 1);
+    }
+    damageRows(top, bottom);
+}
+
+void TerminalScreen::moveTo(int r, int c) {
+    row = std::max(0, std::min(r, rowCount - 1));
+    column = std::max(0, std::min(c, columnCount - 1));
+    wrapPending = false;
+}
+
+void TerminalScreen::control(unsigned char byte) {
+    switch (byte) {
+    case '\b':
+        if (column > 0) {
+            column--;
+        }
+        wrapPending = false;
+        break;
+    case '\t':
+        column = std::min((column / 8 + 1) * 8, columnCount - 1);
+        wrapPending = false;
+        break;
+    case '\n':
+    case '\v':
+    case '\f':
+        wrapPending = false;
+        lineFeed();
+        break;
+    case '\r':
+        column = 0;
+        wrapPending = false;
+        break;
+    case 0x18:  // CAN and SUB abandon a sequence
+    case 0x1a:
+        state = STATE_GROUND;
+        break;
+    case 0x1b:
+        state = STATE_ESCAPE;
+        break;
+    default:
+        break;  // BEL and the rest draw nothing
+    }
+}
+
+void TerminalScreen::escape(unsigned char byte) {
+    state = STATE_GROUND;
+    switch (byte) {
+    case '[':
+        params.clear();
+        state = STATE_CSI;
+        break;
+    case ']':
+    case 'P':   // DCS strings are skipped like OSC
+        state = STATE_OSC;
+        break;
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+        state = STATE_CHARSET;
+        break;
+    case '7':
+        savedRow = row;
+        savedColumn = column;
+        savedPen = pen;
+        break;
+    case '8':
+        moveTo(savedRow, savedColumn);
+        pen = savedPen;
+        break;
+    case 'D':
+        lineFeed();
+        break;
+    case 'E':
+        column = 0;
+        lineFeed();
+        break;
+    case 'M':
+        reverseIndex();
+        break;
+    case 'c':
+        reset();
+        break;
+    default:
+        break;
+    }
+}
+
+void TerminalScreen::setGraphics(const int* values, int count) {
+    if (count == 0) {
+        values = NULL;
+    }
+    for (int i = 0; i < std::max(count, 1); i++) {
+        int value = values ? values[i] : 0;
+        if (value == 0) {
+            pen.fg = SCREEN_COLOR_DEFAULT;
+            pen.bg = SCREEN_COLOR_DEFAULT;
+            pen.attributes = 0;
+        } else if (value == 1) {
+            pen.attributes |= SCREEN_BOLD;
+        } else if (value == 4) {
+            pen.attributes |= SCREEN_UNDERLINE;
+        } else if (value == 7) {
+            pen.attributes |= SCREEN_REVERSE;
+        } else if (value == 22) {
+            pen.attributes &= ~SCREEN_BOLD;
+        } else if (value == 24) {
+            pen.attributes &= ~SCREEN_UNDERLINE;
+        } else if (value == 27) {
+            pen.attributes &= ~SCREEN_REVERSE;
+        } else if (value >= 30 && value <= 37) {
+            pen.fg = (uint16_t)(value - 30);
+        } else if (value == 39) {
+            pen.fg = SCREEN_COLOR_DEFAULT;
+        } else if (value >= 40 && value <= 47) {
+            pen.bg = (uint16_t)(value - 40);
+        } else if (value == 49) {
+            pen.bg = SCREEN_COLOR_DEFAULT;
+        } else if (value >= 90 && value <= 97) {
+            pen.fg = (uint16_t)(value - 90 + 8);
+        } else if (value >= 100 && value <= 107) {
+            pen.bg = (uint16_t)(value - 100 + 8);
+        } else if ((value == 38 || value == 48) && i + 1 < count) {
+            // 256 colours are kept; 24-bit ones are skipped
+            uint16_t* target = value == 38 ? &pen.fg : &pen.bg;
+            if (values[i + 1] == 5 && i + 2 < count) {
+                *target = (uint16_t)(values[i + 2] & 0xff);
+                i += 2;
+            } else if (values[i + 1] == 2) {
+                i += 4;
+            }
+        }
+    }
+}
+
+void TerminalScreen::dispatchCsi(unsigned char final) {
+    bool isPrivate = !params.empty() && (params[0] == '?' || params[0] == '>' || params[0] == '=');
+    int values[16];
+    int count = 0;
+    const char* p = params.c_str() + (isPrivate ? 1 : 0);
+    while (*p && count < 16) {
+        values[count++] = atoi(p);
+        while (*p && *p != ';' && *p != ':') {
+            p++;
+        }
+        if (*p) {
+            p++;
+        }
+    }
+    int first = count > 0 ? values[0] : 0;
+    int n = std::max(first, 1);
+
+    if (isPrivate) {
+        if (final != 'h' && final != 'l') {
+            return;
+        }
+        bool set = final == 'h';
+        for (int i = 0; i < count; i++) {
+            if (values[i] == 25) {
+                cursorVisible = set;
+            } else if (values[i] == 47 || values[i] == 1047 || values[i] == 1049) {
+                // The alternate screen, without keeping the main one
+                if (values[i] == 1049 && set) {
+                    savedRow = row;
+                    savedColumn = column;
+                }
+                for (int r = 0; r < rowCount; r++) {
+                    clearCells(r, 0, columnCount - 1);
+                }
+                if (values[i] == 1049 && !set) {
+                    moveTo(savedRow, savedColumn);
+                }
+            }
+        }
+        return;
+    }
+
+    switch (final) {
+    case 'A':
+        moveTo(row - n, column);
+        break;
+    case 'B':
+        moveTo(row + n, column);
+        break;
+    case 'C':
+        moveTo(row, column + n);
+        break;
+    case 'D':
+        moveTo(row, column - n);
+        break;
+    case 'E':
+        moveTo(row + n, 0);
+        break;
+    case 'F':
+        moveTo(row - n, 0);
+        break;
+    case 'G':
+    case '`':
+        moveTo(row, n - 1);
+        break;
+    case 'd':
+        moveTo(n - 1, column);
+        break;
+    case 'H':
+    case 'f':
+        moveTo(n - 1, (count > 1 ? std::max(values[1], 1) : 1) - 1);
+        break;
+    case 'J':
+        if (first == 0) {
+            clearCells(row, column, columnCount - 1);
+            for (int r = row + 1; r < rowCount; r++) {
+                clearCells(r, 0, columnCount - 1);
+            }
+        } else if (first == 1) {
+            for (int r = 0; r < row; r++) {
+                clearCells(r, 0, columnCount - 1);
+            }
+            clearCells(row, 0, column);
+        } else {
+            for (int r = 0; r < rowCount; r++) {
+                clearCells(r, 0, columnCount - 1);
+            }
+        }
+        break;
+    case 'K':
+        if (first == 0) {
+            clearCells(row, column, columnCount - 1);
+        } else if (first == 1) {
+            clearCells(row, 0, column);
+        } else {
+            clearCells(row, 0, columnCount - 1);
+        }
+        break;
+    case 'L':
+        if (row >= scrollTop && row <= scrollBottom) {
+            scrollDown(row, scrollBottom, n);
+        }
+        break;
+    case 'M':
+        if (row >= scrollTop && row <= scrollBottom) {
+            scrollUp(row, scrollBottom, n);
+        }
+        break;
+    case '@': {
+        std::vector<ScreenCell>& line = lines[row].cells;
+        n = std::min(n, columnCount - column);
+        lines[row].used = std::min(lines[row].used + n, columnCount);
+        std::copy_backward(line.begin() + column, line.end() - n, line.end());
+        clearCells(row, column, column + n - 1);
+        damage(row, column, columnCount - 1);
+        break;
+    }
+    case 'P': {
+        std::vector<ScreenCell>& line = lines[row].cells;
+        n = std::min(n, columnCount - column);
+        std::copy(line.begin() + column + n, line.end(), line.begin() + column);
+        clearCells(row, columnCount - n, columnCount - 1);
+        damage(row, column, columnCount - 1);
+        break;
+    }
+    case 'X':
+        clearCells(row, column, column + n - 1);
+        break;
+    case 'S':
+        scrollUp(scrollTop, scrollBottom, n);
+        break;
+    case 'T':
+        scrollDown(scrollTop, scrollBottom, n);
+        break;
+    case 'm':
+        setGraphics(values, count);
+        break;
+    case 'r': {
+        int top = first > 0 ? first - 1 : 0;
+        int bottom = (count > 1 && values[1] > 0) ? values[1] - 1 : rowCount - 1;
+        if (top < bottom && bottom < rowCount) {
+            scrollTop = top;
+            scrollBottom = bottom;
+            moveTo(0, 0);
+        }
+        break;
+    }
+    case 's':
+        savedRow = row;
+        savedColumn = column;
+        break;
+    case 'u':
+        moveTo(savedRow, savedColumn);
+        break;
+    default:
+        break;
+    }
+}
+
+void TerminalScreen::write(const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char byte = (unsigned char)data[i];
+        switch (state) {
+        case STATE_GROUND:
+            if (byte >= 0x20 && byte < 0x7f && utf8Remaining == 0) {
+                size_t end = i + 1;
+                while (end < length && (unsigned char)data[end] >= 0x20 && (unsigned char)data[end] < 0x7f) {
+                    end++;
+                }
+                printRun(data + i, end - i);
+                i = end - 1;
+            } else if (byte < 0x20) {
+                utf8Remaining = 0;
+                control(byte);
+            } else if (byte == 0x7f) {
+                // DEL draws nothing
+            } else if (byte >= 0x80 && byte < 0xc0) {
+                if (utf8Remaining > 0) {
+                    codePoint = (codePoint << 6) | (byte & 0x3f);
+                    if (--utf8Remaining == 0) {
+                        print(codePoint);
+                    }
+                } else {
+                    print(0xfffd);
+                }
+            } else {
+                if (utf8Remaining > 0) {
+                    utf8Remaining = 0;
+                    print(0xfffd);
+                }
+                if (byte >= 0xc0 && byte < 0xe0) {
+                    codePoint = byte & 0x1f;
+                    utf8Remaining = 1;
+                } else if (byte >= 0xe0 && byte < 0xf0) {
+                    codePoint = byte & 0x0f;
+                    utf8Remaining = 2;
+                } else if (byte >= 0xf0 && byte < 0xf8) {
+                    codePoint = byte & 0x07;
+                    utf8Remaining = 3;
+                } else if (byte >= 0x20 && byte < 0x7f) {
+                    print(byte);
+                } else {
+                    print(0xfffd);
+                }
+            }
+            break;
+        case STATE_ESCAPE:
+            if (byte < 0x20) {
+                control(byte);
+            } else {
+                escape(byte);
+            }
+            break;
+        case STATE_CSI:
+            if (byte < 0x20) {
+                // Controls inside a sequence take effect; ESC starts over
+                control(byte);
+            } else if (byte >= 0x40 && byte <= 0x7e) {
+                state = STATE_GROUND;
+                dispatchCsi(byte);
+            } else if (params.length() < SCREEN_MAX_PARAMS) {
+                params += (char)byte;
+            }
+            break;
+        case STATE_OSC:
+            if (byte == 0x07) {
+                state = STATE_GROUND;
+            } else if (byte == 0x1b) {
+                state = STATE_OSC_ESCAPE;
+            }
+            break;
+        case STATE_OSC_ESCAPE:
+            state = byte == 0x1b ? STATE_OSC_ESCAPE : (byte == '\\' ? STATE_GROUND : STATE_OSC);
+            break;
+        case STATE_CHARSET:
+            state = STATE_GROUND;
+            break;
+        }
+    }
+}
+
+ScreenCell TerminalScreen::penCell(uint32_t ch) const {
+    ScreenCell cell = pen;
+    cell.ch = ch;
+    return cell;
+}
+
+void TerminalScreen::setOverlay(const std::vector<ScreenOverlayCell>& cells, int cursorRow, int cursorColumn) {
+    // What the old overlay covered is drawn again from the screen
+    for (size_t i = 0; i < overlay.size(); i++) {
+        damage(overlay[i].row, overlay[i].column, overlay[i].column);
+    }
+    overlay.clear();
+    for (size_t i = 0; i < cells.size(); i++) {
+        if (cells[i].row >= 0 && cells[i].row < rowCount && cells[i].column >= 0 && cells[i].column < columnCount) {
+            overlay.push_back(cells[i]);
+            damage(cells[i].row, cells[i].column, cells[i].column);
+        }
+    }
+    overlayRow = std::max(0, std::min(cursorRow, rowCount - 1));
+    overlayColumn = std::max(0, std::min(cursorColumn, columnCount - 1));
+}
+
+const ScreenCell* TerminalScreen::overlayAt(int r, int c) const {
+    // A line's worth of cells at most, so a scan is cheap
+    for (size_t i = 0; i < overlay.size(); i++) {
+        if (overlay[i].row == r && overlay[i].column == c) {
+            return &overlay[i].cell;
+        }
+    }
+    return NULL;
+}
+
+static void appendCursor(std::string& out, int r, int c) {
+    char sequence[32];
+    int length = snprintf(sequence, sizeof(sequence), "\x1b[%d;%dH", r + 1, c + 1);
+    out.append(sequence, length);
+}
+
+static void appendColor(std::string& out, uint16_t color, int base, int brightBase) {
+    char sequence[16];
+    int length;
+    if (color < 8) {
+        length = snprintf(sequence, sizeof(sequence), ";%d", base + color);
+    } else if (color < 16) {
+        length = snprintf(sequence, sizeof(sequence), ";%d", brightBase + color - 8);
+    } else {
+        length = snprintf(sequence, sizeof(sequence), ";%d;5;%d", base + 8, color);
+    }
+    out.append(sequence, length);
+}
+
+static bool sameLook(const ScreenCell& a, const ScreenCell& b) {
+    return a.fg == b.fg && a.bg == b.bg && a.attributes == b.attributes;
+}
+
+static void appendGraphics(std::string& out, const ScreenCell& cell) {
+    // Always from a reset, so the console's state doesn't matter
+    out += "\x1b[0";
+    if (cell.attributes & SCREEN_BOLD) {
+        out += ";1";
+    }
+    if (cell.attributes & SCREEN_UNDERLINE) {
+        out += ";4";
+    }
+    if (cell.attributes & SCREEN_REVERSE) {
+        out += ";7";
+    }
+    if (cell.fg != SCREEN_COLOR_DEFAULT) {
+        appendColor(out, cell.fg, 30, 90);
+    }
+    if (cell.bg != SCREEN_COLOR_DEFAULT) {
+        appendColor(out, cell.bg, 40, 100);
+    }
+    out += 'm';
+}
+
+static void appendCodePoint(std::string& out, uint32_t ch) {
+    if (ch < 0x80) {
+        out += ch ? (char)ch : ' ';
+    } else if (ch < 0x800) {
+        out += (char)(0xc0 | (ch >> 6));
+        out += (char)(0x80 | (ch & 0x3f));
+    } else if (ch < 0x10000) {
+        out += (char)(0xe0 | (ch >> 12));
+        out += (char)(0x80 | ((ch >> 6) & 0x3f));
+        out += (char)(0x80 | (ch & 0x3f));
+    } else {
+        out += (char)(0xf0 | (ch >> 18));
+        out += (char)(0x80 | ((ch >> 12) & 0x3f));
+        out += (char)(0x80 | ((ch >> 6) & 0x3f));
+        out += (char)(0x80 | (ch & 0x3f));
+    }
+}
+
+static bool isBlank(const ScreenCell& cell) {
+    return (cell.ch == 0 || cell.ch == ' ') && cell.bg == SCREEN_COLOR_DEFAULT && !(cell.attributes & (SCREEN_REVERSE | SCREEN_UNDERLINE));
+}
+
+void TerminalScreen::render(std::string& out) {
+    if (!isDamaged()) {
+        return;
+    }
+
+    // The cursor would flicker across the screen while rows are drawn
+    out += "\x1b[?25l\x1b[0m";
+    ScreenCell current;
+    current.fg = SCREEN_COLOR_DEFAULT;
+    current.bg = SCREEN_COLOR_DEFAULT;
+    current.attributes = 0;
+    const ScreenCell plain = current;
+
+    for (int r = 0; r < rowCount; r++) {
+        int first = damageFirst[r];
+        int last = damageLast[r];
+        if (r >= damageRowsFirst && r <= damageRowsLast) {
+            first = 0;
+            last = columnCount - 1;
+        }
+        if (first > last) {
+            continue;
+        }
+        damageFirst[r] = 0;
+        damageLast[r] = -1;
+
+        // Damage reaching the end of the row is drawn up to its last
+        // visible cell, and the rest erased in one go
+        const std::vector<ScreenCell>& line = lines[r].cells;
+        bool toEnd = last == columnCount - 1;
+        int end = last;
+        if (toEnd) {
+            end = std::min(end, lines[r].used - 1);
+            while (end >= first && isBlank(line[end])) {
+                end--;
+            }
+            for (size_t i = 0; i < overlay.size(); i++) {
+                if (overlay[i].row == r && overlay[i].column >= first) {
+                    end = std::max(end, overlay[i].column);
+                }
+            }
+        }
+        appendCursor(out, r, first);
+        for (int c = first; c <= end; c++) {
+            const ScreenCell* predicted = overlay.empty() ? NULL : overlayAt(r, c);
+            const ScreenCell& cell = predicted ? *predicted : line[c];
+            if (!sameLook(cell, current)) {
+                appendGraphics(out, cell);
+                current = cell;
+            }
+            appendCodePoint(out, cell.ch);
+        }
+        if (toEnd && end < last) {
+            if (!sameLook(current, plain)) {
+                out += "\x1b[0m";
+                current = plain;
+            }
+            out += "\x1b[K";
+        }
+    }
+    if (!sameLook(current, plain)) {
+        out += "\x1b[0m";
+    }
+    appendCursor(out, shownRow(), shownColumn());
+    if (cursorVisible) {
+        out += "\x1b[?25h";
+    }
+    damageRowsFirst = 0;
+    damageRowsLast = -1;
+    damaged = false;
+    paintedRow = shownRow();
+    paintedColumn = shownColumn();
+    paintedCursorVisible = cursorVisible;
+}
+
+void TerminalScreen::renderAll(std::string& out) {
+    damageAll();
+    render(out);
+}
+
+std::string TerminalScreen::lineText(int r) const {
+    std::string text;
+    const std::vector<ScreenCell>& line = lines[r].cells;
+    int end = lines[r].used - 1;
+    while (end >= 0 && (line[end].ch == 0 || line[end].ch == ' ')) {
+        end--;
+    }
+    for (int c = 0; c <= end; c++) {
+        appendCodePoint(text, line[c].ch);
+    }
+    return text;
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Screen size used when the console's can't be read
+#define SCREEN_DEFAULT_ROWS 24
+#define SCREEN_DEFAULT_COLUMNS 80
+
+// Longest CSI parameter string kept; anything longer is garbage anyway
+#define SCREEN_MAX_PARAMS 64
+
+#define SCREEN_COLOR_DEFAULT 0x100
+
+// One character position: a code point and how it is drawn
+struct ScreenCell {
+    uint32_t ch;        // 0 for a blank that was never written
+    uint16_t fg;        // 0-255, or SCREEN_COLOR_DEFAULT
+    uint16_t bg;
+    uint8_t attributes; // SCREEN_BOLD etc.
+};
+
+#define SCREEN_BOLD 0x01
+#define SCREEN_UNDERLINE 0x02
+#define SCREEN_REVERSE 0x04
+
+// A cell drawn over the screen without being part of it: the predicted
+// echo of a keystroke (InputPredictor.h)
+struct ScreenOverlayCell {
+    int row;
+    int column;
+    ScreenCell cell;
+};
+
+// A row of cells. Cells from 'used' on are blank in the default colors, so
+// clearing a short line doesn't rewrite the whole row.
+struct ScreenLine {
+    std::vector<ScreenCell> cells;
+    int used;
+};
+
+// The remote terminal's screen as the VT/ANSI output it receives draws it,
+// in memory. write() only updates cells and notes which parts of which rows
+// changed; render() turns that damage into the escape sequences that bring
+// a console up to date. Output that scrolls off between two renders is
+// never drawn at all, which is what keeps a flood from being limited by
+// the console. An overlay of predicted cells, and the cursor after them,
+// can be drawn over the screen; write() never touches it.
+//
+// Covers what shells, pagers and editors use in practice: cursor movement,
+// erase and insert/delete, scroll regions, SGR colors (16 and 256), the
+// alternate screen (as a cleared screen) and UTF-8. Every code point takes
+// one cell.
+class TerminalScreen {
+private:
+    enum ParseState {
+        STATE_GROUND,
+        STATE_ESCAPE,
+        STATE_CSI,
+        STATE_OSC,
+        STATE_OSC_ESCAPE,   // ESC inside an OSC, usually the start of ST
+        STATE_CHARSET,      // ESC ( and friends take one more byte
+    };
+
+    int rowCount;
+    int columnCount;
+    std::vector<ScreenLine> lines;
+
+    // Damaged columns per row, [first, last]; first > last when clean.
+    // Scrolling damages whole rows, kept as one range of rows instead.
+    std::vector<int> damageFirst;
+    std::vector<int> damageLast;
+    int damageRowsFirst;
+    int damageRowsLast;
+    bool damaged;
+
+    // Where the last render left the console's cursor
+    int paintedRow;
+    int paintedColumn;
+    bool paintedCursorVisible;
+
+    int row;
+    int column;
+    bool wrapPending;       // Printed in the last column: the next character wraps
+    bool cursorVisible;
+    int savedRow;
+    int savedColumn;
+    ScreenCell pen;         // Attributes for the next character written
+    ScreenCell savedPen;
+    int scrollTop;          // Scroll region, inclusive
+    int scrollBottom;
+
+    ParseState state;
+    std::string params;
+    uint32_t codePoint;
+    int utf8Remaining;
+
+    uint64_t scrolledLines;
+
+    std::vector<ScreenOverlayCell> overlay;
+    int overlayRow;             // Where the cursor is drawn while there is an overlay
+    int overlayColumn;
+
+    int shownRow() const { return overlay.empty() ? row : overlayRow; }
+    int shownColumn() const { return overlay.empty() ? column : overlayColumn; }
+    const ScreenCell* overlayAt(int r, int c) const;
+
+    void damage(int r, int first, int last);
+    void damageRows(int top, int bottom);
+    void damageAll();
+    ScreenCell blank() const;
+    void clearCells(int r, int first, int last);
+    void print(uint32_t ch);
+    void printRun(const char* text, size_t count);
+    void lineFeed();
+    void reverseIndex();
+    void scrollUp(int top, int bottom, int count);
+    void scrollDown(int top, int bottom, int count);
+    void moveTo(int r, int c);
+    void control(unsigned char byte);
+    void escape(unsigned char byte);
+    void dispatchCsi(unsigned char final);
+    void setGraphics(const int* values, int count);
+    void reset();
+
+public:
+    TerminalScreen(int rows = SCREEN_DEFAULT_ROWS, int columns = SCREEN_DEFAULT_COLUMNS);
+
+    // Clears the screen at the new size
+    void resize(int rows, int columns);
+    int rows() const { return rowCount; }
+    int columns() const { return columnCount; }
+
+    void write(const char* data, size_t length);
+
+    // True when render() has anything to draw, even just a cursor move
+    bool isDamaged() const {
+        return damaged || shownRow() != paintedRow || shownColumn() != paintedColumn ||
+            cursorVisible != paintedCursorVisible;
+    }
+
+    // Repaints every damaged region, leaving the console's cursor where the
+    // screen's is, and marks the screen clean. A console that showed the
+    // previous render (or was cleared, for the first) then shows the screen.
+    void render(std::string& out);
+
+    // Appends everything, as for a console in an unknown state
+    void renderAll(std::string& out);
+
+    // Lines pushed off the top of the screen since it was created
+    uint64_t linesScrolled() const { return scrolledLines; }
+
+    // Row text with trailing blanks removed (checks and tests)
+    std::string lineText(int r) const;
+    int cursorRow() const { return row; }
+    int cursorColumn() const { return column; }
+    bool isCursorVisible() const { return cursorVisible; }
+
+    // A cell as output left it, overlay aside
+    const ScreenCell& cellAt(int r, int c) const { return lines[r].cells[c]; }
+
+    // A cell showing 'ch' as the next character written would look
+    ScreenCell penCell(uint32_t ch) const;
+
+    // Replaces the overlay, drawing the cursor at ('cursorRow',
+    // 'cursorColumn') while it isn't empty
+    void setOverlay(const std::vector<ScreenOverlayCell>& cells, int cursorRow, int cursorColumn);
+    bool hasOverlay() const { return !overlay.empty(); }
+};
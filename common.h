@@ -7,4 +7,37 @@
 #define DEFAULT_BUFLEN 4096
 
 // End-of-response marker for message delimiting
-#define END_OF_RESPONSE_MARKER "\n<<END_OF_RESPONSE>>\n" 
\ No newline at end of file
+#define END_OF_RESPONSE_MARKER "\n<<END_OF_RESPONSE>>\n"
+
+// Binary framing (see FrameProtocol.h), negotiated with a FRAME_HELLO exchange
+#define PROTOCOL_VERSION 1
+#define FRAME_MAGIC 0x546B // "kT" on the wire
+
+// Optional protocol features, negotiated in the FRAME_HELLO exchange
+#define FEATURE_COMPRESSION 0x00000001u // Output frames may be compressed (see Compression.h)
+#define FEATURE_CHANNELS 0x00000002u    // Several shells share the connection (see FrameProtocol.h)
+#define FEATURE_RESUME 0x00000004u      // The session survives a dropped connection (see FrameProtocol.h)
+#define FEATURE_RAW_INPUT 0x00000008u   // Input is keystrokes for the shell's terminal (see FrameProtocol.h)
+#define FEATURE_FILE_TRANSFER 0x00000010u   // Files move in their own frames (see FrameProtocol.h)
+#define FEATURE_SYNC 0x00000020u            // Directory trees are synced by delta (see FrameProtocol.h)
+#define FEATURE_OUTPUT_STREAMS 0x00000040u  // Output frames say which stream and when it was read (see FrameProtocol.h)
+#define FEATURE_COMMANDS 0x00000080u        // Commands can be tracked to their exit status (see FrameProtocol.h)
+#define FEATURE_SEARCH 0x00000100u          // The server searches a channel's output history (see FrameProtocol.h)
+#define FEATURE_SCREEN_SYNC 0x00000200u     // Channel 0 comes as screen updates, with FEATURE_RAW_INPUT (see FrameProtocol.h)
+
+// Shell output the server may send on a channel before the client grants
+// more with FRAME_WINDOW (only when FEATURE_CHANNELS is negotiated)
+#define CHANNEL_WINDOW (256 * 1024)
+
+// Largest piece of a file in one FRAME_FILE_DATA. Shell output queued
+// behind a transfer waits for at most this much per transfer.
+#define FILE_CHUNK_SIZE (64 * 1024)
+
+// Download bytes the server sends beyond what the client has reported
+// written. Bytes in flight sit in socket buffers ahead of any shell output,
+// so this bounds how far a download can delay it.
+#define FILE_WINDOW (1024 * 1024)
+
+// How long the server waits for a client's FRAME_HELLO before assuming a
+// legacy (marker-delimited) client
+#define HELLO_TIMEOUT_MS 250
@@ -0,0 +1,1827 @@
+// BenchSuite.cpp : End-to-end benchmarks against an in-process server.
+//
+// Scenarios, each reported as one JSON object:
+//   session_setup    connect until the new shell's first prompt, taking
+//                    shells from the server's ShellPool
+//   session_setup_unpooled
+//                    the same with the pool off, and a PersistentShell
+//                    starting on its own
+//   echo_latency     a typed command until the first byte comes back (the
+//                    terminal's echo of it)
+//   command_status   tracked commands, timed by the server from the command
+//                    to its prompt, and the exit status they report
+//   bulk_throughput  a command printing --bulk-mb MB of build log text
+//   file_transfer    :get and :put of a --file-mb MB file, with commands
+//                    echoed back to back while the download runs, and a
+//                    download resumed from half way; every copy is compared
+//   tree_sync        :sync of a --sync-files file source tree into an empty
+//                    directory, again with nothing changed, and again after
+//                    a one-line edit; the trees are compared after each
+//   batch_fanout     kClient --batch against --batch-hosts hosts at once
+//                    (all of them this server), and a script that fails on
+//                    its first line
+//   output_search    a build log of --search-mb MB printed with a marker
+//                    line after every 4 MB, then searched for on the server:
+//                    as a string, ignoring case, as a regular expression,
+//                    and a common word up to a match limit
+//   transport_encryption
+//                    connection setup (TCP, TLS, hello) plain, with a full
+//                    TLS handshake and resuming one, a malformed hello over
+//                    TLS that has to leave the server serving, then bulk
+//                    output plain and over TLS; with --ssh, the same output
+//                    through an SSH tunnel to this machine
+//   session_recording
+//                    bulk output plain and from a server recording its
+//                    sessions, then the recording replayed as fast as it
+//                    goes, checked against what the client was sent, and
+//                    replayed again from half way through
+//   screen_sync      bulk output to a raw client drawing everything it is
+//                    sent, then to one with screen sync drawing the
+//                    server's updates; both must end on the same screen
+//   max_sessions     sessions each typing a line every
+//                    SUITE_TYPING_INTERVAL_MS, doubled until echo p99
+//                    degrades
+
+#include "BenchSuite.h"
+#include "BenchUtil.h"
+#include "../kServer/RemoteTerminalServer.h"
+#include "../kClient/RemoteTerminalClient.h"
+#include "../kClient/BatchRunner.h"
+#include "../kClient/SessionReplay.h"
+#include "../TerminalScreen.h"
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#ifndef _WIN32
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+// How often each session of the max_sessions scenario sends a line
+#define SUITE_TYPING_INTERVAL_MS 100
+
+// A load step is degraded once its echo p99 exceeds both of these, relative
+// to the single-session step
+#define SUITE_DEGRADE_FACTOR 2.0
+#define SUITE_DEGRADE_FLOOR_US 1000.0
+
+// Longest any one command may take before the scenario gives up
+#define SUITE_COMMAND_TIMEOUT_MS 30000
+
+// Longest ssh may take to set up the transport_encryption tunnel
+#define SUITE_SSH_TIMEOUT_MS 15000
+
+// Output kept per client to look for end markers and prompts
+#define SUITE_TAIL_BYTES 256
+
+// The bulk scenario prints a build log of this size as often as needed
+#define SUITE_BULK_FILE_BYTES (4 * 1024 * 1024)
+
+// The file_transfer scenario writes and compares files in blocks this big
+#define SUITE_FILE_BLOCK_BYTES (1024 * 1024)
+
+// The tree_sync scenario's files are slices of a build log up to this big,
+// a few to a directory
+#define SUITE_SYNC_MAX_FILE_BYTES (64 * 1024)
+#define SUITE_SYNC_FILES_PER_DIRECTORY 50
+
+struct SuiteConfig {
+    int setupIterations;
+    int echoIterations;
+    int bulkMegabytes;
+    int fileMegabytes;
+    int syncFiles;
+    int batchHosts;
+    int searchMegabytes;
+    int maxSessions;
+    int stepMs;             // Length of each max_sessions load step
+    std::string sshDestination;     // For the tunnel transport_encryption compares with; empty skips it
+    std::string label;
+    std::string outputFile;
+};
+
+// Just enough JSON for the report. Values are rendered as they are added;
+// nested objects are added with raw().
+class JsonObject {
+private:
+    std::vector<std::string> fields;
+
+    static std::string quote(const std::string& text) {
+        std::string quoted = "\"";
+        for (size_t i = 0; i < text.length(); i++) {
+            unsigned char c = (unsigned char)text[i];
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += (char)c;
+            } else if (c < 0x20) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                quoted += escape;
+            } else {
+                quoted += (char)c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+public:
+    void raw(const char* name, const std::string& json) {
+        fields.push_back(quote(name) + ": " + json);
+    }
+
+    void number(const char* name, double value, int decimals = 1) {
+        char text[64];
+        snprintf(text, sizeof(text), "%.*f", decimals, value);
+        raw(name, text);
+    }
+
+    void integer(const char* name, long long value) {
+        raw(name, std::to_string(value));
+    }
+
+    void text(const char* name, const std::string& value) {
+        raw(name, quote(value));
+    }
+
+    void flag(const char* name, bool value) {
+        raw(name, value ? "true" : "false");
+    }
+
+    // One line, or one field per line for the top level
+    std::string str(bool multiline = false) const {
+        std::string out = multiline ? "{\n  " : "{";
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (i > 0) {
+                out += multiline ? ",\n  " : ", ";
+            }
+            out += fields[i];
+        }
+        return out + (multiline ? "\n}\n" : "}");
+    }
+};
+
+static double microseconds(BenchClock::duration elapsed) {
+    return std::chrono::duration<double, std::micro>(elapsed).count();
+}
+
+// min/p50/p99/max of latency samples in microseconds
+static void addLatencies(JsonObject& result, std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    result.integer("samples", (long long)samples.size());
+    result.number("min_us", percentile(samples, 0.0));
+    result.number("p50_us", percentile(samples, 0.50));
+    result.number("p99_us", percentile(samples, 0.99));
+    result.number("max_us", percentile(samples, 1.0));
+}
+
+// A RemoteTerminalClient without a console. Output is collected as it
+// arrives on the client's receive thread, and the scenario waits on it.
+class ScriptedClient {
+private:
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::string tail;           // The latest output since the last send
+    uint64_t outputBytes;       // Shell output, control messages excluded
+    bool armed;                 // Timing the first output after a send
+    BenchClock::time_point sentAt;
+    std::vector<double> echoSamples;
+    bool transferring;
+    TransferResult transferResult;
+    bool syncing;
+    SyncResult syncResult;
+    bool commandPending;
+    CommandResultPayload commandResult;
+    bool searching;
+    SearchReport searchReport;
+    uint64_t lastCapture;       // Capture time of the latest timed output
+    bool capturesOrdered;       // No capture time has gone backwards
+    RemoteTerminalClient client;    // Last, so its receive thread stops first
+
+    void onOutput(uint8_t stream, uint64_t captureTime, const char* data, size_t length) {
+        BenchClock::time_point now = BenchClock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stream == STREAM_CONTROL) {
+            return;
+        }
+        if (captureTime != 0) {
+            capturesOrdered = capturesOrdered && captureTime >= lastCapture;
+            lastCapture = captureTime;
+        }
+        if (armed) {
+            armed = false;
+            echoSamples.push_back(microseconds(now - sentAt));
+        }
+        outputBytes += length;
+        tail.append(data, length);
+        if (tail.length() > 2 * SUITE_TAIL_BYTES) {
+            tail.erase(0, tail.length() - SUITE_TAIL_BYTES);
+        }
+        arrived.notify_all();
+    }
+
+public:
+    ScriptedClient() : outputBytes(0), armed(false), transferring(false), syncing(false), commandPending(false), searching(false),
+        lastCapture(0), capturesOrdered(true) {}
+
+    // Before connect()
+    void setTls(std::shared_ptr<TlsClientContext> context) {
+        client.setTls(context);
+    }
+
+    std::string tlsDescription() {
+        return client.tlsDescription();
+    }
+
+    bool connect(const std::string& port) {
+        client.setRequestedFeatures(FEATURE_COMPRESSION | FEATURE_CHANNELS | FEATURE_FILE_TRANSFER | FEATURE_SYNC |
+                                    FEATURE_OUTPUT_STREAMS | FEATURE_COMMANDS | FEATURE_SEARCH);
+        client.setOutputHandler([this](uint16_t, uint8_t stream, uint64_t captureTime, const char* data, size_t length) {
+            onOutput(stream, captureTime, data, length);
+        });
+        client.setTransferHandler([this](const TransferResult& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            transferring = false;
+            transferResult = result;
+            arrived.notify_all();
+        });
+        client.setSyncHandler([this](const SyncResult& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            syncing = false;
+            syncResult = result;
+            arrived.notify_all();
+        });
+        client.setCommandHandler([this](uint16_t, const CommandResultPayload& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            commandPending = false;
+            commandResult = result;
+            arrived.notify_all();
+        });
+        client.setSearchHandler([this](const SearchReport& report) {
+            std::lock_guard<std::mutex> lock(mutex);
+            searching = false;
+            searchReport = report;
+            arrived.notify_all();
+        });
+        return client.initialize() && client.connectToServer("127.0.0.1", port) && client.start();
+    }
+
+    // With 'timeEcho', the time until the first output is kept as a sample
+    bool send(const std::string& command, bool timeEcho) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tail.clear();
+            armed = timeEcho;
+            sentAt = BenchClock::now();
+        }
+        return client.sendCommand(0, command);
+    }
+
+    // Waits for 'marker' (if any) followed by the prompt
+    bool waitFor(const std::string& marker, int timeoutMs) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, &marker]() {
+            return (marker.empty() || tail.find(marker) != std::string::npos) && endsWithPrompt(tail);
+        });
+    }
+
+    bool echoPending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return armed;
+    }
+
+    // Hands over the samples so far; false if an echo never arrived
+    bool takeSamples(std::vector<double>& samples) {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.insert(samples.end(), echoSamples.begin(), echoSamples.end());
+        echoSamples.clear();
+        bool complete = !armed;
+        armed = false;
+        return complete;
+    }
+
+    uint64_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return outputBytes;
+    }
+
+    bool capturesInOrder() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return capturesOrdered;
+    }
+
+    // One file transfer at a time, started here and collected with
+    // waitTransfer()
+    bool startTransfer(bool upload, const std::string& localPath, const std::string& remotePath) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            transferring = true;
+        }
+        return upload ? client.putFile(localPath, remotePath) : client.getFile(remotePath, localPath);
+    }
+
+    bool transferPending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return transferring;
+    }
+
+    bool waitTransfer(int timeoutMs, TransferResult& result) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !transferring; })) {
+            return false;
+        }
+        result = transferResult;
+        return result.ok;
+    }
+
+    // One directory sync at a time, like transfers
+    bool sync(const std::string& localPath, const std::string& remotePath, int timeoutMs, SyncResult& result) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            syncing = true;
+        }
+        if (!client.syncDirectory(localPath, remotePath)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (syncing) {
+                syncing = false;
+                syncResult = SyncResult();
+                syncResult.ok = false;
+                syncResult.message = "not started";
+            }
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !syncing; })) {
+            result.ok = false;
+            result.message = "timed out";
+            return false;
+        }
+        result = syncResult;
+        return result.ok;
+    }
+
+    // A tracked command, waited for until the server reports it finished
+    bool run(const std::string& command, int timeoutMs, CommandResultPayload& result) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tail.clear();
+            commandPending = true;
+        }
+        if (!client.runCommand(0, command)) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !commandPending; })) {
+            return false;
+        }
+        result = commandResult;
+        return true;
+    }
+
+    // A search of channel 0's history, waited for until its result
+    bool search(const SearchRequest& request, int timeoutMs, SearchReport& report) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            searching = true;
+        }
+        if (!client.searchHistory(0, request)) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !searching; })) {
+            return false;
+        }
+        report = searchReport;
+        return report.result.status == FILE_OK;
+    }
+};
+
+static std::unique_ptr<ScriptedClient> openClient(const std::string& port, std::shared_ptr<TlsClientContext> tls = NULL) {
+    std::unique_ptr<ScriptedClient> client(new ScriptedClient());
+    if (tls) {
+        client->setTls(tls);
+    }
+    if (!client->connect(port) || !client->waitFor("", SUITE_COMMAND_TIMEOUT_MS)) {
+        return NULL;
+    }
+    return client;
+}
+
+static bool runSessionSetup(RemoteTerminalServer& server, const std::string& port, int iterations, size_t poolSize,
+                            JsonObject& result) {
+    // Start from a full pool, as on a server that has been idle for a moment
+    server.setShellPool(poolSize);
+    for (int waited = 0; gaugeTotal(METRIC_IDLE_SHELLS) < (int64_t)poolSize && waited < SUITE_COMMAND_TIMEOUT_MS;
+         waited += 10) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    uint64_t hits = counterTotal(METRIC_SHELL_POOL_HITS);
+    uint64_t misses = counterTotal(METRIC_SHELL_POOL_MISSES);
+
+    // Connection, hello, shell start (or claim) and the shell's first prompt
+    std::vector<double> samples;
+    for (int i = 0; i < iterations; i++) {
+        BenchClock::time_point start = BenchClock::now();
+        std::unique_ptr<ScriptedClient> client = openClient(port);
+        if (!client) {
+            result.text("error", "session did not start");
+            return false;
+        }
+        samples.push_back(microseconds(BenchClock::now() - start));
+    }
+    addLatencies(result, samples);
+    result.integer("pool_size", (long long)poolSize);
+    result.integer("pool_hits", (long long)(counterTotal(METRIC_SHELL_POOL_HITS) - hits));
+    result.integer("pool_misses", (long long)(counterTotal(METRIC_SHELL_POOL_MISSES) - misses));
+    if (poolSize > 0) {
+        return true;
+    }
+
+    // The shell on its own, as the server starts one for a session when
+    // the pool has none
+    std::vector<double> shellSamples;
+    for (int i = 0; i < iterations; i++) {
+        BenchClock::time_point start = BenchClock::now();
+        PersistentShell shell;
+        if (!shell.isActive()) {
+            result.text("error", "shell did not start");
+            return false;
+        }
+        shellSamples.push_back(microseconds(BenchClock::now() - start));
+    }
+    std::sort(shellSamples.begin(), shellSamples.end());
+    result.number("shell_start_p50_us", percentile(shellSamples, 0.50));
+    result.number("shell_start_p99_us", percentile(shellSamples, 0.99));
+    return true;
+}
+
+static bool runEchoLatency(const std::string& port, int iterations, JsonObject& result) {
+    std::unique_ptr<ScriptedClient> client = openClient(port);
+    if (!client) {
+        result.text("error", "session did not start");
+        return false;
+    }
+    for (int i = 0; i < iterations; i++) {
+        // Wait for the whole command, so each one starts at an idle prompt
+        if (!client->send(echoCommand("kbench", i), true) ||
+            !client->waitFor("kbench" + std::to_string(i), SUITE_COMMAND_TIMEOUT_MS)) {
+            result.text("error", "command " + std::to_string(i) + " did not complete");
+            return false;
+        }
+    }
+    std::vector<double> samples;
+    client->takeSamples(samples);
+    addLatencies(result, samples);
+    return true;
+}
+
+static bool runCommandStatus(const std::string& port, int iterations, JsonObject& result) {
+    std::unique_ptr<ScriptedClient> client = openClient(port);
+    if (!client) {
+        result.text("error", "session did not start");
+        return false;
+    }
+    std::vector<double> wallSamples;
+    std::vector<double> firstOutputSamples;
+    uint64_t bytes = 0;
+    for (int i = 0; i < iterations; i++) {
+        CommandResultPayload command;
+        if (!client->run(echoCommand("kbench", i), SUITE_COMMAND_TIMEOUT_MS, command)) {
+            result.text("error", "command " + std::to_string(i) + " was not reported");
+            return false;
+        }
+        wallSamples.push_back((double)command.wallMicroseconds);
+        firstOutputSamples.push_back((double)command.firstOutputMicroseconds);
+        bytes += command.outputBytes;
+    }
+    addLatencies(result, wallSamples);
+    std::sort(firstOutputSamples.begin(), firstOutputSamples.end());
+    result.number("first_output_p50_us", percentile(firstOutputSamples, 0.50));
+    result.number("first_output_p99_us", percentile(firstOutputSamples, 0.99));
+    result.integer("output_bytes", (long long)bytes);
+
+    // cmd.exe can't put ERRORLEVEL in its prompt, so only a POSIX shell
+    // reports how a command exited
+#ifndef _WIN32
+    CommandResultPayload failing;
+    CommandResultPayload passing;
+    if (!client->run("false", SUITE_COMMAND_TIMEOUT_MS, failing) ||
+        !client->run("true", SUITE_COMMAND_TIMEOUT_MS, passing)) {
+        result.text("error", "status command was not reported");
+        return false;
+    }
+    if (failing.status != COMMAND_EXITED || failing.exitCode != 1 || passing.status != COMMAND_EXITED ||
+        passing.exitCode != 0) {
+        result.text("error", "wrong exit status");
+        return false;
+    }
+#endif
+    return true;
+}
+
+static FILE* createTempFile(std::string& path) {
+    // An empty temporary file, open for writing
+#ifdef _WIN32
+    char directory[MAX_PATH];
+    char name[MAX_PATH];
+    if (!GetTempPathA(MAX_PATH, directory) || !GetTempFileNameA(directory, "kbe", 0, name)) {
+        return NULL;
+    }
+    path = name;
+    return fopen(name, "wb");
+#else
+    char name[] = "/tmp/kbench-XXXXXX";
+    int fd = mkstemp(name);
+    path = name;
+    return fd >= 0 ? fdopen(fd, "wb") : NULL;
+#endif
+}
+
+static std::string writeBulkFile() {
+    // A temporary build log for the shell to print
+    std::string log = makeBuildLog(SUITE_BULK_FILE_BYTES);
+    std::string path;
+    FILE* file = createTempFile(path);
+    if (!file) {
+        return "";
+    }
+    bool written = fwrite(log.data(), 1, log.length(), file) == log.length();
+    fclose(file);
+    return written ? path : "";
+}
+
+static bool runBulkThroughput(const std::string& port, int megabytes, std::shared_ptr<TlsClientContext> tls, JsonObject& result,
+                              double& mbPerSecond, uint64_t* outputBytes = NULL) {
+    std::string path = writeBulkFile();
+    if (path.empty()) {
+        result.text("error", "unable to write the build log");
+        return false;
+    }
+    int repeats = (int)(((uint64_t)megabytes * 1024 * 1024 + SUITE_BULK_FILE_BYTES - 1) / SUITE_BULK_FILE_BYTES);
+    if (repeats < 1) {
+        repeats = 1;
+    }
+#ifdef _WIN32
+    std::string command = "(for /L %i in (1,1," + std::to_string(repeats) + ") do @type \"" + path + "\") & ";
+#else
+    std::string command = "i=0; while [ $i -lt " + std::to_string(repeats) + " ]; do cat '" + path + "'; i=$((i+1)); done; ";
+#endif
+    command += echoCommand("kbench", 0);
+
+    bool completed = false;
+    mbPerSecond = 0.0;
+    std::unique_ptr<ScriptedClient> client = openClient(port, tls);
+    if (client) {
+        uint64_t startBytes = client->bytes();
+        uint64_t startWire = counterTotal(METRIC_BYTES_SENT);
+        double startCpu = processCpuSeconds();
+        BenchClock::time_point start = BenchClock::now();
+        completed = client->send(command, false) && client->waitFor("kbench0", SUITE_COMMAND_TIMEOUT_MS + repeats * 1000);
+        double seconds = elapsedSeconds(start);
+        double cpu = processCpuSeconds() - startCpu;
+        uint64_t output = client->bytes() - startBytes;
+        uint64_t wire = counterTotal(METRIC_BYTES_SENT) - startWire;
+        double outputMB = output / (1024.0 * 1024.0);
+        mbPerSecond = outputMB / seconds;
+        if (outputBytes) {
+            *outputBytes = output;
+        }
+
+        result.integer("output_bytes", (long long)output);
+        result.integer("wire_bytes", (long long)wire);
+        result.number("seconds", seconds, 3);
+        result.number("mb_per_second", mbPerSecond, 1);
+        result.number("cpu_ms_per_mb", output ? 1000.0 * cpu / outputMB : 0.0, 2);
+    }
+    remove(path.c_str());
+    if (!completed) {
+        result.text("error", client ? "output did not complete" : "session did not start");
+    } else if (!client->capturesInOrder()) {
+        result.text("error", "output capture times went backwards");
+        completed = false;
+    }
+    return completed;
+}
+
+static std::string writeRandomFile(int megabytes) {
+    // Incompressible, and different in every block, so a misplaced chunk
+    // shows up in the comparison
+    std::string path;
+    FILE* file = createTempFile(path);
+    if (!file) {
+        return "";
+    }
+    std::vector<uint64_t> block(SUITE_FILE_BLOCK_BYTES / sizeof(uint64_t));
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    bool written = true;
+    for (int i = 0; i < megabytes && written; i++) {
+        for (size_t j = 0; j < block.size(); j++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            block[j] = state;
+        }
+        written = fwrite(block.data(), 1, SUITE_FILE_BLOCK_BYTES, file) == SUITE_FILE_BLOCK_BYTES;
+    }
+    fclose(file);
+    return written ? path : "";
+}
+
+static bool sameFiles(const std::string& first, const std::string& second) {
+    FILE* a = fopen(first.c_str(), "rb");
+    FILE* b = fopen(second.c_str(), "rb");
+    bool same = a && b;
+    std::vector<char> blockA(SUITE_FILE_BLOCK_BYTES);
+    std::vector<char> blockB(SUITE_FILE_BLOCK_BYTES);
+    while (same) {
+        size_t lengthA = fread(blockA.data(), 1, blockA.size(), a);
+        size_t lengthB = fread(blockB.data(), 1, blockB.size(), b);
+        same = lengthA == lengthB && memcmp(blockA.data(), blockB.data(), lengthA) == 0;
+        if (lengthA == 0) {
+            break;
+        }
+    }
+    if (a) {
+        fclose(a);
+    }
+    if (b) {
+        fclose(b);
+    }
+    return same;
+}
+
+static double transferRate(const TransferResult& transfer) {
+    double megabytes = (transfer.size - transfer.start) / (1024.0 * 1024.0);
+    return transfer.seconds > 0 ? megabytes / transfer.seconds : 0.0;
+}
+
+static bool transferFiles(ScriptedClient& client, const std::string& source, const std::string& copy,
+                          const std::string& back, int megabytes, JsonObject& result) {
+    // Paths on the server are the same files, the server being in-process
+    int timeoutMs = SUITE_COMMAND_TIMEOUT_MS + megabytes * 100;
+    TransferResult transfer;
+
+    // Download, with commands echoed back to back until it is done: what
+    // typing feels like while a file is coming in
+    int commands = 0;
+    if (!client.startTransfer(false, copy, source)) {
+        result.text("error", "download did not start");
+        return false;
+    }
+    while (client.transferPending()) {
+        if (!client.send(echoCommand("kbench", commands), true) ||
+            !client.waitFor("kbench" + std::to_string(commands), SUITE_COMMAND_TIMEOUT_MS)) {
+            result.text("error", "command " + std::to_string(commands) + " did not complete during the download");
+            return false;
+        }
+        commands++;
+    }
+    if (!client.waitTransfer(timeoutMs, transfer) || !sameFiles(source, copy)) {
+        result.text("error", "download failed: " + (transfer.ok ? "copy differs" : transfer.message));
+        return false;
+    }
+    std::vector<double> samples;
+    client.takeSamples(samples);
+    std::sort(samples.begin(), samples.end());
+    result.number("get_mb_per_second", transferRate(transfer));
+    result.integer("echo_during_get_samples", (long long)samples.size());
+    result.number("echo_during_get_p50_us", percentile(samples, 0.50));
+    result.number("echo_during_get_p99_us", percentile(samples, 0.99));
+
+    // A download cut off part of the way through, not on a chunk boundary
+    uint64_t partial = transfer.size / 2 + 1234;
+    std::filesystem::resize_file(copy, partial);
+    if (!client.startTransfer(false, copy, source) || !client.waitTransfer(timeoutMs, transfer) ||
+        transfer.start != partial || !sameFiles(source, copy)) {
+        result.text("error", "resumed download failed: " + (transfer.ok ? "did not resume" : transfer.message));
+        return false;
+    }
+    result.integer("resumed_from", (long long)transfer.start);
+
+    if (!client.startTransfer(true, copy, back) || !client.waitTransfer(timeoutMs, transfer) || !sameFiles(source, back)) {
+        result.text("error", "upload failed: " + (transfer.ok ? "copy differs" : transfer.message));
+        return false;
+    }
+    result.number("put_mb_per_second", transferRate(transfer));
+    return true;
+}
+
+static bool runFileTransfer(const std::string& port, int megabytes, JsonObject& result) {
+    std::string source = writeRandomFile(megabytes);
+    std::string copy;
+    std::string back;
+    FILE* file = createTempFile(copy);
+    if (file) {
+        fclose(file);
+    }
+    file = createTempFile(back);
+    if (file) {
+        fclose(file);
+    }
+
+    bool completed = false;
+    if (source.empty() || copy.empty() || back.empty()) {
+        result.text("error", "unable to write the files");
+    } else {
+        std::unique_ptr<ScriptedClient> client = openClient(port);
+        if (!client) {
+            result.text("error", "session did not start");
+        } else {
+            result.integer("file_bytes", (long long)megabytes * SUITE_FILE_BLOCK_BYTES);
+            completed = transferFiles(*client, source, copy, back, megabytes, result);
+        }
+    }
+    remove(source.c_str());
+    remove(copy.c_str());
+    remove(back.c_str());
+    return completed;
+}
+
+static bool writeSourceTree(const std::filesystem::path& root, int files, uint64_t& totalBytes) {
+    // Files of assorted sizes cut from one long log, so no two are alike
+    std::string log = makeBuildLog(4 * 1024 * 1024);
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    totalBytes = 0;
+    for (int i = 0; i < files; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t length = (size_t)(state % SUITE_SYNC_MAX_FILE_BYTES);
+        size_t offset = (size_t)((state >> 20) % (log.length() - length));
+        std::filesystem::path directory = root / ("module" + std::to_string(i / SUITE_SYNC_FILES_PER_DIRECTORY));
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        FILE* file = fopen((directory / ("file" + std::to_string(i) + ".txt")).string().c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        bool written = fwrite(log.data() + offset, 1, length, file) == length;
+        fclose(file);
+        if (!written) {
+            return false;
+        }
+        totalBytes += length;
+    }
+    return true;
+}
+
+static bool sameTrees(const std::filesystem::path& first, const std::filesystem::path& second) {
+    std::error_code error;
+    int files = 0;
+    std::filesystem::recursive_directory_iterator it(first, error);
+    for (; !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        if (it->is_regular_file() && !sameFiles(it->path().string(), (second / it->path().lexically_relative(first)).string())) {
+            return false;
+        }
+        files += it->is_regular_file() ? 1 : 0;
+    }
+    int copies = 0;
+    for (it = std::filesystem::recursive_directory_iterator(second, error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        copies += it->is_regular_file() ? 1 : 0;
+    }
+    return !error && files == copies;
+}
+
+static bool insertLine(const std::filesystem::path& path) {
+    // A line added half way through, which moves everything after it
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    std::string text;
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, length);
+    }
+    fclose(file);
+    size_t middle = text.find('\n', text.length() / 2);
+    text.insert(middle == std::string::npos ? text.length() : middle + 1, "  edited by kbench\r\n");
+    file = fopen(path.string().c_str(), "wb");
+    bool written = file && fwrite(text.data(), 1, text.length(), file) == text.length();
+    if (file) {
+        fclose(file);
+    }
+    return written;
+}
+
+static void addSync(JsonObject& result, const std::string& prefix, const SyncResult& sync) {
+    result.number((prefix + "_ms").c_str(), sync.seconds * 1000.0, 2);
+    result.integer((prefix + "_changed_files").c_str(), (long long)sync.changed);
+    result.integer((prefix + "_wire_bytes").c_str(), (long long)sync.wireBytes);
+    result.integer((prefix + "_literal_bytes").c_str(), (long long)sync.literalBytes);
+}
+
+static bool syncTrees(ScriptedClient& client, const std::filesystem::path& source, const std::filesystem::path& copy,
+                      int files, JsonObject& result) {
+    // The server is in-process, so an absolute remote path is a local one
+    int timeoutMs = SUITE_COMMAND_TIMEOUT_MS + files * 10;
+    SyncResult sync;
+    if (!client.sync(source.string(), copy.string(), timeoutMs, sync) || !sameTrees(source, copy)) {
+        result.text("error", "initial sync failed: " + (sync.ok ? "copy differs" : sync.message));
+        return false;
+    }
+    addSync(result, "initial", sync);
+    result.number("initial_mb_per_second", sync.seconds > 0 ? sync.literalBytes / (1024.0 * 1024.0) / sync.seconds : 0.0);
+
+    if (!client.sync(source.string(), copy.string(), timeoutMs, sync) || sync.changed != 0) {
+        result.text("error", "unchanged sync failed: " + (sync.ok ? "files were sent" : sync.message));
+        return false;
+    }
+    addSync(result, "unchanged", sync);
+
+    std::filesystem::path edited = source / "module0" / "file0.txt";
+    if (!insertLine(edited) || !client.sync(source.string(), copy.string(), timeoutMs, sync) || sync.changed != 1 ||
+        !sameTrees(source, copy)) {
+        result.text("error", "sync after an edit failed: " + (sync.ok ? "copy differs" : sync.message));
+        return false;
+    }
+    addSync(result, "edit", sync);
+    result.integer("edit_matched_bytes", (long long)sync.matchedBytes);
+    return true;
+}
+
+static bool runTreeSync(const std::string& port, int files, JsonObject& result) {
+    std::string base;
+    FILE* file = createTempFile(base);
+    if (file) {
+        fclose(file);
+        remove(base.c_str());
+    }
+    std::filesystem::path source = base + "-source";
+    std::filesystem::path copy = base + "-copy";
+    uint64_t treeBytes = 0;
+
+    bool completed = false;
+    if (base.empty() || !writeSourceTree(source, files, treeBytes)) {
+        result.text("error", "unable to write the tree");
+    } else {
+        std::unique_ptr<ScriptedClient> client = openClient(port);
+        if (!client) {
+            result.text("error", "session did not start");
+        } else {
+            result.integer("files", files);
+            result.integer("tree_bytes", (long long)treeBytes);
+            completed = syncTrees(*client, source, copy, files, result);
+        }
+    }
+    std::error_code error;
+    std::filesystem::remove_all(source, error);
+    std::filesystem::remove_all(copy, error);
+    return completed;
+}
+
+static void addSearch(JsonObject& result, const std::string& prefix, const SearchReport& search) {
+    const SearchResultPayload& found = search.result;
+    result.integer((prefix + "_matches").c_str(), (long long)found.matches);
+    result.number((prefix + "_server_ms").c_str(), found.microseconds / 1000.0, 2);
+    result.number((prefix + "_client_ms").c_str(), search.seconds * 1000.0, 2);
+    result.integer((prefix + "_scanned_bytes").c_str(), (long long)found.scannedBytes);
+    result.integer((prefix + "_skipped_bytes").c_str(), (long long)found.skippedBytes);
+    result.integer((prefix + "_wire_bytes").c_str(), (long long)search.wireBytes);
+}
+
+static bool searchOutput(ScriptedClient& client, const char* prefix, const std::string& pattern, uint8_t flags,
+                         uint32_t maxMatches, uint64_t expected, JsonObject& result) {
+    SearchRequest request;
+    request.flags = flags;
+    request.context = 0;
+    request.maxMatches = maxMatches;
+    request.pattern = pattern;
+    SearchReport search;
+    if (!client.search(request, SUITE_COMMAND_TIMEOUT_MS, search)) {
+        result.text("error", std::string(prefix) + " search failed: " + search.result.message);
+        return false;
+    }
+    addSearch(result, prefix, search);
+
+    // Every line sent is a match, and says so
+    bool linesMatch = search.lines.size() == search.result.matches;
+    for (size_t i = 0; i < search.lines.size() && linesMatch; i++) {
+        linesMatch = (search.lines[i].flags & SEARCH_LINE_MATCH) != 0;
+    }
+    if (search.result.matches != expected || !linesMatch) {
+        result.text("error", std::string(prefix) + " search found " + std::to_string(search.result.matches) + " matches, expected " +
+                                 std::to_string(expected));
+        return false;
+    }
+    return true;
+}
+
+static bool runOutputSearch(const std::string& port, int megabytes, JsonObject& result) {
+    std::string path = writeBulkFile();
+    if (path.empty()) {
+        result.text("error", "unable to write the build log");
+        return false;
+    }
+
+    // The whole log stays in the history, so every marker can be found.
+    // The echoed command line doesn't contain the marker itself.
+    int repeats = (int)(((uint64_t)megabytes * 1024 * 1024 + SUITE_BULK_FILE_BYTES - 1) / SUITE_BULK_FILE_BYTES);
+    repeats = std::max(1, std::min(repeats, (int)(DEFAULT_SEARCH_HISTORY_BYTES / SUITE_BULK_FILE_BYTES) - 1));
+#ifdef _WIN32
+    std::string command = "(for /L %i in (1,1," + std::to_string(repeats) + ") do @type \"" + path +
+                          "\" & @echo kbench-needle^-%i) & ";
+#else
+    std::string command = "i=0; while [ $i -lt " + std::to_string(repeats) + " ]; do cat '" + path +
+                          "'; i=$((i+1)); echo kbench-needle''-$i; done; ";
+#endif
+    command += echoCommand("kbench", 0);
+
+    bool completed = false;
+    std::unique_ptr<ScriptedClient> client = openClient(port);
+    if (!client) {
+        result.text("error", "session did not start");
+    } else if (!client->send(command, false) || !client->waitFor("kbench0", SUITE_COMMAND_TIMEOUT_MS + repeats * 1000)) {
+        result.text("error", "output did not complete");
+    } else {
+        result.integer("history_bytes", (long long)client->bytes());
+        completed = searchOutput(*client, "string", "kbench-needle-", 0, 0, repeats, result) &&
+                    searchOutput(*client, "nocase", "KBENCH-Needle-", SEARCH_IGNORE_CASE, 0, repeats, result) &&
+                    searchOutput(*client, "regex", "needle-[0-9]+$", SEARCH_REGEX, 0, repeats, result) &&
+                    searchOutput(*client, "limited", "warning", 0, 100, 100, result);
+    }
+    remove(path.c_str());
+    return completed;
+}
+
+static bool runLoadStep(std::vector<std::unique_ptr<ScriptedClient>>& clients, int stepMs, std::vector<double>& samples,
+                        int& commands, int& missed) {
+    // Every session types a line each interval, the sessions spread evenly
+    // over it so the load is steady rather than bursty
+    size_t count = clients.size();
+    BenchClock::duration interval = std::chrono::milliseconds(SUITE_TYPING_INTERVAL_MS);
+    BenchClock::time_point begin = BenchClock::now();
+    BenchClock::time_point end = begin + std::chrono::milliseconds(stepMs);
+    std::vector<BenchClock::time_point> due(count);
+    for (size_t i = 0; i < count; i++) {
+        due[i] = begin + interval * i / count;
+    }
+
+    commands = 0;
+    missed = 0;
+    while (true) {
+        BenchClock::time_point next = *std::min_element(due.begin(), due.end());
+        if (next >= end) {
+            break;
+        }
+        std::this_thread::sleep_until(next);
+        BenchClock::time_point now = BenchClock::now();
+        for (size_t i = 0; i < count; i++) {
+            if (due[i] > now) {
+                continue;
+            }
+            due[i] += interval;
+            // Still waiting for the last echo: it is slower than the interval
+            if (clients[i]->echoPending()) {
+                missed++;
+                continue;
+            }
+            if (!clients[i]->send(echoCommand("kbench", commands), true)) {
+                return false;
+            }
+            commands++;
+        }
+    }
+
+    // Give the last echoes a moment, then count any that never came
+    BenchClock::time_point deadline = BenchClock::now() + interval;
+    for (size_t i = 0; i < count; i++) {
+        while (clients[i]->echoPending() && BenchClock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (!clients[i]->takeSamples(samples)) {
+            missed++;
+        }
+    }
+    return true;
+}
+
+static bool runBatch(const std::string& port, int hosts, const std::vector<std::string>& commands, int& status,
+                     std::vector<BatchHostResult>& results, size_t& markers) {
+    BatchRunner batch(commands);
+    for (int i = 0; i < hosts; i++) {
+        batch.addHost("127.0.0.1:" + port);
+    }
+    batch.setQuiet(true);
+    batch.setTimeout(SUITE_COMMAND_TIMEOUT_MS);
+    markers = 0;
+    batch.setLineHandler([&markers](const std::string&, uint8_t, const std::string& line) {
+        markers += (line == "kbench0") ? 1 : 0;
+    });
+    status = batch.run();
+    results = batch.results();
+    return true;
+}
+
+static bool runBatchFanout(const std::string& port, int hosts, JsonObject& result) {
+    // Every host prints the marker once; the echo of the command line
+    // doesn't count, as it has the quotes
+    std::vector<std::string> commands;
+    commands.push_back(echoCommand("kbench", 0));
+    int status;
+    std::vector<BatchHostResult> results;
+    size_t markers;
+    BenchClock::time_point start = BenchClock::now();
+    runBatch(port, hosts, commands, status, results, markers);
+    double seconds = std::chrono::duration<double>(BenchClock::now() - start).count();
+    std::vector<double> samples;
+    for (size_t i = 0; i < results.size(); i++) {
+        samples.push_back(results[i].seconds * 1e6);
+    }
+    result.integer("hosts", hosts);
+    result.number("seconds", seconds, 3);
+    addLatencies(result, samples);
+    if (status != BATCH_OK || markers != (size_t)hosts) {
+        result.text("error", status != BATCH_OK ? "a host failed" : "output missing");
+        return false;
+    }
+
+    // The first failure ends each host's run, and the status says so
+#ifndef _WIN32
+    commands.insert(commands.begin(), "false");
+    runBatch(port, hosts, commands, status, results, markers);
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].status != BATCH_FAILED || results[i].commands != 1 || results[i].exitCode != 1) {
+            status = BATCH_OK;
+        }
+    }
+    if (status != BATCH_FAILED || markers != 0) {
+        result.text("error", "failing script not stopped");
+        return false;
+    }
+#endif
+    return true;
+}
+
+static bool timeConnections(const std::string& port, int iterations, std::shared_ptr<TlsClientContext> tls, bool resume,
+                            std::vector<double>& samples, int& resumed) {
+    // Connection, TLS handshake and hello exchange; the shell isn't waited
+    // for. Without 'resume' every handshake is a full one.
+    resumed = 0;
+    for (int i = 0; i < iterations; i++) {
+        if (tls && !resume) {
+            tls->clearSessions();
+        }
+        ScriptedClient client;
+        if (tls) {
+            client.setTls(tls);
+        }
+        BenchClock::time_point start = BenchClock::now();
+        if (!client.connect(port)) {
+            return false;
+        }
+        samples.push_back(microseconds(BenchClock::now() - start));
+        resumed += (client.tlsDescription().find("resumed") != std::string::npos) ? 1 : 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    return true;
+}
+
+static bool sendMalformedHello(const std::string& port, std::shared_ptr<TlsClientContext> tls) {
+    // A hello too short to decode, sealed straight after the handshake so
+    // the session has it before it reads from the socket. True once the
+    // server has closed the connection.
+    SOCKET connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connection == INVALID_SOCKET) {
+        return false;
+    }
+    struct sockaddr_in address;
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((unsigned short)atoi(port.c_str()));
+    bool ok = connect(connection, (struct sockaddr*)&address, sizeof(address)) == 0;
+
+    SecureChannel secure(*tls, "127.0.0.1", port);
+    std::vector<char> buffer(TLS_RECEIVE_SIZE);
+    std::string sealed;
+    while (ok && !secure.handshakeDone() && !secure.failed()) {
+        sealed.clear();
+        secure.takeOutput(sealed);
+        if (!sealed.empty() && send(connection, sealed.data(), (int)sealed.length(), 0) != (int)sealed.length()) {
+            ok = false;
+            break;
+        }
+        int received = recv(connection, buffer.data(), (int)buffer.size(), 0);
+        ok = received > 0 && secure.receive(buffer.data(), received);
+    }
+    std::string hello = makeFrame(FRAME_HELLO, STREAM_CONTROL, "ABCD", 4);
+    sealed.clear();
+    ok = ok && secure.write(hello.data(), hello.length());
+    secure.takeOutput(sealed);
+    ok = ok && send(connection, sealed.data(), (int)sealed.length(), 0) == (int)sealed.length();
+
+    // Anything the server sends (session tickets) before it closes is
+    // ignored
+    bool closed = false;
+    while (ok && !closed) {
+        WSAPOLLFD fd;
+        fd.fd = connection;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        if (WSAPoll(&fd, 1, SUITE_COMMAND_TIMEOUT_MS) <= 0) {
+            break;
+        }
+        closed = recv(connection, buffer.data(), (int)buffer.size(), 0) <= 0;
+    }
+    closesocket(connection);
+    return closed;
+}
+
+#ifndef _WIN32
+static std::string freeLoopbackPort() {
+    SOCKET probe = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in address;
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    std::string port;
+    if (probe != INVALID_SOCKET && bind(probe, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+        getsockname(probe, (struct sockaddr*)&address, &length) == 0) {
+        port = std::to_string(ntohs(address.sin_port));
+    }
+    closesocket(probe);
+    return port;
+}
+
+static pid_t startSshTunnel(const std::string& destination, const std::string& port, std::string& localPort) {
+    // ssh forwards a local port to the server as the destination sees it,
+    // so the destination has to be this machine
+    localPort = freeLoopbackPort();
+    if (localPort.empty()) {
+        return -1;
+    }
+    std::string forward = localPort + ":127.0.0.1:" + port;
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("ssh", "ssh", "-N", "-o", "BatchMode=yes", "-o", "ExitOnForwardFailure=yes", "-L", forward.c_str(),
+            destination.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    for (int waited = 0; pid > 0 && waited < SUITE_SSH_TIMEOUT_MS; waited += 100) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return -1;
+        }
+        SOCKET probe = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        struct sockaddr_in address;
+        ZeroMemory(&address, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((unsigned short)atoi(localPort.c_str()));
+        bool listening = connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+        closesocket(probe);
+        if (listening) {
+            return pid;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return -1;
+}
+#endif
+
+static bool runTransportEncryption(const std::string& port, int iterations, int megabytes, const std::string& sshDestination,
+                                   JsonObject& result) {
+    if (!tlsSupported()) {
+        result.text("skipped", "built without TLS");
+        return true;
+    }
+    std::shared_ptr<TlsClientContext> tls(new TlsClientContext());
+    std::string error;
+    if (!tls->initialize("", "", error)) {
+        result.text("error", error);
+        return false;
+    }
+    result.text("cipher_suites", tlsCipherSuites());
+    result.flag("aes_hardware", aesHardware());
+
+    // Setup: a full handshake costs the certificate and a signature, a
+    // resumed one neither
+    std::vector<double> plainSetup;
+    std::vector<double> fullSetup;
+    std::vector<double> resumedSetup;
+    int fullResumed;
+    int resumed;
+    int unused;
+    if (!timeConnections(port, iterations, NULL, false, plainSetup, unused) ||
+        !timeConnections(port, iterations, tls, false, fullSetup, fullResumed) ||
+        !timeConnections(port, iterations, tls, true, resumedSetup, resumed)) {
+        result.text("error", "connection failed");
+        return false;
+    }
+    result.number("setup_plain_p50_us", percentile(plainSetup, 0.50));
+    result.number("setup_tls_full_p50_us", percentile(fullSetup, 0.50));
+    result.number("setup_tls_resumed_p50_us", percentile(resumedSetup, 0.50));
+    result.integer("resumed", resumed);
+    if (fullResumed != 0 || resumed != iterations) {
+        result.text("error", "sessions were not resumed as expected");
+        return false;
+    }
+
+    // A client failing its hello takes only its own session with it
+    std::vector<double> afterMalformed;
+    if (!sendMalformedHello(port, tls)) {
+        result.text("error", "malformed hello over TLS was not turned away");
+        return false;
+    }
+    if (!timeConnections(port, 1, tls, true, afterMalformed, unused)) {
+        result.text("error", "server stopped serving after a malformed hello");
+        return false;
+    }
+
+    // Throughput, each transport on a connection of its own
+    JsonObject plain;
+    JsonObject secure;
+    double plainRate;
+    double secureRate;
+    bool ok = runBulkThroughput(port, megabytes, NULL, plain, plainRate);
+    ok = runBulkThroughput(port, megabytes, tls, secure, secureRate) && ok;
+    result.raw("plain", plain.str());
+    result.raw("tls", secure.str());
+    result.number("tls_relative_throughput", plainRate > 0.0 ? secureRate / plainRate : 0.0, 3);
+    if (!ok) {
+        result.text("error", "bulk output did not complete");
+        return false;
+    }
+
+    if (sshDestination.empty()) {
+        return true;
+    }
+#ifdef _WIN32
+    result.text("ssh", "not supported on Windows");
+#else
+    std::string tunnelPort;
+    pid_t ssh = startSshTunnel(sshDestination, port, tunnelPort);
+    if (ssh < 0) {
+        result.text("error", "ssh tunnel to " + sshDestination + " did not start");
+        return false;
+    }
+    JsonObject tunnel;
+    double tunnelRate;
+    ok = runBulkThroughput(tunnelPort, megabytes, NULL, tunnel, tunnelRate);
+    kill(ssh, SIGTERM);
+    waitpid(ssh, NULL, 0);
+    result.raw("ssh", tunnel.str());
+    result.number("ssh_relative_throughput", plainRate > 0.0 ? tunnelRate / plainRate : 0.0, 3);
+    if (!ok) {
+        result.text("error", "bulk output through ssh did not complete");
+        return false;
+    }
+#endif
+    return true;
+}
+
+static bool replayRecording(const std::vector<std::string>& parts, const std::string& from, ReplayReport& report,
+                            double& openSeconds, bool& sawMarker) {
+    BenchClock::time_point start = BenchClock::now();
+    SessionReplay replay;
+    for (size_t i = 0; i < parts.size(); i++) {
+        std::string error;
+        if (!replay.addFile(parts[i], error)) {
+            return false;
+        }
+    }
+    openSeconds = elapsedSeconds(start);
+
+    // As fast as it goes, looking for the bulk command's end marker
+    std::string tail;
+    sawMarker = false;
+    replay.setStart(from);
+    replay.setSpeed(0);
+    replay.setQuiet(true);
+    replay.setOutputHandler([&tail, &sawMarker](uint16_t, uint8_t, uint64_t, const char* data, size_t length) {
+        tail.append(data, length);
+        sawMarker = sawMarker || tail.find("kbench0") != std::string::npos;
+        if (tail.length() > SUITE_TAIL_BYTES) {
+            tail.erase(0, tail.length() - SUITE_TAIL_BYTES);
+        }
+    });
+    bool played = replay.run() == 0;
+    report = replay.report();
+    return played;
+}
+
+static bool runSessionRecording(const std::string& port, int megabytes, JsonObject& result) {
+    std::string base;
+    FILE* file = createTempFile(base);
+    if (file) {
+        fclose(file);
+        remove(base.c_str());
+    }
+    std::filesystem::path directory = base + "-recordings";
+
+    // A second server, recording every session, so the bulk output can be
+    // compared with the main one's on the same machine
+    RemoteTerminalServer recorded;
+    recorded.setPort("0");
+    recorded.setRecording(directory.string(), DEFAULT_RECORDING_LIMIT_BYTES);
+    if (base.empty() || !recorded.initialize()) {
+        result.text("error", "unable to start a recording server");
+        return false;
+    }
+    std::thread serverThread([&recorded]() { recorded.run(); });
+
+    JsonObject plain;
+    JsonObject recording;
+    double plainRate;
+    double recordingRate;
+    uint64_t expected = 0;
+    bool ok = runBulkThroughput(port, megabytes, NULL, plain, plainRate);
+    ok = runBulkThroughput(std::to_string(recorded.boundPort()), megabytes, NULL, recording, recordingRate, &expected) && ok;
+    result.raw("plain", plain.str());
+    result.raw("recorded", recording.str());
+    result.number("recorded_relative_throughput", plainRate > 0.0 ? recordingRate / plainRate : 0.0, 3);
+
+    // The session has to end for its last chunk and index to be written
+    for (int waited = 0; gaugeTotal(METRIC_SESSIONS) > 0 && waited < 5000; waited += 10) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    recorded.flushRecordings();
+    recorded.stop();
+    serverThread.join();
+
+    std::vector<std::string> parts;
+    uint64_t diskBytes = 0;
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(directory, error); !error && it != std::filesystem::directory_iterator();
+         it.increment(error)) {
+        parts.push_back(it->path().string());
+        diskBytes += it->file_size(error);
+    }
+    result.integer("parts", (long long)parts.size());
+    result.integer("disk_bytes", (long long)diskBytes);
+
+    ReplayReport whole;
+    ReplayReport half;
+    double openSeconds;
+    double halfOpenSeconds;
+    bool sawMarker;
+    bool halfSawMarker;
+    if (!ok) {
+        result.text("error", "bulk output did not complete");
+    } else if (!replayRecording(parts, "", whole, openSeconds, sawMarker)) {
+        result.text("error", "the recording could not be replayed");
+        ok = false;
+    } else {
+        // Everything the client was sent is in the recording, unless the
+        // writer fell behind and says how much it dropped
+        double outputMB = whole.outputBytes / (1024.0 * 1024.0);
+        result.integer("replayed_bytes", (long long)whole.outputBytes);
+        result.integer("lost_bytes", (long long)whole.lostBytes);
+        result.integer("chunks", (long long)whole.chunksRead);
+        result.number("disk_ratio", whole.outputBytes ? (double)diskBytes / whole.outputBytes : 0.0, 3);
+        result.number("replay_mb_per_second", whole.seconds > 0.0 ? outputMB / whole.seconds : 0.0, 1);
+        if (whole.outputBytes + whole.lostBytes < expected || (whole.lostBytes == 0 && !sawMarker)) {
+            result.text("error", "the recording is missing output");
+            ok = false;
+        }
+
+        // Seeking to the middle reads one chunk, however long the recording
+        uint64_t middle = (whole.lastTime - whole.firstTime) / 2;
+        std::string from = "+" + std::to_string((whole.firstTime - whole.sessionStart + middle) / 1000000.0);
+        if (ok && replayRecording(parts, from, half, halfOpenSeconds, halfSawMarker)) {
+            result.number("seek_ms", (halfOpenSeconds + half.seekSeconds) * 1000.0, 2);
+            result.integer("from_middle_chunks", (long long)half.chunksRead);
+        } else if (ok) {
+            result.text("error", "seeking into the recording failed");
+            ok = false;
+        }
+    }
+    std::filesystem::remove_all(directory, error);
+    return ok;
+}
+
+// A raw client without a console, drawing what it is sent on a screen of
+// its own as ConsoleRenderer would: the shell's output, or with screen sync
+// the server's updates. The server's own messages are left out.
+class ScreenClient {
+private:
+    std::mutex mutex;
+    std::condition_variable arrived;
+    TerminalScreen screen;
+    uint64_t drawnBytes;
+    uint64_t writes;            // Output frames, or screen updates
+    RemoteTerminalClient client;    // Last, so its receive thread stops first
+
+    // A line with the marker, then the prompt under it
+    bool showsPrompt(const std::string& marker) {
+        std::string line = screen.lineText(screen.cursorRow());
+        if (!endsWithPrompt(line)) {
+            return false;
+        }
+        for (int r = 0; r < screen.cursorRow() && !marker.empty(); r++) {
+            if (screen.lineText(r).find(marker) != std::string::npos) {
+                return true;
+            }
+        }
+        return marker.empty();
+    }
+
+public:
+    ScreenClient() : drawnBytes(0), writes(0) {}
+
+    bool connect(const std::string& port, bool sync) {
+        client.setRequestedFeatures(FEATURE_COMPRESSION | FEATURE_RAW_INPUT | (sync ? FEATURE_SCREEN_SYNC : 0));
+        client.setScreenSize(screen.rows(), screen.columns());
+        client.setOutputHandler([this](uint16_t, uint8_t stream, uint64_t, const char* data, size_t length) {
+            if (stream == STREAM_CONTROL) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            screen.write(data, length);
+            drawnBytes += length;
+            writes++;
+            arrived.notify_all();
+        });
+        return client.initialize() && client.connectToServer("127.0.0.1", port) && client.start();
+    }
+
+    bool type(const std::string& line) {
+        std::string keys = line + "\r";
+        return client.sendInput(0, keys.data(), keys.length());
+    }
+
+    // Until the screen shows 'marker' with the prompt after it (just the
+    // prompt for an empty marker)
+    bool waitForPrompt(const std::string& marker, int timeoutMs) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, &marker]() {
+            return showsPrompt(marker);
+        });
+    }
+
+    uint64_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return drawnBytes;
+    }
+
+    uint64_t frames() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writes;
+    }
+
+    // Every row's text, and where the cursor is
+    std::string contents() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string text;
+        for (int r = 0; r < screen.rows(); r++) {
+            text += screen.lineText(r) + "\n";
+        }
+        return text + std::to_string(screen.cursorRow()) + "," + std::to_string(screen.cursorColumn());
+    }
+};
+
+static bool runScreenClient(const std::string& port, bool sync, const std::string& command, int timeoutMs,
+                            JsonObject& result, std::string& contents) {
+    ScreenClient client;
+    if (!client.connect(port, sync) || !client.waitForPrompt("", SUITE_COMMAND_TIMEOUT_MS)) {
+        result.text("error", "session did not start");
+        return false;
+    }
+    uint64_t startBytes = client.bytes();
+    uint64_t startFrames = client.frames();
+    uint64_t startWire = counterTotal(METRIC_BYTES_SENT);
+    double startCpu = processCpuSeconds();
+    BenchClock::time_point start = BenchClock::now();
+    bool completed = client.type(command) && client.waitForPrompt("kbench0", timeoutMs);
+    result.number("seconds", elapsedSeconds(start), 3);
+    result.integer("wire_bytes", (long long)(counterTotal(METRIC_BYTES_SENT) - startWire));
+    result.integer("drawn_bytes", (long long)(client.bytes() - startBytes));
+    result.integer(sync ? "updates" : "output_frames", (long long)(client.frames() - startFrames));
+    result.number("cpu_seconds", processCpuSeconds() - startCpu, 3);
+    contents = client.contents();
+    if (!completed) {
+        result.text("error", "output did not complete");
+    }
+    return completed;
+}
+
+static bool runScreenSync(const std::string& port, int megabytes, JsonObject& result) {
+#ifdef _WIN32
+    result.text("skipped", "a cmd.exe shell has no terminal screen");
+    return true;
+#else
+    std::string path = writeBulkFile();
+    if (path.empty()) {
+        result.text("error", "unable to write the build log");
+        return false;
+    }
+    int repeats = (int)(((uint64_t)megabytes * 1024 * 1024 + SUITE_BULK_FILE_BYTES - 1) / SUITE_BULK_FILE_BYTES);
+    if (repeats < 1) {
+        repeats = 1;
+    }
+    std::string command = "i=0; while [ $i -lt " + std::to_string(repeats) + " ]; do cat '" + path + "'; i=$((i+1)); done; " +
+        echoCommand("kbench", 0);
+    int timeoutMs = SUITE_COMMAND_TIMEOUT_MS + repeats * 1000;
+
+    // The client and the server share the process, so the CPU time is both
+    // of theirs
+    JsonObject plain;
+    JsonObject synced;
+    std::string plainScreen;
+    std::string syncedScreen;
+    bool ok = runScreenClient(port, false, command, timeoutMs, plain, plainScreen);
+    ok = runScreenClient(port, true, command, timeoutMs, synced, syncedScreen) && ok;
+    remove(path.c_str());
+    result.raw("raw", plain.str());
+    result.raw("screen_sync", synced.str());
+    if (!ok) {
+        result.text("error", "bulk output did not complete");
+        return false;
+    }
+    if (plainScreen != syncedScreen) {
+        result.text("error", "the synced screen differs from the raw one");
+        return false;
+    }
+    return true;
+#endif
+}
+
+static bool runMaxSessions(const std::string& port, int maxSessions, int stepMs, JsonObject& result) {
+    std::vector<std::unique_ptr<ScriptedClient>> clients;
+    std::string steps = "[";
+    double baseline = 0.0;
+    int sustained = 0;
+    bool ok = true;
+    for (int count = 1; count <= maxSessions; count *= 2) {
+        while ((int)clients.size() < count) {
+            std::unique_ptr<ScriptedClient> client = openClient(port);
+            if (!client) {
+                result.text("error", "session " + std::to_string(clients.size() + 1) + " did not start");
+                ok = false;
+                break;
+            }
+            clients.push_back(std::move(client));
+        }
+        std::vector<double> samples;
+        int commands;
+        int missed;
+        if (!ok || !runLoadStep(clients, stepMs, samples, commands, missed)) {
+            ok = false;
+            break;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        double p50 = percentile(samples, 0.50);
+        double p99 = percentile(samples, 0.99);
+        if (count == 1) {
+            baseline = p99;
+        }
+        double limit = std::max(baseline * SUITE_DEGRADE_FACTOR, baseline + SUITE_DEGRADE_FLOOR_US);
+        bool degraded = missed > 0 || p99 > limit;
+
+        JsonObject step;
+        step.integer("sessions", count);
+        step.integer("commands", commands);
+        step.integer("missed", missed);
+        step.number("p50_us", p50);
+        step.number("p99_us", p99);
+        step.flag("degraded", degraded);
+        steps += (count > 1 ? ", " : "") + step.str();
+        fprintf(stderr, "  %d sessions: echo p50 %.0f us, p99 %.0f us%s\n", count, p50, p99, degraded ? " (degraded)" : "");
+        if (degraded) {
+            break;
+        }
+        sustained = count;
+    }
+
+    result.integer("max_sessions", sustained);
+    result.number("baseline_p99_us", baseline);
+    result.integer("typing_interval_ms", SUITE_TYPING_INTERVAL_MS);
+    result.raw("steps", steps + "]");
+    return ok;
+}
+
+static std::string hostDescription() {
+    JsonObject host;
+    host.integer("cores", (long long)std::thread::hardware_concurrency());
+#ifdef _WIN32
+    host.text("os", "Windows");
+    host.text("shell", "cmd.exe");
+#else
+    struct utsname name;
+    if (uname(&name) == 0) {
+        host.text("os", std::string(name.sysname) + " " + name.release);
+        host.text("machine", name.machine);
+    }
+    const char* shell = getenv("KSERVER_SHELL");
+    host.text("shell", shell && *shell ? shell : "/bin/sh");
+#endif
+    return host.str();
+}
+
+static std::string utcTimestamp() {
+    std::time_t now = std::time(NULL);
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &now);
+#else
+    gmtime_r(&now, &utc);
+#endif
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    return text;
+}
+
+static bool parseSuiteArguments(int argc, char* argv[], SuiteConfig& config) {
+    config.setupIterations = 20;
+    config.echoIterations = 500;
+    config.bulkMegabytes = 1024;
+    config.fileMegabytes = 256;
+    config.syncFiles = 5000;
+    config.batchHosts = 256;
+    config.searchMegabytes = 12;
+    config.maxSessions = 256;
+    config.stepMs = 2000;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--quick") {
+            // A smoke run for ctest: every scenario, a few seconds in all
+            config.setupIterations = 5;
+            config.echoIterations = 50;
+            config.bulkMegabytes = 16;
+            config.fileMegabytes = 16;
+            config.syncFiles = 500;
+            config.batchHosts = 16;
+            config.searchMegabytes = 8;
+            config.maxSessions = 8;
+            config.stepMs = 500;
+        } else if (arg == "--output" && hasValue) {
+            config.outputFile = argv[++i];
+        } else if (arg == "--label" && hasValue) {
+            config.label = argv[++i];
+        } else if (arg == "--bulk-mb" && hasValue) {
+            config.bulkMegabytes = atoi(argv[++i]);
+        } else if (arg == "--file-mb" && hasValue) {
+            config.fileMegabytes = atoi(argv[++i]);
+        } else if (arg == "--sync-files" && hasValue) {
+            config.syncFiles = atoi(argv[++i]);
+        } else if (arg == "--batch-hosts" && hasValue) {
+            config.batchHosts = atoi(argv[++i]);
+        } else if (arg == "--search-mb" && hasValue) {
+            config.searchMegabytes = atoi(argv[++i]);
+        } else if (arg == "--max-sessions" && hasValue) {
+            config.maxSessions = atoi(argv[++i]);
+        } else if (arg == "--ssh" && hasValue) {
+            config.sshDestination = argv[++i];
+        } else if (arg == "--echo" && hasValue) {
+            config.echoIterations = atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return config.bulkMegabytes > 0 && config.fileMegabytes > 0 && config.syncFiles > 0 &&
+        config.batchHosts > 0 && config.searchMegabytes > 0 && config.maxSessions > 0 && config.echoIterations > 0;
+}
+
+int runSuite(int argc, char* argv[]) {
+    SuiteConfig config;
+    if (!parseSuiteArguments(argc, argv, config)) {
+        printf("Usage: kBench suite [--quick] [--output <file>] [--label <text>] [--bulk-mb <MB>]\n");
+        printf("                    [--file-mb <MB>] [--sync-files <n>] [--batch-hosts <n>] [--max-sessions <n>]\n");
+        printf("                    [--search-mb <MB>] [--echo <commands>] [--ssh <this machine as an ssh destination>]\n");
+        return 1;
+    }
+
+    // The server shares stdout with the report
+    setLogLevel(LOG_ERROR);
+    RemoteTerminalServer server;
+    server.setPort("0");
+    TlsConfig tlsConfig;
+    tlsConfig.enabled = tlsSupported();
+    tlsConfig.required = false;
+    server.setTls(tlsConfig);
+    if (!server.initialize()) {
+        fprintf(stderr, "Unable to start the server\n");
+        return 1;
+    }
+    std::thread serverThread([&server]() { server.run(); });
+    std::string port = std::to_string(server.boundPort());
+
+    JsonObject report;
+    report.text("suite", "kBench");
+    report.integer("version", 1);
+    report.text("label", config.label);
+    report.text("timestamp", utcTimestamp());
+    report.raw("host", hostDescription());
+
+    JsonObject settings;
+    settings.integer("setup_iterations", config.setupIterations);
+    settings.integer("echo_iterations", config.echoIterations);
+    settings.integer("bulk_mb", config.bulkMegabytes);
+    settings.integer("file_mb", config.fileMegabytes);
+    settings.integer("sync_files", config.syncFiles);
+    settings.integer("batch_hosts", config.batchHosts);
+    settings.integer("search_mb", config.searchMegabytes);
+    settings.integer("max_sessions", config.maxSessions);
+    settings.integer("step_ms", config.stepMs);
+    settings.text("ssh", config.sshDestination);
+    report.raw("config", settings.str());
+
+    bool ok = true;
+    JsonObject setup;
+    fprintf(stderr, "session_setup: %d sessions\n", config.setupIterations);
+    ok = runSessionSetup(server, port, config.setupIterations, DEFAULT_SHELL_POOL_SIZE, setup) && ok;
+    report.raw("session_setup", setup.str());
+
+    JsonObject unpooled;
+    fprintf(stderr, "session_setup_unpooled: %d sessions\n", config.setupIterations);
+    ok = runSessionSetup(server, port, config.setupIterations, 0, unpooled) && ok;
+    report.raw("session_setup_unpooled", unpooled.str());
+    server.setShellPool(DEFAULT_SHELL_POOL_SIZE);
+
+    JsonObject echo;
+    fprintf(stderr, "echo_latency: %d commands\n", config.echoIterations);
+    ok = runEchoLatency(port, config.echoIterations, echo) && ok;
+    report.raw("echo_latency", echo.str());
+
+    JsonObject commands;
+    fprintf(stderr, "command_status: %d commands\n", config.echoIterations);
+    ok = runCommandStatus(port, config.echoIterations, commands) && ok;
+    report.raw("command_status", commands.str());
+
+    JsonObject bulk;
+    fprintf(stderr, "bulk_throughput: %d MB\n", config.bulkMegabytes);
+    double bulkRate;
+    ok = runBulkThroughput(port, config.bulkMegabytes, NULL, bulk, bulkRate) && ok;
+    report.raw("bulk_throughput", bulk.str());
+
+    JsonObject files;
+    fprintf(stderr, "file_transfer: %d MB\n", config.fileMegabytes);
+    ok = runFileTransfer(port, config.fileMegabytes, files) && ok;
+    report.raw("file_transfer", files.str());
+
+    JsonObject tree;
+    fprintf(stderr, "tree_sync: %d files\n", config.syncFiles);
+    ok = runTreeSync(port, config.syncFiles, tree) && ok;
+    report.raw("tree_sync", tree.str());
+
+    JsonObject batch;
+    fprintf(stderr, "batch_fanout: %d hosts\n", config.batchHosts);
+    ok = runBatchFanout(port, config.batchHosts, batch) && ok;
+    report.raw("batch_fanout", batch.str());
+
+    JsonObject search;
+    fprintf(stderr, "output_search: %d MB\n", config.searchMegabytes);
+    ok = runOutputSearch(port, config.searchMegabytes, search) && ok;
+    report.raw("output_search", search.str());
+
+    // Smaller than bulk_throughput, as it is run twice or three times (here,
+    // in session_recording and in screen_sync)
+    JsonObject encryption;
+    int encryptionMegabytes = std::max(config.bulkMegabytes / 4, 16);
+    fprintf(stderr, "transport_encryption: %d connections, %d MB\n", config.setupIterations, encryptionMegabytes);
+    ok = runTransportEncryption(port, config.setupIterations, encryptionMegabytes, config.sshDestination, encryption) && ok;
+    report.raw("transport_encryption", encryption.str());
+
+    JsonObject recording;
+    fprintf(stderr, "session_recording: %d MB\n", encryptionMegabytes);
+    ok = runSessionRecording(port, encryptionMegabytes, recording) && ok;
+    report.raw("session_recording", recording.str());
+
+    JsonObject screenSync;
+    fprintf(stderr, "screen_sync: %d MB\n", encryptionMegabytes);
+    ok = runScreenSync(port, encryptionMegabytes, screenSync) && ok;
+    report.raw("screen_sync", screenSync.str());
+
+    JsonObject sessions;
+    fprintf(stderr, "max_sessions: up to %d\n", config.maxSessions);
+    ok = runMaxSessions(port, config.maxSessions, config.stepMs, sessions) && ok;
+    report.raw("max_sessions", sessions.str());
+    report.flag("ok", ok);
+
+    // Every client has gone; let their sessions close before the loops stop
+    for (int waited = 0; gaugeTotal(METRIC_SESSIONS) > 0 && waited < 5000; waited += 10) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    server.stop();
+    serverThread.join();
+
+    std::string json = report.str(true);
+    if (config.outputFile.empty()) {
+        fwrite(json.data(), 1, json.length(), stdout);
+    } else {
+        FILE* file = fopen(config.outputFile.c_str(), "w");
+        if (!file || fwrite(json.data(), 1, json.length(), file) != json.length()) {
+            fprintf(stderr, "Unable to write %s\n", config.outputFile.c_str());
+            ok = false;
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+    return ok ? 0 : 1;
+}
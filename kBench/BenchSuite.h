@@ -0,0 +1,11 @@
+#pragma once
+
+// kBench suite [--quick] [--output <file>] [--label <text>] [--bulk-mb <MB>]
+//              [--file-mb <MB>] [--sync-files <n>] [--max-sessions <n>]
+//              [--echo <commands>] [--ssh <destination>]
+//
+// Runs a kServer inside this process on a free loopback port, drives it with
+// headless RemoteTerminalClients and prints the results as one JSON object.
+// Needs nothing but a shell, so it runs the same on a build box without
+// network access; pass the commit as --label to keep results per commit.
+int runSuite(int argc, char* argv[]);
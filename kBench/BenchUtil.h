@@ -0,0 +1,91 @@
+#pragma once
+
+// Helpers shared by the benchmark modes in kBench.cpp and the suite in
+// BenchSuite.cpp
+
+#include "../platform.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <ctime>
+
+typedef std::chrono::steady_clock BenchClock;
+
+inline double elapsedSeconds(BenchClock::time_point start) {
+    return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+inline double processCpuSeconds() {
+#ifndef _WIN32
+    struct timespec cpuTime;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuTime);
+    return cpuTime.tv_sec + cpuTime.tv_nsec / 1e9;
+#else
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+        return 0.0;
+    }
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = kernelTime.dwLowDateTime;
+    kernel.HighPart = kernelTime.dwHighDateTime;
+    user.LowPart = userTime.dwLowDateTime;
+    user.HighPart = userTime.dwHighDateTime;
+    return (double)(kernel.QuadPart + user.QuadPart) / 1e7;
+#endif
+}
+
+inline double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// A command whose output contains 'token' but whose echoed command line
+// doesn't, so the echo can't be mistaken for the output
+inline std::string echoCommand(const std::string& token, int n) {
+#ifdef _WIN32
+    return "echo " + token + "^" + std::to_string(n);
+#else
+    return "echo " + token + "''" + std::to_string(n);
+#endif
+}
+
+// True once the shell prompt ("C:\dir>" or "/dir> ") ends the output
+inline bool endsWithPrompt(const std::string& output) {
+    size_t end = output.find_last_not_of(' ');
+    return end != std::string::npos && output[end] == '>';
+}
+
+// Roughly what an MSBuild/cl.exe build writes to the console
+inline std::string makeBuildLog(size_t bytes) {
+    static const char* projects[] = { "core", "net", "render", "tools", "tests" };
+    static const char* warnings[] = {
+        "warning C4244: 'argument': conversion from 'double' to 'float', possible loss of data",
+        "warning C4267: '=': conversion from 'size_t' to 'int', possible loss of data",
+        "warning C4996: 'strcpy': This function or variable may be unsafe.",
+    };
+
+    std::string log;
+    unsigned seed = 12345;
+    while (log.length() < bytes) {
+        seed = seed * 1103515245 + 12345;
+        const char* project = projects[(seed >> 8) % 5];
+        int file = (seed >> 12) % 400;
+        std::ostringstream line;
+        line << "  " << project << "_file" << file << ".cpp\r\n";
+        if ((seed >> 20) % 7 == 0) {
+            line << "C:\\src\\engine\\" << project << "\\" << project << "_file" << file << ".cpp("
+                 << (seed >> 4) % 2000 << ",17): " << warnings[(seed >> 16) % 3]
+                 << " [C:\\src\\engine\\" << project << "\\" << project << ".vcxproj]\r\n";
+        }
+        if ((seed >> 24) % 50 == 0) {
+            line << "  " << project << ".vcxproj -> C:\\src\\engine\\x64\\Release\\" << project << ".lib\r\n";
+        }
+        log += line.str();
+    }
+    log.resize(bytes);
+    return log;
+}
@@ -0,0 +1,1185 @@
+// kBench.cpp : Benchmarks for the remote terminal client/server.
+//
+// Usage:
+//   kBench latency [server] [iterations]
+//       Connects to a running kServer, sends a series of echo commands and
+//       measures the time from send() to the first byte of shell output.
+//   kBench load [server] [sessions] [rounds]
+//       Opens many sessions at once, echoes through all of them each round
+//       and reports p50/p99 echo latency plus the local kServer process's
+//       thread count and CPU use.
+//   kBench channels [server] [shells] [rounds] [connections|channels]
+//       Runs the same number of shells as separate connections and as
+//       channels of one connection, and reports the kServer process's memory
+//       growth and the echo latency for each. Pooled buffers stay reserved
+//       once allocated, so for exact memory figures run one variant per
+//       fresh server.
+//   kBench resume [server] [reconnects] [kilobytes]
+//       Drops a resumable session's connection while a command prints the
+//       given amount of output, reattaches with the session token, and
+//       reports the hello round trip and the time to replay the missed
+//       output, next to the cost of starting a new session.
+//   kBench frames [megabytes]
+//       In-memory parser throughput for the framed protocol versus the
+//       legacy END_OF_RESPONSE_MARKER protocol on 'type'-like output.
+//   kBench compress [logfile]
+//       Bytes on the wire and CPU per MB for output compression, using the
+//       given file or a synthetic build log.
+//   kBench render [megabytes]
+//       Client rendering of a 'cat' of a large build log: the screen model's
+//       throughput alone, with a repaint every frame (as kClient --raw
+//       does) and with a repaint after every chunk, plus the bytes each
+//       writes to the console. The frames are replayed into a second screen
+//       to check that they draw what the model holds.
+//   kBench predict [round trip ms]
+//       Local echo prediction for kClient --raw: a script typed into a
+//       simulated shell over a link with this round trip, in virtual time,
+//       with the time from each keystroke to its character on screen with
+//       and without prediction. Checks that a password prompt never shows
+//       what is typed, that a shell echoing something else is caught, and
+//       that the console ends up showing exactly the shell's screen. Up to
+//       1000 ms: beyond that each line is typed before its first echo is
+//       back, and nothing is confirmed in time to be drawn.
+//   kBench suite [--quick] [--output <file>] [options]
+//       Starts a server in this process and runs every end-to-end scenario
+//       against it, with the results as JSON (see BenchSuite.h).
+
+#include "../platform.h"
+#ifdef _WIN32
+#include <tlhelp32.h>
+#include <psapi.h>
+#else
+#include <dirent.h>
+#endif
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <cctype>
+#include <sstream>
+#include "../common.h"
+#include "../FrameProtocol.h"
+#include "../Compression.h"
+#include "../TerminalScreen.h"
+#include "../kClient/ConsoleRenderer.h"
+#include "../kClient/InputPredictor.h"
+#include "BenchUtil.h"
+#include "BenchSuite.h"
+
+// A framed connection to a running kServer
+struct BenchSession {
+    SOCKET socket;
+    FrameReader reader;
+    bool channels;      // FEATURE_CHANNELS: output has to be acknowledged
+    std::map<uint16_t, uint32_t> unacknowledged;
+    std::string token;  // FEATURE_RESUME
+};
+
+static bool receiveMore(BenchSession& session) {
+    int iResult = recv(session.socket, session.reader.writePtr(), (int)session.reader.writeSpace(), 0);
+    if (iResult <= 0) {
+        return false;
+    }
+    session.reader.commit(iResult);
+    return true;
+}
+
+// Waits for the next frame of the given type; its payload is appended to 'text'
+static bool receiveFrame(BenchSession& session, uint8_t type, std::string* text) {
+    while (true) {
+        FrameHeader header;
+        const char* payload;
+        FrameReader::Result result;
+        while ((result = session.reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+            if (header.type == type) {
+                if (text) {
+                    text->append(payload, header.length);
+                }
+                return true;
+            }
+        }
+        if (result == FrameReader::FRAME_INVALID || !receiveMore(session)) {
+            return false;
+        }
+    }
+}
+
+static SOCKET connectToServer(const std::string& serverAddress) {
+    struct addrinfo hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo* result = NULL;
+    if (getaddrinfo(serverAddress.c_str(), DEFAULT_PORT, &hints, &result) != 0) {
+        return INVALID_SOCKET;
+    }
+
+    SOCKET connectSocket = INVALID_SOCKET;
+    for (struct addrinfo* ptr = result; ptr != NULL; ptr = ptr->ai_next) {
+        connectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+        if (connectSocket == INVALID_SOCKET) {
+            continue;
+        }
+        if (connect(connectSocket, ptr->ai_addr, (int)ptr->ai_addrlen) == SOCKET_ERROR) {
+            closesocket(connectSocket);
+            connectSocket = INVALID_SOCKET;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(result);
+    if (connectSocket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+    // Small commands must not sit in the client's Nagle buffer
+    BOOL noDelay = TRUE;
+    setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    return connectSocket;
+}
+
+static bool openSession(const std::string& serverAddress, BenchSession& session, uint32_t features = 0) {
+    session.socket = connectToServer(serverAddress);
+    if (session.socket == INVALID_SOCKET) {
+        return false;
+    }
+
+    HelloPayload hello;
+    hello.version = PROTOCOL_VERSION;
+    hello.features = features;
+    std::string helloFrame = makeHelloFrame(hello);
+    if (send(session.socket, helloFrame.c_str(), (int)helloFrame.length(), 0) == SOCKET_ERROR) {
+        return false;
+    }
+
+    // Server hello, then the welcome message once the shell is up
+    std::string reply;
+    HelloPayload accepted;
+    if (!receiveFrame(session, FRAME_HELLO, &reply) || !decodeHello(reply.data(), reply.length(), accepted)) {
+        return false;
+    }
+    session.channels = (accepted.features & features & FEATURE_CHANNELS) != 0;
+    if (accepted.features & features & FEATURE_RESUME) {
+        session.token = accepted.token;
+    }
+    return receiveFrame(session, FRAME_OUTPUT, NULL);
+}
+
+// Hands output credit back to the server as a client that displayed it would
+static bool acknowledgeOutput(BenchSession& session, uint16_t channel, size_t length) {
+    if (!session.channels) {
+        return true;
+    }
+    uint32_t& pending = session.unacknowledged[channel];
+    pending += (uint32_t)length;
+    if (pending < CHANNEL_WINDOW / 2) {
+        return true;
+    }
+    std::string frame = makeWindowFrame(channel, pending);
+    pending = 0;
+    return send(session.socket, frame.c_str(), (int)frame.length(), 0) != SOCKET_ERROR;
+}
+
+// Appends the payload of every buffered output frame to the text for its
+// channel without blocking
+static bool drainOutput(BenchSession& session, std::map<uint16_t, std::string*>& texts) {
+    FrameHeader header;
+    const char* payload;
+    FrameReader::Result result;
+    while ((result = session.reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+        if (header.type != FRAME_OUTPUT) {
+            continue;
+        }
+        std::map<uint16_t, std::string*>::iterator it = texts.find(header.channel);
+        if (it != texts.end()) {
+            it->second->append(payload, header.length);
+        }
+        if (!acknowledgeOutput(session, header.channel, header.length)) {
+            return false;
+        }
+    }
+    return result != FrameReader::FRAME_INVALID;
+}
+
+static bool sendInput(BenchSession& session, const std::string& command, uint16_t channel = 0) {
+    std::string frame = makeFrame(FRAME_INPUT, STREAM_STDIN, command.c_str(), command.length(), 0, channel);
+    return send(session.socket, frame.c_str(), (int)frame.length(), 0) != SOCKET_ERROR;
+}
+
+// Opens channels 1 to count - 1 on a session, waiting for each shell to start
+static bool openChannels(BenchSession& session, int count) {
+    for (int channel = 1; channel < count; channel++) {
+        std::string frame = makeFrame(FRAME_CHANNEL_OPEN, STREAM_CONTROL, NULL, 0, 0, (uint16_t)channel);
+        if (send(session.socket, frame.c_str(), (int)frame.length(), 0) == SOCKET_ERROR) {
+            return false;
+        }
+    }
+
+    int opened = 1;
+    while (opened < count) {
+        FrameHeader header;
+        const char* payload;
+        FrameReader::Result result;
+        while ((result = session.reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+            if (header.type == FRAME_CHANNEL_OPEN) {
+                opened++;
+            } else if (header.type == FRAME_CHANNEL_CLOSE) {
+                printf("Server refused channel %u: %.*s\n", (unsigned)header.channel, (int)header.length, payload);
+                return false;
+            } else if (header.type == FRAME_OUTPUT && !acknowledgeOutput(session, header.channel, header.length)) {
+                return false;
+            }
+        }
+        if (result == FrameReader::FRAME_INVALID || (opened < count && !receiveMore(session))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int runFirstByteLatency(const std::string& serverAddress, int iterations) {
+    BenchSession session;
+    if (!openSession(serverAddress, session)) {
+        printf("Unable to open a framed session with %s:%s\n", serverAddress.c_str(), DEFAULT_PORT);
+        return 1;
+    }
+
+    std::vector<double> samples;
+    for (int i = 0; i < iterations; i++) {
+        // The token only appears once the command has actually run
+        std::string token = "kbench" + std::to_string(i);
+        std::string command = echoCommand("kbench", i);
+
+        std::string output;
+        BenchClock::time_point start = BenchClock::now();
+        if (!sendInput(session, command)) {
+            printf("send failed with error: %d\n", WSAGetLastError());
+            break;
+        }
+        if (!receiveFrame(session, FRAME_OUTPUT, &output)) {
+            printf("Connection closed during benchmark\n");
+            break;
+        }
+        samples.push_back(std::chrono::duration<double, std::micro>(BenchClock::now() - start).count());
+
+        // Drain the rest of this command's output, up to and including the
+        // next prompt, before the next round
+        bool drained = true;
+        while (output.find(token) == std::string::npos || !endsWithPrompt(output)) {
+            if (!receiveFrame(session, FRAME_OUTPUT, &output)) {
+                drained = false;
+                break;
+            }
+        }
+        if (!drained) {
+            break;
+        }
+    }
+
+    closesocket(session.socket);
+
+    std::sort(samples.begin(), samples.end());
+    printf("command-to-first-byte over %zu commands (us): min %.0f  p50 %.0f  p99 %.0f  max %.0f\n",
+        samples.size(),
+        percentile(samples, 0.0), percentile(samples, 0.50),
+        percentile(samples, 0.99), percentile(samples, 1.0));
+    return samples.size() == (size_t)iterations ? 0 : 1;
+}
+
+// Prints about 'kilobytes' of output, then a line with the token
+static std::string bulkOutputCommand(int kilobytes, const std::string& token, int n) {
+#ifdef _WIN32
+    return "for /L %i in (1,1," + std::to_string(kilobytes) + ") do @echo " + std::string(1021, 'x') + " & " +
+        echoCommand(token, n);
+#else
+    return "head -c " + std::to_string(kilobytes * 1024) + " /dev/zero | tr '\\0' x; echo; " + echoCommand(token, n);
+#endif
+}
+
+// Reads channel 0's shell output, counting its bytes as a resuming client
+// does, until 'token' has been printed and the prompt is back
+static bool readUntilPrompt(BenchSession& session, const std::string& token, std::string& output, uint64_t& received) {
+    while (token.empty() ? !endsWithPrompt(output) : (output.find(token) == std::string::npos || !endsWithPrompt(output))) {
+        FrameHeader header;
+        const char* payload;
+        FrameReader::Result result;
+        bool progress = false;
+        while ((result = session.reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+            if (header.type == FRAME_OUTPUT && header.stream != STREAM_CONTROL && header.channel == 0) {
+                output.append(payload, header.length);
+                received += header.length;
+                progress = true;
+            }
+        }
+        if (result == FrameReader::FRAME_INVALID) {
+            return false;
+        }
+        if (!progress && !receiveMore(session)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int runResume(const std::string& serverAddress, int reconnects, int kilobytes) {
+    // A new session for comparison: connection, hello and a shell to start
+    BenchSession session;
+    uint64_t received = 0;
+    std::string output;
+    BenchClock::time_point start = BenchClock::now();
+    if (!openSession(serverAddress, session, FEATURE_RESUME) || !readUntilPrompt(session, "", output, received)) {
+        printf("Unable to open a framed session with %s:%s\n", serverAddress.c_str(), DEFAULT_PORT);
+        return 1;
+    }
+    double freshUs = elapsedSeconds(start) * 1e6;
+    if (session.token.empty()) {
+        printf("The server does not support resuming sessions\n");
+        closesocket(session.socket);
+        return 1;
+    }
+
+    std::vector<double> helloSamples;
+    std::vector<double> replaySamples;
+    uint64_t replayedBytes = 0;
+    for (int i = 0; i < reconnects; i++) {
+        // Drop the connection as soon as the command is on its way, and let
+        // the output pile up in the scrollback
+        if (!sendInput(session, bulkOutputCommand(kilobytes, "kbench", i))) {
+            break;
+        }
+        closesocket(session.socket);
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+        HelloPayload hello;
+        hello.version = PROTOCOL_VERSION;
+        hello.features = FEATURE_RESUME;
+        hello.token = session.token;
+        StreamOffset offset = { 0, received };
+        hello.offsets.push_back(offset);
+        std::string helloFrame = makeHelloFrame(hello);
+
+        start = BenchClock::now();
+        session.reader = FrameReader();
+        session.socket = connectToServer(serverAddress);
+        std::string reply;
+        HelloPayload accepted;
+        if (session.socket == INVALID_SOCKET ||
+            send(session.socket, helloFrame.c_str(), (int)helloFrame.length(), 0) == SOCKET_ERROR ||
+            !receiveFrame(session, FRAME_HELLO, &reply) || !decodeHello(reply.data(), reply.length(), accepted)) {
+            printf("Reconnect %d failed\n", i);
+            break;
+        }
+        helloSamples.push_back(elapsedSeconds(start) * 1e6);
+        if (accepted.token != session.token || accepted.offsets.empty() || accepted.offsets[0].offset != received) {
+            printf("Reconnect %d did not resume the session where it left off\n", i);
+            break;
+        }
+
+        uint64_t before = received;
+        output.clear();
+        if (!readUntilPrompt(session, "kbench" + std::to_string(i), output, received)) {
+            printf("Connection closed during replay\n");
+            break;
+        }
+        replaySamples.push_back(elapsedSeconds(start) * 1e6);
+        replayedBytes += received - before;
+    }
+    closesocket(session.socket);
+
+    std::sort(helloSamples.begin(), helloSamples.end());
+    std::sort(replaySamples.begin(), replaySamples.end());
+    printf("new session (connect, hello, shell start): %.0f us\n", freshUs);
+    printf("reattach over %zu reconnects (us): hello reply p50 %.0f  p99 %.0f, all missed output p50 %.0f  p99 %.0f\n",
+        replaySamples.size(), percentile(helloSamples, 0.50), percentile(helloSamples, 0.99),
+        percentile(replaySamples, 0.50), percentile(replaySamples, 0.99));
+    printf("replayed %.1f KB per reconnect\n", replaySamples.empty() ? 0.0 : replayedBytes / 1024.0 / replaySamples.size());
+    return replaySamples.size() == (size_t)reconnects ? 0 : 1;
+}
+
+// Resource usage of the kServer process on this machine
+struct ServerProcessStats {
+    DWORD threadCount;
+    double cpuSeconds;  // User + kernel time
+    size_t residentBytes;   // Resident set (working set on Windows)
+};
+
+static bool queryServerProcess(ServerProcessStats& stats) {
+#ifndef _WIN32
+    DIR* proc = opendir("/proc");
+    if (!proc) {
+        return false;
+    }
+
+    bool found = false;
+    for (struct dirent* entry = readdir(proc); entry && !found; entry = readdir(proc)) {
+        std::string dir = std::string("/proc/") + entry->d_name;
+        std::ifstream comm(dir + "/comm");
+        std::string name;
+        if (!comm || !std::getline(comm, name) || name != "kServer") {
+            continue;
+        }
+
+        // Fields after the parenthesised name: state is field 3, utime 14,
+        // stime 15, num_threads 20 and rss (in pages) 24
+        std::ifstream statFile(dir + "/stat");
+        std::string stat((std::istreambuf_iterator<char>(statFile)), std::istreambuf_iterator<char>());
+        size_t nameEnd = stat.rfind(')');
+        if (nameEnd == std::string::npos) {
+            continue;
+        }
+        std::istringstream fields(stat.substr(nameEnd + 2));
+        std::vector<std::string> values;
+        std::string value;
+        while (fields >> value) {
+            values.push_back(value);
+        }
+        if (values.size() < 22 || values[0] == "Z") {
+            continue;   // A server that has exited but not been reaped
+        }
+        double ticksPerSecond = (double)sysconf(_SC_CLK_TCK);
+        stats.cpuSeconds = (strtod(values[11].c_str(), NULL) + strtod(values[12].c_str(), NULL)) / ticksPerSecond;
+        stats.threadCount = strtoul(values[17].c_str(), NULL, 10);
+        stats.residentBytes = strtoul(values[21].c_str(), NULL, 10) * (size_t)sysconf(_SC_PAGESIZE);
+        found = true;
+    }
+    closedir(proc);
+    return found;
+#else
+    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (hSnapshot == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    PROCESSENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    bool found = false;
+    for (BOOL more = Process32First(hSnapshot, &entry); more; more = Process32Next(hSnapshot, &entry)) {
+        if (lstrcmpi(entry.szExeFile, TEXT("kServer.exe")) == 0) {
+            found = true;
+            break;
+        }
+    }
+    CloseHandle(hSnapshot);
+    if (!found) {
+        return false;
+    }
+
+    stats.threadCount = entry.cntThreads;
+    stats.cpuSeconds = 0.0;
+    stats.residentBytes = 0;
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, entry.th32ProcessID);
+    if (hProcess) {
+        FILETIME creationTime, exitTime, kernelTime, userTime;
+        if (GetProcessTimes(hProcess, &creationTime, &exitTime, &kernelTime, &userTime)) {
+            ULARGE_INTEGER kernel, user;
+            kernel.LowPart = kernelTime.dwLowDateTime;
+            kernel.HighPart = kernelTime.dwHighDateTime;
+            user.LowPart = userTime.dwLowDateTime;
+            user.HighPart = userTime.dwHighDateTime;
+            stats.cpuSeconds = (double)(kernel.QuadPart + user.QuadPart) / 1e7;
+        }
+        PROCESS_MEMORY_COUNTERS memory;
+        if (GetProcessMemoryInfo(hProcess, &memory, sizeof(memory))) {
+            stats.residentBytes = memory.WorkingSetSize;
+        }
+        CloseHandle(hProcess);
+    }
+    return true;
+#endif
+}
+
+// One shell the echo rounds run through: a connection, or a channel of one
+struct EchoTarget {
+    BenchSession* session;
+    uint16_t channel;
+    std::string output;
+    BenchClock::time_point sent;
+    bool echoed;
+    bool done;
+};
+
+// Each round sends an echo to every target at once and waits until all of
+// them have printed it and returned to the prompt. Appends the latency from
+// send to echo to 'samples'.
+static bool runEchoRounds(std::vector<std::unique_ptr<EchoTarget>>& targets, int rounds, std::vector<double>& samples) {
+    std::vector<BenchSession*> sessions;
+    std::map<BenchSession*, std::map<uint16_t, std::string*>> texts;
+    for (size_t i = 0; i < targets.size(); i++) {
+        EchoTarget& target = *targets[i];
+        if (texts.find(target.session) == texts.end()) {
+            sessions.push_back(target.session);
+        }
+        texts[target.session][target.channel] = &target.output;
+    }
+
+    std::vector<WSAPOLLFD> pollFds(sessions.size());
+    for (int round = 0; round < rounds; round++) {
+        std::string token = "kbench" + std::to_string(round);
+        std::string command = echoCommand("kbench", round);
+
+        for (size_t i = 0; i < targets.size(); i++) {
+            EchoTarget& target = *targets[i];
+            target.output.clear();
+            target.echoed = false;
+            target.done = false;
+            target.sent = BenchClock::now();
+            if (!sendInput(*target.session, command, target.channel)) {
+                printf("send failed with error: %d\n", WSAGetLastError());
+                return false;
+            }
+        }
+
+        size_t remaining = targets.size();
+        while (remaining > 0) {
+            for (size_t i = 0; i < sessions.size(); i++) {
+                pollFds[i].fd = sessions[i]->socket;
+                pollFds[i].events = POLLRDNORM;
+                pollFds[i].revents = 0;
+            }
+            if (WSAPoll(pollFds.data(), (ULONG)pollFds.size(), 10000) <= 0) {
+                printf("Timed out waiting for %zu shells\n", remaining);
+                return false;
+            }
+
+            for (size_t i = 0; i < sessions.size(); i++) {
+                if (pollFds[i].revents == 0) {
+                    continue;
+                }
+                if (!receiveMore(*sessions[i]) || !drainOutput(*sessions[i], texts[sessions[i]])) {
+                    printf("Session %zu closed during benchmark\n", i);
+                    return false;
+                }
+            }
+
+            for (size_t i = 0; i < targets.size(); i++) {
+                EchoTarget& target = *targets[i];
+                if (target.done) {
+                    continue;
+                }
+                if (!target.echoed && target.output.find(token) != std::string::npos) {
+                    target.echoed = true;
+                    samples.push_back(std::chrono::duration<double, std::micro>(BenchClock::now() - target.sent).count());
+                }
+                // Round is over for this shell once the next prompt shows up
+                if (target.echoed && endsWithPrompt(target.output)) {
+                    target.done = true;
+                    remaining--;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static void addEchoTarget(std::vector<std::unique_ptr<EchoTarget>>& targets, BenchSession& session, uint16_t channel) {
+    std::unique_ptr<EchoTarget> target(new EchoTarget());
+    target->session = &session;
+    target->channel = channel;
+    targets.push_back(std::move(target));
+}
+
+static int runLoad(const std::string& serverAddress, int sessionCount, int rounds) {
+    BenchClock::time_point setupStart = BenchClock::now();
+    std::vector<std::unique_ptr<BenchSession>> sessions;
+    std::vector<std::unique_ptr<EchoTarget>> targets;
+    for (int i = 0; i < sessionCount; i++) {
+        std::unique_ptr<BenchSession> session(new BenchSession());
+        if (!openSession(serverAddress, *session)) {
+            printf("Unable to open session %d with %s:%s\n", i, serverAddress.c_str(), DEFAULT_PORT);
+            return 1;
+        }
+        addEchoTarget(targets, *session, 0);
+        sessions.push_back(std::move(session));
+    }
+    printf("Opened %d sessions in %.2f s\n", sessionCount, elapsedSeconds(setupStart));
+
+    ServerProcessStats before, after;
+    bool haveServerStats = queryServerProcess(before);
+
+    std::vector<double> samples;
+    BenchClock::time_point runStart = BenchClock::now();
+    if (!runEchoRounds(targets, rounds, samples)) {
+        return 1;
+    }
+    double runSeconds = elapsedSeconds(runStart);
+    haveServerStats = haveServerStats && queryServerProcess(after);
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        closesocket(sessions[i]->socket);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    printf("echo latency over %d sessions x %d rounds (us): p50 %.0f  p99 %.0f  max %.0f\n",
+        sessionCount, rounds,
+        percentile(samples, 0.50), percentile(samples, 0.99), percentile(samples, 1.0));
+    if (haveServerStats) {
+        printf("kServer: %lu threads, %.1f%% of one core during the run\n",
+            after.threadCount, 100.0 * (after.cpuSeconds - before.cpuSeconds) / runSeconds);
+    } else {
+        printf("kServer: process not found on this machine, no CPU/thread stats\n");
+    }
+    return 0;
+}
+
+// Runs 'shellCount' shells either as that many connections or as channels
+// of a single connection, and prints one row of the comparison
+static bool runShellVariant(const std::string& serverAddress, int shellCount, int rounds, bool asChannels) {
+    ServerProcessStats before, after;
+    bool haveServerStats = queryServerProcess(before);
+
+    BenchClock::time_point setupStart = BenchClock::now();
+    std::vector<std::unique_ptr<BenchSession>> sessions;
+    std::vector<std::unique_ptr<EchoTarget>> targets;
+    for (int i = 0; i < (asChannels ? 1 : shellCount); i++) {
+        std::unique_ptr<BenchSession> session(new BenchSession());
+        if (!openSession(serverAddress, *session, asChannels ? FEATURE_CHANNELS : 0)) {
+            printf("Unable to open session %d with %s:%s\n", i, serverAddress.c_str(), DEFAULT_PORT);
+            return false;
+        }
+        sessions.push_back(std::move(session));
+    }
+    if (asChannels) {
+        if (!sessions[0]->channels) {
+            printf("Server does not support channels\n");
+            return false;
+        }
+        if (!openChannels(*sessions[0], shellCount)) {
+            printf("Unable to open %d channels\n", shellCount);
+            return false;
+        }
+        for (int i = 0; i < shellCount; i++) {
+            addEchoTarget(targets, *sessions[0], (uint16_t)i);
+        }
+    } else {
+        for (size_t i = 0; i < sessions.size(); i++) {
+            addEchoTarget(targets, *sessions[i], 0);
+        }
+    }
+    double setupSeconds = elapsedSeconds(setupStart);
+
+    std::vector<double> samples;
+    bool completed = runEchoRounds(targets, rounds, samples);
+    haveServerStats = haveServerStats && queryServerProcess(after);
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        closesocket(sessions[i]->socket);
+    }
+    if (!completed) {
+        return false;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    char memory[64] = "n/a";
+    if (haveServerStats) {
+        double growthKb = ((double)after.residentBytes - (double)before.residentBytes) / 1024.0;
+        snprintf(memory, sizeof(memory), "%+.0f KB (%+.1f KB/shell)", growthKb, growthKb / shellCount);
+    }
+    printf("%3d %-11s  setup %6.0f ms  echo p50 %6.0f us  p99 %6.0f us  kServer memory %s\n",
+        shellCount, asChannels ? "channels" : "connections", setupSeconds * 1000.0,
+        percentile(samples, 0.50), percentile(samples, 0.99), memory);
+
+    // Let the server tear the shells down before anything else is measured
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    return true;
+}
+
+static int runChannels(const std::string& serverAddress, int shellCount, int rounds, const std::string& variant) {
+    bool ok = true;
+    if (variant != "channels") {
+        ok = runShellVariant(serverAddress, shellCount, rounds, false);
+    }
+    if (ok && variant != "connections") {
+        ok = runShellVariant(serverAddress, shellCount, rounds, true);
+    }
+    return ok ? 0 : 1;
+}
+
+// Feeds 'stream' to a parser in recv()-sized pieces
+template <typename Parser>
+static double measureParser(const std::string& stream, Parser parse) {
+    const size_t recvSize = 64 * 1024;
+    BenchClock::time_point start = BenchClock::now();
+    for (size_t offset = 0; offset < stream.length(); offset += recvSize) {
+        parse(stream.data() + offset, std::min(recvSize, stream.length() - offset));
+    }
+    return elapsedSeconds(start);
+}
+
+static int runFrameThroughput(int megabytes) {
+    // One 'type' output chunk as the server would forward it
+    std::string chunk;
+    while (chunk.length() < DEFAULT_BUFLEN) {
+        chunk += "2024-01-14  14:30:15    <DIR>          build output line of a typical log\r\n";
+    }
+    chunk.resize(DEFAULT_BUFLEN);
+
+    size_t chunkCount = ((size_t)megabytes * 1024 * 1024) / chunk.length();
+    std::string framedStream, legacyStream;
+    for (size_t i = 0; i < chunkCount; i++) {
+        framedStream += makeFrame(FRAME_OUTPUT, STREAM_STDOUT, chunk.c_str(), chunk.length());
+        legacyStream += chunk + END_OF_RESPONSE_MARKER;
+    }
+    double payloadMB = (double)(chunkCount * chunk.length()) / (1024.0 * 1024.0);
+
+    size_t messages = 0;
+
+    // The pre-framing client: append, find, substr
+    std::string buffer;
+    const std::string endMarker = END_OF_RESPONSE_MARKER;
+    double legacyCopySeconds = measureParser(legacyStream, [&](const char* data, size_t length) {
+        buffer += std::string(data, length);
+        size_t markerPos;
+        while ((markerPos = buffer.find(endMarker)) != std::string::npos) {
+            std::string message = buffer.substr(0, markerPos);
+            buffer = buffer.substr(markerPos + endMarker.length());
+            messages++;
+        }
+    });
+
+    // Legacy marker mode through FrameReader
+    FrameReader markerReader;
+    double legacyScanSeconds = measureParser(legacyStream, [&](const char* data, size_t length) {
+        while (length > 0) {
+            size_t n = std::min(length, markerReader.writeSpace());
+            memcpy(markerReader.writePtr(), data, n);
+            markerReader.commit(n);
+            data += n;
+            length -= n;
+            const char* message;
+            size_t messageLength;
+            while (markerReader.nextMarkerMessage(message, messageLength)) {
+                messages++;
+            }
+        }
+    });
+
+    // Framed mode
+    FrameReader frameReader;
+    double framedSeconds = measureParser(framedStream, [&](const char* data, size_t length) {
+        while (length > 0) {
+            size_t n = std::min(length, frameReader.writeSpace());
+            memcpy(frameReader.writePtr(), data, n);
+            frameReader.commit(n);
+            data += n;
+            length -= n;
+            FrameHeader header;
+            const char* payload;
+            while (frameReader.nextFrame(header, payload) == FrameReader::FRAME_READY) {
+                messages++;
+            }
+        }
+    });
+
+    if (messages != chunkCount * 3) {
+        printf("Parser mismatch: expected %zu messages, got %zu\n", chunkCount * 3, messages);
+        return 1;
+    }
+
+    printf("%.0f MB of output in %zu messages:\n", payloadMB, chunkCount);
+    printf("  legacy marker (find/substr):  %8.1f MB/s\n", payloadMB / legacyCopySeconds);
+    printf("  legacy marker (FrameReader):  %8.1f MB/s\n", payloadMB / legacyScanSeconds);
+    printf("  framed (FrameReader):         %8.1f MB/s\n", payloadMB / framedSeconds);
+    return 0;
+}
+
+static int runCompression(const char* logFile) {
+    std::string log;
+    if (logFile) {
+        std::ifstream file(logFile, std::ios::binary);
+        if (!file) {
+            printf("Unable to read %s\n", logFile);
+            return 1;
+        }
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        log = contents.str();
+    } else {
+        log = makeBuildLog(64 * 1024 * 1024);
+    }
+
+    // Compress in the chunk sizes the server reads from the shell pipes
+    StreamCompressor compressor;
+    StreamDecompressor decompressor;
+    std::vector<std::string> frames;
+    std::vector<bool> compressed;
+    size_t wireBytes = 0;
+    std::string block;
+
+    double cpuStart = processCpuSeconds();
+    for (size_t offset = 0; offset < log.length(); offset += DEFAULT_BUFLEN) {
+        size_t length = std::min((size_t)DEFAULT_BUFLEN, log.length() - offset);
+        bool isCompressed = compressor.compress(log.data() + offset, length, block);
+        frames.push_back(isCompressed ? block : log.substr(offset, length));
+        compressed.push_back(isCompressed);
+        wireBytes += FRAME_HEADER_SIZE + frames.back().length();
+    }
+    double compressCpu = processCpuSeconds() - cpuStart;
+
+    cpuStart = processCpuSeconds();
+    size_t offset = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        const char* data = frames[i].data();
+        size_t length = frames[i].length();
+        if (compressed[i]) {
+            if (!decompressor.decompress(frames[i].data(), frames[i].length(), data, length, FRAME_MAX_PAYLOAD)) {
+                printf("Decompression failed at frame %zu\n", i);
+                return 1;
+            }
+        } else {
+            decompressor.appendHistory(data, length);
+        }
+        if (log.compare(offset, length, data, length) != 0) {
+            printf("Round trip mismatch at frame %zu\n", i);
+            return 1;
+        }
+        offset += length;
+    }
+    double decompressCpu = processCpuSeconds() - cpuStart;
+
+    double megabytes = (double)log.length() / (1024.0 * 1024.0);
+    size_t rawWireBytes = frames.size() * FRAME_HEADER_SIZE + log.length();
+    printf("%.1f MB of %s in %zu frames:\n", megabytes, logFile ? logFile : "synthetic build log", frames.size());
+    printf("  bytes on wire:     %zu uncompressed, %zu compressed (%.1f%%)\n",
+        rawWireBytes, wireBytes, 100.0 * wireBytes / rawWireBytes);
+    printf("  compress CPU:      %.2f ms/MB\n", 1000.0 * compressCpu / megabytes);
+    printf("  decompress CPU:    %.2f ms/MB\n", 1000.0 * decompressCpu / megabytes);
+    return 0;
+}
+
+// Feeds 'output' to a screen in DEFAULT_BUFLEN chunks, as the receive thread
+// does, repainting every 'frameMs' (0: after every chunk, -1: never).
+// Returns the seconds taken; 'painted' gets the bytes for the console.
+static double measureRender(const std::string& output, int frameMs, TerminalScreen& screen,
+    TerminalScreen& console, size_t& painted, size_t& frames) {
+    std::string frame;
+    painted = 0;
+    frames = 0;
+    BenchClock::time_point start = BenchClock::now();
+    BenchClock::time_point nextFrame = start;
+    for (size_t offset = 0; offset < output.length(); offset += DEFAULT_BUFLEN) {
+        screen.write(output.data() + offset, std::min((size_t)DEFAULT_BUFLEN, output.length() - offset));
+        if (frameMs < 0 || (frameMs > 0 && BenchClock::now() < nextFrame)) {
+            continue;
+        }
+        frame.clear();
+        screen.render(frame);
+        console.write(frame.data(), frame.length());
+        painted += frame.length();
+        frames++;
+        nextFrame = BenchClock::now() + std::chrono::milliseconds(frameMs);
+    }
+    frame.clear();
+    screen.render(frame);
+    console.write(frame.data(), frame.length());
+    painted += frame.length();
+    return elapsedSeconds(start);
+}
+
+static int runRender(int megabytes) {
+    // A pty's output: CRLF line endings, long lines wrapping, and a last
+    // line to check the screen by
+    std::string output = makeBuildLog((size_t)megabytes * 1024 * 1024) + "\r\nrender check\r\n";
+    double outputMB = (double)output.length() / (1024.0 * 1024.0);
+
+    struct Variant {
+        const char* name;
+        int frameMs;
+    };
+    Variant variants[] = {
+        { "screen model only:", -1 },
+        { "repaint per frame:", RENDER_FRAME_MS },
+        { "repaint per chunk:", 0 },
+    };
+
+    printf("%.0f MB of build log through a %dx%d screen:\n", outputMB, SCREEN_DEFAULT_COLUMNS, SCREEN_DEFAULT_ROWS);
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        TerminalScreen screen;
+        TerminalScreen console;
+        size_t painted, frames;
+        double seconds = measureRender(output, variants[i].frameMs, screen, console, painted, frames);
+
+        for (int r = 0; r < screen.rows(); r++) {
+            if (screen.lineText(r) != console.lineText(r)) {
+                printf("Render mismatch in row %d: '%s' drawn as '%s'\n", r,
+                    screen.lineText(r).c_str(), console.lineText(r).c_str());
+                return 1;
+            }
+        }
+        if (screen.lineText(screen.rows() - 2) != "render check" || screen.cursorRow() != screen.rows() - 1) {
+            printf("Screen mismatch: last line '%s'\n", screen.lineText(screen.rows() - 2).c_str());
+            return 1;
+        }
+
+        printf("  %-20s %8.1f MB/s, %6zu frames, %10zu bytes to the console (%.2f%%)\n", variants[i].name,
+            outputMB / seconds, frames, painted, 100.0 * painted / output.length());
+    }
+    return 0;
+}
+
+// A shell at the far end of a link, as the predict mode's keystrokes see
+// it: a line editor that echoes, a password prompt that doesn't, and a
+// 'caps' command after which it echoes the next line in capitals from its
+// fourth character on (as a program that rewrites input would)
+struct SimulatedShell {
+    std::string line;
+    bool password;
+    bool caps;
+
+    SimulatedShell() : password(false), caps(false) {}
+
+    std::string key(char key) {
+        if (key == '\r') {
+            std::string out = "\r\n";
+            if (password) {
+                password = false;
+            } else if (line == "sudo true") {
+                password = true;
+                line.clear();
+                return out + "Password: ";
+            } else {
+                caps = line == "caps";
+                if (!line.empty()) {
+                    out += "ran " + line + "\r\n";
+                }
+            }
+            line.clear();
+            return out + "$ ";
+        }
+        if (key == 0x7f) {
+            if (line.empty()) {
+                return "";
+            }
+            line.pop_back();
+            return password ? "" : "\b \b";
+        }
+        line += key;
+        if (password) {
+            return "";
+        }
+        return std::string(1, caps && line.length() > 3 ? (char)toupper((unsigned char)key) : key);
+    }
+};
+
+struct PredictResult {
+    std::vector<double> latencies;  // Keystroke to drawn, ms
+    PredictStats stats;
+    bool passwordHidden;            // No password character ever drawn
+    bool settled;                   // The console matches the screen at the end
+};
+
+// Types the script with 'rttMs' between each key and its echo, in virtual
+// time, drawing every change into a second screen standing in for the
+// console
+static PredictResult simulateTyping(int rttMs, PredictMode mode) {
+    typedef std::chrono::steady_clock::time_point Time;
+    const int KEY_INTERVAL_MS = 120;
+    const int THINK_MS = 400;
+    const char* script[] = { "ls -la /usr/share/doc", "git statsu\x7f\x7fus", "sudo true", "hunter2", "caps", "hello",
+        "make -j8 all" };
+
+    TerminalScreen screen;
+    TerminalScreen console;
+    InputPredictor predictor(screen);
+    predictor.setMode(mode);
+    SimulatedShell shell;
+    std::multimap<Time, std::string> arrivals;     // Output on its way
+    PredictResult result;
+    result.passwordHidden = true;
+    std::string frame;
+
+    // A typed character waiting to be drawn, where the echo will put it
+    struct Typed {
+        Time at;
+        int row;
+        int column;
+        char ch;
+    };
+    std::vector<Typed> waiting;
+
+    // Paints the screen onto the console, as the render thread would, and
+    // notes which typed characters have appeared
+    int passwordRow = -1;
+    auto draw = [&](Time now) {
+        frame.clear();
+        screen.render(frame);
+        console.write(frame.data(), frame.length());
+        for (size_t i = 0; i < waiting.size();) {
+            if (console.cellAt(waiting[i].row, waiting[i].column).ch == (uint32_t)waiting[i].ch) {
+                result.latencies.push_back(std::chrono::duration<double, std::milli>(now - waiting[i].at).count());
+                waiting.erase(waiting.begin() + i);
+            } else {
+                i++;
+            }
+        }
+        if (passwordRow >= 0 && console.lineText(passwordRow) != "Password:") {
+            result.passwordHidden = false;
+        }
+    };
+
+    // Delivers the output, and times out the predictions, due by 'until'
+    auto advance = [&](Time until) {
+        while (true) {
+            Time next = std::min(predictor.deadline(), arrivals.empty() ? Time::max() : arrivals.begin()->first);
+            if (next > until) {
+                break;
+            }
+            if (!arrivals.empty() && arrivals.begin()->first == next) {
+                screen.write(arrivals.begin()->second.data(), arrivals.begin()->second.length());
+                arrivals.erase(arrivals.begin());
+                predictor.output(next);
+            }
+            predictor.expire(next);
+            draw(next);
+        }
+    };
+
+    screen.write("$ ", 2);
+    Time clock = Time() + std::chrono::seconds(1);
+    for (size_t l = 0; l < sizeof(script) / sizeof(script[0]); l++) {
+        std::string keys = std::string(script[l]) + "\r";
+        advance(clock);
+        bool measured = !shell.password && !shell.caps;
+        if (shell.password) {
+            passwordRow = screen.cursorRow();
+        }
+        int row = screen.cursorRow();
+        int column = screen.cursorColumn();
+        for (size_t k = 0; k < keys.length(); k++) {
+            advance(clock);
+            char key = keys[k];
+            if (key == 0x7f) {
+                column--;
+                waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                    [row, column](const Typed& typed) { return typed.row == row && typed.column >= column; }),
+                    waiting.end());
+            } else if (key != '\r') {
+                if (measured) {
+                    Typed typed = { clock, row, column, key };
+                    waiting.push_back(typed);
+                }
+                column++;
+            }
+            arrivals.insert(std::make_pair(clock + std::chrono::milliseconds(rttMs), shell.key(key)));
+            predictor.input(&key, 1, clock);
+            draw(clock);
+            clock += std::chrono::milliseconds(KEY_INTERVAL_MS);
+        }
+        // The next line is typed once the prompt is back
+        clock += std::chrono::milliseconds(rttMs + THINK_MS);
+    }
+    advance(clock + std::chrono::milliseconds(PREDICT_TIMEOUT_MS + 3 * rttMs));
+
+    result.stats = predictor.statistics();
+    result.settled = waiting.empty() && !screen.hasOverlay();
+    for (int r = 0; r < screen.rows(); r++) {
+        result.settled = result.settled && screen.lineText(r) == console.lineText(r);
+    }
+    std::sort(result.latencies.begin(), result.latencies.end());
+    return result;
+}
+
+static int runPredict(int rttMs) {
+    if (rttMs < 1 || rttMs > 1000) {
+        printf("The round trip must be 1 to 1000 ms\n");
+        return 1;
+    }
+    printf("Typing over a %d ms round trip (virtual time):\n", rttMs);
+    struct Variant {
+        const char* name;
+        PredictMode mode;
+    };
+    Variant variants[] = {
+        { "no prediction:", PREDICT_NEVER },
+        { "adaptive:", PREDICT_ADAPTIVE },
+    };
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        PredictResult result = simulateTyping(rttMs, variants[i].mode);
+        printf("  %-16s keystroke to screen p50 %6.1f ms, p99 %6.1f ms; %llu predicted, %llu shown, %llu wrong\n",
+            variants[i].name, percentile(result.latencies, 0.50), percentile(result.latencies, 0.99),
+            (unsigned long long)result.stats.predicted, (unsigned long long)result.stats.shown,
+            (unsigned long long)result.stats.wrong);
+        if (!result.passwordHidden) {
+            printf("A password character was drawn\n");
+            return 1;
+        }
+        if (!result.settled) {
+            printf("The console doesn't show the screen once the echoes are in\n");
+            return 1;
+        }
+        // Shown only where it helps, and then for most keystrokes; of the
+        // 'caps' line, one wrong guess at most is drawn
+        bool slow = rttMs >= PREDICT_SHOW_RTT_MS;
+        if (variants[i].mode == PREDICT_ADAPTIVE &&
+            (slow ? (percentile(result.latencies, 0.50) > rttMs / 2.0 || result.stats.wrong > 1)
+                  : result.stats.shown != 0)) {
+            printf("Prediction did not behave as expected\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "latency";
+
+    if (mode == "frames") {
+        return runFrameThroughput(argc > 2 ? atoi(argv[2]) : 100);
+    }
+    if (mode == "compress") {
+        return runCompression(argc > 2 ? argv[2] : NULL);
+    }
+    if (mode == "render") {
+        return runRender(argc > 2 ? atoi(argv[2]) : 256);
+    }
+    if (mode == "predict") {
+        return runPredict(argc > 2 ? atoi(argv[2]) : 150);
+    }
+    if (mode != "latency" && mode != "load" && mode != "channels" && mode != "resume" &&
+        mode != "suite") {
+        printf("Usage: kBench latency [server] [iterations]\n");
+        printf("       kBench load [server] [sessions] [rounds]\n");
+        printf("       kBench channels [server] [shells] [rounds] [connections|channels]\n");
+        printf("       kBench resume [server] [reconnects] [kilobytes]\n");
+        printf("       kBench frames [megabytes]\n");
+        printf("       kBench compress [logfile]\n");
+        printf("       kBench render [megabytes]\n");
+        printf("       kBench predict [round trip ms]\n");
+        printf("       kBench suite [--quick] [--output <file>] [--label <text>] [--bulk-mb <MB>]\n");
+        return 1;
+    }
+
+    std::string serverAddress = argc > 2 ? argv[2] : "127.0.0.1";
+
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        printf("WSAStartup failed with error: %d\n", iResult);
+        return 1;
+    }
+
+    int exitCode;
+    if (mode == "suite") {
+        exitCode = runSuite(argc, argv);
+    } else if (mode == "load") {
+        exitCode = runLoad(serverAddress, argc > 3 ? atoi(argv[3]) : 100, argc > 4 ? atoi(argv[4]) : 20);
+    } else if (mode == "channels") {
+        exitCode = runChannels(serverAddress, argc > 3 ? atoi(argv[3]) : 16, argc > 4 ? atoi(argv[4]) : 20,
+            argc > 5 ? argv[5] : "both");
+    } else if (mode == "resume") {
+        exitCode = runResume(serverAddress, argc > 3 ? atoi(argv[3]) : 20, argc > 4 ? atoi(argv[4]) : 256);
+    } else {
+        exitCode = runFirstByteLatency(serverAddress, argc > 3 ? atoi(argv[3]) : 200);
+    }
+
+    WSACleanup();
+    return exitCode;
+}
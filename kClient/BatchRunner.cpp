@@ -0,0 +1,535 @@
+#include "BatchRunner.h"
+#include <algorithm>
+#include <climits>
+#include <filesystem>
+
+static bool connectInProgress() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+static bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.length() >= suffix.length() && text.compare(text.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+BatchRunner::BatchRunner(const std::vector<std::string>& commands) : commands(commands), parallel(BATCH_DEFAULT_PARALLEL),
+    timeoutMs(0), quiet(false) {
+}
+
+BatchRunner::~BatchRunner() {
+    for (size_t i = 0; i < hosts.size(); i++) {
+        finish(*hosts[i], BATCH_UNREACHABLE, "Cancelled");
+    }
+}
+
+void BatchRunner::addHost(const std::string& name) {
+    std::unique_ptr<Host> host(new Host());
+    host->result.host = name;
+    host->result.status = BATCH_OK;
+    host->result.commands = 0;
+    host->result.exitCode = 0;
+    host->result.seconds = 0.0;
+    host->port = DEFAULT_PORT;
+    host->state = HOST_WAITING;
+    host->socket = INVALID_SOCKET;
+    host->addresses = NULL;
+    host->nextAddress = NULL;
+    host->features = 0;
+    host->command = 0;
+    host->echoPending = false;
+    host->output = NULL;
+
+    // A bare IPv6 address has more than one ':' and no port
+    size_t colon = name.rfind(':');
+    if (!name.empty() && name[0] == '[') {
+        size_t close = name.find(']');
+        host->address = name.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+        if (close != std::string::npos && close + 1 < name.length() && name[close + 1] == ':') {
+            host->port = name.substr(close + 2);
+        }
+    } else if (colon != std::string::npos && name.find(':') == colon) {
+        host->address = name.substr(0, colon);
+        host->port = name.substr(colon + 1);
+    } else {
+        host->address = name;
+    }
+    hosts.push_back(std::move(host));
+}
+
+void BatchRunner::setOutputDirectory(const std::string& directory) {
+    outputDirectory = directory;
+}
+
+void BatchRunner::setParallel(int connections) {
+    parallel = std::max(connections, 1);
+}
+
+void BatchRunner::setTimeout(int milliseconds) {
+    timeoutMs = std::max(milliseconds, 0);
+}
+
+void BatchRunner::setQuiet(bool enabled) {
+    quiet = enabled;
+}
+
+void BatchRunner::setLineHandler(BatchLineHandler handler) {
+    lineHandler = handler;
+}
+
+void BatchRunner::setTls(std::shared_ptr<TlsClientContext> context) {
+    tls = context;
+}
+
+std::vector<BatchHostResult> BatchRunner::results() const {
+    std::vector<BatchHostResult> all;
+    for (size_t i = 0; i < hosts.size(); i++) {
+        all.push_back(hosts[i]->result);
+    }
+    return all;
+}
+
+int BatchRunner::run() {
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return BATCH_UNREACHABLE;
+    }
+    if (!outputDirectory.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(outputDirectory, error);
+    }
+    if (tls) {
+        tlsInput.resize(BATCH_TLS_RECEIVE_SIZE);
+        if (!tls->verifies() && !quiet) {
+            fprintf(stderr, "Server certificates are not checked (use --tls-ca or --tls-fingerprint)\n");
+        }
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    std::vector<WSAPOLLFD> fds;
+    std::vector<Host*> polled;
+    size_t next = 0;
+    while (true) {
+        // Hosts start as others finish, so no more than 'parallel' sockets
+        // are open at once
+        size_t active = 0;
+        for (size_t i = 0; i < next; i++) {
+            active += (hosts[i]->state != HOST_DONE) ? 1 : 0;
+        }
+        while (active < (size_t)parallel && next < hosts.size()) {
+            active += startHost(*hosts[next++]) ? 1 : 0;
+        }
+        if (active == 0 && next == hosts.size()) {
+            break;
+        }
+
+        Clock::time_point now = Clock::now();
+        int waitMs = -1;
+        fds.clear();
+        polled.clear();
+        for (size_t i = 0; i < next; i++) {
+            Host& host = *hosts[i];
+            if (host.state == HOST_DONE) {
+                continue;
+            }
+            WSAPOLLFD fd;
+            fd.fd = host.socket;
+            fd.events = POLLIN;
+            if (host.state == HOST_CONNECTING || !host.outgoing.empty()) {
+                fd.events |= POLLOUT;
+            }
+            fd.revents = 0;
+            fds.push_back(fd);
+            polled.push_back(&host);
+            if (host.deadline != Clock::time_point::max()) {
+                long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(host.deadline - now).count();
+                remaining = std::min(std::max(remaining, 0LL), (long long)INT_MAX);
+                if (waitMs < 0 || remaining < waitMs) {
+                    waitMs = (int)remaining;
+                }
+            }
+        }
+
+        if (WSAPoll(fds.data(), (ULONG)fds.size(), waitMs) == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed with error: %d\n", WSAGetLastError());
+            for (size_t i = 0; i < hosts.size(); i++) {
+                finish(*hosts[i], BATCH_UNREACHABLE, "Cancelled");
+            }
+            break;
+        }
+
+        now = Clock::now();
+        for (size_t i = 0; i < polled.size(); i++) {
+            Host& host = *polled[i];
+            short events = fds[i].revents;
+            if (host.state == HOST_CONNECTING && events != 0) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if (getsockopt(host.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0) {
+                    closesocket(host.socket);
+                    host.socket = INVALID_SOCKET;
+                    host.nextAddress = host.nextAddress->ai_next;
+                    connectNext(host);
+                } else {
+                    connected(host);
+                }
+            } else if (events != 0) {
+                if ((events & POLLOUT) && !flushSend(host)) {
+                    finish(host, BATCH_UNREACHABLE, "Connection lost");
+                }
+                if (host.state != HOST_DONE && (events & (POLLIN | POLLERR | POLLHUP))) {
+                    receive(host);
+                }
+            }
+            if (host.state != HOST_DONE && now >= host.deadline) {
+                finish(host, BATCH_UNREACHABLE, host.state == HOST_RUNNING ? "Timed out" : "Connection timed out");
+            }
+        }
+    }
+
+    int status = BATCH_OK;
+    size_t failed = 0;
+    size_t unreachable = 0;
+    for (size_t i = 0; i < hosts.size(); i++) {
+        const BatchHostResult& result = hosts[i]->result;
+        status = std::max(status, (int)result.status);
+        failed += (result.status == BATCH_FAILED) ? 1 : 0;
+        unreachable += (result.status == BATCH_UNREACHABLE) ? 1 : 0;
+        if (result.status != BATCH_OK && !quiet) {
+            fprintf(stderr, "%s: %s\n", result.host.c_str(), result.message.c_str());
+        }
+    }
+    if (!quiet) {
+        fprintf(stderr, "%zu hosts: %zu ok, %zu failed, %zu unreachable in %.3f s\n", hosts.size(),
+            hosts.size() - failed - unreachable, failed, unreachable,
+            std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    WSACleanup();
+    return status;
+}
+
+bool BatchRunner::startHost(Host& host) {
+    // Names are resolved here, one host at a time; connecting is what
+    // happens in parallel
+    host.start = std::chrono::steady_clock::now();
+    host.deadline = host.start + std::chrono::milliseconds(BATCH_CONNECT_TIMEOUT_MS);
+    if (timeoutMs > 0) {
+        host.deadline = std::min(host.deadline, host.start + std::chrono::milliseconds(timeoutMs));
+    }
+    if (!outputDirectory.empty()) {
+        std::string file = host.result.host;
+        std::replace_if(file.begin(), file.end(), [](char c) {
+            return c == ':' || c == '/' || c == '\\' || c == '[' || c == ']';
+        }, '_');
+        host.output = fopen((std::filesystem::path(outputDirectory) / (file + ".log")).string().c_str(), "w");
+        if (!host.output) {
+            finish(host, BATCH_UNREACHABLE, "Unable to write " + file + ".log");
+            return false;
+        }
+    }
+
+    struct addrinfo hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(host.address.c_str(), host.port.c_str(), &hints, &host.addresses) != 0) {
+        host.addresses = NULL;
+        finish(host, BATCH_UNREACHABLE, "Unable to resolve " + host.address);
+        return false;
+    }
+    host.nextAddress = host.addresses;
+    return connectNext(host);
+}
+
+bool BatchRunner::connectNext(Host& host) {
+    for (; host.nextAddress != NULL; host.nextAddress = host.nextAddress->ai_next) {
+        struct addrinfo* address = host.nextAddress;
+        host.socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (host.socket == INVALID_SOCKET) {
+            continue;
+        }
+        BOOL noDelay = TRUE;
+        setsockopt(host.socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+        if (setNonBlocking(host.socket)) {
+            if (connect(host.socket, address->ai_addr, (int)address->ai_addrlen) == 0) {
+                connected(host);
+                return host.state != HOST_DONE;
+            }
+            if (connectInProgress()) {
+                host.state = HOST_CONNECTING;
+                return true;
+            }
+        }
+        closesocket(host.socket);
+        host.socket = INVALID_SOCKET;
+    }
+    finish(host, BATCH_UNREACHABLE, "Unable to connect");
+    return false;
+}
+
+void BatchRunner::connected(Host& host) {
+    freeaddrinfo(host.addresses);
+    host.addresses = NULL;
+    host.nextAddress = NULL;
+    host.state = HOST_HELLO;
+
+    // With TLS the hello waits for the handshake (see decrypt)
+    if (tls) {
+        host.secure.reset(new SecureChannel(*tls, host.address, host.port));
+        host.secure->takeOutput(host.outgoing);
+        if (host.secure->failed() || !flushSend(host)) {
+            finish(host, BATCH_UNREACHABLE, host.secure->failed() ? host.secure->error() : "Connection lost");
+        }
+        return;
+    }
+    if (!sendHello(host)) {
+        finish(host, BATCH_UNREACHABLE, "Connection lost");
+    }
+}
+
+bool BatchRunner::sendHello(Host& host) {
+    HelloPayload hello;
+    hello.version = PROTOCOL_VERSION;
+    hello.features = BATCH_FEATURES;
+    return queueSend(host, makeHelloFrame(hello));
+}
+
+bool BatchRunner::queueSend(Host& host, const std::string& frame) {
+    if (!host.secure) {
+        host.outgoing += frame;
+    } else if (!host.secure->write(frame.data(), frame.length()) || !host.secure->takeOutput(host.outgoing)) {
+        return false;
+    }
+    return flushSend(host);
+}
+
+bool BatchRunner::decrypt(Host& host, size_t length) {
+    // Ciphertext from tlsInput. Once the handshake is done the hello goes
+    // out, after its last message.
+    bool handshaking = !host.secure->handshakeDone();
+    if (!host.secure->receive(tlsInput.data(), length)) {
+        return false;
+    }
+    if (handshaking && host.secure->handshakeDone() && !sendHello(host)) {
+        return false;
+    }
+    size_t decrypted;
+    while ((decrypted = host.secure->read(host.reader.writePtr(), host.reader.writeSpace())) > 0) {
+        host.reader.commit(decrypted);
+    }
+    host.secure->takeOutput(host.outgoing);
+    return flushSend(host) && !host.secure->failed();
+}
+
+bool BatchRunner::flushSend(Host& host) {
+    while (!host.outgoing.empty()) {
+        int sent = send(host.socket, host.outgoing.data(), (int)host.outgoing.length(), 0);
+        if (sent == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        host.outgoing.erase(0, (size_t)sent);
+    }
+    return true;
+}
+
+void BatchRunner::receive(Host& host) {
+    while (host.state != HOST_DONE) {
+        int received = host.secure ? recv(host.socket, tlsInput.data(), (int)tlsInput.size(), 0)
+                                   : recv(host.socket, host.reader.writePtr(), (int)host.reader.writeSpace(), 0);
+        if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            return;
+        }
+        if (received <= 0) {
+            finish(host, BATCH_UNREACHABLE, "Connection closed");
+            return;
+        }
+        if (!host.secure) {
+            host.reader.commit((size_t)received);
+        } else if (!decrypt(host, (size_t)received)) {
+            finish(host, BATCH_UNREACHABLE, host.secure->failed() ? host.secure->error() : "Connection lost");
+            return;
+        }
+
+        // A server from before framing answers the hello with its welcome
+        // text
+        if (host.state == HOST_HELLO && host.reader.bufferedBytes() > 0 && !looksLikeFrame(host.reader.bufferedData(), host.reader.bufferedBytes())) {
+            finish(host, BATCH_UNREACHABLE, "The server does not support batch mode");
+            return;
+        }
+        FrameHeader header;
+        const char* payload;
+        FrameReader::Result result;
+        while (host.state != HOST_DONE && (result = host.reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+            if (!handleFrame(host, header, payload) && host.state != HOST_DONE) {
+                finish(host, BATCH_UNREACHABLE, "Invalid frame from the server");
+            }
+        }
+        if (host.state != HOST_DONE && result == FrameReader::FRAME_INVALID) {
+            finish(host, BATCH_UNREACHABLE, "Invalid frame from the server");
+        }
+    }
+}
+
+bool BatchRunner::handleFrame(Host& host, const FrameHeader& header, const char* payload) {
+    if (host.state == HOST_HELLO) {
+        HelloPayload reply;
+        if (header.type != FRAME_HELLO || !decodeHello(payload, header.length, reply)) {
+            return false;
+        }
+        host.features = reply.features & BATCH_FEATURES;
+        if (!(host.features & FEATURE_COMMANDS)) {
+            finish(host, BATCH_UNREACHABLE, "The server does not support command tracking");
+            return true;
+        }
+        host.state = HOST_RUNNING;
+        host.deadline = timeoutMs > 0 ? host.start + std::chrono::milliseconds(timeoutMs)
+                                      : std::chrono::steady_clock::time_point::max();
+        return sendNext(host);
+    }
+
+    if (header.type == FRAME_OUTPUT) {
+        return handleOutput(host, header, payload);
+    }
+    if (header.type == FRAME_COMMAND) {
+        return handleResult(host, payload, header.length);
+    }
+    if (header.type == FRAME_CHANNEL_CLOSE && header.channel == 0) {
+        std::string reason(payload, header.length);
+        finish(host, BATCH_UNREACHABLE, reason.empty() ? "Shell exited" : reason);
+    }
+    return true;
+}
+
+bool BatchRunner::handleOutput(Host& host, const FrameHeader& header, const char* payload) {
+    const char* message = payload;
+    size_t length = header.length;
+    if (!(host.features & FEATURE_COMPRESSION)) {
+        if (header.flags & FRAME_FLAG_COMPRESSED) {
+            return false;
+        }
+    } else if (!(header.flags & FRAME_FLAG_COMPRESSED)) {
+        host.decompressor.appendHistory(payload, header.length);
+    } else if (!host.decompressor.decompress(payload, header.length, message, length, FRAME_MAX_PAYLOAD)) {
+        return false;
+    }
+
+    // The server's own messages (the welcome) aren't the script's output
+    if (header.stream == STREAM_CONTROL) {
+        return true;
+    }
+    uint64_t captureTime;
+    if ((host.features & FEATURE_OUTPUT_STREAMS) && !decodeOutputTime(message, length, captureTime, message, length)) {
+        return false;
+    }
+    writeOutput(host, header.stream, message, length);
+    return true;
+}
+
+bool BatchRunner::handleResult(Host& host, const char* payload, size_t length) {
+    CommandResultPayload result;
+    if (!decodeCommandResult(payload, length, result)) {
+        return false;
+    }
+    if (result.id != host.command + 1) {
+        return true;
+    }
+
+    // All of the command's output came before its result; a line it left
+    // unfinished ends here, before the prompt
+    for (int i = 0; i < 2; i++) {
+        if (!host.partial[i].empty()) {
+            std::string line;
+            line.swap(host.partial[i]);
+            writeLine(host, (uint8_t)(STREAM_STDOUT + i), line);
+        }
+    }
+    host.result.commands++;
+    host.result.exitCode = result.status == COMMAND_EXITED ? result.exitCode : 0;
+    if (host.result.exitCode != 0) {
+        finish(host, BATCH_FAILED, commands[host.command] + " exited with status " + std::to_string(host.result.exitCode));
+        return true;
+    }
+    host.command++;
+    return sendNext(host);
+}
+
+bool BatchRunner::sendNext(Host& host) {
+    if (host.command >= commands.size()) {
+        finish(host, BATCH_OK, "");
+        return true;
+    }
+    host.echoPending = true;
+    if (!queueSend(host, makeCommandFrame(0, (uint32_t)host.command + 1, commands[host.command]))) {
+        finish(host, BATCH_UNREACHABLE, "Connection lost");
+    }
+    return true;
+}
+
+void BatchRunner::writeOutput(Host& host, uint8_t stream, const char* data, size_t length) {
+    std::string& partial = host.partial[stream == STREAM_STDERR ? 1 : 0];
+    partial.append(data, length);
+    size_t start = 0;
+    size_t newline;
+    while ((newline = partial.find('\n', start)) != std::string::npos) {
+        writeLine(host, stream, partial.substr(start, newline - start));
+        start = newline + 1;
+    }
+    partial.erase(0, start);
+}
+
+void BatchRunner::writeLine(Host& host, uint8_t stream, const std::string& text) {
+    std::string line = text;
+    while (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+
+    // The shell's prompt and its echo of the command come first; a shell
+    // that doesn't echo gets its first line through
+    if (stream == STREAM_STDOUT && host.echoPending) {
+        host.echoPending = false;
+        if (host.command < commands.size() && endsWith(line, commands[host.command])) {
+            return;
+        }
+    }
+    if (lineHandler) {
+        lineHandler(host.result.host, stream, line);
+    } else if (host.output) {
+        fprintf(host.output, "%s\n", line.c_str());
+    } else {
+        fprintf(stream == STREAM_STDERR ? stderr : stdout, "%s: %s\n", host.result.host.c_str(), line.c_str());
+    }
+}
+
+void BatchRunner::finish(Host& host, BatchStatus status, const std::string& message) {
+    // A line left unfinished after the last result is the next prompt,
+    // and isn't written
+    if (host.state == HOST_DONE) {
+        return;
+    }
+    host.state = HOST_DONE;
+    host.result.status = status;
+    host.result.message = message;
+    host.result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - host.start).count();
+    if (host.socket != INVALID_SOCKET) {
+        closesocket(host.socket);
+        host.socket = INVALID_SOCKET;
+    }
+    host.secure.reset();
+    if (host.addresses) {
+        freeaddrinfo(host.addresses);
+        host.addresses = NULL;
+    }
+    if (host.output) {
+        fclose(host.output);
+        host.output = NULL;
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "../platform.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../common.h"
+#include "../FrameProtocol.h"
+#include "../Compression.h"
+#include "../SecureChannel.h"
+
+// Batch mode (--batch): hosts connected at once, at most this many
+#define BATCH_DEFAULT_PARALLEL 256
+
+// What batch mode asks each server for; command tracking is required
+#define BATCH_FEATURES (FEATURE_COMPRESSION | FEATURE_OUTPUT_STREAMS | FEATURE_COMMANDS)
+
+// Longest a host may take to accept the connection and answer the hello
+#define BATCH_CONNECT_TIMEOUT_MS 10000
+
+// TLS: ciphertext is received this much at a time
+#define BATCH_TLS_RECEIVE_SIZE (64 * 1024)
+
+// How a batch run ended, as kClient's exit status
+enum BatchStatus {
+    BATCH_OK = 0,           // Every command on every host exited with 0
+    BATCH_FAILED = 1,       // A command exited with another status
+    BATCH_UNREACHABLE = 2,  // A host couldn't be reached, or dropped out
+};
+
+// How one host's run ended
+struct BatchHostResult {
+    std::string host;
+    BatchStatus status;
+    size_t commands;        // Commands that finished
+    int exitCode;           // Of the last command that finished
+    double seconds;
+    std::string message;    // Why it failed
+};
+
+// Receives each line of output in place of the console: the host as it
+// was given, the stream and the line without its newline
+typedef std::function<void(const std::string& host, uint8_t stream, const std::string& line)> BatchLineHandler;
+
+// Runs the same script on many servers at once from one thread: every
+// connection is non-blocking and served by a single poll() loop, so a run
+// takes as long as its slowest host rather than the sum of them all. Each
+// line of the script is sent as a tracked command (FEATURE_COMMANDS) once
+// the one before it has exited with 0; the first command to fail ends that
+// host's run, as with 'sh -e'. Output goes to stdout and stderr a line at a
+// time with a "host: " prefix, or into one file per host.
+class BatchRunner {
+private:
+    enum HostState {
+        HOST_WAITING,       // Not connected yet
+        HOST_CONNECTING,
+        HOST_HELLO,         // Waiting for the server's hello (after the TLS handshake, with TLS)
+        HOST_RUNNING,
+        HOST_DONE,
+    };
+
+    struct Host {
+        BatchHostResult result;
+        std::string address;
+        std::string port;
+        HostState state;
+        SOCKET socket;
+        struct addrinfo* addresses;     // Still to try
+        struct addrinfo* nextAddress;
+        FrameReader reader;
+        StreamDecompressor decompressor;
+        uint32_t features;
+        std::string outgoing;           // Not yet accepted by the socket (ciphertext, with TLS)
+        std::unique_ptr<SecureChannel> secure;
+        size_t command;                 // Index of the running command
+        bool echoPending;               // Its echo hasn't been seen yet
+        std::string partial[2];         // Unfinished stdout and stderr lines
+        FILE* output;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    std::vector<std::string> commands;
+    std::vector<std::unique_ptr<Host>> hosts;
+    std::string outputDirectory;
+    int parallel;
+    int timeoutMs;
+    bool quiet;
+    BatchLineHandler lineHandler;
+    std::shared_ptr<TlsClientContext> tls;
+    std::vector<char> tlsInput;
+
+    bool startHost(Host& host);
+    bool connectNext(Host& host);
+    void connected(Host& host);
+    bool sendHello(Host& host);
+    bool decrypt(Host& host, size_t length);
+    void receive(Host& host);
+    bool handleFrame(Host& host, const FrameHeader& header, const char* payload);
+    bool handleOutput(Host& host, const FrameHeader& header, const char* payload);
+    bool handleResult(Host& host, const char* payload, size_t length);
+    bool sendNext(Host& host);
+    bool queueSend(Host& host, const std::string& frame);
+    bool flushSend(Host& host);
+    void writeOutput(Host& host, uint8_t stream, const char* data, size_t length);
+    void writeLine(Host& host, uint8_t stream, const std::string& line);
+    void finish(Host& host, BatchStatus status, const std::string& message);
+
+public:
+    BatchRunner(const std::vector<std::string>& commands);
+    ~BatchRunner();
+
+    // "address" or "address:port" ("[address]:port" for IPv6); the port
+    // defaults to DEFAULT_PORT
+    void addHost(const std::string& host);
+
+    // Each host's output goes to <directory>/<host>.log instead of the
+    // console
+    void setOutputDirectory(const std::string& directory);
+    void setParallel(int connections);
+
+    // Longest any host's whole run may take; 0 for no limit
+    void setTimeout(int milliseconds);
+
+    // No summary on stderr
+    void setQuiet(bool quiet);
+
+    // Headless use (kBench)
+    void setLineHandler(BatchLineHandler handler);
+
+    // Connects over TLS, checking servers as the context says; NULL for
+    // plain connections
+    void setTls(std::shared_ptr<TlsClientContext> context);
+
+    // Runs the script everywhere and returns a BatchStatus
+    int run();
+
+    std::vector<BatchHostResult> results() const;
+};
@@ -0,0 +1,202 @@
+#include "ConsoleRenderer.h"
+#include <algorithm>
+#include <cstdio>
+#ifndef _WIN32
+#include <sys/ioctl.h>
+#endif
+
+void consoleSize(int& rows, int& columns) {
+    rows = SCREEN_DEFAULT_ROWS;
+    columns = SCREEN_DEFAULT_COLUMNS;
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+        columns = info.srWindow.Right - info.srWindow.Left + 1;
+    }
+#else
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 && size.ws_col > 0) {
+        rows = size.ws_row;
+        columns = size.ws_col;
+    }
+#endif
+}
+
+ConsoleRenderer::ConsoleRenderer(std::mutex& consoleMutex, std::function<void()> printPrompt) :
+    consoleMutex(consoleMutex), printPrompt(printPrompt), running(false), screenMode(false), predictor(screen),
+    skippedLines(0), rows(SCREEN_DEFAULT_ROWS) {
+}
+
+ConsoleRenderer::~ConsoleRenderer() {
+    stop();
+}
+
+void ConsoleRenderer::start(bool fullScreen) {
+    int columns;
+    consoleSize(rows, columns);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        screenMode = fullScreen;
+        if (screenMode) {
+            screen.resize(rows, columns);
+            predictor.clear();
+            frame = "\x1b[H\x1b[2J";
+        }
+        running = true;
+    }
+    if (!frame.empty()) {
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        fwrite(frame.data(), 1, frame.length(), stdout);
+        fflush(stdout);
+    }
+    thread = std::thread(&ConsoleRenderer::renderLoop, this);
+}
+
+void ConsoleRenderer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        running = false;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void ConsoleRenderer::write(const char* data, size_t length) {
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle = !hasPending();
+        screen.write(data, length);
+        predictor.output(std::chrono::steady_clock::now());
+    }
+    if (idle) {
+        wake.notify_one();
+    }
+}
+
+void ConsoleRenderer::writeText(const std::string& text) {
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle = !hasPending();
+        pendingText += text;
+        if (pendingText.length() > RENDER_MAX_PENDING) {
+            trimPending(rows);
+        }
+    }
+    if (idle) {
+        wake.notify_one();
+    }
+}
+
+void ConsoleRenderer::predict(const char* data, size_t length) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!screenMode) {
+            return;
+        }
+        predictor.input(data, length, std::chrono::steady_clock::now());
+    }
+    // Even with nothing to draw, the render thread has predictions to time out
+    wake.notify_one();
+}
+
+void ConsoleRenderer::setPrediction(PredictMode mode) {
+    std::lock_guard<std::mutex> lock(mutex);
+    predictor.setMode(mode);
+}
+
+PredictStats ConsoleRenderer::predictionStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return predictor.statistics();
+}
+
+bool ConsoleRenderer::hasPending() const {
+    // Caller holds mutex
+    return screenMode ? screen.isDamaged() : !pendingText.empty();
+}
+
+void ConsoleRenderer::trimPending(size_t keepLines) {
+    // Caller holds mutex. Keeps the last 'keepLines' lines, counting a
+    // trailing partial line as one.
+    size_t keep = pendingText.length();
+    size_t lines = 0;
+    if (keep > 0 && pendingText[keep - 1] == '\n') {
+        keep--;
+    }
+    while (lines < keepLines) {
+        size_t newline = keep > 0 ? pendingText.rfind('\n', keep - 1) : std::string::npos;
+        if (newline == std::string::npos) {
+            return;
+        }
+        keep = newline;
+        lines++;
+    }
+    skippedLines += std::count(pendingText.begin(), pendingText.begin() + keep + 1, '\n');
+    pendingText.erase(0, keep + 1);
+}
+
+void ConsoleRenderer::paint(std::unique_lock<std::mutex>& lock) {
+    // Called with mutex held, and returns with it held; the console is
+    // written without it, so output keeps arriving meanwhile
+    frame.clear();
+    if (screenMode) {
+        predictor.expire(std::chrono::steady_clock::now());
+        screen.render(frame);
+    } else if (!pendingText.empty()) {
+        trimPending(rows > 1 ? rows - 1 : 1);
+        frame = "\r";
+        if (skippedLines > 0) {
+            frame += "[" + std::to_string(skippedLines) + " lines skipped]\n";
+            skippedLines = 0;
+        }
+        frame += pendingText;
+        pendingText.clear();
+    }
+    if (frame.empty()) {
+        return;
+    }
+
+    lock.unlock();
+    {
+        std::lock_guard<std::mutex> console(consoleMutex);
+        fwrite(frame.data(), 1, frame.length(), stdout);
+        if (!screenMode && printPrompt) {
+            printPrompt();
+        }
+        fflush(stdout);
+    }
+    lock.lock();
+}
+
+void ConsoleRenderer::renderLoop() {
+    std::chrono::steady_clock::time_point nextFrame = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (running) {
+        // Predicted echo that never comes is taken back when it is due
+        while (running && !hasPending()) {
+            if (predictor.hasPending()) {
+                wake.wait_until(lock, predictor.deadline());
+                predictor.expire(std::chrono::steady_clock::now());
+            } else {
+                wake.wait(lock);
+            }
+        }
+        if (!running) {
+            break;
+        }
+
+        // Changes that arrive within a frame of the last paint wait for the
+        // next one, and are painted together
+        wake.wait_until(lock, nextFrame, [this] { return !running; });
+        paint(lock);
+        nextFrame = std::chrono::steady_clock::now() + std::chrono::milliseconds(RENDER_FRAME_MS);
+    }
+    paint(lock);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "../platform.h"
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include "../TerminalScreen.h"
+#include "InputPredictor.h"
+
+// Longest gap between repaints of a console that keeps changing (about 60
+// frames a second). Output arriving after a quiet spell is shown at once.
+#define RENDER_FRAME_MS 16
+
+// Line mode text waiting for the next frame, beyond which whole lines that
+// could no longer be on screen anyway are dropped
+#define RENDER_MAX_PENDING (256 * 1024)
+
+// Paints the console from its own thread, so the thread receiving output
+// only ever appends to memory. Whatever arrives between two frames is drawn
+// once, at the next one.
+//
+// In screen mode (raw input) output goes through a TerminalScreen and each
+// frame repaints its damage. In line mode (the remote> prompt) a frame
+// prints the pending text; when that is more than a screenful, only the
+// last screenful is printed, after a note of how many lines were skipped.
+// Screen mode also draws the predicted echo of what is typed (see
+// InputPredictor.h), checked against each piece of output as it arrives.
+class ConsoleRenderer {
+private:
+    std::mutex& consoleMutex;   // Held for every write to the console
+    std::function<void()> printPrompt;
+
+    std::mutex mutex;           // Everything below
+    std::condition_variable wake;
+    std::thread thread;
+    bool running;
+    bool screenMode;
+    TerminalScreen screen;
+    InputPredictor predictor;
+    std::string pendingText;
+    uint64_t skippedLines;
+    int rows;
+
+    std::string frame;          // Render thread only
+
+    void renderLoop();
+    bool hasPending() const;
+    void trimPending(size_t keepLines);
+    void paint(std::unique_lock<std::mutex>& lock);
+
+public:
+    // 'printPrompt' is called after each line mode frame, with the console
+    // mutex held
+    ConsoleRenderer(std::mutex& consoleMutex, std::function<void()> printPrompt);
+    ~ConsoleRenderer();
+
+    // Screen mode clears the console and takes it over until stop()
+    void start(bool fullScreen);
+    // Paints what is pending and ends the render thread
+    void stop();
+
+    // Shell output, as the remote terminal would receive it
+    void write(const char* data, size_t length);
+    // A line mode message, printed as it is
+    void writeText(const std::string& text);
+
+    // Screen mode: keystrokes just sent to the shell, whose echo is drawn
+    // ahead of the server's as the mode allows
+    void predict(const char* data, size_t length);
+    void setPrediction(PredictMode mode);
+    PredictStats predictionStats();
+};
+
+// The console's size, or the defaults when it can't be read
+void consoleSize(int& rows, int& columns);
@@ -0,0 +1,198 @@
+#include "DirectorySync.h"
+#include <algorithm>
+
+DirectorySync::DirectorySync(uint16_t id, const std::string& localPath, const std::string& remotePath, Sender send)
+    : id(id), send(send), root(localPath), startTime(std::chrono::steady_clock::now()), stopping(false), finished(false), resolved(0),
+      changed(0), literalBytes(0), matchedBytes(0), wireBytes(0) {
+    result.ok = false;
+    result.localPath = localPath;
+    result.remotePath = remotePath;
+    result.files = 0;
+    result.changed = 0;
+    result.updated = 0;
+    result.literalBytes = 0;
+    result.matchedBytes = 0;
+    result.wireBytes = 0;
+    result.seconds = 0.0;
+}
+
+DirectorySync::~DirectorySync() {
+    finish(NULL, "Cancelled");
+}
+
+bool DirectorySync::scan() {
+    // Regular files only: symbolic links are neither followed nor copied
+    std::error_code failure;
+    if (!std::filesystem::is_directory(root, failure)) {
+        result.message = result.localPath + " is not a directory";
+        return false;
+    }
+    std::filesystem::recursive_directory_iterator it(root, std::filesystem::directory_options::skip_permission_denied, failure);
+    for (; !failure && it != std::filesystem::recursive_directory_iterator(); it.increment(failure)) {
+        std::error_code entryFailure;
+        if (it->is_symlink(entryFailure) || !it->is_regular_file(entryFailure)) {
+            continue;
+        }
+        SyncFile file;
+        file.path = it->path().lexically_relative(root).generic_string();
+        file.size = it->file_size(entryFailure);
+        file.writeTime = syncWriteTime(it->last_write_time(entryFailure));
+        if (!entryFailure && file.path.length() <= 0xFFFF) {
+            files.push_back(file);
+        }
+    }
+    if (failure) {
+        result.message = "Unable to read " + result.localPath + ": " + failure.message();
+        return false;
+    }
+    std::sort(files.begin(), files.end(), [](const SyncFile& a, const SyncFile& b) {
+        return a.path < b.path;
+    });
+    result.files = (uint32_t)files.size();
+    return true;
+}
+
+bool DirectorySync::start(uint16_t channel) {
+    if (!sendFrame(makeSyncFrame(id, SYNC_BEGIN, makeSyncBegin(channel, result.remotePath)))) {
+        return false;
+    }
+    std::string body;
+    for (size_t i = 0; i < files.size(); i++) {
+        appendSyncFile(body, files[i]);
+        if (body.length() >= SYNC_BATCH_BYTES || i + 1 == files.size()) {
+            if (!sendFrame(makeSyncFrame(id, SYNC_FILES, body))) {
+                return false;
+            }
+            body.clear();
+        }
+    }
+    if (!sendFrame(makeSyncFrame(id, SYNC_SCAN))) {
+        return false;
+    }
+
+    // Nothing to wait for
+    return !files.empty() || sendFrame(makeSyncFrame(id, SYNC_END));
+}
+
+bool DirectorySync::sendFrame(const std::string& frame) {
+    wireBytes += frame.length();
+    return send(frame);
+}
+
+bool DirectorySync::handleSignatures(const char* body, size_t length) {
+    std::vector<FileSignature> signatures;
+    if (!decodeFileSignatures(body, length, signatures)) {
+        return false;
+    }
+    for (size_t i = 0; i < signatures.size(); i++) {
+        if (signatures[i].file >= files.size()) {
+            return false;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t i = 0; i < signatures.size(); i++) {
+        if (signatures[i].blockSize == 0) {
+            lock.unlock();
+            resolve();
+            lock.lock();
+        } else {
+            pending.push_back(std::move(signatures[i]));
+        }
+    }
+
+    // The threads start with the first file that has changed, so a tree
+    // that is already up to date costs none
+    if (!pending.empty() && workers.empty() && !stopping) {
+        int threads = syncThreads(files.size());
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(&DirectorySync::encodeFiles, this);
+        }
+    }
+    ready.notify_all();
+    return true;
+}
+
+void DirectorySync::encodeFiles() {
+    while (true) {
+        FileSignature signature;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) {
+                return;
+            }
+            signature = std::move(pending.front());
+            pending.pop_front();
+        }
+        encodeFile(signature);
+        resolve();
+    }
+}
+
+void DirectorySync::encodeFile(const FileSignature& signature) {
+    // A file that can't be read is left as it is on the server; the
+    // server drops whatever of it has arrived when the sync ends
+    const SyncFile& file = files[signature.file];
+    FILE* input = fopen((root / std::filesystem::path(file.path)).string().c_str(), "rb");
+    if (!input) {
+        fail("Unable to read " + file.path);
+        return;
+    }
+    DeltaEncoder encoder(signature);
+    bool ok = encoder.encode(input, [this](const std::string& body) {
+        return !stopping && sendFrame(makeSyncFrame(id, SYNC_DELTA, body));
+    });
+    fclose(input);
+    if (!ok) {
+        fail("Unable to read " + file.path);
+        return;
+    }
+    changed++;
+    literalBytes += encoder.literalBytes;
+    matchedBytes += encoder.matchedBytes;
+    sendFrame(makeSyncFrame(id, SYNC_COMMIT, makeSyncCommit(signature.file, encoder.hash)));
+}
+
+void DirectorySync::resolve() {
+    // Whoever resolves the last file ends the sync
+    if (++resolved == files.size()) {
+        sendFrame(makeSyncFrame(id, SYNC_END));
+    }
+}
+
+void DirectorySync::fail(const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error.empty()) {
+        error = message;
+    }
+}
+
+void DirectorySync::finish(const SyncResultPayload* reply, const std::string& reason) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+    if (finished) {
+        return;
+    }
+    finished = true;
+
+    result.changed = changed;
+    result.literalBytes = literalBytes;
+    result.matchedBytes = matchedBytes;
+    result.wireBytes = wireBytes;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (!reply) {
+        result.message = reason;
+    } else {
+        result.updated = reply->updated;
+        result.ok = reply->status == FILE_OK && error.empty();
+        result.message = !error.empty() ? error : reply->message;
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../FrameProtocol.h"
+#include "../DeltaSync.h"
+
+// How a directory sync (:sync) ended
+struct SyncResult {
+    bool ok;
+    std::string localPath;
+    std::string remotePath;
+    uint32_t files;         // In the local tree
+    uint32_t changed;       // Not up to date on the server, so a delta was sent
+    uint32_t updated;       // Replaced or created by the server
+    uint64_t literalBytes;  // New bytes sent
+    uint64_t matchedBytes;  // Bytes the server took from its own copies
+    uint64_t wireBytes;     // Of every frame the sync sent
+    double seconds;
+    std::string message;    // Why it failed
+};
+
+// The client's end of one directory sync (FEATURE_SYNC): lists the local
+// tree for the server, then, as the server's signatures arrive, encodes a
+// delta of each file that changed on a few threads of its own and sends it
+// through 'send', which must be safe to call from any thread.
+class DirectorySync {
+public:
+    typedef std::function<bool(const std::string& frame)> Sender;
+
+private:
+    uint16_t id;
+    Sender send;
+    std::filesystem::path root;
+    std::vector<SyncFile> files;
+    std::chrono::steady_clock::time_point startTime;
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<FileSignature> pending;  // Files to encode
+    std::vector<std::thread> workers;
+    std::string error;                  // The first local failure
+    std::atomic<bool> stopping;
+    bool finished;
+
+    std::atomic<uint32_t> resolved;     // Files up to date or sent
+    std::atomic<uint32_t> changed;
+    std::atomic<uint64_t> literalBytes;
+    std::atomic<uint64_t> matchedBytes;
+    std::atomic<uint64_t> wireBytes;
+
+    bool sendFrame(const std::string& frame);
+    void encodeFiles();
+    void encodeFile(const FileSignature& signature);
+    void resolve();
+    void fail(const std::string& message);
+
+public:
+    SyncResult result;
+
+    DirectorySync(uint16_t id, const std::string& localPath, const std::string& remotePath, Sender send);
+    ~DirectorySync();
+
+    // Lists the local tree; false, with result.message saying why, if it
+    // can't be read
+    bool scan();
+
+    // Sends SYNC_BEGIN for the tree to land in 'remotePath' relative to the
+    // channel's shell, then the file list
+    bool start(uint16_t channel);
+
+    // Receive thread: a SYNC_SIGNATURES body. False if it is invalid.
+    bool handleSignatures(const char* body, size_t length);
+
+    // Stops the threads and fills in 'result' from the server's SYNC_RESULT,
+    // or with 'reason' if the sync ends without one
+    void finish(const SyncResultPayload* reply, const std::string& reason);
+};
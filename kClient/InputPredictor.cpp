@@ -0,0 +1,186 @@
+#include "InputPredictor.h"
+#include <algorithm>
+
+InputPredictor::InputPredictor(TerminalScreen& screen) : screen(screen), mode(PREDICT_ADAPTIVE), lost(false), epoch(0),
+    confident(false), measured(false), rttMs(0.0) {
+    stats.predicted = 0;
+    stats.shown = 0;
+    stats.confirmed = 0;
+    stats.wrong = 0;
+    stats.rttMs = 0.0;
+}
+
+void InputPredictor::setMode(PredictMode value) {
+    mode = value;
+    reset(false);
+}
+
+bool InputPredictor::slowLink() const {
+    return mode == PREDICT_ALWAYS || (mode == PREDICT_ADAPTIVE && measured && rttMs >= PREDICT_SHOW_RTT_MS);
+}
+
+double InputPredictor::timeoutMs() const {
+    return std::max((double)PREDICT_TIMEOUT_MS, 3.0 * rttMs);
+}
+
+bool InputPredictor::place(Prediction& prediction) const {
+    // Output may have scrolled the row up since; false once it is gone
+    uint64_t scrolled = screen.linesScrolled() - prediction.scrolled;
+    if (scrolled > (uint64_t)prediction.row) {
+        return false;
+    }
+    prediction.row -= (int)scrolled;
+    prediction.scrolled = screen.linesScrolled();
+    return true;
+}
+
+void InputPredictor::reset(bool wrong) {
+    // A prediction that was drawn and turned out wrong costs the rest of
+    // them their place on screen until one is confirmed again
+    if (wrong) {
+        stats.wrong++;
+    }
+    pending.clear();
+    lost = false;
+    epoch++;
+    confident = false;
+    publish();
+}
+
+void InputPredictor::publish() {
+    std::vector<ScreenOverlayCell> cells;
+    int cursorRow = 0;
+    int cursorColumn = 0;
+    bool slow = slowLink();
+    for (std::deque<Prediction>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        if (!place(*it) || it->tentative || !slow) {
+            continue;
+        }
+        if (!it->shown) {
+            it->shown = true;
+            stats.shown++;
+        }
+        ScreenOverlayCell cell;
+        cell.row = it->row;
+        cell.column = it->column;
+        cell.cell = it->cell;
+        cells.push_back(cell);
+        cursorRow = it->row;
+        cursorColumn = it->column + 1;
+    }
+    if (!cells.empty() || screen.hasOverlay()) {
+        screen.setOverlay(cells, cursorRow, cursorColumn);
+    }
+}
+
+void InputPredictor::input(const char* data, size_t length, std::chrono::steady_clock::time_point now) {
+    if (mode == PREDICT_NEVER) {
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        unsigned char byte = (unsigned char)data[i];
+        if (byte >= 0x20 && byte < 0x7f && !lost && pending.size() < PREDICT_MAX_PENDING) {
+            // Echoed where the cursor will be by then: after the pending
+            // predictions, or where it is now
+            Prediction prediction;
+            if (pending.empty()) {
+                prediction.row = screen.cursorRow();
+                prediction.column = screen.cursorColumn();
+            } else {
+                prediction.row = pending.back().row;
+                prediction.column = pending.back().column + 1;
+            }
+            // Wrapping onto the next row isn't worth guessing at
+            if (prediction.column < screen.columns() - 1) {
+                prediction.cell = screen.penCell(byte);
+                prediction.scrolled = screen.linesScrolled();
+                prediction.sent = now;
+                prediction.epoch = epoch;
+                prediction.tentative = !confident;
+                prediction.shown = false;
+                pending.push_back(prediction);
+                stats.predicted++;
+                continue;
+            }
+        }
+
+        // Enter, Backspace, a control key, an escape sequence or anything
+        // else may change how what follows is echoed, or move the cursor
+        // where it can't be followed: what is typed next is predicted out
+        // of sight until the server's output bears it out
+        epoch++;
+        confident = false;
+        lost = !pending.empty();
+    }
+    publish();
+}
+
+void InputPredictor::output(std::chrono::steady_clock::time_point now) {
+    if (pending.empty()) {
+        return;
+    }
+    while (!pending.empty()) {
+        Prediction& prediction = pending.front();
+        if (!place(prediction)) {
+            pending.pop_front();
+            continue;
+        }
+
+        // The echo moves the cursor past the cell; until it has, the cell
+        // may still show what was there before
+        int row = screen.cursorRow();
+        if (row < prediction.row || (row == prediction.row && screen.cursorColumn() <= prediction.column)) {
+            break;
+        }
+        if (screen.cellAt(prediction.row, prediction.column).ch != prediction.cell.ch) {
+            // Every prediction after it was made on the same assumption
+            reset(prediction.shown);
+            return;
+        }
+
+        double sample = std::chrono::duration<double, std::milli>(now - prediction.sent).count();
+        rttMs = measured ? 0.875 * rttMs + 0.125 * sample : sample;
+        measured = true;
+        stats.rttMs = rttMs;
+        stats.confirmed++;
+        uint64_t confirmedEpoch = prediction.epoch;
+        pending.pop_front();
+        // Echo of one typed before the last unpredicted key says nothing
+        // about what follows it
+        if (!confident && confirmedEpoch == epoch) {
+            confident = true;
+            for (std::deque<Prediction>::iterator it = pending.begin(); it != pending.end(); ++it) {
+                it->tentative = false;
+            }
+        }
+    }
+    if (pending.empty()) {
+        lost = false;
+    }
+    publish();
+}
+
+void InputPredictor::expire(std::chrono::steady_clock::time_point now) {
+    if (!pending.empty() && now >= deadline()) {
+        // Nothing echoed: a password prompt, or a program reading keys
+        bool shown = false;
+        for (std::deque<Prediction>::iterator it = pending.begin(); it != pending.end(); ++it) {
+            shown = shown || it->shown;
+        }
+        reset(shown);
+    }
+}
+
+std::chrono::steady_clock::time_point InputPredictor::deadline() const {
+    if (pending.empty()) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    return pending.front().sent +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(timeoutMs()));
+}
+
+void InputPredictor::clear() {
+    pending.clear();
+    lost = false;
+    confident = false;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "../TerminalScreen.h"
+
+// Predictions are shown once echoes take this long to come back (smoothed);
+// below it the console keeps up with typing anyway
+#define PREDICT_SHOW_RTT_MS 30
+
+// A prediction not confirmed within this long, or three round trips if
+// that is longer, was wrong (a prompt that doesn't echo)
+#define PREDICT_TIMEOUT_MS 1000
+
+// Keystrokes predicted ahead of the server at most
+#define PREDICT_MAX_PENDING 256
+
+// When kClient --raw shows predicted echo (--predict)
+enum PredictMode {
+    PREDICT_ADAPTIVE,   // Once the link is slow enough for it to matter
+    PREDICT_ALWAYS,
+    PREDICT_NEVER,
+};
+
+struct PredictStats {
+    uint64_t predicted;     // Keystrokes given a prediction
+    uint64_t shown;         // Of those, drawn before their echo came
+    uint64_t confirmed;     // The echo matched
+    uint64_t wrong;         // Drawn, then taken back
+    double rttMs;           // Smoothed keystroke to echo time
+};
+
+// Speculative local echo for raw mode, after mosh: typed characters are
+// drawn on a TerminalScreen's overlay where the cursor would put them, then
+// checked against the server's output as it arrives. A cell that now
+// shows the predicted character confirms it; a cell the cursor has passed
+// without showing it, or a prediction that times out, proves it wrong.
+//
+// Predictions start out hidden after anything that may change how input is
+// echoed (Enter, a control key, an escape sequence, a wrong guess), and are
+// only drawn once one of them has been confirmed. Password prompts, pagers
+// and editors never confirm any, so what is typed into them never appears.
+// Only printable ASCII is predicted, and only up to the end of the row;
+// the screen is never changed, only drawn over.
+//
+// Not thread-safe: ConsoleRenderer calls it under its own lock.
+class InputPredictor {
+private:
+    struct Prediction {
+        int row;
+        int column;
+        ScreenCell cell;
+        uint64_t scrolled;      // screen.linesScrolled() when it was made
+        std::chrono::steady_clock::time_point sent;
+        uint64_t epoch;
+        bool tentative;         // Made before any of its epoch was confirmed
+        bool shown;             // Drawn at some point
+    };
+
+    TerminalScreen& screen;
+    PredictMode mode;
+    std::deque<Prediction> pending;
+    bool lost;                  // A key that wasn't predicted is behind the pending ones
+    uint64_t epoch;             // Advanced by every key that wasn't predicted
+    bool confident;             // A prediction of this epoch has been confirmed
+    bool measured;
+    double rttMs;
+    PredictStats stats;
+
+    bool slowLink() const;
+    double timeoutMs() const;
+    void reset(bool wrong);
+    void publish();
+    bool place(Prediction& prediction) const;
+
+public:
+    InputPredictor(TerminalScreen& screen);
+
+    void setMode(PredictMode mode);
+
+    // Keystrokes the client has just sent
+    void input(const char* data, size_t length, std::chrono::steady_clock::time_point now);
+
+    // Checks the predictions against the screen, after output was written
+    // to it
+    void output(std::chrono::steady_clock::time_point now);
+
+    // Takes back predictions whose echo is overdue
+    void expire(std::chrono::steady_clock::time_point now);
+
+    // When the oldest prediction times out; time_point::max() with none
+    std::chrono::steady_clock::time_point deadline() const;
+
+    // The screen was cleared and resized under the predictions
+    void clear();
+
+    bool hasPending() const { return !pending.empty(); }
+    const PredictStats& statistics() const { return stats; }
+};
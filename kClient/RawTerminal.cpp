@@ -0,0 +1,123 @@
+#include "RawTerminal.h"
+
+RawTerminal::RawTerminal() : active(false) {
+#ifdef _WIN32
+    input = GetStdHandle(STD_INPUT_HANDLE);
+    output = GetStdHandle(STD_OUTPUT_HANDLE);
+    savedInputMode = 0;
+    savedOutputMode = 0;
+#endif
+}
+
+RawTerminal::~RawTerminal() {
+    restore();
+}
+
+#ifdef _WIN32
+
+bool RawTerminal::enable() {
+    if (!GetConsoleMode(input, &savedInputMode) || !GetConsoleMode(output, &savedOutputMode)) {
+        return false;
+    }
+
+    // Keys arrive as VT sequences (arrows, function keys) and output escape
+    // sequences are interpreted, as on a POSIX terminal
+    DWORD inputMode = (savedInputMode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT)) |
+        ENABLE_VIRTUAL_TERMINAL_INPUT;
+    DWORD outputMode = savedOutputMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN;
+    if (!SetConsoleMode(input, inputMode) || !SetConsoleMode(output, outputMode)) {
+        SetConsoleMode(input, savedInputMode);
+        return false;
+    }
+    active = true;
+    return true;
+}
+
+void RawTerminal::restore() {
+    if (active) {
+        SetConsoleMode(input, savedInputMode);
+        SetConsoleMode(output, savedOutputMode);
+        active = false;
+    }
+}
+
+int RawTerminal::read(char* buffer, size_t size, int timeoutMs) {
+    // The handle is signalled for any console event; only key presses
+    // with a character carry input
+    DWORD wait = WaitForSingleObject(input, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
+    if (wait == WAIT_TIMEOUT) {
+        return 0;
+    }
+    if (wait != WAIT_OBJECT_0) {
+        return -1;
+    }
+
+    INPUT_RECORD records[256];
+    DWORD count;
+    if (!ReadConsoleInputA(input, records, 256, &count)) {
+        return -1;
+    }
+    size_t length = 0;
+    for (DWORD i = 0; i < count; i++) {
+        const KEY_EVENT_RECORD& key = records[i].Event.KeyEvent;
+        if (records[i].EventType != KEY_EVENT || !key.bKeyDown || key.uChar.AsciiChar == 0) {
+            continue;
+        }
+        for (WORD r = 0; r < key.wRepeatCount && length < size; r++) {
+            buffer[length++] = key.uChar.AsciiChar;
+        }
+    }
+    return (int)length;
+}
+
+#else
+
+bool RawTerminal::enable() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0) {
+        return false;
+    }
+
+    // As cfmakeraw(), which isn't everywhere: Ctrl-C and friends become
+    // bytes for the remote terminal, and reads return what has been typed
+    struct termios raw = saved;
+    raw.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    raw.c_oflag &= ~OPOST;
+    raw.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    raw.c_cflag &= ~(CSIZE | PARENB);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        return false;
+    }
+    active = true;
+    return true;
+}
+
+void RawTerminal::restore() {
+    if (active) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+        active = false;
+    }
+}
+
+int RawTerminal::read(char* buffer, size_t size, int timeoutMs) {
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, timeoutMs);
+    if (ready == 0 || (ready < 0 && errno == EINTR)) {
+        return 0;
+    }
+    if (ready < 0) {
+        return -1;
+    }
+    ssize_t bytes = ::read(STDIN_FILENO, buffer, size);
+    if (bytes < 0 && errno == EINTR) {
+        return 0;
+    }
+    return bytes > 0 ? (int)bytes : -1;
+}
+
+#endif
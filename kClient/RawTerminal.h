@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../platform.h"
+#include <cstddef>
+#ifndef _WIN32
+#include <termios.h>
+#endif
+
+// The local console in raw mode (kClient --raw): keystrokes are read as
+// they are typed, without line editing, echo or signals, and output is
+// written untranslated, so the remote terminal does all of that instead.
+class RawTerminal {
+private:
+#ifdef _WIN32
+    HANDLE input;
+    HANDLE output;
+    DWORD savedInputMode;
+    DWORD savedOutputMode;
+#else
+    struct termios saved;
+#endif
+    bool active;
+
+public:
+    RawTerminal();
+    ~RawTerminal();
+
+    bool enable();
+    void restore();
+
+    // Waits up to 'timeoutMs' (-1: indefinitely) for input and reads what
+    // has arrived. Returns the byte count, 0 on timeout, -1 once input ends.
+    int read(char* buffer, size_t size, int timeoutMs);
+};
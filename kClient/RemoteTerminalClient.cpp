@@ -1,6 +1,30 @@
 #include "RemoteTerminalClient.h"
+#include "../Checksum.h"
+#include <algorithm>
+#include <ctime>
+#ifdef _WIN32
+#include <io.h>
+#endif
 
-RemoteTerminalClient::RemoteTerminalClient() : ConnectSocket(INVALID_SOCKET), connected(false), shouldStop(false) {}
+// Line mode shows stderr in red (STDERR_COLOR)
+#define STDERR_COLOR_START "\x1b[31m"
+#define STDERR_COLOR_END "\x1b[0m"
+
+static std::string formatCaptureTime(uint64_t captureTime) {
+    // The same "[HH:MM:SS] " the server puts on output without capture times
+    std::time_t seconds = (std::time_t)(captureTime / 1000000);
+    struct tm timeinfo;
+    localtime_s(&timeinfo, &seconds);
+    char buffer[32];
+    return std::string(buffer, std::strftime(buffer, sizeof(buffer), "[%H:%M:%S] ", &timeinfo));
+}
+
+RemoteTerminalClient::RemoteTerminalClient() : ConnectSocket(INVALID_SOCKET), connected(false), shouldStop(false), framed(false),
+    requestedFeatures(CLIENT_FEATURES), features(0), activeChannel(0), nextChannel(1), reconnecting(false),
+    rawTerminal(false), screenRows(0), screenColumns(0), stderrMode(STDERR_COLOR), renderer(outputMutex, [this] { printPrompt(); }), nextTransfer(1),
+    nextCommand(1) {
+    openChannels.insert(0);
+}
 
 RemoteTerminalClient::~RemoteTerminalClient() {
     cleanup();
@@ -16,7 +40,75 @@ bool RemoteTerminalClient::initialize() {
     return true;
 }
 
-bool RemoteTerminalClient::connectToServer(const std::string& serverAddress) {
+void RemoteTerminalClient::setRequestedFeatures(uint32_t requested) {
+    requestedFeatures = requested;
+}
+
+void RemoteTerminalClient::setStderrMode(StderrMode mode) {
+    stderrMode = mode;
+}
+
+void RemoteTerminalClient::setPredictMode(PredictMode mode) {
+    renderer.setPrediction(mode);
+}
+
+void RemoteTerminalClient::setScreenSize(int rows, int columns) {
+    screenRows = rows;
+    screenColumns = columns;
+}
+
+void RemoteTerminalClient::setTls(std::shared_ptr<TlsClientContext> context) {
+    tlsContext = context;
+}
+
+std::string RemoteTerminalClient::tlsDescription() {
+    std::lock_guard<std::mutex> lock(tlsMutex);
+    return secure ? secure->describe() : "";
+}
+
+void RemoteTerminalClient::setOutputHandler(OutputHandler handler) {
+    outputHandler = handler;
+}
+
+void RemoteTerminalClient::setTransferHandler(TransferHandler handler) {
+    transferHandler = handler;
+}
+
+void RemoteTerminalClient::setSyncHandler(SyncHandler handler) {
+    syncHandler = handler;
+}
+
+void RemoteTerminalClient::setCommandHandler(CommandHandler handler) {
+    commandHandler = handler;
+}
+
+void RemoteTerminalClient::setSearchHandler(SearchHandler handler) {
+    searchHandler = handler;
+}
+
+bool RemoteTerminalClient::connectToServer(const std::string& address, const std::string& port) {
+    serverAddress = address;
+    serverPort = port;
+    ConnectSocket = openConnection();
+    if (ConnectSocket == INVALID_SOCKET) {
+        printf("Unable to connect to server!\n");
+        return false;
+    }
+
+    connected = true;
+    if (!outputHandler) {
+        printf("Connected to server at %s:%s\n", serverAddress.c_str(), serverPort.c_str());
+    }
+
+    if (!negotiateProtocol()) {
+        printf("Protocol negotiation failed\n");
+        connected = false;
+        return false;
+    }
+    return true;
+}
+
+SOCKET RemoteTerminalClient::openConnection() {
     struct addrinfo hints;
     ZeroMemory(&hints, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -25,121 +117,1387 @@ bool RemoteTerminalClient::connectToServer(const std::string& serverAddress) {
 
     // Resolve the server address and port
     struct addrinfo* result = NULL;
-    int iResult = getaddrinfo(serverAddress.c_str(), DEFAULT_PORT, &hints, &result);
+    int iResult = getaddrinfo(serverAddress.c_str(), serverPort.c_str(), &hints, &result);
     if (iResult != 0) {
         printf("getaddrinfo failed with error: %d\n", iResult);
-        WSACleanup();
-        return false;
+        return INVALID_SOCKET;
     }
 
     // Attempt to connect to an address until one succeeds
+    SOCKET connectSocket = INVALID_SOCKET;
     for (struct addrinfo* ptr = result; ptr != NULL; ptr = ptr->ai_next) {
         // Create a SOCKET for connecting to server
-        ConnectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-        if (ConnectSocket == INVALID_SOCKET) {
+        connectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+        if (connectSocket == INVALID_SOCKET) {
             printf("socket failed with error: %d\n", WSAGetLastError());
-            WSACleanup();
-            return false;
+            break;
         }
 
         // Connect to server
-        iResult = connect(ConnectSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
+        iResult = connect(connectSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
         if (iResult == SOCKET_ERROR) {
-            closesocket(ConnectSocket);
-            ConnectSocket = INVALID_SOCKET;
+            closesocket(connectSocket);
+            connectSocket = INVALID_SOCKET;
             continue;
         }
         break;
     }
 
     freeaddrinfo(result);
+    if (connectSocket != INVALID_SOCKET) {
+        // A command must not wait in the Nagle buffer behind an unanswered
+        // window grant
+        BOOL noDelay = TRUE;
+        setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    }
+    return connectSocket;
+}
 
-    if (ConnectSocket == INVALID_SOCKET) {
-        printf("Unable to connect to server!\n");
-        WSACleanup();
+bool RemoteTerminalClient::startTls() {
+    // A ticket from an earlier connection to the server makes this a
+    // resumed handshake
+    std::unique_ptr<SecureChannel> channel(new SecureChannel(*tlsContext, serverAddress, serverPort));
+    {
+        std::lock_guard<std::mutex> sendLock(sendMutex);
+        std::lock_guard<std::mutex> lock(tlsMutex);
+        secure = std::move(channel);
+    }
+    tlsInput.resize(TLS_RECEIVE_SIZE);
+    while (!secure->handshakeDone() && !secure->failed()) {
+        flushTls();
+        int iResult = recv(ConnectSocket, tlsInput.data(), (int)tlsInput.size(), 0);
+        if (iResult <= 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(tlsMutex);
+        secure->receive(tlsInput.data(), iResult);
+    }
+    // The last handshake message, or an alert saying why it failed
+    flushTls();
+    if (secure->failed()) {
+        printf("%s\n", secure->error().c_str());
         return false;
     }
 
-    connected = true;
-    printf("Connected to server at %s:%s\n", serverAddress.c_str(), DEFAULT_PORT);
+    if (!outputHandler && !reconnecting) {
+        printf("Encrypted with %s\n", secure->describe().c_str());
+        if (!tlsContext->verifies()) {
+            printf("Server certificate not checked; its fingerprint is %s (pin it with --tls-fingerprint)\n",
+                secure->peerFingerprint().c_str());
+        }
+    }
+    return true;
+}
+
+void RemoteTerminalClient::flushTls() {
+    // TLS messages of the protocol's own: the handshake, alerts, key updates
+    std::lock_guard<std::mutex> sendLock(sendMutex);
+    std::string sealed;
+    {
+        std::lock_guard<std::mutex> lock(tlsMutex);
+        secure->takeOutput(sealed);
+    }
+    if (!sealed.empty()) {
+        send(ConnectSocket, sealed.c_str(), (int)sealed.length(), 0);
+    }
+}
+
+int RemoteTerminalClient::receiveInput() {
+    // Like recv() into the reader. With TLS, whatever has been decrypted
+    // already comes first; a failed connection reads as closed.
+    if (!tlsContext) {
+        int iResult = recv(ConnectSocket, reader.writePtr(), (int)reader.writeSpace(), 0);
+        if (iResult > 0) {
+            reader.commit(iResult);
+        }
+        return iResult;
+    }
+    while (true) {
+        bool replies;
+        {
+            std::lock_guard<std::mutex> lock(tlsMutex);
+            size_t length = secure->read(reader.writePtr(), reader.writeSpace());
+            if (length > 0) {
+                reader.commit(length);
+                return (int)length;
+            }
+            if (secure->failed()) {
+                printStatus(secure->error());
+                return 0;
+            }
+            replies = secure->hasOutput();
+        }
+        if (replies) {
+            flushTls();
+        }
+        int iResult = recv(ConnectSocket, tlsInput.data(), (int)tlsInput.size(), 0);
+        if (iResult <= 0) {
+            return iResult;
+        }
+        std::lock_guard<std::mutex> lock(tlsMutex);
+        secure->receive(tlsInput.data(), iResult);
+    }
+}
+
+bool RemoteTerminalClient::sendBytes(const std::string& data) {
+    // Under sendMutex, or while no other thread sends (negotiation). Over
+    // TLS nothing goes out unencrypted, even after a failed reconnect.
+    if (!tlsContext) {
+        return send(ConnectSocket, data.c_str(), (int)data.length(), 0) != SOCKET_ERROR;
+    }
+    std::string sealed;
+    {
+        std::lock_guard<std::mutex> lock(tlsMutex);
+        if (!secure || !secure->write(data.data(), data.length())) {
+            return false;
+        }
+        secure->takeOutput(sealed);
+    }
+    return send(ConnectSocket, sealed.c_str(), (int)sealed.length(), 0) != SOCKET_ERROR;
+}
+
+bool RemoteTerminalClient::negotiateProtocol() {
+    if (tlsContext && !startTls()) {
+        return false;
+    }
+
+    // Reattaching: tell the server which session, and how far each
+    // channel's output got
+    HelloPayload hello;
+    hello.version = PROTOCOL_VERSION;
+    hello.features = requestedFeatures;
+    hello.token = sessionToken;
+    if (!sessionToken.empty()) {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        for (std::set<uint16_t>::iterator it = openChannels.begin(); it != openChannels.end(); ++it) {
+            StreamOffset offset = { *it, received[*it] };
+            hello.offsets.push_back(offset);
+        }
+    }
+    std::string helloFrame = makeHelloFrame(hello);
+    if (!sendBytes(helloFrame)) {
+        printf("send failed with error: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    // The server's first bytes tell us which protocol it speaks: a framed
+    // server answers with FRAME_HELLO, a legacy one with its welcome text
+    if (receiveInput() <= 0) {
+        return false;
+    }
+
+    if (!looksLikeFrame(reader.bufferedData(), reader.bufferedBytes())) {
+        if (!outputHandler) {
+            printf("Server does not support framing, using legacy marker mode\n");
+        }
+        return true;
+    }
+
+    FrameHeader header;
+    const char* payload;
+    FrameReader::Result result;
+    while ((result = reader.nextFrame(header, payload)) == FrameReader::FRAME_INCOMPLETE) {
+        if (receiveInput() <= 0) {
+            return false;
+        }
+    }
+
+    HelloPayload reply;
+    if (result != FrameReader::FRAME_READY || header.type != FRAME_HELLO ||
+        !decodeHello(payload, header.length, reply)) {
+        return false;
+    }
+
+    framed = true;
+    features = reply.features & requestedFeatures;
+    if ((features & FEATURE_SCREEN_SYNC) && !sendScreenSize()) {
+        return false;
+    }
+    if (!sessionToken.empty()) {
+        applyResume(reply);
+        return true;
+    }
+    if ((features & FEATURE_COMPRESSION) && !outputHandler) {
+        printf("Output compression enabled\n");
+    }
+    if ((features & FEATURE_CHANNELS) && !outputHandler) {
+        printf("Channels enabled, type :help for channel commands\n");
+    }
+    if (features & FEATURE_RESUME) {
+        sessionToken = reply.token;
+    }
+    return true;
+}
+
+void RemoteTerminalClient::applyResume(const HelloPayload& reply) {
+    // The reply lists the session's channels and where each replay starts
+    std::set<uint16_t> previous;
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        previous = openChannels;
+        openChannels.clear();
+        openChannels.insert(0);
+    }
+    received.clear();
+
+    if (!(features & FEATURE_RESUME) || reply.token != sessionToken) {
+        // The server no longer has the session (it expired or restarted)
+        sessionToken = (features & FEATURE_RESUME) ? reply.token : "";
+        activeChannel = 0;
+        printStatus("The previous session has ended, started a new one");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        for (size_t i = 0; i < reply.offsets.size(); i++) {
+            openChannels.insert(reply.offsets[i].channel);
+            received[reply.offsets[i].channel] = reply.offsets[i].offset;
+        }
+    }
+    for (std::set<uint16_t>::iterator it = previous.begin(); it != previous.end(); ++it) {
+        if (!received.count(*it)) {
+            printStatus("Channel " + std::to_string(*it) + " closed while disconnected");
+            if (activeChannel == *it) {
+                activeChannel = 0;
+            }
+        }
+    }
+    printStatus("Reconnected, session resumed");
+}
+
+bool RemoteTerminalClient::sendData(const std::string& data) {
+    std::lock_guard<std::mutex> lock(sendMutex);
+    if (reconnecting) {
+        // Window grants are moot on a new connection; the server starts
+        // with a full window
+        return true;
+    }
+    if (!sendBytes(data)) {
+        printf("send failed with error: %d\n", WSAGetLastError());
+        if (!sessionToken.empty()) {
+            // Wake the receive thread, which reconnects
+            shutdown(ConnectSocket, SD_BOTH);
+            return true;
+        }
+        return false;
+    }
     return true;
 }
 
-bool RemoteTerminalClient::sendCommand(const std::string& command) {
+bool RemoteTerminalClient::sendCommand(uint16_t channel, const std::string& command) {
     if (!connected) {
         printf("Not connected to server\n");
         return false;
     }
+    if (reconnecting) {
+        printStatus("Reconnecting, command not sent");
+        return true;
+    }
 
     // Send the command
-    int iResult = send(ConnectSocket, command.c_str(), (int)command.length(), 0);
-    if (iResult == SOCKET_ERROR) {
-        printf("send failed with error: %d\n", WSAGetLastError());
+    if (!framed) {
+        return sendData(command);
+    }
+    return sendData(makeFrame(FRAME_INPUT, STREAM_STDIN, command.c_str(), command.length(), 0, channel));
+}
+
+bool RemoteTerminalClient::runCommand(uint16_t channel, const std::string& command) {
+    if (!connected) {
+        printf("Not connected to server\n");
+        return false;
+    }
+    if (reconnecting) {
+        printStatus("Reconnecting, command not sent");
+        return true;
+    }
+    uint32_t id;
+    {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        id = nextCommand++;
+        runningCommands[id] = command;
+    }
+    return sendData(makeCommandFrame(channel, id, command));
+}
+
+bool RemoteTerminalClient::searchHistory(uint16_t channel, SearchRequest request) {
+    if (!connected) {
+        printf("Not connected to server\n");
+        return false;
+    }
+    if (reconnecting) {
+        printStatus("Reconnecting, search not started");
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        request.id = nextCommand++;
+        Search& search = searches[request.id];
+        search.report.channel = channel;
+        search.report.pattern = request.pattern;
+        search.report.result = SearchResultPayload();
+        search.report.wireBytes = 0;
+        search.report.seconds = 0;
+        search.lastShown = 0;
+        search.startTime = std::chrono::steady_clock::now();
+    }
+    return sendData(makeSearchRequestFrame(channel, request));
+}
+
+bool RemoteTerminalClient::sendInput(uint16_t channel, const char* data, size_t length) {
+    if (!connected) {
         return false;
     }
+    if (reconnecting) {
+        // Typed into a connection that isn't there; the shell never sees it
+        return true;
+    }
+    return sendData(makeFrame(FRAME_INPUT, STREAM_STDIN, data, length, 0, channel));
+}
+
+static std::string baseName(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+bool RemoteTerminalClient::handleLocalCommand(const std::string& line) {
+    // Channel commands start with ':'; returns false if the connection failed
+    std::string name = line.substr(0, line.find(' '));
+    std::string argument = (name.length() < line.length()) ? line.substr(name.length() + 1) : "";
+
+    if (name == ":put" || name == ":get") {
+        std::string source = argument.substr(0, argument.find(' '));
+        std::string target = (source.length() < argument.length()) ? argument.substr(source.length() + 1) : baseName(source);
+        if (!(features & FEATURE_FILE_TRANSFER)) {
+            printStatus("The server does not support file transfer");
+        } else if (source.empty()) {
+            printStatus("Usage: " + name + " <file> [destination]");
+        } else if (name == ":put") {
+            putFile(source, target);
+        } else {
+            getFile(source, target);
+        }
+        return true;
+    }
 
+    if (name == ":sync") {
+        std::string source = argument.substr(0, argument.find(' '));
+        std::string target = (source.length() < argument.length()) ? argument.substr(source.length() + 1) : "";
+        while (source.length() > 1 && (source.back() == '/' || source.back() == '\\')) {
+            source.pop_back();
+        }
+        if (!(features & FEATURE_SYNC)) {
+            printStatus("The server does not support sync");
+        } else if (source.empty()) {
+            printStatus("Usage: :sync <directory> [destination]");
+        } else {
+            syncDirectory(source, target.empty() ? baseName(source) : target);
+        }
+        return true;
+    }
+
+    if (name == ":run") {
+        if (!(features & FEATURE_COMMANDS)) {
+            printStatus("The server does not support command tracking");
+        } else if (argument.empty()) {
+            printStatus("Usage: :run <command>");
+        } else {
+            return runCommand(activeChannel, argument);
+        }
+        return true;
+    }
+
+    if (name == ":search") {
+        if (!(features & FEATURE_SEARCH)) {
+            printStatus("The server does not support search");
+            return true;
+        }
+        return startSearch(argument);
+    }
+
+    if (!(features & FEATURE_CHANNELS)) {
+        printStatus("The server does not support channels");
+        return true;
+    }
+
+    if (name == ":open") {
+        // Ids are never reused within a connection, so late output can't
+        // land on a newer channel
+        uint16_t channel = nextChannel++;
+        printStatus("Opening channel " + std::to_string(channel));
+        return sendData(makeFrame(FRAME_CHANNEL_OPEN, STREAM_CONTROL, NULL, 0, 0, channel));
+    }
+
+    if (name == ":close" || name == ":ch") {
+        int channel = argument.empty() ? (int)activeChannel : atoi(argument.c_str());
+        bool open;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            open = openChannels.count((uint16_t)channel) != 0;
+        }
+        if (!open) {
+            printStatus("No channel " + argument);
+        } else if (name == ":ch") {
+            activeChannel = (uint16_t)channel;
+        } else if (channel == 0) {
+            printStatus("Channel 0 closes with the connection, use 'exit'");
+        } else {
+            return sendData(makeFrame(FRAME_CHANNEL_CLOSE, STREAM_CONTROL, NULL, 0, 0, (uint16_t)channel));
+        }
+        return true;
+    }
+
+    if (name == ":all") {
+        std::set<uint16_t> targets;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            targets = openChannels;
+        }
+        for (std::set<uint16_t>::iterator it = targets.begin(); it != targets.end(); ++it) {
+            if (!sendCommand(*it, argument)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (name == ":list") {
+        std::string list = "Open channels:";
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            for (std::set<uint16_t>::iterator it = openChannels.begin(); it != openChannels.end(); ++it) {
+                list += " " + std::to_string(*it) + (*it == activeChannel ? "*" : "");
+            }
+        }
+        printStatus(list);
+        return true;
+    }
+
+    printStatus(":open          open a channel with a new shell\n"
+                ":ch <n>        send input to channel n\n"
+                ":close [n]     close channel n (default: the current one)\n"
+                ":all <command> send a command to every channel\n"
+                ":list          list open channels\n"
+                ":put <file> [remote]  copy a file to the server\n"
+                ":get <file> [local]   copy a file from the server\n"
+                ":sync <dir> [remote]  bring a directory on the server up to date\n"
+                ":run <command>        run a command and report its exit status and timing\n"
+                ":search [-i] [-E] [-C n] [-m n] <pattern>  search the channel's output history");
     return true;
 }
 
-void RemoteTerminalClient::continuousReceive() {
-    char recvbuf[DEFAULT_BUFLEN];
-    std::string buffer;
-    const std::string endMarker = END_OF_RESPONSE_MARKER;
+bool RemoteTerminalClient::startSearch(const std::string& argument) {
+    // :search [-i] [-E] [-C n] [-m n] <pattern>; the pattern is the rest of
+    // the line, spaces and all
+    SearchRequest request;
+    request.flags = 0;
+    request.context = 0;
+    request.maxMatches = 0;
+    size_t position = 0;
+    while (position < argument.length() && argument[position] == '-') {
+        size_t end = argument.find(' ', position);
+        if (end == std::string::npos) {
+            break;
+        }
+        std::string option = argument.substr(position, end - position);
+        position = end + 1;
+        if (option == "-i") {
+            request.flags |= SEARCH_IGNORE_CASE;
+        } else if (option == "-E") {
+            request.flags |= SEARCH_REGEX;
+        } else if ((option == "-C" || option == "-m") && position < argument.length()) {
+            end = argument.find(' ', position);
+            if (end == std::string::npos) {
+                break;
+            }
+            unsigned long value = strtoul(argument.substr(position, end - position).c_str(), NULL, 10);
+            if (option == "-C") {
+                request.context = (uint8_t)std::min(value, 255ul);
+            } else {
+                request.maxMatches = (uint32_t)std::min(value, 0xfffffffful);
+            }
+            position = end + 1;
+        } else if (option == "--") {
+            break;
+        } else {
+            position -= option.length() + 1;
+            break;
+        }
+    }
+    request.pattern = argument.substr(position);
+    if (request.pattern.empty()) {
+        printStatus("Usage: :search [-i] [-E] [-C n] [-m n] <pattern>");
+        return true;
+    }
+    return searchHistory(activeChannel, request);
+}
+
+void RemoteTerminalClient::printPrompt() {
+    // Caller holds outputMutex. A terminal shows the remote shell's prompt.
+    if (rawTerminal) {
+        return;
+    }
+    uint16_t channel = activeChannel;
+    if (channel == 0) {
+        printf("remote> ");
+    } else {
+        printf("remote[%u]> ", (unsigned)channel);
+    }
+    fflush(stdout);
+}
+
+void RemoteTerminalClient::printStatus(const std::string& status) {
+    if (outputHandler) {
+        return;
+    }
+    if (rawTerminal) {
+        writeTerminal(STREAM_CONTROL, status.c_str(), status.length());
+        return;
+    }
+    renderer.writeText(status + "\n");
+}
+
+void RemoteTerminalClient::writeTerminal(uint8_t stream, const char* data, size_t length) {
+    // Shell output already has the remote terminal's line endings; the
+    // server's own messages get a line of their own, with the carriage
+    // returns a raw console needs.
+    if (stream != STREAM_CONTROL) {
+        renderer.write(data, length);
+        return;
+    }
+    std::string message = "\r\n";
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == '\n') {
+            message += '\r';
+        }
+        message += data[i];
+    }
+    message += "\r\n";
+    renderer.write(message.data(), message.length());
+}
+
+void RemoteTerminalClient::displayMessage(uint16_t channel, uint8_t stream, uint64_t captureTime, const char* message,
+                                          size_t length) {
+    if (stream == STREAM_STDERR && stderrMode == STDERR_HIDE) {
+        return;
+    }
+
+    // Remove trailing newlines that were added before the marker
+    while (length > 0 && message[length - 1] == '\n') {
+        length--;
+    }
+
+    // Timed output gets its timestamp here, from when the server read it
+    std::string timed;
+    if ((features & FEATURE_OUTPUT_STREAMS) && stream != STREAM_CONTROL && captureTime != 0) {
+        timed = formatCaptureTime(captureTime);
+        timed.append(message, length);
+        message = timed.data();
+        length = timed.length();
+    }
+
+    // Once other channels are open, tag each line with where it came from
+    bool tagged;
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        tagged = channel != 0 || openChannels.size() > 1;
+    }
+
+    std::string text;
+    if (tagged) {
+        std::string tag = "[" + std::to_string(channel) + "] ";
+        size_t start = 0;
+        while (start < length) {
+            const char* newline = (const char*)memchr(message + start, '\n', length - start);
+            size_t end = newline ? (size_t)(newline - message) + 1 : length;
+            text += tag;
+            text.append(message + start, end - start);
+            start = end;
+        }
+    } else {
+        text.assign(message, length);
+    }
+    if (stream == STREAM_STDERR && stderrMode == STDERR_COLOR) {
+        text = STDERR_COLOR_START + text + STDERR_COLOR_END;
+    }
+    if (length > 0 && message[length - 1] != '\n') {
+        text += '\n';
+    }
+    if (stream == STREAM_STDERR && stderrMode == STDERR_SPLIT) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        fwrite(text.data(), 1, text.length(), stderr);
+        fflush(stderr);
+        return;
+    }
+    renderer.writeText(text);
+}
+
+bool RemoteTerminalClient::decompressPayload(const FrameHeader& header, const char* payload, const char*& data,
+                                             size_t& length) {
+    data = payload;
+    length = header.length;
+    if (!(features & FEATURE_COMPRESSION)) {
+        return !(header.flags & FRAME_FLAG_COMPRESSED);
+    }
+    if (!(header.flags & FRAME_FLAG_COMPRESSED)) {
+        // Every output and screen frame feeds the shared history,
+        // compressed or not
+        decompressor.appendHistory(payload, header.length);
+        return true;
+    }
+    return decompressor.decompress(payload, header.length, data, length, FRAME_MAX_PAYLOAD);
+}
+
+bool RemoteTerminalClient::handleOutputFrame(const FrameHeader& header, const char* payload) {
+    const char* message;
+    size_t length;
+    if (!decompressPayload(header, payload, message, length)) {
+        return false;
+    }
+    uint64_t captureTime = 0;
+    if ((features & FEATURE_OUTPUT_STREAMS) && header.stream != STREAM_CONTROL &&
+        !decodeOutputTime(message, length, captureTime, message, length)) {
+        return false;
+    }
+
+    if (outputHandler) {
+        outputHandler(header.channel, header.stream, captureTime, message, length);
+    } else if (rawTerminal) {
+        writeTerminal(header.stream, message, length);
+    } else {
+        displayMessage(header.channel, header.stream, captureTime, message, length);
+    }
+    if (header.stream != STREAM_CONTROL) {
+        received[header.channel] += length;
+        acknowledgeOutput(header.channel, length);
+    }
+    return true;
+}
+
+bool RemoteTerminalClient::sendScreenSize() {
+    // During negotiation, before anything else is sent
+    int rows = screenRows;
+    int columns = screenColumns;
+    if (rows <= 0 || columns <= 0) {
+        consoleSize(rows, columns);
+    }
+    return sendBytes(makeScreenSizeFrame((uint16_t)rows, (uint16_t)columns));
+}
+
+bool RemoteTerminalClient::handleScreenFrame(const FrameHeader& header, const char* payload) {
+    const char* decoded;
+    size_t length;
+    uint8_t message;
+    const char* body;
+    size_t bodyLength;
+    uint32_t sequence;
+    const char* data;
+    size_t dataLength;
+    if (!decompressPayload(header, payload, decoded, length) ||
+        !decodeScreenFrame(decoded, length, message, body, bodyLength) || message != SCREEN_UPDATE ||
+        !decodeScreenSequence(body, bodyLength, sequence, data, dataLength)) {
+        return false;
+    }
 
+    // The update is drawn over what the last one left, and the renderer
+    // has taken it, so the server may send the next at once (unless the
+    // connection is being shut down)
+    if (outputHandler) {
+        outputHandler(0, STREAM_STDOUT, 0, data, dataLength);
+    } else {
+        renderer.write(data, dataLength);
+    }
+    if (!shouldStop) {
+        sendData(makeScreenAckFrame(sequence));
+    }
+    return true;
+}
+
+void RemoteTerminalClient::acknowledgeOutput(uint16_t channel, size_t length) {
+    if (!(features & FEATURE_CHANNELS)) {
+        return;
+    }
+
+    // Output has been displayed: hand the credit back in half-window steps,
+    // well before the server runs out
+    uint32_t& pending = unacknowledged[channel];
+    pending += (uint32_t)length;
+    if (pending >= CHANNEL_WINDOW / 2) {
+        sendData(makeWindowFrame(channel, pending));
+        pending = 0;
+    }
+}
+
+void RemoteTerminalClient::handleChannelFrame(const FrameHeader& header, const char* payload) {
+    std::string channel = std::to_string(header.channel);
+    if (header.type == FRAME_CHANNEL_OPEN) {
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            openChannels.insert(header.channel);
+        }
+        activeChannel = header.channel;
+        printStatus("Channel " + channel + " open");
+        return;
+    }
+
+    // Channel 0 only closes when its shell has ended the session (raw
+    // input), which is then not worth reattaching to
+    if (header.channel == 0) {
+        shouldStop = true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        openChannels.erase(header.channel);
+    }
+    unacknowledged.erase(header.channel);
+    if (activeChannel == header.channel) {
+        activeChannel = 0;
+    }
+    std::string reason(payload, header.length);
+    printStatus("Channel " + channel + " closed" + (reason.empty() ? "" : ": " + reason));
+}
+
+// 64-bit positions, for files over 2 GB
+static bool seekFile(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t fileLength(FILE* file) {
+#ifdef _WIN32
+    return _fseeki64(file, 0, SEEK_END) == 0 ? (uint64_t)_ftelli64(file) : 0;
+#else
+    return fseeko(file, 0, SEEK_END) == 0 ? (uint64_t)ftello(file) : 0;
+#endif
+}
+
+static bool truncateFile(FILE* file, uint64_t length) {
+    fflush(file);
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), (__int64)length) == 0;
+#else
+    return ftruncate(fileno(file), (off_t)length) == 0;
+#endif
+}
+
+// The Adler-32 of the FILE_CHUNK_SIZE bytes (or fewer) before 'end', which
+// both ends compare before resuming from there
+static bool windowChecksum(FILE* file, uint64_t end, uint32_t& adler) {
+    std::vector<char> window((size_t)std::min(end, (uint64_t)FILE_CHUNK_SIZE));
+    adler = ADLER32_INIT;
+    if (!seekFile(file, end - window.size()) || fread(window.data(), 1, window.size(), file) != window.size()) {
+        return false;
+    }
+    adler = adler32(adler, window.data(), window.size());
+    return true;
+}
+
+bool RemoteTerminalClient::putFile(const std::string& localPath, const std::string& remotePath) {
+    return startTransfer(true, localPath, remotePath);
+}
+
+bool RemoteTerminalClient::getFile(const std::string& remotePath, const std::string& localPath) {
+    return startTransfer(false, localPath, remotePath);
+}
+
+bool RemoteTerminalClient::startTransfer(bool upload, const std::string& localPath, const std::string& remotePath) {
+    if (!connected || !(features & FEATURE_FILE_TRANSFER)) {
+        return false;
+    }
+    if (reconnecting) {
+        printStatus("Reconnecting, transfer not started");
+        return false;
+    }
+
+    // A download keeps whatever an earlier attempt left, to resume from
+    FILE* file = fopen(localPath.c_str(), upload ? "rb" : "r+b");
+    bool created = false;
+    if (!file && !upload) {
+        file = fopen(localPath.c_str(), "w+b");
+        created = true;
+    }
+    if (!file) {
+        printStatus("Unable to open " + localPath);
+        return false;
+    }
+
+    std::unique_ptr<Transfer> transfer(new Transfer());
+    transfer->result.upload = upload;
+    transfer->result.ok = false;
+    transfer->result.localPath = localPath;
+    transfer->result.remotePath = remotePath;
+    transfer->result.size = 0;
+    transfer->result.start = 0;
+    transfer->result.seconds = 0.0;
+    transfer->file = file;
+    transfer->created = created;
+    transfer->offset = 0;
+    transfer->checksum = ADLER32_INIT;
+    transfer->reported = 0;
+    transfer->stopping = false;
+    transfer->startTime = std::chrono::steady_clock::now();
+
+    FileOpenPayload request;
+    request.direction = upload ? FILE_PUT : FILE_GET;
+    request.size = 0;
+    request.offset = 0;
+    request.checksum = 0;
+    request.path = remotePath;
+    uint64_t length = fileLength(file);
+    if (upload) {
+        request.size = length;
+        transfer->result.size = length;
+    } else if (length > 0 && windowChecksum(file, length, request.checksum)) {
+        request.offset = length;
+    }
+
+    uint16_t id;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        id = nextTransfer++;
+        transfers[id] = std::move(transfer);
+    }
+    return sendData(makeFileOpenFrame(id, request));
+}
+
+void RemoteTerminalClient::handleFileFrame(const FrameHeader& header, const char* payload) {
+    // Transfers only leave the map on this thread (or once it has ended),
+    // so the pointer stays good
+    Transfer* transfer;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        std::map<uint16_t, std::unique_ptr<Transfer>>::iterator it = transfers.find(header.channel);
+        if (it == transfers.end()) {
+            return;
+        }
+        transfer = it->second.get();
+    }
+
+    if (header.type == FRAME_FILE_OPEN) {
+        FileOpenPayload reply;
+        if (!decodeFileOpen(payload, header.length, reply)) {
+            cancelTransfer(header.channel, *transfer, "Invalid reply from the server");
+        } else {
+            acceptTransfer(header.channel, *transfer, reply);
+        }
+    } else if (header.type == FRAME_FILE_DATA) {
+        if (!transfer->result.upload && !transfer->stopping) {
+            receiveFileData(header.channel, *transfer, payload, header.length);
+        }
+    } else {
+        FileClosePayload close;
+        if (!decodeFileClose(payload, header.length, close)) {
+            close.status = FILE_FAILED;
+            close.checksum = 0;
+            close.message = "Invalid reply from the server";
+        }
+        finishTransfer(header.channel, close);
+    }
+}
+
+void RemoteTerminalClient::acceptTransfer(uint16_t id, Transfer& transfer, const FileOpenPayload& reply) {
+    // The server continues a download from where the request said; an
+    // upload continues only if the server's copy ends like ours
+    TransferResult& result = transfer.result;
+    uint64_t start = reply.offset;
+    uint32_t checksum;
+    if (!result.upload) {
+        result.size = reply.size;
+    } else if (start > result.size || !windowChecksum(transfer.file, start, checksum) || checksum != reply.checksum) {
+        start = 0;
+    }
+    if (!seekFile(transfer.file, start)) {
+        cancelTransfer(id, transfer, "Unable to read " + result.localPath);
+        return;
+    }
+    result.start = start;
+    transfer.offset = start;
+    transfer.reported = start;
+
+    printStatus((result.upload ? "put " + result.localPath + " -> " : "get " + result.remotePath + " -> ") +
+        (result.upload ? result.remotePath : result.localPath) + ": " + std::to_string(result.size) + " bytes" +
+        (start ? ", resuming at " + std::to_string(start) : ""));
+    if (result.upload) {
+        transfer.sender = std::thread(&RemoteTerminalClient::sendFile, this, id, &transfer);
+    }
+}
+
+void RemoteTerminalClient::receiveFileData(uint16_t id, Transfer& transfer, const char* payload, size_t length) {
+    uint64_t offset;
+    const char* data;
+    size_t dataLength;
+    if (!decodeFileData(payload, length, offset, data, dataLength) || offset != transfer.offset ||
+        dataLength > transfer.result.size - offset) {
+        cancelTransfer(id, transfer, "Unexpected data from the server");
+        return;
+    }
+    if (fwrite(data, 1, dataLength, transfer.file) != dataLength) {
+        cancelTransfer(id, transfer, "Unable to write " + transfer.result.localPath);
+        return;
+    }
+    transfer.checksum = adler32(transfer.checksum, data, dataLength);
+    transfer.offset += dataLength;
+
+    // The server keeps FILE_WINDOW bytes in flight; report progress in
+    // half-window steps, well before it runs out
+    if (transfer.offset - transfer.reported >= FILE_WINDOW / 2) {
+        std::string progress(FRAME_HEADER_SIZE + FILE_DATA_PREFIX_SIZE, '\0');
+        encodeFileDataHeader(&progress[0], id, transfer.offset, 0);
+        sendData(progress);
+        transfer.reported = transfer.offset;
+    }
+}
+
+void RemoteTerminalClient::cancelTransfer(uint16_t id, Transfer& transfer, const std::string& error) {
+    // The server answers, and the transfer ends with that answer
+    transfer.error = error;
+    transfer.stopping = true;
+    sendData(makeFileCloseFrame(id, FILE_FAILED, 0, error));
+}
+
+void RemoteTerminalClient::sendFile(uint16_t id, Transfer* transfer) {
+    // Each chunk is read straight into its frame
+    std::string frame;
+    while (!transfer->stopping && transfer->offset < transfer->result.size) {
+        uint64_t offset = transfer->offset;
+        size_t length = (size_t)std::min((uint64_t)FILE_CHUNK_SIZE, transfer->result.size - offset);
+        frame.resize(FRAME_HEADER_SIZE + FILE_DATA_PREFIX_SIZE + length);
+        char* data = &frame[FRAME_HEADER_SIZE + FILE_DATA_PREFIX_SIZE];
+        if (fread(data, 1, length, transfer->file) != length) {
+            cancelTransfer(id, *transfer, "Unable to read " + transfer->result.localPath);
+            return;
+        }
+        encodeFileDataHeader(&frame[0], id, offset, length);
+        transfer->checksum = adler32(transfer->checksum, data, length);
+        if (!sendData(frame)) {
+            // Abandoned with the connection
+            return;
+        }
+        transfer->offset = offset + length;
+    }
+    if (!transfer->stopping) {
+        sendData(makeFileCloseFrame(id, FILE_OK, transfer->checksum));
+    }
+}
+
+void RemoteTerminalClient::finishTransfer(uint16_t id, const FileClosePayload& close) {
+    std::unique_ptr<Transfer> transfer;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        std::map<uint16_t, std::unique_ptr<Transfer>>::iterator it = transfers.find(id);
+        if (it == transfers.end()) {
+            return;
+        }
+        transfer = std::move(it->second);
+        transfers.erase(it);
+    }
+    transfer->stopping = true;
+    if (transfer->sender.joinable()) {
+        transfer->sender.join();
+    }
+
+    // The server's answer to an upload carries what it received
+    TransferResult& result = transfer->result;
+    if (!transfer->error.empty()) {
+        result.message = transfer->error;
+    } else if (close.status != FILE_OK) {
+        result.message = close.message.empty() ? "Failed on the server" : close.message;
+    } else if (transfer->offset != result.size) {
+        result.message = "Received " + std::to_string(transfer->offset) + " of " + std::to_string(result.size) + " bytes";
+    } else if (close.checksum != transfer->checksum) {
+        result.message = "Checksum mismatch";
+    } else if (!result.upload && !truncateFile(transfer->file, result.size)) {
+        // A longer file was there before
+        result.message = "Unable to write " + result.localPath;
+    } else {
+        result.ok = true;
+    }
+    reportTransfer(std::move(transfer));
+}
+
+void RemoteTerminalClient::reportTransfer(std::unique_ptr<Transfer> transfer) {
+    fclose(transfer->file);
+    TransferResult& result = transfer->result;
+    if (!result.ok && transfer->created && transfer->offset == 0) {
+        remove(result.localPath.c_str());
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer->startTime).count();
+    if (transferHandler) {
+        transferHandler(result);
+        return;
+    }
+
+    std::string name = result.upload ? "put " + result.localPath : "get " + result.remotePath;
+    if (!result.ok) {
+        printStatus(name + " failed: " + result.message);
+        return;
+    }
+    char rate[64];
+    double megabytes = (result.size - result.start) / (1024.0 * 1024.0);
+    snprintf(rate, sizeof(rate), " in %.2f s (%.1f MB/s)", result.seconds,
+        result.seconds > 0 ? megabytes / result.seconds : 0.0);
+    printStatus(name + ": " + std::to_string(result.size - result.start) + " bytes" + rate);
+}
+
+void RemoteTerminalClient::abandonTransfers(const std::string& reason) {
+    std::map<uint16_t, std::unique_ptr<Transfer>> abandoned;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        abandoned.swap(transfers);
+    }
+    for (std::map<uint16_t, std::unique_ptr<Transfer>>::iterator it = abandoned.begin(); it != abandoned.end(); ++it) {
+        it->second->stopping = true;
+        if (it->second->sender.joinable()) {
+            it->second->sender.join();
+        }
+        it->second->result.message = reason;
+        reportTransfer(std::move(it->second));
+    }
+}
+
+bool RemoteTerminalClient::syncDirectory(const std::string& localPath, const std::string& remotePath) {
+    if (!connected || !(features & FEATURE_SYNC)) {
+        return false;
+    }
+    if (reconnecting) {
+        printStatus("Reconnecting, sync not started");
+        return false;
+    }
+
+    uint16_t id;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        id = nextTransfer++;
+    }
+    std::unique_ptr<DirectorySync> sync(new DirectorySync(id, localPath, remotePath, [this](const std::string& frame) {
+        return sendData(frame);
+    }));
+    if (!sync->scan()) {
+        sync->finish(NULL, sync->result.message);
+        reportSync(std::move(sync));
+        return false;
+    }
+
+    // Registered first: the server's answers may arrive before start()
+    // returns
+    DirectorySync* started = sync.get();
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        syncs[id] = std::move(sync);
+    }
+    return started->start(activeChannel);
+}
+
+void RemoteTerminalClient::handleSyncFrame(const FrameHeader& header, const char* payload) {
+    // Syncs only leave the map on this thread (or once it has ended)
+    DirectorySync* sync;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        std::map<uint16_t, std::unique_ptr<DirectorySync>>::iterator it = syncs.find(header.channel);
+        if (it == syncs.end() || header.length < 1) {
+            return;
+        }
+        sync = it->second.get();
+    }
+
+    uint8_t message = (uint8_t)payload[0];
+    SyncResultPayload reply;
+    bool valid;
+    if (message == SYNC_SIGNATURES) {
+        if (sync->handleSignatures(payload + 1, header.length - 1)) {
+            return;
+        }
+        valid = false;
+    } else if (message == SYNC_RESULT) {
+        valid = decodeSyncResult(payload + 1, header.length - 1, reply);
+    } else {
+        return;
+    }
+
+    std::unique_ptr<DirectorySync> finished;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        finished = std::move(syncs[header.channel]);
+        syncs.erase(header.channel);
+    }
+    if (message == SYNC_SIGNATURES) {
+        // The server's end finishes too
+        sendData(makeSyncFrame(header.channel, SYNC_END));
+    }
+    finished->finish(valid ? &reply : NULL, "Invalid reply from the server");
+    reportSync(std::move(finished));
+}
+
+void RemoteTerminalClient::reportSync(std::unique_ptr<DirectorySync> sync) {
+    const SyncResult& result = sync->result;
+    if (syncHandler) {
+        syncHandler(result);
+        return;
+    }
+    if (!result.ok) {
+        printStatus("sync " + result.localPath + " failed: " + result.message);
+        return;
+    }
+    char summary[160];
+    snprintf(summary, sizeof(summary), ": %u of %u files changed, %llu bytes sent (%llu matched) in %.3f s",
+        result.changed, result.files, (unsigned long long)result.wireBytes, (unsigned long long)result.matchedBytes,
+        result.seconds);
+    printStatus("sync " + result.localPath + summary);
+}
+
+void RemoteTerminalClient::abandonSyncs(const std::string& reason) {
+    std::map<uint16_t, std::unique_ptr<DirectorySync>> abandoned;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        abandoned.swap(syncs);
+    }
+    for (std::map<uint16_t, std::unique_ptr<DirectorySync>>::iterator it = abandoned.begin(); it != abandoned.end(); ++it) {
+        it->second->finish(NULL, reason);
+        reportSync(std::move(it->second));
+    }
+}
+
+void RemoteTerminalClient::handleCommandFrame(const FrameHeader& header, const char* payload) {
+    CommandResultPayload result;
+    if (!decodeCommandResult(payload, header.length, result)) {
+        return;
+    }
+    std::string command;
+    {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        std::map<uint32_t, std::string>::iterator it = runningCommands.find(result.id);
+        if (it == runningCommands.end()) {
+            return;
+        }
+        command = it->second;
+        runningCommands.erase(it);
+    }
+    if (commandHandler) {
+        commandHandler(header.channel, result);
+        return;
+    }
+    char summary[160];
+    std::string status = result.status == COMMAND_EXITED ? "exit " + std::to_string(result.exitCode)
+                       : result.status == COMMAND_UNKNOWN ? "status unknown" : "done";
+    snprintf(summary, sizeof(summary), ": %s in %.3f s, first output after %.3f s, %llu bytes", status.c_str(),
+        result.wallMicroseconds / 1e6, result.firstOutputMicroseconds / 1e6, (unsigned long long)result.outputBytes);
+    printStatus("run " + command + summary);
+}
+
+void RemoteTerminalClient::handleSearchFrame(const FrameHeader& header, const char* payload) {
+    uint32_t id;
+    uint8_t message;
+    const char* body;
+    size_t bodyLength;
+    if (!decodeSearchFrame(payload, header.length, id, message, body, bodyLength)) {
+        return;
+    }
+    SearchReport report;
+    {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        std::map<uint32_t, Search>::iterator it = searches.find(id);
+        if (it == searches.end()) {
+            return;
+        }
+        Search& search = it->second;
+        search.report.wireBytes += header.length;
+        if (message == SEARCH_LINES) {
+            std::vector<SearchLine> lines;
+            if (!decodeSearchLines(body, bodyLength, lines)) {
+                return;
+            }
+            if (searchHandler) {
+                search.report.lines.insert(search.report.lines.end(), lines.begin(), lines.end());
+            } else {
+                printSearchLines(search, lines);
+            }
+            return;
+        }
+        if (message != SEARCH_RESULT || !decodeSearchResult(body, bodyLength, search.report.result)) {
+            return;
+        }
+        search.report.seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - search.startTime).count();
+        report = std::move(search.report);
+        searches.erase(it);
+    }
+    reportSearch(report);
+}
+
+void RemoteTerminalClient::printSearchLines(Search& search, const std::vector<SearchLine>& lines) {
+    // As grep -n prints them: "12:" before a match, "12-" before context,
+    // and "--" between lines that don't follow on from each other
+    std::string text;
+    for (size_t i = 0; i < lines.size(); i++) {
+        const SearchLine& line = lines[i];
+        if (search.lastShown != 0 && line.number > search.lastShown + 1) {
+            text += "--\n";
+        }
+        text += std::to_string(line.number) + ((line.flags & SEARCH_LINE_MATCH) ? ":" : "-") + line.text;
+        text += (line.flags & SEARCH_LINE_CUT) ? "...\n" : "\n";
+        search.lastShown = line.number;
+    }
+    if (!text.empty()) {
+        text.pop_back();
+        printStatus(text);
+    }
+}
+
+void RemoteTerminalClient::reportSearch(const SearchReport& report) {
+    if (searchHandler) {
+        searchHandler(report);
+        return;
+    }
+    const SearchResultPayload& result = report.result;
+    if (result.status != FILE_OK) {
+        printStatus("search " + report.pattern + " failed: " + result.message);
+        return;
+    }
+    char summary[200];
+    snprintf(summary, sizeof(summary), ": %llu matches%s in %llu lines, %.1f MB read (%.1f MB ruled out) in %.3f s",
+        (unsigned long long)result.matches, result.complete ? "" : " (limit reached)",
+        (unsigned long long)(result.lastLine - result.firstLine), result.scannedBytes / 1e6, result.skippedBytes / 1e6,
+        result.microseconds / 1e6);
+    printStatus("search " + report.pattern + summary);
+}
+
+void RemoteTerminalClient::continuousReceive() {
     while (!shouldStop && connected) {
-        int iResult = recv(ConnectSocket, recvbuf, DEFAULT_BUFLEN - 1, 0);
-        if (iResult > 0) {
-            recvbuf[iResult] = '\0';
-            buffer += std::string(recvbuf);
-            
-            // Process complete messages (those ending with end marker)
-            size_t markerPos;
-            while ((markerPos = buffer.find(endMarker)) != std::string::npos) {
-                std::string message = buffer.substr(0, markerPos);
-                buffer = buffer.substr(markerPos + endMarker.length());
-                
-                // Remove trailing newlines that were added before the marker
-                while (!message.empty() && message.back() == '\n') {
-                    message.pop_back();
+        // Process complete messages already in the buffer (the negotiation
+        // may have received more than the server's hello)
+        if (framed) {
+            FrameHeader header;
+            const char* payload;
+            FrameReader::Result result;
+            while ((result = reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+                if (header.type == FRAME_OUTPUT && !handleOutputFrame(header, payload)) {
+                    result = FrameReader::FRAME_INVALID;
+                    break;
+                }
+                if (header.type == FRAME_SCREEN && !handleScreenFrame(header, payload)) {
+                    result = FrameReader::FRAME_INVALID;
+                    break;
+                }
+                if (header.type == FRAME_CHANNEL_OPEN || header.type == FRAME_CHANNEL_CLOSE) {
+                    handleChannelFrame(header, payload);
+                }
+                if (header.type == FRAME_FILE_OPEN || header.type == FRAME_FILE_DATA || header.type == FRAME_FILE_CLOSE) {
+                    handleFileFrame(header, payload);
                 }
-                
-                // Thread-safe output
-                {
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    printf("\r%s", message.c_str());
-                    if (!message.empty() && message.back() != '\n') {
-                        printf("\n");
-                    }
-                    printf("remote> ");
-                    fflush(stdout);
+                if (header.type == FRAME_SYNC) {
+                    handleSyncFrame(header, payload);
+                }
+                if (header.type == FRAME_COMMAND) {
+                    handleCommandFrame(header, payload);
+                }
+                if (header.type == FRAME_SEARCH) {
+                    handleSearchFrame(header, payload);
+                }
+            }
+            if (result == FrameReader::FRAME_INVALID) {
+                printStatus("Invalid frame from server");
+                connected = false;
+                break;
+            }
+        } else {
+            const char* message;
+            size_t length;
+            while (reader.nextMarkerMessage(message, length)) {
+                if (outputHandler) {
+                    outputHandler(0, STREAM_STDOUT, 0, message, length);
+                } else {
+                    displayMessage(0, STREAM_STDOUT, 0, message, length);
                 }
             }
         }
-        else if (iResult == 0) {
+
+        int iResult = receiveInput();
+        if (iResult == 0) {
             // Connection closed
-            {
-                std::lock_guard<std::mutex> lock(outputMutex);
-                printf("\rConnection closed by server\n");
-                printf("remote> ");
-                fflush(stdout);
+            if (reconnect()) {
+                continue;
+            }
+            if (!shouldStop) {
+                printStatus("Connection closed by server");
             }
             connected = false;
             break;
         }
-        else {
+        else if (iResult < 0) {
             // Error occurred
             if (WSAGetLastError() != WSAEWOULDBLOCK) {
-                {
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    printf("\rReceive failed with error: %d\n", WSAGetLastError());
-                    printf("remote> ");
-                    fflush(stdout);
+                if (reconnect()) {
+                    continue;
                 }
+                printStatus("Receive failed with error: " + std::to_string(WSAGetLastError()));
                 connected = false;
                 break;
             }
         }
     }
+    abandonTransfers("Connection closed");
+    abandonSyncs("Connection closed");
+}
+
+bool RemoteTerminalClient::reconnect() {
+    // Only a session the server keeps for us is worth going back to
+    if (sessionToken.empty() || shouldStop) {
+        return false;
+    }
+    printStatus("Connection lost, reconnecting...");
+    reconnecting = true;
+
+    // Transfers belong to the connection. Shutting it down wakes an upload
+    // blocked sending on it.
+    shutdown(ConnectSocket, SD_BOTH);
+    abandonTransfers("Connection lost; run it again to resume");
+    abandonSyncs("Connection lost; run it again");
+
+    // Back off from an immediate retry up to RECONNECT_MAX_DELAY_MS
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(RECONNECT_TIMEOUT_MS);
+    int delayMs = 0;
+    while (!shouldStop && std::chrono::steady_clock::now() < deadline) {
+        for (int waited = 0; waited < delayMs && !shouldStop; waited += 50) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        delayMs = delayMs ? (delayMs * 2 < RECONNECT_MAX_DELAY_MS ? delayMs * 2 : RECONNECT_MAX_DELAY_MS) : 250;
+
+        SOCKET connectSocket = openConnection();
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            std::lock_guard<std::mutex> tlsLock(tlsMutex);
+            closesocket(ConnectSocket);
+            ConnectSocket = connectSocket;
+            secure.reset();
+        }
+        if (connectSocket == INVALID_SOCKET) {
+            continue;
+        }
+
+        // A new connection starts a new compression stream and window
+        reader = FrameReader();
+        decompressor.reset();
+        unacknowledged.clear();
+        if (negotiateProtocol()) {
+            reconnecting = false;
+            return true;
+        }
+    }
+
+    reconnecting = false;
+    return false;
+}
+
+bool RemoteTerminalClient::start() {
+    if (!connected) {
+        return false;
+    }
+    receiveThread = std::thread(&RemoteTerminalClient::continuousReceive, this);
+    return true;
 }
 
 void RemoteTerminalClient::run() {
@@ -148,20 +1506,37 @@ void RemoteTerminalClient::run() {
         return;
     }
 
+    if (features & FEATURE_RAW_INPUT) {
+        runRaw();
+        return;
+    }
+    if (requestedFeatures & FEATURE_RAW_INPUT) {
+        printf("The server does not support raw input, using line mode\n");
+    }
+
     printf("\nRemote Terminal Client (Async Mode)\n");
     printf("Type commands to execute on the remote server.\n");
     printf("Responses will appear automatically as they arrive.\n");
     printf("Type 'exit' or 'quit' to disconnect.\n\n");
 
+#ifdef _WIN32
+    // Red stderr (STDERR_COLOR) is an escape sequence
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD consoleMode;
+    if (stderrMode == STDERR_COLOR && GetConsoleMode(console, &consoleMode)) {
+        SetConsoleMode(console, consoleMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    }
+#endif
+
     // Start the continuous receive thread
+    renderer.start(false);
     receiveThread = std::thread(&RemoteTerminalClient::continuousReceive, this);
 
     std::string command;
     while (connected && !shouldStop) {
         {
             std::lock_guard<std::mutex> lock(outputMutex);
-            printf("remote> ");
-            fflush(stdout);
+            printPrompt();
         }
         
         std::getline(std::cin, command);
@@ -170,10 +1545,19 @@ void RemoteTerminalClient::run() {
             continue;
         }
 
-        // Check if user wants to exit
-        if (command == "exit" || command == "quit") {
+        if (command[0] == ':') {
+            if (!handleLocalCommand(command)) {
+                break;
+            }
+            continue;
+        }
+
+        // Check if user wants to exit. On another channel 'exit' only ends
+        // that channel's shell.
+        uint16_t channel = activeChannel;
+        if (command == "quit" || (command == "exit" && channel == 0)) {
             shouldStop = true;
-            if (!sendCommand(command)) {
+            if (!sendCommand(0, command)) {
                 break;
             }
             // Give a moment for the exit response to arrive
@@ -182,7 +1566,7 @@ void RemoteTerminalClient::run() {
         }
 
         // Send the command to server (asynchronously)
-        if (!sendCommand(command)) {
+        if (!sendCommand(channel, command)) {
             {
                 std::lock_guard<std::mutex> lock(outputMutex);
                 printf("Failed to send command\n");
@@ -196,24 +1580,98 @@ void RemoteTerminalClient::run() {
     if (receiveThread.joinable()) {
         receiveThread.join();
     }
+    renderer.stop();
+}
+
+void RemoteTerminalClient::runRaw() {
+    RawTerminal terminal;
+    if (!terminal.enable()) {
+        printf("Unable to switch the console to raw mode\n");
+        return;
+    }
+    rawTerminal = true;
+    renderer.start(true);
+    std::string banner = "Connected in raw mode; Ctrl-] disconnects\r\n";
+    renderer.write(banner.data(), banner.length());
+
+    receiveThread = std::thread(&RemoteTerminalClient::continuousReceive, this);
+
+    std::vector<char> batch(INPUT_BATCH_MAX_BYTES);
+    bool leaving = false;
+    while (connected && !shouldStop && !leaving) {
+        // Wake up now and then to notice the session ending
+        int bytes = terminal.read(batch.data(), batch.size(), 100);
+        if (bytes < 0) {
+            break;
+        }
+        if (bytes == 0) {
+            continue;
+        }
+
+        // A keystroke goes out at once; anything already waiting behind it
+        // goes with it, and a paste is read for as long as it keeps coming
+        size_t length = (size_t)bytes;
+        int windowMs = length > INPUT_KEYSTROKE_BYTES ? INPUT_BATCH_WINDOW_MS : 0;
+        while (length < batch.size()) {
+            bytes = terminal.read(batch.data() + length, batch.size() - length, windowMs);
+            if (bytes <= 0) {
+                break;
+            }
+            length += (size_t)bytes;
+            windowMs = INPUT_BATCH_WINDOW_MS;
+        }
+
+        const char* escape = (const char*)memchr(batch.data(), INPUT_ESCAPE_KEY, length);
+        if (escape) {
+            length = escape - batch.data();
+            leaving = true;
+        }
+        if (length > 0 && !sendInput(activeChannel, batch.data(), length)) {
+            break;
+        }
+        renderer.predict(batch.data(), length);
+    }
+
+    shouldStop = true;
+    if (leaving) {
+        // Wake the receive thread, which would otherwise try to reattach
+        std::lock_guard<std::mutex> lock(sendMutex);
+        shutdown(ConnectSocket, SD_BOTH);
+    }
+    if (receiveThread.joinable()) {
+        receiveThread.join();
+    }
+    renderer.stop();
+    {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        terminal.restore();
+        rawTerminal = false;
+    }
+    printf("\n");
 }
 
 void RemoteTerminalClient::cleanup() {
     // Stop the receive thread
     shouldStop = true;
     connected = false;
-    
+
+    // Shutdown the connection, which also wakes the receive thread if it is
+    // still waiting for the server (a scripted client stops without 'exit')
+    {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (ConnectSocket != INVALID_SOCKET && shutdown(ConnectSocket, SD_BOTH) == SOCKET_ERROR && !outputHandler) {
+            printf("shutdown failed with error: %d\n", WSAGetLastError());
+        }
+    }
+
     // Join the receive thread if it's running
     if (receiveThread.joinable()) {
         receiveThread.join();
     }
-    
+    abandonTransfers("Connection closed");
+    abandonSyncs("Connection closed");
+
     if (ConnectSocket != INVALID_SOCKET) {
-        // Shutdown the connection
-        int iResult = shutdown(ConnectSocket, SD_SEND);
-        if (iResult == SOCKET_ERROR) {
-            printf("shutdown failed with error: %d\n", WSAGetLastError());
-        }
         closesocket(ConnectSocket);
     }
     WSACleanup();
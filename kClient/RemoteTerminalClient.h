@@ -1,17 +1,100 @@
 #pragma once
 
-#pragma comment(lib, "ws2_32.lib")
-
 #include <iostream>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "../platform.h"
 #include <string>
 #include <cstdio>
 #include <thread>
 #include <atomic>
 #include <mutex>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+#include <functional>
 #include "../common.h"
+#include "../FrameProtocol.h"
+#include "../Compression.h"
+#include "../SecureChannel.h"
+#include "RawTerminal.h"
+#include "ConsoleRenderer.h"
+#include "DirectorySync.h"
+
+// Protocol features this client asks the server for by default
+#define CLIENT_FEATURES (FEATURE_COMPRESSION | FEATURE_CHANNELS | FEATURE_RESUME | FEATURE_FILE_TRANSFER | FEATURE_SYNC | \
+                         FEATURE_OUTPUT_STREAMS | FEATURE_COMMANDS | FEATURE_SEARCH)
+
+// How long a client whose connection dropped keeps trying to reattach, and
+// the longest wait between attempts
+#define RECONNECT_TIMEOUT_MS (5 * 60 * 1000)
+#define RECONNECT_MAX_DELAY_MS 5000
+
+// TLS: ciphertext is received this much at a time
+#define TLS_RECEIVE_SIZE (64 * 1024)
+
+// Raw input (--raw). Input that arrives faster than anyone types is a
+// paste: reading continues while more keeps coming within the window, up
+// to the batch limit, so it reaches the shell as one write. A read of at
+// most INPUT_KEYSTROKE_BYTES (one key, or one key's escape sequence) is
+// sent at once.
+#define INPUT_KEYSTROKE_BYTES 8
+#define INPUT_BATCH_WINDOW_MS 2
+#define INPUT_BATCH_MAX_BYTES (64 * 1024)
+
+// Ctrl-] leaves a raw session, as in telnet
+#define INPUT_ESCAPE_KEY 0x1d
+
+// Receives output in place of the console: the channel, the frame's
+// stream, when the server read it (FEATURE_OUTPUT_STREAMS: microseconds
+// since 1970, zero if unknown) and the (decompressed) bytes, exactly as the
+// server sent them
+typedef std::function<void(uint16_t channel, uint8_t stream, uint64_t captureTime, const char* data, size_t length)> OutputHandler;
+
+// How line mode shows a shell's stderr (FEATURE_OUTPUT_STREAMS), which only
+// a server that reads it apart from stdout sends. A raw terminal shows
+// every stream as it comes.
+enum StderrMode {
+    STDERR_COLOR,   // In red, among the rest
+    STDERR_PLAIN,   // Like stdout
+    STDERR_HIDE,    // Not at all
+    STDERR_SPLIT,   // On the client's own stderr, so it can be redirected
+};
+
+// How a file transfer (:put or :get) ended
+struct TransferResult {
+    bool upload;
+    bool ok;
+    std::string localPath;
+    std::string remotePath;
+    uint64_t size;          // Of the whole file
+    uint64_t start;         // Offset it resumed from, or 0
+    double seconds;
+    std::string message;    // Why it failed
+};
+
+// Receives finished transfers in place of the status line
+typedef std::function<void(const TransferResult& result)> TransferHandler;
+
+// Receives finished directory syncs (:sync) in place of the status line
+typedef std::function<void(const SyncResult& result)> SyncHandler;
+
+// Receives the results of tracked commands (:run) in place of the status
+// line
+typedef std::function<void(uint16_t channel, const CommandResultPayload& result)> CommandHandler;
+
+// How a search of a channel's output history (:search) ended
+struct SearchReport {
+    uint16_t channel;
+    std::string pattern;
+    std::vector<SearchLine> lines;  // Matches and their context, in order
+    SearchResultPayload result;
+    uint64_t wireBytes;             // Payload of the server's FRAME_SEARCH frames
+    double seconds;                 // From the request to the result
+};
+
+// Receives finished searches in place of the console
+typedef std::function<void(const SearchReport& report)> SearchHandler;
 
 class RemoteTerminalClient {
 private:
@@ -20,9 +103,136 @@ private:
     std::atomic<bool> connected;
     std::atomic<bool> shouldStop;
     std::thread receiveThread;
-    std::mutex outputMutex;
+    std::mutex outputMutex;     // Held for every write to the console
+    std::mutex sendMutex;       // Input and window grants come from different threads
+    FrameReader reader;
+    bool framed;    // Server answered our FRAME_HELLO, otherwise legacy marker mode
+    uint32_t requestedFeatures;
+    uint32_t features;  // FEATURE_* bits the server accepted
+    StreamDecompressor decompressor;
+
+    // Channels (FEATURE_CHANNELS): input goes to the active one. Channel 0
+    // is the connection's own shell and is always open.
+    std::mutex channelMutex;
+    std::set<uint16_t> openChannels;
+    std::atomic<uint16_t> activeChannel;
+    uint16_t nextChannel;
+    std::map<uint16_t, uint32_t> unacknowledged;   // Output not yet granted back, receive thread only
+
+    // Resume (FEATURE_RESUME): the session's token and how much of each
+    // channel's output has arrived, which is where a reattach picks up
+    std::string serverAddress;
+    std::string serverPort;
+    std::string sessionToken;
+    std::map<uint16_t, uint64_t> received;         // Receive thread only
+    std::atomic<bool> reconnecting;
+
+    // TLS (--tls). The channel is replaced, by the receive thread, only
+    // under both sendMutex and tlsMutex; the receive thread decrypts and
+    // senders encrypt under tlsMutex.
+    std::shared_ptr<TlsClientContext> tlsContext;
+    std::unique_ptr<SecureChannel> secure;
+    std::mutex tlsMutex;
+    std::vector<char> tlsInput;
+
+    // Headless use (kBench): output goes here and nothing is printed
+    OutputHandler outputHandler;
 
-    bool sendCommand(const std::string& command);
+    // FEATURE_RAW_INPUT: the console is the remote shell's terminal
+    std::atomic<bool> rawTerminal;
+
+    // FEATURE_SCREEN_SYNC: the size the server is told; zero for the
+    // console's
+    int screenRows;
+    int screenColumns;
+
+    StderrMode stderrMode;
+
+    // Output reaches the console through here, so receiving never waits
+    // for the console
+    ConsoleRenderer renderer;
+
+    // File transfers (FEATURE_FILE_TRANSFER) by id, which like channel ids
+    // are never reused on a connection. A download is written by the
+    // receive thread; an upload is read and sent by a thread of its own,
+    // one chunk per sendMutex hold, so input goes out between its chunks.
+    struct Transfer {
+        TransferResult result;
+        FILE* file;
+        bool created;                   // A download's file wasn't there before
+        std::atomic<uint64_t> offset;   // Next byte to send or expect
+        uint32_t checksum;              // Adler-32 from result.start to offset
+        uint64_t reported;              // Download progress sent to the server
+        std::string error;              // Why the client gave up, once it has
+        std::atomic<bool> stopping;
+        std::thread sender;
+        std::chrono::steady_clock::time_point startTime;
+    };
+    std::mutex transferMutex;
+    std::map<uint16_t, std::unique_ptr<Transfer>> transfers;
+    uint16_t nextTransfer;
+    TransferHandler transferHandler;
+
+    // Directory syncs (FEATURE_SYNC), under transferMutex and with ids from
+    // nextTransfer. Their deltas are sent by their own threads.
+    std::map<uint16_t, std::unique_ptr<DirectorySync>> syncs;
+    SyncHandler syncHandler;
+
+    // Tracked commands (FEATURE_COMMANDS) waiting for their result, by id
+    std::mutex commandMutex;
+    std::map<uint32_t, std::string> runningCommands;
+    uint32_t nextCommand;
+    CommandHandler commandHandler;
+
+    // Searches (FEATURE_SEARCH) waiting for their result, by id, under
+    // commandMutex and with ids from nextCommand. Without a handler lines
+    // are printed as they arrive and only the last one shown is kept.
+    struct Search {
+        SearchReport report;
+        uint64_t lastShown;             // Number of the last line printed
+        std::chrono::steady_clock::time_point startTime;
+    };
+    std::map<uint32_t, Search> searches;
+    SearchHandler searchHandler;
+
+    SOCKET openConnection();
+    bool negotiateProtocol();
+    bool startTls();
+    void flushTls();
+    int receiveInput();
+    bool sendBytes(const std::string& data);
+    void applyResume(const HelloPayload& reply);
+    bool reconnect();
+    bool sendData(const std::string& data);
+    bool handleLocalCommand(const std::string& line);
+    bool startTransfer(bool upload, const std::string& localPath, const std::string& remotePath);
+    void printPrompt();
+    void printStatus(const std::string& status);
+    void displayMessage(uint16_t channel, uint8_t stream, uint64_t captureTime, const char* message, size_t length);
+    void writeTerminal(uint8_t stream, const char* data, size_t length);
+    void runRaw();
+    bool decompressPayload(const FrameHeader& header, const char* payload, const char*& data, size_t& length);
+    bool handleOutputFrame(const FrameHeader& header, const char* payload);
+    bool sendScreenSize();
+    bool handleScreenFrame(const FrameHeader& header, const char* payload);
+    void acknowledgeOutput(uint16_t channel, size_t length);
+    void handleChannelFrame(const FrameHeader& header, const char* payload);
+    void handleFileFrame(const FrameHeader& header, const char* payload);
+    void acceptTransfer(uint16_t id, Transfer& transfer, const FileOpenPayload& reply);
+    void receiveFileData(uint16_t id, Transfer& transfer, const char* payload, size_t length);
+    void cancelTransfer(uint16_t id, Transfer& transfer, const std::string& error);
+    void sendFile(uint16_t id, Transfer* transfer);
+    void finishTransfer(uint16_t id, const FileClosePayload& close);
+    void reportTransfer(std::unique_ptr<Transfer> transfer);
+    void abandonTransfers(const std::string& reason);
+    void handleSyncFrame(const FrameHeader& header, const char* payload);
+    void reportSync(std::unique_ptr<DirectorySync> sync);
+    void abandonSyncs(const std::string& reason);
+    void handleCommandFrame(const FrameHeader& header, const char* payload);
+    bool startSearch(const std::string& argument);
+    void handleSearchFrame(const FrameHeader& header, const char* payload);
+    void printSearchLines(Search& search, const std::vector<SearchLine>& lines);
+    void reportSearch(const SearchReport& report);
     void continuousReceive();
     void cleanup();
 
@@ -31,6 +241,60 @@ public:
     ~RemoteTerminalClient();
 
     bool initialize();
-    bool connectToServer(const std::string& serverAddress = "127.0.0.1");
+    void setRequestedFeatures(uint32_t requested);
+    void setStderrMode(StderrMode mode);
+
+    // How --raw shows the echo of typing before the server's arrives
+    void setPredictMode(PredictMode mode);
+
+    // Encrypts the connection, checking the server as the context says.
+    // Clients sharing a context resume each other's sessions.
+    void setTls(std::shared_ptr<TlsClientContext> context);
+
+    // TLS: how the connection is encrypted, and whether it resumed an
+    // earlier session; empty without TLS
+    std::string tlsDescription();
+    bool connectToServer(const std::string& serverAddress = "127.0.0.1", const std::string& port = DEFAULT_PORT);
     void run();
+
+    // Scripted use instead of run(): set the handler before connecting,
+    // start the receive thread, then send commands from any thread
+    void setOutputHandler(OutputHandler handler);
+    bool start();
+    bool sendCommand(uint16_t channel, const std::string& command);
+
+    // FEATURE_RAW_INPUT: bytes for the shell's terminal, sent as one frame
+    bool sendInput(uint16_t channel, const char* data, size_t length);
+
+    // FEATURE_SCREEN_SYNC: the screen size to ask for instead of the
+    // console's, set before connecting. The output handler then gets each
+    // screen update's bytes as channel 0's output.
+    void setScreenSize(int rows, int columns);
+
+    // FEATURE_FILE_TRANSFER: starts copying a file to or from the server,
+    // alongside the shell; a partial copy left by an earlier attempt is
+    // resumed. Without a handler the outcome is printed.
+    void setTransferHandler(TransferHandler handler);
+    bool putFile(const std::string& localPath, const std::string& remotePath);
+    bool getFile(const std::string& remotePath, const std::string& localPath);
+
+    // FEATURE_SYNC: brings 'remotePath', relative to the active channel's
+    // shell, up to date with the local directory, sending only the parts
+    // of files that changed. Without a handler the outcome is printed.
+    void setSyncHandler(SyncHandler handler);
+    bool syncDirectory(const std::string& localPath, const std::string& remotePath);
+
+    // FEATURE_COMMANDS: sends a command whose exit status and timing the
+    // server reports once the shell prompts again. Commands sent while one
+    // is running wait their turn on the server. Without a handler the
+    // result is printed.
+    void setCommandHandler(CommandHandler handler);
+    bool runCommand(uint16_t channel, const std::string& command);
+
+    // FEATURE_SEARCH: has the server look through the channel's output
+    // history (SEARCH_IGNORE_CASE, SEARCH_REGEX), returning matches with
+    // 'context' lines around them. request.id is filled in. Without a
+    // handler the lines are printed as grep -n would.
+    void setSearchHandler(SearchHandler handler);
+    bool searchHistory(uint16_t channel, SearchRequest request);
 }; 
\ No newline at end of file
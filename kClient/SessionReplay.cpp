@@ -0,0 +1,240 @@
+#include "SessionReplay.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string formatTime(uint64_t time) {
+    std::time_t seconds = (std::time_t)(time / 1000000);
+    struct tm timeinfo;
+    localtime_s(&timeinfo, &seconds);
+    char buffer[32];
+    return std::string(buffer, std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &timeinfo));
+}
+
+SessionReplay::SessionReplay() : speed(1.0), channel(-1), quiet(false) {
+    result.sessionStart = 0;
+    result.parts = 0;
+    result.chunksRead = 0;
+    result.damagedChunks = 0;
+    result.records = 0;
+    result.outputBytes = 0;
+    result.inputBytes = 0;
+    result.lostBytes = 0;
+    result.firstTime = 0;
+    result.lastTime = 0;
+    result.seekSeconds = 0.0;
+    result.seconds = 0.0;
+}
+
+bool SessionReplay::addFile(const std::string& path, std::string& error) {
+    std::unique_ptr<RecordingReader> reader(new RecordingReader());
+    if (!reader->open(path, error)) {
+        return false;
+    }
+    if (!parts.empty() && (reader->header().session != parts[0]->header().session ||
+                           reader->header().startTime != parts[0]->header().startTime)) {
+        error = path + " is from another session";
+        return false;
+    }
+    parts.push_back(std::move(reader));
+    return true;
+}
+
+void SessionReplay::setStart(const std::string& when) {
+    from = when;
+}
+
+void SessionReplay::setSpeed(double value) {
+    speed = value;
+}
+
+void SessionReplay::setChannel(int value) {
+    channel = value;
+}
+
+void SessionReplay::setQuiet(bool value) {
+    quiet = value;
+}
+
+void SessionReplay::setOutputHandler(ReplayOutputHandler handler) {
+    outputHandler = handler;
+}
+
+bool SessionReplay::startTime(uint64_t sessionStart, uint64_t& time, std::string& error) const {
+    if (from[0] == '+') {
+        char* end;
+        double seconds = strtod(from.c_str() + 1, &end);
+        if (*end == '\0' && end != from.c_str() + 1 && seconds >= 0) {
+            time = sessionStart + (uint64_t)(seconds * 1000000.0);
+            return true;
+        }
+    } else {
+        // A time of day on the day the session started, or the day after
+        // for a session that ran past midnight
+        int hours, minutes, seconds = 0;
+        char extra;
+        int fields = sscanf(from.c_str(), "%d:%d:%d%c", &hours, &minutes, &seconds, &extra);
+        if ((fields == 2 || fields == 3) && hours >= 0 && hours < 24 && minutes >= 0 && minutes < 60 &&
+            seconds >= 0 && seconds < 60) {
+            std::time_t start = (std::time_t)(sessionStart / 1000000);
+            struct tm timeinfo;
+            localtime_s(&timeinfo, &start);
+            timeinfo.tm_hour = hours;
+            timeinfo.tm_min = minutes;
+            timeinfo.tm_sec = seconds;
+            timeinfo.tm_isdst = -1;
+            std::time_t wanted = mktime(&timeinfo);
+            if (wanted < start) {
+                timeinfo.tm_mday++;
+                timeinfo.tm_isdst = -1;
+                wanted = mktime(&timeinfo);
+            }
+            time = (uint64_t)wanted * 1000000;
+            return true;
+        }
+    }
+    error = "Unknown --from time " + from + " (+seconds or HH:MM[:SS])";
+    return false;
+}
+
+void SessionReplay::notice(const std::string& text) {
+    if (!quiet) {
+        fflush(stdout);
+        fprintf(stderr, "%s\n", text.c_str());
+    }
+}
+
+void SessionReplay::play(uint16_t recordChannel, uint8_t stream, uint64_t time, const char* data, size_t length) {
+    if (outputHandler) {
+        outputHandler(recordChannel, stream, time, data, length);
+    } else {
+        fwrite(data, 1, length, stdout);
+    }
+}
+
+int SessionReplay::run() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (parts.empty()) {
+        notice("No recording to replay");
+        return 1;
+    }
+    std::sort(parts.begin(), parts.end(),
+        [](const std::unique_ptr<RecordingReader>& a, const std::unique_ptr<RecordingReader>& b) {
+            return a->header().part < b->header().part;
+        });
+    result.parts = parts.size();
+
+    const RecordingHeader& session = parts[0]->header();
+    result.sessionStart = session.startTime;
+    uint64_t target = 0;
+    if (!from.empty()) {
+        std::string error;
+        if (!startTime(session.startTime, target, error)) {
+            notice(error);
+            return 1;
+        }
+    }
+    if (!quiet) {
+        fprintf(stderr, "Session %u, started %s, %zu part%s%s\n", session.session, formatTime(session.startTime).c_str(),
+            parts.size(), parts.size() == 1 ? "" : "s",
+            parts[0]->header().part == 1 ? "" : " (the first have been rotated away)");
+    }
+
+    // The part, then the chunk, holding the first record at or after
+    // --from: two binary searches over indexes already in memory
+    size_t part = 0;
+    size_t chunk = 0;
+    for (; part < parts.size(); part++) {
+        chunk = parts[part]->findChunk(target);
+        if (chunk < parts[part]->chunks().size()) {
+            break;
+        }
+    }
+
+    std::chrono::steady_clock::time_point playStart;
+    bool seeking = true;
+    std::string raw;
+    for (; part < parts.size(); part++, chunk = 0) {
+        const RecordingReader& reader = *parts[part];
+        for (; chunk < reader.chunks().size(); chunk++) {
+            const RecordingChunk& entry = reader.chunks()[chunk];
+            if (entry.lostBytes > 0) {
+                result.lostBytes += entry.lostBytes;
+                notice("[" + std::to_string(entry.lostBytes) + " bytes not recorded here]");
+            }
+            if (!reader.readChunk(chunk, raw)) {
+                result.damagedChunks++;
+                notice("[damaged chunk skipped]");
+                continue;
+            }
+            result.chunksRead++;
+
+            size_t offset = 0;
+            RecordingRecord record;
+            while (nextRecordingRecord(raw, offset, record)) {
+                if (record.time < target) {
+                    continue;
+                }
+                if (record.stream == STREAM_STDIN) {
+                    // The shell's echo of it is in the output
+                    result.inputBytes += record.length;
+                    continue;
+                }
+                if (channel >= 0 && record.channel != channel) {
+                    continue;
+                }
+                if (seeking) {
+                    result.seekSeconds = secondsSince(start);
+                    result.firstTime = record.time;
+                    playStart = std::chrono::steady_clock::now();
+                    seeking = false;
+                } else if (speed > 0 && record.time > result.firstTime) {
+                    // Paced from the first record played, so time spent
+                    // writing doesn't add up
+                    std::chrono::steady_clock::time_point due = playStart +
+                        std::chrono::microseconds((int64_t)((record.time - result.firstTime) / speed));
+                    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                    if (due > now) {
+                        fflush(stdout);
+                        if (due - now > std::chrono::milliseconds(REPLAY_PAUSE_NOTICE_MS)) {
+                            notice("[paused " + std::to_string((record.time - result.lastTime) / 1000000) + " s until " +
+                                   formatTime(record.time) + "]");
+                        }
+                        std::this_thread::sleep_until(due);
+                    }
+                }
+                play(record.channel, record.stream, record.time, record.data, record.length);
+                result.records++;
+                result.outputBytes += record.length;
+                result.lastTime = record.time;
+            }
+        }
+    }
+    fflush(stdout);
+    result.seconds = secondsSince(start);
+    if (seeking) {
+        result.seekSeconds = result.seconds;
+    }
+
+    if (!quiet) {
+        fprintf(stderr, "\nReplayed %.2f MB of output", result.outputBytes / (1024.0 * 1024.0));
+        if (result.records > 0) {
+            fprintf(stderr, " from %s to %s", formatTime(result.firstTime).c_str(), formatTime(result.lastTime).c_str());
+        }
+        fprintf(stderr, " in %.2f s (first output after %.1f ms)\n", result.seconds, result.seekSeconds * 1000.0);
+        if (result.lostBytes > 0) {
+            fprintf(stderr, "%llu bytes were not recorded: the server fell behind\n",
+                (unsigned long long)result.lostBytes);
+        }
+        if (result.damagedChunks > 0) {
+            fprintf(stderr, "%zu damaged chunks were skipped\n", result.damagedChunks);
+        }
+    }
+    return result.damagedChunks > 0 ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "../platform.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../FrameProtocol.h"
+#include "../Recording.h"
+
+// A pause in the recording longer than this is shown as "[paused ...]"
+// while it is waited out at --speed
+#define REPLAY_PAUSE_NOTICE_MS 5000
+
+// How a replay went
+struct ReplayReport {
+    uint64_t sessionStart;      // Microseconds since 1970
+    size_t parts;
+    size_t chunksRead;          // Decompressed; the ones before --from are never touched
+    size_t damagedChunks;
+    uint64_t records;
+    uint64_t outputBytes;       // Played
+    uint64_t inputBytes;        // Recorded as sent to the shells, not played
+    uint64_t lostBytes;         // The recorder fell behind and dropped them
+    uint64_t firstTime;         // Of the first record played, microseconds since 1970
+    uint64_t lastTime;
+    double seekSeconds;         // Opening the parts and finding --from
+    double seconds;
+};
+
+// Receives what the replay plays in place of stdout: output records only,
+// as they were read from the shell
+typedef std::function<void(uint16_t channel, uint8_t stream, uint64_t time, const char* data, size_t length)>
+    ReplayOutputHandler;
+
+// Plays back a session recorded by kServer --record (--replay <parts>).
+// Every part is memory-mapped and indexed on opening, so starting from
+// any time (--from) reads only the chunk holding it. Output is written as
+// it was read from the shell, either paced like the original (--speed,
+// 1 by default) or as fast as it can be decompressed (--fast).
+class SessionReplay {
+private:
+    std::vector<std::unique_ptr<RecordingReader>> parts;
+    std::string from;
+    double speed;               // 0: as fast as possible
+    int channel;                // -1: every channel
+    bool quiet;
+    ReplayOutputHandler outputHandler;
+    ReplayReport result;
+
+    bool startTime(uint64_t sessionStart, uint64_t& time, std::string& error) const;
+    void play(uint16_t channel, uint8_t stream, uint64_t time, const char* data, size_t length);
+    void notice(const std::string& text);
+
+public:
+    SessionReplay();
+
+    // One part of the recording, in any order; false, with 'error' saying
+    // why, if it can't be read
+    bool addFile(const std::string& path, std::string& error);
+
+    // "+<seconds>" into the session, or "HH:MM[:SS]" local time
+    void setStart(const std::string& when);
+
+    // 1 plays at the recorded pace, 2 twice as fast; 0 without pauses
+    void setSpeed(double speed);
+
+    // Only this channel's output; -1 for all of them
+    void setChannel(int channel);
+
+    // No notices or summary on stderr
+    void setQuiet(bool quiet);
+
+    // Headless use (kBench)
+    void setOutputHandler(ReplayOutputHandler handler);
+
+    // Plays the recording; 0 once it has all been played, 1 if it couldn't
+    // start or a chunk was damaged
+    int run();
+
+    const ReplayReport& report() const { return result; }
+};
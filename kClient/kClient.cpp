@@ -2,23 +2,198 @@
 //
 
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <vector>
 #include "RemoteTerminalClient.h"
+#include "BatchRunner.h"
+#include "SessionReplay.h"
 
-int main(int argc, char* argv[]) {
-    printf("Remote Terminal Client Starting...\n");
+// The non-empty lines of a file, or of stdin for "-"; '#' starts a comment
+// line. False if the file can't be read.
+static bool readLines(const std::string& path, std::vector<std::string>& lines) {
+    std::ifstream file;
+    if (path != "-") {
+        file.open(path);
+        if (!file) {
+            return false;
+        }
+    }
+    std::istream& input = (path == "-") ? std::cin : file;
+    std::string line;
+    while (std::getline(input, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] != '#') {
+            lines.push_back(line);
+        }
+    }
+    return true;
+}
 
+int main(int argc, char* argv[]) {
     RemoteTerminalClient client;
-    
+
+    // Default to localhost, or use command line argument for server address
+    std::string serverAddress = "127.0.0.1";
+    uint32_t features = CLIENT_FEATURES;
+
+    // Batch mode: a script run on every host given
+    std::string script;
+    std::vector<std::string> hosts;
+    std::string outputDirectory;
+    int parallel = BATCH_DEFAULT_PARALLEL;
+    int timeoutSeconds = 0;
+
+    // Replay: a recording's parts (kServer --record) played to stdout
+    std::vector<std::string> replayFiles;
+    std::string replayFrom;
+    double replaySpeed = 1.0;
+    int replayChannel = -1;
+
+    // Encryption: any of the TLS options turns it on
+    bool tls = false;
+    std::string tlsCaFile;
+    std::string tlsFingerprint;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) {
+            script = argv[++i];
+        } else if (arg == "--hosts" && i + 1 < argc) {
+            std::string file = argv[++i];
+            if (!readLines(file, hosts)) {
+                printf("Unable to read %s\n", file.c_str());
+                return 1;
+            }
+        } else if (arg == "--output-dir" && i + 1 < argc) {
+            outputDirectory = argv[++i];
+        } else if (arg == "--parallel" && i + 1 < argc) {
+            parallel = atoi(argv[++i]);
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            timeoutSeconds = atoi(argv[++i]);
+        } else if (arg == "--replay" && i + 1 < argc) {
+            // Every part named, as a shell glob over a session gives them
+            while (i + 1 < argc && argv[i + 1][0] != '-') {
+                replayFiles.push_back(argv[++i]);
+            }
+        } else if (arg == "--from" && i + 1 < argc) {
+            replayFrom = argv[++i];
+        } else if (arg == "--speed" && i + 1 < argc) {
+            replaySpeed = atof(argv[++i]);
+        } else if (arg == "--fast") {
+            replaySpeed = 0;
+        } else if (arg == "--channel" && i + 1 < argc) {
+            replayChannel = atoi(argv[++i]);
+        } else if (arg == "--tls") {
+            tls = true;
+        } else if (arg == "--tls-ca" && i + 1 < argc) {
+            // Check the server's certificate against these CAs and its name
+            tls = true;
+            tlsCaFile = argv[++i];
+        } else if (arg == "--tls-fingerprint" && i + 1 < argc) {
+            // Or accept only the certificate with this SHA-256
+            tls = true;
+            tlsFingerprint = argv[++i];
+        } else if (arg == "--no-compress") {
+            features &= ~FEATURE_COMPRESSION;
+        } else if (arg == "--no-resume") {
+            features &= ~FEATURE_RESUME;
+        } else if (arg == "--raw") {
+            // Keystrokes straight to the remote terminal, for editors and
+            // other full-screen programs
+            features |= FEATURE_RAW_INPUT;
+        } else if (arg == "--screen-sync") {
+            // --raw, drawing the server's copy of the screen instead of the
+            // shell's output, so a flood costs no more than a screen a frame
+            features |= FEATURE_RAW_INPUT | FEATURE_SCREEN_SYNC;
+        } else if (arg == "--predict" && i + 1 < argc) {
+            // When --raw draws typing before its echo comes back
+            std::string mode = argv[++i];
+            if (mode == "adaptive") {
+                client.setPredictMode(PREDICT_ADAPTIVE);
+            } else if (mode == "always") {
+                client.setPredictMode(PREDICT_ALWAYS);
+            } else if (mode == "never") {
+                client.setPredictMode(PREDICT_NEVER);
+            } else {
+                printf("Unknown --predict mode %s (adaptive, always or never)\n", mode.c_str());
+                return 1;
+            }
+        } else if (arg == "--stderr" && i + 1 < argc) {
+            // How line mode shows the shell's stderr
+            std::string mode = argv[++i];
+            if (mode == "color") {
+                client.setStderrMode(STDERR_COLOR);
+            } else if (mode == "plain") {
+                client.setStderrMode(STDERR_PLAIN);
+            } else if (mode == "hide") {
+                client.setStderrMode(STDERR_HIDE);
+            } else if (mode == "split") {
+                client.setStderrMode(STDERR_SPLIT);
+            } else {
+                printf("Unknown --stderr mode %s (color, plain, hide or split)\n", mode.c_str());
+                return 1;
+            }
+        } else {
+            serverAddress = arg;
+            hosts.push_back(arg);
+        }
+    }
+
+    if (!replayFiles.empty()) {
+        SessionReplay replay;
+        for (size_t i = 0; i < replayFiles.size(); i++) {
+            std::string error;
+            if (!replay.addFile(replayFiles[i], error)) {
+                printf("%s\n", error.c_str());
+                return 1;
+            }
+        }
+        replay.setStart(replayFrom);
+        replay.setSpeed(replaySpeed);
+        replay.setChannel(replayChannel);
+        return replay.run();
+    }
+
+    std::shared_ptr<TlsClientContext> tlsContext;
+    if (tls) {
+        std::string error;
+        tlsContext.reset(new TlsClientContext());
+        if (!tlsContext->initialize(tlsCaFile, tlsFingerprint, error)) {
+            printf("TLS unavailable: %s\n", error.c_str());
+            return 1;
+        }
+    }
+
+    if (!script.empty()) {
+        std::vector<std::string> commands;
+        if (!readLines(script, commands)) {
+            printf("Unable to read %s\n", script.c_str());
+            return 1;
+        }
+        if (hosts.empty()) {
+            hosts.push_back(serverAddress);
+        }
+        BatchRunner batch(commands);
+        for (size_t i = 0; i < hosts.size(); i++) {
+            batch.addHost(hosts[i]);
+        }
+        batch.setOutputDirectory(outputDirectory);
+        batch.setParallel(parallel);
+        batch.setTimeout(timeoutSeconds * 1000);
+        batch.setTls(tlsContext);
+        return batch.run();
+    }
+
+    printf("Remote Terminal Client Starting...\n");
     if (!client.initialize()) {
         printf("Failed to initialize client\n");
         return 1;
     }
-
-    // Default to localhost, or use command line argument for server address
-    std::string serverAddress = "127.0.0.1";
-    if (argc > 1) {
-        serverAddress = argv[1];
+    client.setRequestedFeatures(features);
+    if (tlsContext) {
+        client.setTls(tlsContext);
     }
 
     if (!client.connectToServer(serverAddress)) {
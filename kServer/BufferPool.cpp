@@ -0,0 +1,59 @@
+#include "BufferPool.h"
+
+void IoBuffer::release() {
+    if (--refCount == 0) {
+        pool->recycle(this);
+    }
+}
+
+BufferPool::BufferPool() : freeList(NULL) {
+    counters.acquires = 0;
+    counters.slabAllocations = 0;
+    counters.buffersInUse = 0;
+    counters.highWaterBytes = 0;
+    counters.reservedBytes = 0;
+}
+
+void BufferPool::grow() {
+    std::unique_ptr<IoBuffer[]> slab(new IoBuffer[IO_BUFFERS_PER_SLAB]);
+    for (size_t i = 0; i < IO_BUFFERS_PER_SLAB; i++) {
+        slab[i].pool = this;
+        slab[i].nextFree = freeList;
+        freeList = &slab[i];
+    }
+    slabs.push_back(std::move(slab));
+    counters.slabAllocations++;
+    counters.reservedBytes += IO_BUFFERS_PER_SLAB * sizeof(IoBuffer);
+}
+
+IoBuffer* BufferPool::acquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!freeList) {
+        grow();
+    }
+
+    IoBuffer* buffer = freeList;
+    freeList = buffer->nextFree;
+    buffer->nextFree = NULL;
+    buffer->refCount = 1;
+    buffer->used = 0;
+
+    counters.acquires++;
+    counters.buffersInUse++;
+    if (counters.buffersInUse * sizeof(IoBuffer) > counters.highWaterBytes) {
+        counters.highWaterBytes = counters.buffersInUse * sizeof(IoBuffer);
+    }
+    return buffer;
+}
+
+void BufferPool::recycle(IoBuffer* buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer->nextFree = freeList;
+    freeList = buffer;
+    counters.buffersInUse--;
+}
+
+BufferPool::Stats BufferPool::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Size of one pooled I/O buffer. Shell pipes read straight into these and
+// the filled ranges are sent from them, so output is never copied into a
+// std::string on its way to the socket.
+#define IO_BUFFER_SIZE (16 * 1024)
+
+// Buffers are carved out of slabs of this many; a slab is never freed
+#define IO_BUFFERS_PER_SLAB 64
+
+class BufferPool;
+
+// A fixed-size buffer owned by a BufferPool. Each user (an outstanding pipe
+// read, a queued send) holds a reference; the buffer returns to the pool
+// when the last one is dropped. Buffers belong to one session at a time, so
+// the reference count is only touched on that session's loop thread.
+struct IoBuffer {
+    BufferPool* pool;
+    IoBuffer* nextFree;
+    int refCount;
+    size_t used;                // Bytes filled so far, from the front
+    char data[IO_BUFFER_SIZE];
+
+    size_t space() const { return IO_BUFFER_SIZE - used; }
+    char* tail() { return data + used; }
+
+    void addRef() { refCount++; }
+    void release();
+};
+
+// A referenced range inside an IoBuffer
+struct IoSlice {
+    IoBuffer* buffer;
+    const char* data;
+    size_t length;
+};
+
+// Free list of IoBuffers shared by every session. Acquiring a buffer only
+// touches the heap when the pool has to grow by another slab, so steady
+// state output costs no allocations.
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t acquires;          // Buffers handed out since startup
+        uint64_t slabAllocations;   // Heap allocations since startup
+        size_t buffersInUse;
+        size_t highWaterBytes;      // Most memory ever held by buffers in use
+        size_t reservedBytes;       // Memory held by all slabs
+    };
+
+private:
+    std::mutex mutex;
+    IoBuffer* freeList;
+    std::vector<std::unique_ptr<IoBuffer[]>> slabs;
+    Stats counters;
+
+    void grow();
+
+public:
+    BufferPool();
+
+    // Returns an empty buffer holding one reference
+    IoBuffer* acquire();
+    void recycle(IoBuffer* buffer);
+
+    Stats stats();
+};
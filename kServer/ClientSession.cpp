@@ -0,0 +1,2617 @@
+#include "ClientSession.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "../Checksum.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+static size_t formatTimestamp(char* buffer, size_t size) {
+    std::time_t rawtime;
+    std::time(&rawtime);
+    // Sessions on different loops format timestamps concurrently
+    struct tm timeinfo;
+    localtime_s(&timeinfo, &rawtime);
+    return std::strftime(buffer, size, "[%H:%M:%S] ", &timeinfo);
+}
+
+static uint64_t captureTime(std::chrono::steady_clock::time_point readTime) {
+    // The wall clock is read once; later times are measured from it on the
+    // monotonic clock, so they never step back and match the latency metrics
+    static const std::chrono::steady_clock::time_point steadyStart = std::chrono::steady_clock::now();
+    static const int64_t wallStart = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    return (uint64_t)(wallStart + std::chrono::duration_cast<std::chrono::microseconds>(readTime - steadyStart).count());
+}
+
+// 64-bit positions: a spill file can outgrow a 32-bit long
+static bool seekFile(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// A spilled read: this header, then its bytes. The file is the session's
+// own, so the header is written as it is in memory.
+struct SpillHeader {
+    int64_t readTime;       // steady_clock ticks
+    uint32_t length;        // At most IO_BUFFER_SIZE, as a read is
+    uint8_t stream;
+};
+
+enum MarkMatch {
+    MARK_NONE,
+    MARK_PARTIAL,       // The data ends before it could tell
+    MARK_FOUND,
+};
+
+static MarkMatch matchPromptMark(const char* data, size_t length, size_t& markLength, bool& hasStatus, int& status) {
+    // 'data' starts with an escape; see PROMPT_MARK for what follows it
+    size_t prefixLength = sizeof(PROMPT_MARK) - 1;
+    if (memcmp(data, PROMPT_MARK, length < prefixLength ? length : prefixLength) != 0) {
+        return MARK_NONE;
+    }
+    size_t i = prefixLength;
+    hasStatus = false;
+    status = 0;
+    if (i < length && data[i] == ';') {
+        bool negative = ++i < length && data[i] == '-';
+        i += negative ? 1 : 0;
+        for (int digits = 0; i < length && digits < 9 && data[i] >= '0' && data[i] <= '9'; digits++) {
+            status = status * 10 + (data[i++] - '0');
+            hasStatus = true;
+        }
+        status = negative ? -status : status;
+    }
+    if (i + 1 < length && data[i] == '\x1b' && data[i + 1] == '\\') {
+        markLength = i + 2;
+        return MARK_FOUND;
+    }
+    if (i < length && data[i] == '\a') {
+        markLength = i + 1;
+        return MARK_FOUND;
+    }
+    return (i >= length || (i + 1 == length && data[i] == '\x1b')) && length < PROMPT_MARK_MAX ? MARK_PARTIAL : MARK_NONE;
+}
+
+static std::string getCurrentTimestamp() {
+    char buffer[100];
+    size_t length = formatTimestamp(buffer, sizeof(buffer));
+    return std::string(buffer, length);
+}
+
+ClientSession::ClientSession(EventLoop& loop, BufferPool& pool, SessionRegistry& registry, ShellPool& shellPool,
+                             const OutputQueueConfig& queueConfig, OutputQueueStats& queueStats, SOCKET clientSocket,
+                             std::unique_ptr<PersistentShell> shell, std::unique_ptr<SecureChannel> secure,
+                             const std::string& input)
+    : loop(loop), pool(pool), registry(registry), shellPool(shellPool), queueConfig(queueConfig), queueStats(queueStats),
+      clientSocket(clientSocket), state(NEGOTIATING), framed(false), compressOutput(false), multiplexed(false), rawInput(false), fileTransfer(false), treeSync(false), outputStreams(false), trackCommands(false), searchable(false), screenSync(false), refCount(1), recvPending(false), recvPaused(false), inputQueuedBytes(0),
+      sendHead(0), sendOffset(0), sendPending(false), closeWhenSent(false), sendQueuedBytes(0), backlogBytes(0),
+      reportedDepth(0), stalled(false), readsBlocked(false), peakDepth(0), stalledSeconds(0.0), droppedBytes(0),
+      spilledBytes(0), searchPosted(false), screenTimer(0), scratch(NULL), bytesSent(0), sendCalls(0), helloTimer(0), exiting(false),
+      sealedOffset(0), sealedPlain(0), pendingSocket(INVALID_SOCKET), pendingSecure(std::move(secure)), pendingInput(input),
+      detachTimer(0), resumes(0) {
+    ZeroMemory(&recvOperation, sizeof(recvOperation));
+    ZeroMemory(&sendOperation, sizeof(sendOperation));
+    if (registry.recorder()) {
+        recording = registry.recorder()->startRecording();
+    }
+    createChannel(0, std::move(shell));
+    countMetric(METRIC_SESSIONS_STARTED);
+    adjustGauge(METRIC_SESSIONS, 1);
+}
+
+ClientSession::~ClientSession() {
+    // Every operation has completed, so all buffers can go back to the pool
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        releaseChannel(*it->second);
+    }
+    for (size_t i = 0; i < closedChannels.size(); i++) {
+        releaseChannel(*closedChannels[i]);
+    }
+    for (size_t i = sendHead; i < sendQueue.size(); i++) {
+        if (sendQueue[i].buffer) {
+            sendQueue[i].buffer->release();
+        }
+    }
+    if (scratch) {
+        scratch->release();
+    }
+
+    // Take this session out of the server-wide backpressure totals
+    queueStats.queuedBytes -= reportedDepth;
+    if (stalled) {
+        std::chrono::duration<double> stall = std::chrono::steady_clock::now() - stallStart;
+        stalledSeconds += stall.count();
+        queueStats.stallMicroseconds += (uint64_t)(stall.count() * 1e6);
+        queueStats.stalledSessions--;
+    }
+
+    // The shells are destroyed with the session, after their pipe reads have drained
+    reportSendStats();
+    reportQueueStats();
+    if (screen) {
+        const ScreenStats& stats = screen->statistics();
+        logMessage(LOG_INFO, "Screen sync drew %.2f MB of output as %llu updates totalling %.2f MB",
+            stats.writtenBytes / (1024.0 * 1024.0), (unsigned long long)stats.updates,
+            stats.updateBytes / (1024.0 * 1024.0));
+    }
+    adjustGauge(METRIC_SESSIONS, -1);
+    logMessage(LOG_INFO, "Client connection closed");
+}
+
+void ClientSession::addRef() {
+    refCount++;
+}
+
+void ClientSession::release() {
+    if (--refCount == 0) {
+        delete this;
+    }
+}
+
+void ClientSession::start(bool helloTimedOut) {
+    // Held to the end: a legacy client's first command or a TLS client's
+    // hello is already in, and a bad one closes the session before
+    // beginSession() or takeConnection() returns
+    addRef();
+
+    // Route completions for the socket and the shell's output to this session
+    if (!attachSocket() || !attachChannel(*channels[0])) {
+        logMessage(LOG_ERROR, "Failed to attach client to event loop: %lu", GetLastError());
+        close();
+        release();
+        return;
+    }
+
+    // A framed client speaks first with FRAME_HELLO; legacy clients stay
+    // silent until the user types a command
+    if (helloTimedOut) {
+        logMessage(LOG_INFO, "No protocol hello, using legacy marker mode");
+        beginSession();
+    } else {
+        addRef();
+        helloTimer = loop.addTimer(HELLO_TIMEOUT_MS, [this]() {
+            helloTimer = 0;
+            if (state == NEGOTIATING) {
+                logMessage(LOG_INFO, "No protocol hello, using legacy marker mode");
+                beginSession();
+            }
+            release();
+        });
+    }
+
+    takeConnection();
+    if (state == NEGOTIATING || state == ACTIVE) {
+        postRecv();
+    }
+    release();
+}
+
+bool ClientSession::attachSocket() {
+    // Latency of small interactive writes is handled by flushing them
+    // immediately; bulk output is batched by the coalescer instead of Nagle
+    BOOL noDelay = TRUE;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    return loop.attach((IoHandle)clientSocket, this);
+}
+
+bool ClientSession::reattach(SOCKET socket, std::unique_ptr<SecureChannel>&& secure, const std::string& input) {
+    if (state == CLOSING) {
+        return false;
+    }
+    if (state != DETACHED) {
+        // After a network change the old connection can look alive for
+        // minutes; the client's reconnect is the better evidence
+        logMessage(LOG_INFO, "Client reconnected, dropping its previous connection");
+        detach();
+    }
+    if (pendingSocket != INVALID_SOCKET) {
+        closesocket(pendingSocket);
+    }
+    pendingSocket = socket;
+    pendingSecure = std::move(secure);
+    pendingInput = input;
+    adoptConnection();
+    return true;
+}
+
+void ClientSession::disconnect() {
+    // A resumable session keeps its shells for the client to come back to
+    if (token.empty() || exiting) {
+        close();
+    } else {
+        detach();
+    }
+}
+
+void ClientSession::detach() {
+    if (state == DETACHED || state == CLOSING) {
+        return;
+    }
+    state = DETACHED;
+    adjustGauge(METRIC_DETACHED_SESSIONS, 1);
+
+    if (helloTimer) {
+        loop.cancelTimer(helloTimer);
+        helloTimer = 0;
+        release();
+    }
+    loop.detach((IoHandle)clientSocket);
+    closesocket(clientSocket);
+    clientSocket = INVALID_SOCKET;
+    secure.reset();
+    closeWhenSent = false;
+    recvPaused = false;
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        it->second->replaying = false;
+    }
+
+    // An aborted send may still be using the queued buffers
+    if (!sendPending) {
+        discardSendQueue();
+    }
+
+    size_t scrollbackBytes = 0;
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        scrollbackBytes += it->second->scrollback->memoryBytes();
+    }
+    logMessage(LOG_INFO, "Client detached from session %s, keeping %zu shells (%zu KB of scrollback) for %lu s",
+        describeToken(token).c_str(), channels.size(), scrollbackBytes / 1024,
+        (unsigned long)(registry.detachTimeout() / 1000));
+
+    addRef();
+    detachTimer = loop.addTimer(registry.detachTimeout(), [this]() {
+        detachTimer = 0;
+        logMessage(LOG_INFO, "Detached session %s expired", describeToken(token).c_str());
+        close();
+        release();
+    });
+}
+
+void ClientSession::discardSendQueue() {
+    // Whatever the lost connection didn't deliver is in the scrollback
+    for (size_t i = sendHead; i < sendQueue.size(); i++) {
+        if (sendQueue[i].buffer) {
+            sendQueue[i].buffer->release();
+        }
+    }
+    sendQueue.clear();
+    sendHead = 0;
+    sendOffset = 0;
+    sendQueuedBytes = 0;
+    sealed.clear();
+    sealedOffset = 0;
+    abortTransfers();
+    abortSyncs();
+    abortSearches();
+
+    // Output held back for the client goes to the scrollback as well, and
+    // shells paused for it run freely until it returns
+    updateQueueStats();
+    releaseBacklogs();
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        resumeReads(*it->second);
+    }
+}
+
+void ClientSession::adoptConnection() {
+    // The new connection reuses the operation structures, so it waits until
+    // the old one's aborted operations are back
+    if (pendingSocket == INVALID_SOCKET || recvPending || sendPending) {
+        return;
+    }
+    // Held to the end, as the timer's reference may be the only other one
+    // and a bad hello closes the session in takeConnection()
+    addRef();
+    if (detachTimer != 0) {
+        loop.cancelTimer(detachTimer);
+        detachTimer = 0;
+        release();
+    }
+    adjustGauge(METRIC_DETACHED_SESSIONS, -1);
+
+    clientSocket = pendingSocket;
+    pendingSocket = INVALID_SOCKET;
+    if (!attachSocket()) {
+        logMessage(LOG_ERROR, "Failed to attach client to event loop: %lu", GetLastError());
+        closesocket(clientSocket);
+        clientSocket = INVALID_SOCKET;
+        close();
+    } else {
+        // The client starts over with a fresh decoder; its hello is already
+        // waiting, or was decrypted on the accept thread
+        state = NEGOTIATING;
+        reader = FrameReader();
+        compressor.reset();
+        takeConnection();
+        if (state == NEGOTIATING || state == ACTIVE) {
+            postRecv();
+        }
+    }
+    release();
+}
+
+void ClientSession::takeConnection() {
+    // A TLS client's handshake and hello have already been read, on the
+    // accept thread; the session carries on from there
+    secure = std::move(pendingSecure);
+    sealed.clear();
+    sealedOffset = 0;
+    if (secure) {
+        secureInput.resize(TLS_RECEIVE_SIZE);
+    }
+    if (pendingInput.empty()) {
+        return;
+    }
+    size_t offset = 0;
+    while (offset < pendingInput.length()) {
+        size_t length = std::min(pendingInput.length() - offset, reader.writeSpace());
+        memcpy(reader.writePtr(), pendingInput.data() + offset, length);
+        reader.commit(length);
+        offset += length;
+    }
+    pendingInput.clear();
+    processInput();
+}
+
+void ClientSession::onIoComplete(IoOperation* operation, DWORD bytesTransferred, DWORD status) {
+    if (operation == &recvOperation) {
+        onRecv(bytesTransferred, status);
+    } else if (operation == &sendOperation) {
+        onSend(bytesTransferred, status);
+    } else if (PipeWrite* input = findShellWrite(operation)) {
+        onShellWrite(*input, bytesTransferred, status);
+    } else {
+        onShellRead(*reinterpret_cast<PipeRead*>(operation), bytesTransferred, status);
+    }
+
+    // Drop the reference the operation held (may delete the session)
+    release();
+}
+
+void ClientSession::postRecv() {
+    ZeroMemory(&recvOperation, sizeof(recvOperation));
+    addRef();
+    recvPending = true;
+    bool started = secure ? loop.postReceive(clientSocket, secureInput.data(), secureInput.size(), &recvOperation)
+                          : loop.postReceive(clientSocket, reader.writePtr(), reader.writeSpace(), &recvOperation);
+    if (!started) {
+        logMessage(LOG_ERROR, "recv failed with error: %lu", GetLastError());
+        recvPending = false;
+        release();
+        disconnect();
+    }
+}
+
+void ClientSession::onRecv(DWORD bytes, DWORD status) {
+    recvPending = false;
+    if (state == CLOSING) {
+        return;
+    }
+    if (state == DETACHED) {
+        // The old connection's aborted receive
+        adoptConnection();
+        return;
+    }
+    if (status != 0 || bytes == 0) {
+        logMessage(LOG_INFO, "Client disconnected");
+        disconnect();
+        return;
+    }
+
+    countMetric(METRIC_RECV_CALLS);
+    countMetric(METRIC_BYTES_RECEIVED, bytes);
+    if (!secure) {
+        reader.commit(bytes);
+    } else if (!decrypt(bytes)) {
+        logMessage(LOG_INFO, "Client disconnected: %s", secure->error().c_str());
+        disconnect();
+        return;
+    }
+    processInput();
+
+    if (state == NEGOTIATING || state == ACTIVE) {
+        // Input the shells can't take yet holds up the client's
+        if (inputQueuedBytes >= INPUT_QUEUE_LIMIT) {
+            recvPaused = true;
+        } else {
+            postRecv();
+        }
+    }
+}
+
+void ClientSession::postSend() {
+    ZeroMemory(&sendOperation, sizeof(sendOperation));
+    addRef();
+    sendPending = true;
+    sendCalls++;
+    sendStart = std::chrono::steady_clock::now();
+
+    bool started;
+    if (secure) {
+        // Queued bytes go out as TLS records, which may take more than one
+        // send; onSend retires them once the last has gone
+        started = sealedOffset < sealed.size() || sealQueue();
+        if (started) {
+            IoVec buffer;
+            buffer.buf = &sealed[sealedOffset];
+            buffer.len = (ULONG)(sealed.size() - sealedOffset);
+            started = loop.postSend(clientSocket, &buffer, 1, &sendOperation);
+        }
+    } else if (sendQueue[sendHead].transfer) {
+        // A file range goes out on its own, from the file
+        const SendSegment& head = sendQueue[sendHead];
+        started = loop.postTransmit(clientSocket, head.transfer->handle(), head.fileOffset + sendOffset,
+            head.length - sendOffset, &sendOperation);
+    } else {
+        // Gather as many queued segments as fit into a single WSASend, up
+        // to the next file range
+        IoVec buffers[MAX_SEND_BUFFERS];
+        DWORD count = 0;
+        for (size_t i = sendHead; i < sendQueue.size() && count < MAX_SEND_BUFFERS && !sendQueue[i].transfer; i++) {
+            size_t offset = (count == 0) ? sendOffset : 0;
+            buffers[count].buf = const_cast<char*>(sendQueue[i].bytes()) + offset;
+            buffers[count].len = (ULONG)(sendQueue[i].size() - offset);
+            count++;
+        }
+        started = loop.postSend(clientSocket, buffers, count, &sendOperation);
+    }
+    if (!started) {
+        logMessage(LOG_ERROR, "Failed to send output to client: %lu", GetLastError());
+        sendPending = false;
+        release();
+        disconnect();
+    }
+}
+
+void ClientSession::onSend(DWORD bytes, DWORD status) {
+    sendPending = false;
+    if (state == CLOSING) {
+        return;
+    }
+    if (state == DETACHED) {
+        // The old connection's aborted send has let go of the queue
+        discardSendQueue();
+        adoptConnection();
+        return;
+    }
+    if (status != 0) {
+        logMessage(LOG_ERROR, "Failed to send output to client");
+        disconnect();
+        return;
+    }
+
+    // Retire everything that went out
+    countMetric(METRIC_SEND_CALLS);
+    countMetric(METRIC_BYTES_SENT, bytes);
+    observeLatency(METRIC_SEND_TIME, std::chrono::steady_clock::now() - sendStart);
+    bytesSent += bytes;
+    if (secure) {
+        sealedOffset += bytes;
+        if (sealedOffset < sealed.size()) {
+            postSend();
+            return;
+        }
+        bytes = (DWORD)sealedPlain;
+    }
+    FileTransfer* sentChunk = NULL;
+    if (sendHead < sendQueue.size() && sendQueue[sendHead].transfer) {
+        countMetric(METRIC_FILE_BYTES_SENT, bytes);
+    } else {
+        sendQueuedBytes -= bytes;
+    }
+    while (bytes > 0 && sendHead < sendQueue.size()) {
+        SendSegment& segment = sendQueue[sendHead];
+        size_t remaining = segment.size() - sendOffset;
+        if (bytes < remaining) {
+            sendOffset += bytes;
+            break;
+        }
+        bytes -= (DWORD)remaining;
+        if (segment.buffer) {
+            segment.buffer->release();
+        }
+        if (segment.transfer) {
+            sentChunk = segment.transfer;
+        }
+        segment.owned.clear();
+        sendHead++;
+        sendOffset = 0;
+    }
+
+    // The queue keeps its capacity, so a steady stream of sends doesn't
+    // allocate
+    if (sendHead == sendQueue.size()) {
+        sendQueue.clear();
+        sendHead = 0;
+    } else if (sendHead >= MAX_SEND_BUFFERS && sendHead * 2 >= sendQueue.size()) {
+        sendQueue.erase(sendQueue.begin(), sendQueue.begin() + sendHead);
+        sendHead = 0;
+    }
+
+    // Once the client is keeping up again, feed it the output held back
+    // meanwhile
+    updateQueueStats();
+    if (!closeWhenSent) {
+        releaseBacklogs();
+    }
+
+    // A download's next chunk queues behind the output that arrived while
+    // this one was going out
+    if (sentChunk) {
+        sentChunk->chunkQueued = false;
+        queueFileChunk(*sentChunk);
+    }
+
+    // A search waits for its results to drain before it reads on
+    if (!searches.empty()) {
+        scheduleSearch();
+    }
+
+    if (sendHead < sendQueue.size() || (secure && secure->hasOutput())) {
+        startSend();
+    } else if (closeWhenSent) {
+        close();
+    }
+}
+
+bool ClientSession::decrypt(DWORD bytes) {
+    if (!secure->receive(secureInput.data(), bytes)) {
+        return false;
+    }
+    size_t length;
+    while ((length = secure->read(reader.writePtr(), reader.writeSpace())) > 0) {
+        reader.commit(length);
+    }
+
+    // Replies the protocol makes on its own (key updates)
+    if (secure->hasOutput()) {
+        startSend();
+    }
+    return !secure->failed();
+}
+
+bool ClientSession::sealQueue() {
+    // Encrypts what a plain send would have gathered, as one batch: queued
+    // segments up to the next file range, or a file range on its own,
+    // which is read from the file here rather than transmitted
+    sealed.clear();
+    sealedOffset = 0;
+    sealBuffer.clear();
+    if (sendHead < sendQueue.size() && sendQueue[sendHead].transfer) {
+        const SendSegment& head = sendQueue[sendHead];
+        size_t length = std::min(head.length - sendOffset, (size_t)TLS_SEND_BATCH);
+        sealBuffer.resize(length);
+        if (!head.transfer->readAt(head.fileOffset + sendOffset, &sealBuffer[0], length)) {
+            return false;
+        }
+    } else {
+        for (size_t i = sendHead; i < sendQueue.size() && !sendQueue[i].transfer && sealBuffer.length() < TLS_SEND_BATCH; i++) {
+            size_t offset = (i == sendHead) ? sendOffset : 0;
+            size_t length = std::min(sendQueue[i].size() - offset, TLS_SEND_BATCH - sealBuffer.length());
+            sealBuffer.append(sendQueue[i].bytes() + offset, length);
+        }
+    }
+    sealedPlain = sealBuffer.length();
+    if (!secure->write(sealBuffer.data(), sealBuffer.length())) {
+        return false;
+    }
+    secure->takeOutput(sealed);
+    return true;
+}
+
+char* ClientSession::allocate(size_t length, IoSlice& slice) {
+    if (!scratch || scratch->space() < length) {
+        if (scratch) {
+            scratch->release();
+        }
+        scratch = pool.acquire();
+    }
+    char* data = scratch->tail();
+    scratch->used += length;
+    scratch->addRef();
+    slice.buffer = scratch;
+    slice.data = data;
+    slice.length = length;
+    return data;
+}
+
+void ClientSession::pushSlice(const IoSlice& slice) {
+    // Takes over the slice's reference
+    if (state != ACTIVE) {
+        slice.buffer->release();
+        return;
+    }
+    SendSegment segment;
+    segment.buffer = slice.buffer;
+    segment.data = slice.data;
+    segment.length = slice.length;
+    segment.transfer = NULL;
+    segment.fileOffset = 0;
+    sendQueue.push_back(std::move(segment));
+    sendQueuedBytes += slice.length;
+}
+
+void ClientSession::pushFile(FileTransfer& transfer, uint64_t offset, size_t length) {
+    // The file stays open while the range is queued (see queueFileChunk),
+    // and its bytes don't count against the queue's memory
+    SendSegment segment;
+    segment.buffer = NULL;
+    segment.data = NULL;
+    segment.length = length;
+    segment.transfer = &transfer;
+    segment.fileOffset = offset;
+    sendQueue.push_back(std::move(segment));
+}
+
+void ClientSession::pushCopy(const char* data, size_t length) {
+    while (length > 0) {
+        // Avoid splitting the copy into slivers at the end of a buffer
+        size_t chunk = length < IO_BUFFER_SIZE ? length : IO_BUFFER_SIZE;
+        if (scratch && scratch->space() >= DEFAULT_BUFLEN && scratch->space() < chunk) {
+            chunk = scratch->space();
+        }
+        IoSlice slice;
+        memcpy(allocate(chunk, slice), data, chunk);
+        pushSlice(slice);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void ClientSession::startSend() {
+    updateQueueStats();
+    if (!sendPending && (sendHead < sendQueue.size() || (secure && secure->hasOutput()))) {
+        postSend();
+    }
+}
+
+void ClientSession::queueSend(std::string data) {
+    // Without a connection there is no one to tell; the scrollback keeps
+    // the shell output
+    if (state != ACTIVE) {
+        return;
+    }
+    SendSegment segment;
+    segment.buffer = NULL;
+    segment.data = NULL;
+    segment.length = 0;
+    segment.owned = std::move(data);
+    segment.transfer = NULL;
+    segment.fileOffset = 0;
+    sendQueuedBytes += segment.owned.length();
+    sendQueue.push_back(std::move(segment));
+    startSend();
+}
+
+void ClientSession::sendMessage(Channel& channel, uint8_t stream, const std::string& message) {
+    // A synced screen shows them where the client would have; before the
+    // client's size is known there is nowhere to draw them
+    if (channel.id == 0 && screenSync) {
+        if (screen) {
+            screen->writeMessage(message);
+            updateScreen(false);
+        }
+        return;
+    }
+
+    // Keep status messages ordered after any output still being coalesced
+    flushOutput(channel);
+    queueMessage(channel.id, stream, message);
+}
+
+void ClientSession::queueMessage(uint16_t channel, uint8_t stream, const std::string& message) {
+    // Nothing may reach the compressor's history that the client won't see
+    if (state != ACTIVE) {
+        return;
+    }
+    if (framed) {
+        // Shell output sent this way (replayed scrollback) has no capture
+        // time
+        const std::string* payload = &message;
+        std::string timed;
+        if (outputStreams && stream != STREAM_CONTROL) {
+            timed.assign(OUTPUT_TIME_SIZE, '\0');
+            timed += message;
+            payload = &timed;
+        }
+
+        // Each message is compressed as a complete block, so nothing waits
+        // for more output before it can be decoded
+        if (compressOutput && compressor.compress(payload->c_str(), payload->length(), compressBuffer)) {
+            queueSend(makeFrame(FRAME_OUTPUT, stream, compressBuffer.c_str(), compressBuffer.length(), FRAME_FLAG_COMPRESSED, channel));
+        } else {
+            queueSend(makeFrame(FRAME_OUTPUT, stream, payload->c_str(), payload->length(), 0, channel));
+        }
+    } else {
+        queueSend(message + END_OF_RESPONSE_MARKER);
+    }
+}
+
+void ClientSession::readShellOutput(Channel& channel, PipeRead& read, size_t bytes) {
+    // The shell's stderr pipe, where it has one, is its own stream only
+    // for a client that can tell them apart
+    int index = (int)(&read - channel.shellReads);
+    uint8_t stream = (outputStreams && index == SHELL_STDERR) ? STREAM_STDERR : STREAM_STDOUT;
+    IoBuffer* buffer = read.buffer;
+    const char* data = buffer->tail();
+    std::string& carry = channel.markCarry[index];
+    size_t start = 0;   // Output before this has been taken, or skipped as a mark
+    size_t scan = 0;
+    size_t markLength;
+    bool hasStatus;
+    int status;
+
+    // The start of a mark at the end of the last read was held back
+    if (!carry.empty()) {
+        std::string joined = carry;
+        joined.append(data, bytes < PROMPT_MARK_MAX ? bytes : PROMPT_MARK_MAX);
+        MarkMatch match = matchPromptMark(joined.data(), joined.length(), markLength, hasStatus, status);
+        if (match == MARK_PARTIAL) {
+            carry = joined;
+            buffer->used += bytes;
+            return;
+        }
+        if (match == MARK_FOUND) {
+            start = scan = markLength - carry.length();
+            buffer->used += start;
+            carry.clear();
+            channel.marked = true;
+            finishCommand(channel, hasStatus ? COMMAND_EXITED : COMMAND_FINISHED, hasStatus ? status : 0);
+        } else {
+            // Output after all
+            IoBuffer* held = pool.acquire();
+            memcpy(held->data, carry.data(), carry.length());
+            takeShellOutput(channel, stream, held, carry.length());
+            held->release();
+            carry.clear();
+        }
+    }
+
+    // Output on either side of a mark is taken in place; the mark's bytes
+    // are skipped
+    while (scan < bytes) {
+        const char* escape = (const char*)memchr(data + scan, '\x1b', bytes - scan);
+        if (!escape) {
+            break;
+        }
+        size_t at = (size_t)(escape - data);
+        MarkMatch match = matchPromptMark(escape, bytes - at, markLength, hasStatus, status);
+        if (match == MARK_NONE) {
+            scan = at + 1;
+            continue;
+        }
+        takeShellOutput(channel, stream, buffer, at - start);
+        if (match == MARK_PARTIAL) {
+            carry.assign(escape, bytes - at);
+            buffer->used += bytes - at;
+            return;
+        }
+        buffer->used += markLength;
+        start = scan = at + markLength;
+        channel.marked = true;
+        finishCommand(channel, hasStatus ? COMMAND_EXITED : COMMAND_FINISHED, hasStatus ? status : 0);
+    }
+    takeShellOutput(channel, stream, buffer, bytes - start);
+}
+
+void ClientSession::takeShellOutput(Channel& channel, uint8_t stream, IoBuffer* buffer, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (channel.awaitingOutput) {
+        channel.awaitingOutput = false;
+        observeLatency(METRIC_COMMAND_LATENCY, now - channel.commandTime);
+    }
+    if (channel.commandRunning) {
+        if (channel.commandFirstOutput == std::chrono::steady_clock::time_point()) {
+            channel.commandFirstOutput = now;
+        }
+        channel.commandBytes += length;
+        channel.commandLastOutput = now;
+        watchCommand(channel, COMMAND_QUIET_MS);
+    }
+    if (recording) {
+        recording->record(channel.id, stream, captureTime(now), buffer->tail(), length);
+    }
+
+    // A synced screen takes the output in place of the client; the history
+    // still gets it for searches
+    if (channel.id == 0 && screen) {
+        if (channel.scrollback) {
+            channel.scrollback->append(buffer->tail(), length);
+        }
+        screen->write(buffer->tail(), length);
+        buffer->used += length;
+        updateScreen(false);
+        return;
+    }
+    appendOutput(channel, stream, buffer, length);
+}
+
+void ClientSession::postShellRead(PipeRead& read) {
+    // Read straight into pooled memory, moving to a fresh buffer once the
+    // current one is nearly full
+    if (!read.buffer || read.buffer->space() < DEFAULT_BUFLEN) {
+        if (read.buffer) {
+            read.buffer->release();
+        }
+        read.buffer = pool.acquire();
+    }
+
+    ZeroMemory(&read.operation, sizeof(read.operation));
+    addRef();
+    read.pending = true;
+    if (!loop.postRead(read.hPipe, read.buffer->tail(), read.buffer->space(), &read.operation)) {
+        // The shell has exited
+        read.pending = false;
+        release();
+    }
+}
+
+void ClientSession::onShellRead(PipeRead& read, DWORD bytes, DWORD status) {
+    Channel& channel = *read.channel;
+    read.pending = false;
+
+    // A failed read means the shell has exited, or the channel or the
+    // session is closing
+    if (state == CLOSING) {
+        return;
+    }
+    if (channel.closing) {
+        destroyClosedChannel(channel);
+        return;
+    }
+    if (status != 0) {
+        if (channel.id == 0) {
+            flushOutput(channel);
+            // A terminal has no 'exit' command to notice; the shell going
+            // is what ends the session
+            if (rawInput && !exiting) {
+                finish(0);
+            }
+        } else {
+            closeChannel(channel, "Shell exited");
+        }
+        return;
+    }
+
+    if (bytes > 0) {
+        countMetric(METRIC_SHELL_READS);
+        countMetric(METRIC_SHELL_BYTES, bytes);
+        readShellOutput(channel, read, bytes);
+        if (multiplexed && !(channel.id == 0 && screenSync)) {
+            channel.credit -= bytes;
+        }
+    }
+
+    // Out of credit or blocked: leave the output in the pipe, which stalls
+    // the shell until the client catches up
+    if (state != CLOSING && !channel.closing) {
+        if (canRead(channel)) {
+            postShellRead(read);
+        } else {
+            read.paused = true;
+        }
+    }
+}
+
+ClientSession::PipeWrite* ClientSession::findShellWrite(IoOperation* operation) {
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        if (operation == &it->second->shellInput.operation) {
+            return &it->second->shellInput;
+        }
+    }
+    for (size_t i = 0; i < closedChannels.size(); i++) {
+        if (operation == &closedChannels[i]->shellInput.operation) {
+            return &closedChannels[i]->shellInput;
+        }
+    }
+    return NULL;
+}
+
+bool ClientSession::queueShellInput(Channel& channel, const char* data, size_t length) {
+    // Written as the shell's terminal makes room for it. A shell that stops
+    // reading holds up its own input, and past INPUT_QUEUE_LIMIT the
+    // client's, never the loop.
+    PipeWrite& input = channel.shellInput;
+    if (input.hPipe == INVALID_IO_HANDLE || !channel.shell->isActive()) {
+        return false;
+    }
+    input.queued.append(data, length);
+    inputQueuedBytes += length;
+    if (!input.pending) {
+        postShellWrite(input);
+    }
+    return true;
+}
+
+void ClientSession::postShellWrite(PipeWrite& input) {
+    if (input.written == input.writing.length()) {
+        input.writing.clear();
+        input.written = 0;
+        input.writing.swap(input.queued);
+    }
+    if (input.writing.empty()) {
+        return;
+    }
+
+    ZeroMemory(&input.operation, sizeof(input.operation));
+    addRef();
+    input.pending = true;
+    if (!loop.postWrite(input.hPipe, input.writing.data() + input.written, input.writing.length() - input.written,
+                        &input.operation)) {
+        // The shell has exited
+        input.pending = false;
+        release();
+        discardShellInput(input);
+    }
+}
+
+void ClientSession::onShellWrite(PipeWrite& input, DWORD bytes, DWORD status) {
+    Channel& channel = *input.channel;
+    input.pending = false;
+
+    // A failed write means the shell has exited, or the channel or the
+    // session is closing; the channel's reads deal with either
+    if (status != 0) {
+        discardShellInput(input);
+    } else {
+        input.written += bytes;
+        inputQueuedBytes -= bytes;
+    }
+    if (state == CLOSING) {
+        return;
+    }
+    if (channel.closing) {
+        destroyClosedChannel(channel);
+        resumeRecv();
+        return;
+    }
+    postShellWrite(input);
+    resumeRecv();
+}
+
+void ClientSession::discardShellInput(PipeWrite& input) {
+    size_t unwritten = input.writing.length() - input.written + input.queued.length();
+    if (unwritten > 0 && !input.channel->closing && state != CLOSING) {
+        logMessage(LOG_WARNING, "Shell on channel %u is gone with %zu bytes of input unwritten",
+            (unsigned)input.channel->id, unwritten);
+    }
+    inputQueuedBytes -= unwritten;
+    input.writing.clear();
+    input.written = 0;
+    input.queued.clear();
+}
+
+void ClientSession::resumeRecv() {
+    if (recvPaused && inputQueuedBytes < INPUT_QUEUE_LIMIT && (state == NEGOTIATING || state == ACTIVE)) {
+        recvPaused = false;
+        postRecv();
+    }
+}
+
+ClientSession::Channel* ClientSession::createChannel(uint16_t id, std::unique_ptr<PersistentShell> shell) {
+    std::unique_ptr<Channel> channel(new Channel());
+    channel->id = id;
+    channel->closing = false;
+    channel->credit = CHANNEL_WINDOW;
+    channel->pendingBytes = 0;
+    channel->pendingStream = STREAM_STDOUT;
+    channel->flushTimer = 0;
+    channel->awaitingOutput = false;
+    channel->backlogBytes = 0;
+    channel->spill = NULL;
+    channel->spillRead = 0;
+    channel->spillWritten = 0;
+    channel->droppedBytes = 0;
+    if (!token.empty() || searchable) {
+        channel->scrollback.reset(newScrollback());
+    }
+    channel->replayOffset = 0;
+    channel->replaying = false;
+    channel->commandRunning = true;
+    channel->commandTracked = false;
+    channel->commandId = 0;
+    channel->commandBytes = 0;
+    channel->marked = false;
+    channel->commandTimer = 0;
+    ZeroMemory(channel->shellReads, sizeof(channel->shellReads));
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        channel->shellReads[i].channel = channel.get();
+    }
+    channel->shellReads[SHELL_STDOUT].hPipe = shell->stdoutPipe();
+    channel->shellReads[SHELL_STDERR].hPipe = shell->stderrPipe();
+    channel->shellInput.channel = channel.get();
+    channel->shellInput.hPipe = shell->stdinPipe();
+    channel->shellInput.written = 0;
+    channel->shellInput.pending = false;
+    channel->shell = std::move(shell);
+
+    Channel* result = channel.get();
+    channels[id] = std::move(channel);
+    return result;
+}
+
+bool ClientSession::attachChannel(Channel& channel) {
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        if (channel.shellReads[i].hPipe != INVALID_IO_HANDLE && !loop.attach(channel.shellReads[i].hPipe, this)) {
+            return false;
+        }
+    }
+    // On a pty the shell's input is its output's handle, already attached
+    IoHandle input = channel.shellInput.hPipe;
+    return input == INVALID_IO_HANDLE || input == channel.shellReads[SHELL_STDOUT].hPipe || loop.attach(input, this);
+}
+
+void ClientSession::detachChannel(Channel& channel) {
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        if (channel.shellReads[i].hPipe != INVALID_IO_HANDLE) {
+            loop.detach(channel.shellReads[i].hPipe);
+        }
+    }
+    IoHandle input = channel.shellInput.hPipe;
+    if (input != INVALID_IO_HANDLE && input != channel.shellReads[SHELL_STDOUT].hPipe) {
+        loop.detach(input);
+    }
+}
+
+const char* ClientSession::shellTerminal() const {
+#ifdef _WIN32
+    // cmd.exe has no TERM to set
+    return SHELL_TERM_LINE;
+#else
+    return rawInput ? SHELL_TERM_RAW : SHELL_TERM_LINE;
+#endif
+}
+
+bool ClientSession::matchTerminal(Channel& channel) {
+    // Channel 0's shell was claimed before the hello said what kind of
+    // terminal the client is. One started for the other kind is swapped for
+    // a new shell, before any of its output has been read.
+    std::string terminal = shellTerminal();
+    if (channel.shell->terminal() == terminal) {
+        return true;
+    }
+    std::unique_ptr<PersistentShell> shell = shellPool.claim(channel.shell->workingDirectory(), terminal);
+    if (!shell->isActive()) {
+        logMessage(LOG_WARNING, "Unable to start a shell for TERM=%s, keeping TERM=%s", terminal.c_str(),
+            channel.shell->terminal().c_str());
+        return true;
+    }
+    detachChannel(channel);
+    channel.shell = std::move(shell);
+    channel.shellReads[SHELL_STDOUT].hPipe = channel.shell->stdoutPipe();
+    channel.shellReads[SHELL_STDERR].hPipe = channel.shell->stderrPipe();
+    channel.shellInput.hPipe = channel.shell->stdinPipe();
+    return attachChannel(channel);
+}
+
+void ClientSession::startChannel(Channel& channel) {
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        if (channel.shellReads[i].hPipe != INVALID_IO_HANDLE) {
+            postShellRead(channel.shellReads[i]);
+        }
+    }
+}
+
+void ClientSession::openChannel(uint16_t id) {
+    std::string error;
+    if (channels.count(id)) {
+        error = "Channel is already open";
+    } else if (channels.size() >= MAX_CHANNELS) {
+        error = "Too many channels";
+    } else {
+        // Usually an idle one from the pool; starting one instead takes a
+        // moment but doesn't wait on the network, so it is done right here
+        std::unique_ptr<PersistentShell> shell = shellPool.claim("", shellTerminal());
+        if (!shell->isActive()) {
+            error = "Failed to initialize shell session";
+        } else {
+            Channel* channel = createChannel(id, std::move(shell));
+            if (!attachChannel(*channel)) {
+                logMessage(LOG_ERROR, "Failed to attach shell to event loop: %lu", GetLastError());
+                detachChannel(*channel);
+                channels.erase(id);
+                error = "Failed to initialize shell session";
+            } else {
+                logMessage(LOG_INFO, "Opened channel %u (%zu open)", (unsigned)id, channels.size());
+                queueSend(makeFrame(FRAME_CHANNEL_OPEN, STREAM_CONTROL, NULL, 0, 0, id));
+                startChannel(*channel);
+                return;
+            }
+        }
+    }
+
+    logMessage(LOG_WARNING, "Refused channel %u: %s", (unsigned)id, error.c_str());
+    queueSend(makeFrame(FRAME_CHANNEL_CLOSE, STREAM_CONTROL, error.c_str(), error.length(), 0, id));
+}
+
+void ClientSession::closeChannel(Channel& channel, const std::string& reason) {
+    flushOutput(channel);
+    if (channel.commandTimer) {
+        loop.cancelTimer(channel.commandTimer);
+        channel.commandTimer = 0;
+        release();
+    }
+    queueSend(makeFrame(FRAME_CHANNEL_CLOSE, STREAM_CONTROL, reason.c_str(), reason.length(), 0, channel.id));
+    logMessage(LOG_INFO, "Closed channel %u: %s", (unsigned)channel.id, reason.c_str());
+
+    // The id can be reused right away; the channel itself lives on until
+    // its aborted reads and write have completed
+    channel.closing = true;
+    bool draining = channel.shellInput.pending;
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        draining = draining || channel.shellReads[i].pending;
+    }
+    detachChannel(channel);
+    std::unique_ptr<Channel> closed = std::move(channels[channel.id]);
+    channels.erase(channel.id);
+    if (draining) {
+        closedChannels.push_back(std::move(closed));
+    } else {
+        releaseChannel(*closed);
+    }
+}
+
+void ClientSession::releaseChannel(Channel& channel) {
+    for (size_t i = 0; i < channel.pendingOutput.size(); i++) {
+        channel.pendingOutput[i].buffer->release();
+    }
+    channel.pendingOutput.clear();
+    for (size_t i = 0; i < channel.backlog.size(); i++) {
+        channel.backlog[i].slice.buffer->release();
+    }
+    channel.backlog.clear();
+    backlogBytes -= channel.backlogBytes;
+    channel.backlogBytes = 0;
+    if (channel.spill) {
+        fclose(channel.spill);
+        channel.spill = NULL;
+    }
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        if (channel.shellReads[i].buffer) {
+            channel.shellReads[i].buffer->release();
+            channel.shellReads[i].buffer = NULL;
+        }
+    }
+}
+
+void ClientSession::destroyClosedChannel(Channel& channel) {
+    // Once its last aborted read and write are back
+    if (channel.shellInput.pending) {
+        return;
+    }
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        if (channel.shellReads[i].pending) {
+            return;
+        }
+    }
+    releaseChannel(channel);
+    for (size_t i = 0; i < closedChannels.size(); i++) {
+        if (closedChannels[i].get() == &channel) {
+            closedChannels.erase(closedChannels.begin() + i);
+            break;
+        }
+    }
+}
+
+void ClientSession::grantCredit(Channel& channel, uint32_t bytes) {
+    channel.credit += bytes;
+    resumeReads(channel);
+}
+
+bool ClientSession::canRead(const Channel& channel) const {
+    // While detached there is no client to grant credit, and the output
+    // only has to fit in the scrollback
+    return (channel.credit > 0 || state == DETACHED) && !readsBlocked;
+}
+
+void ClientSession::resumeReads(Channel& channel) {
+    if (channel.closing || !canRead(channel)) {
+        return;
+    }
+    for (int i = 0; i < SHELL_STREAMS; i++) {
+        if (channel.shellReads[i].paused) {
+            channel.shellReads[i].paused = false;
+            postShellRead(channel.shellReads[i]);
+        }
+    }
+}
+
+void ClientSession::beginOutput(Channel& channel, uint8_t stream, std::chrono::steady_clock::time_point readTime) {
+    if (!channel.pendingOutput.empty()) {
+        return;
+    }
+
+    // Start a new message: room for the frame header, then the capture time
+    // or the timestamp. A terminal gets the output untouched.
+    char timestamp[32];
+    size_t timestampLength = 0;
+    if (outputStreams) {
+        encodeOutputTime(timestamp, captureTime(readTime));
+        timestampLength = OUTPUT_TIME_SIZE;
+    } else if (!rawInput) {
+        timestampLength = formatTimestamp(timestamp, sizeof(timestamp));
+    }
+    size_t headerSpace = framed ? FRAME_HEADER_SIZE : 0;
+    IoSlice prefix;
+    memcpy(allocate(headerSpace + timestampLength, prefix) + headerSpace, timestamp, timestampLength);
+    channel.pendingOutput.push_back(prefix);
+    channel.pendingStream = stream;
+}
+
+void ClientSession::appendOutput(Channel& channel, uint8_t stream, IoBuffer* buffer, size_t length) {
+    // Once the client falls behind, output waits unframed until it catches
+    // up, and stays behind anything already waiting
+    if (stalled || !channel.backlog.empty() || channel.spill || channel.replaying) {
+        holdOutput(channel, stream, buffer, length);
+        return;
+    }
+
+    // A frame carries one stream: the other's output ends it
+    std::vector<IoSlice>& pendingOutput = channel.pendingOutput;
+    if (!pendingOutput.empty() && channel.pendingStream != stream) {
+        flushOutput(channel);
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool inBurst = !pendingOutput.empty() || now - channel.lastFlush < std::chrono::milliseconds(COALESCE_DELAY_MS);
+    if (pendingOutput.empty()) {
+        channel.firstRead = now;
+    }
+    beginOutput(channel, stream, now);
+
+    // The bytes were read in place; consecutive reads into the same buffer
+    // extend one slice
+    const char* data = buffer->tail();
+    buffer->used += length;
+    IoSlice& last = pendingOutput.back();
+    if (last.buffer == buffer && last.data + last.length == data) {
+        last.length += length;
+    } else {
+        buffer->addRef();
+        IoSlice slice = { buffer, data, length };
+        pendingOutput.push_back(slice);
+    }
+    channel.pendingBytes += length;
+
+    // Interactive output (first write after an idle period) goes out now
+    if (!inBurst || channel.pendingBytes >= COALESCE_MAX_BYTES) {
+        flushOutput(channel);
+        return;
+    }
+
+    // Bulk output waits for more to arrive, up to the coalescing delay.
+    // Closing the channel flushes first, so the timer never outlives it.
+    if (!channel.flushTimer) {
+        addRef();
+        Channel* target = &channel;
+        channel.flushTimer = loop.addTimer(COALESCE_DELAY_MS, [this, target]() {
+            target->flushTimer = 0;
+            flushOutput(*target);
+            release();
+        });
+    }
+}
+
+void ClientSession::holdOutput(Channel& channel, uint8_t stream, IoBuffer* buffer, size_t length) {
+    const char* data = buffer->tail();
+    buffer->used += length;
+
+    // Spilling, once started, continues until the file has been sent, so
+    // output stays in order. The file keeps each read's stream and time
+    // with its bytes.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (queueConfig.policy == OVERFLOW_SPILL &&
+        (channel.spill || sendQueuedBytes + backlogBytes + length > queueConfig.limitBytes) &&
+        spillOutput(channel, stream, now, data, length)) {
+        updateQueueStats();
+        return;
+    }
+
+    // Each stream reads into buffers of its own, so a read that continues
+    // the last slice is the same stream's
+    if (!channel.backlog.empty() && channel.backlog.back().slice.buffer == buffer &&
+        channel.backlog.back().slice.data + channel.backlog.back().slice.length == data) {
+        channel.backlog.back().slice.length += length;
+    } else {
+        buffer->addRef();
+        HeldOutput held;
+        held.slice = { buffer, data, length };
+        held.stream = stream;
+        held.readTime = now;
+        channel.backlog.push_back(held);
+    }
+    channel.backlogBytes += length;
+    backlogBytes += length;
+
+    // Trim this channel's oldest held output back under the ceiling
+    if (queueConfig.policy == OVERFLOW_DROP_OLDEST) {
+        while (sendQueuedBytes + backlogBytes > queueConfig.limitBytes && !channel.backlog.empty()) {
+            IoSlice& oldest = channel.backlog.front().slice;
+            size_t excess = sendQueuedBytes + backlogBytes - queueConfig.limitBytes;
+            size_t dropped = excess < oldest.length ? excess : oldest.length;
+            oldest.data += dropped;
+            oldest.length -= dropped;
+            if (oldest.length == 0) {
+                oldest.buffer->release();
+                channel.backlog.pop_front();
+            }
+            channel.backlogBytes -= dropped;
+            backlogBytes -= dropped;
+            channel.droppedBytes += dropped;
+            droppedBytes += dropped;
+            queueStats.droppedBytes += dropped;
+        }
+    }
+
+    updateQueueStats();
+}
+
+bool ClientSession::spillOutput(Channel& channel, uint8_t stream, std::chrono::steady_clock::time_point readTime,
+                                const char* data, size_t length) {
+    // Disk writes land in the page cache, so this rarely waits on the disk
+    if (!channel.spill) {
+        channel.spill = tmpfile();
+        if (!channel.spill) {
+            logMessage(LOG_ERROR, "Unable to create output spill file: %d", errno);
+            return false;
+        }
+        channel.spillRead = 0;
+        channel.spillWritten = 0;
+    }
+    SpillHeader header;
+    memset(&header, 0, sizeof(header));
+    header.readTime = readTime.time_since_epoch().count();
+    header.length = (uint32_t)length;
+    header.stream = stream;
+    if (!seekFile(channel.spill, channel.spillWritten) ||
+        fwrite(&header, sizeof(header), 1, channel.spill) != 1 ||
+        fwrite(data, 1, length, channel.spill) != length) {
+        logMessage(LOG_ERROR, "Unable to write output spill file: %d", errno);
+        return false;
+    }
+    channel.spillWritten += sizeof(header) + length;
+    spilledBytes += length;
+    queueStats.spilledBytes += length;
+    return true;
+}
+
+bool ClientSession::unspillOutput(Channel& channel) {
+    // Reads the next buffer's worth of spilled output into the backlog:
+    // consecutive reads of one stream, which go out with the first one's
+    // read time as they would have from the backlog
+    IoBuffer* buffer = pool.acquire();
+    size_t length = 0;
+    SpillHeader first = SpillHeader();
+    uint64_t offset = channel.spillRead;
+    bool readable = seekFile(channel.spill, offset);
+    while (readable && offset < channel.spillWritten) {
+        SpillHeader header;
+        if (fread(&header, sizeof(header), 1, channel.spill) != 1 || header.length > IO_BUFFER_SIZE) {
+            readable = false;
+            break;
+        }
+        if (length > 0 && (header.stream != first.stream || length + header.length > IO_BUFFER_SIZE)) {
+            break;
+        }
+        if (fread(buffer->data + length, 1, header.length, channel.spill) != header.length) {
+            readable = false;
+            break;
+        }
+        if (length == 0) {
+            first = header;
+        }
+        length += header.length;
+        offset += sizeof(header) + header.length;
+    }
+    if (length == 0) {
+        logMessage(LOG_ERROR, "Unable to read output spill file, the rest of its output is lost");
+        buffer->release();
+        fclose(channel.spill);
+        channel.spill = NULL;
+        return false;
+    }
+
+    buffer->used = length;
+    HeldOutput held;
+    held.slice = { buffer, buffer->data, length };
+    held.stream = first.stream;
+    held.readTime = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(first.readTime));
+    channel.backlog.push_back(held);
+    channel.backlogBytes += length;
+    backlogBytes += length;
+
+    channel.spillRead = offset;
+    if (channel.spillRead == channel.spillWritten) {
+        fclose(channel.spill);
+        channel.spill = NULL;
+    }
+    return true;
+}
+
+bool ClientSession::releaseBacklog(Channel& channel) {
+    // A reattached client first gets the scrollback it missed
+    if (channel.replaying) {
+        return releaseReplay(channel);
+    }
+
+    // Frames up to COALESCE_MAX_BYTES of the channel's held output
+    if (channel.backlog.empty() && channel.spill) {
+        unspillOutput(channel);
+    }
+    if (channel.backlog.empty() && channel.droppedBytes == 0) {
+        return sendHeldResults(channel);
+    }
+
+    if (channel.droppedBytes > 0) {
+        flushOutput(channel);
+        queueMessage(channel.id, STREAM_CONTROL, getCurrentTimestamp() + "[" + std::to_string(channel.droppedBytes) +
+            " bytes of output dropped, the client was not keeping up]");
+        channel.droppedBytes = 0;
+    }
+    if (channel.backlog.empty()) {
+        return true;
+    }
+
+    // Up to the first piece of the other stream
+    uint8_t stream = channel.backlog.front().stream;
+    if (!channel.pendingOutput.empty() && channel.pendingStream != stream) {
+        flushOutput(channel);
+    }
+    beginOutput(channel, stream, channel.backlog.front().readTime);
+    size_t released = 0;
+    while (!channel.backlog.empty() && released < COALESCE_MAX_BYTES && channel.backlog.front().stream == stream) {
+        // The backlog's references move to pendingOutput
+        channel.pendingOutput.push_back(channel.backlog.front().slice);
+        released += channel.backlog.front().slice.length;
+        channel.backlog.pop_front();
+    }
+    channel.pendingBytes += released;
+    channel.backlogBytes -= released;
+    backlogBytes -= released;
+    flushOutput(channel);
+    sendHeldResults(channel);
+    return true;
+}
+
+bool ClientSession::releaseReplay(Channel& channel) {
+    // Output held meanwhile waits in the backlog, so the scrollback doesn't
+    // grow until the replay has caught up with it
+    channel.scrollback->read(channel.replayOffset, COALESCE_MAX_BYTES, replayBuffer);
+    if (replayBuffer.empty()) {
+        logMessage(LOG_ERROR, "Unable to read scrollback of channel %u", (unsigned)channel.id);
+        channel.replaying = false;
+        return false;
+    }
+    queueMessage(channel.id, STREAM_STDOUT, replayBuffer);
+    channel.replayOffset += replayBuffer.length();
+    channel.replaying = channel.replayOffset < channel.scrollback->end();
+    return true;
+}
+
+void ClientSession::releaseBacklogs() {
+    // A frame from each channel in turn, until the send queue is full again
+    bool released = true;
+    while (released && !stalled && state != CLOSING) {
+        released = false;
+        for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end() && !stalled; ++it) {
+            released = releaseBacklog(*it->second) || released;
+        }
+    }
+}
+
+void ClientSession::updateQueueStats() {
+    size_t depth = sendQueuedBytes + backlogBytes;
+    if (depth > peakDepth) {
+        peakDepth = depth;
+    }
+    queueStats.queuedBytes += (int64_t)depth - reportedDepth;
+    reportedDepth = (int64_t)depth;
+
+    // Stall time is how long the client spends behind
+    bool behind = sendQueuedBytes >= SEND_QUEUE_HIGH_WATER;
+    if (behind != stalled) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        stalled = behind;
+        if (stalled) {
+            stallStart = now;
+            queueStats.stalledSessions++;
+        } else {
+            std::chrono::duration<double> stall = now - stallStart;
+            stalledSeconds += stall.count();
+            queueStats.stallMicroseconds += (uint64_t)(stall.count() * 1e6);
+            queueStats.stalledSessions--;
+        }
+    }
+
+    // OVERFLOW_BLOCK: stop at the ceiling, resume once half of it has drained
+    if (queueConfig.policy == OVERFLOW_BLOCK) {
+        if (!readsBlocked && depth >= queueConfig.limitBytes) {
+            readsBlocked = true;
+        } else if (readsBlocked && depth <= queueConfig.limitBytes / 2) {
+            readsBlocked = false;
+            for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+                resumeReads(*it->second);
+            }
+        }
+    }
+}
+
+void ClientSession::logOutput(const Channel& channel) {
+    // Log what we sent (but clean it up for display)
+    const std::vector<IoSlice>& pendingOutput = channel.pendingOutput;
+    size_t count = pendingOutput.size();
+    size_t lastLength = 0;
+    while (count > 1) {
+        const IoSlice& last = pendingOutput[count - 1];
+        lastLength = last.length;
+        while (lastLength > 0 && (last.data[lastLength - 1] == '\r' || last.data[lastLength - 1] == '\n')) {
+            lastLength--;
+        }
+        if (lastLength > 0) {
+            break;
+        }
+        count--;
+    }
+    if (count <= 1) {
+        return;
+    }
+
+    std::string text;
+    for (size_t i = 1; i < count; i++) {
+        text.append(pendingOutput[i].data, i == count - 1 ? lastLength : pendingOutput[i].length);
+    }
+    if (channel.id == 0) {
+        logMessage(LOG_TRACE, "Sent output to client: %s", text.c_str());
+    } else {
+        logMessage(LOG_TRACE, "Sent output to client on channel %u: %s", (unsigned)channel.id, text.c_str());
+    }
+}
+
+void ClientSession::flushOutput(Channel& channel) {
+    if (channel.flushTimer) {
+        loop.cancelTimer(channel.flushTimer);
+        channel.flushTimer = 0;
+        release();
+    }
+    std::vector<IoSlice>& pendingOutput = channel.pendingOutput;
+    if (pendingOutput.empty()) {
+        return;
+    }
+    channel.lastFlush = std::chrono::steady_clock::now();
+    if (channel.firstRead != std::chrono::steady_clock::time_point()) {
+        observeLatency(METRIC_OUTPUT_DELAY, channel.lastFlush - channel.firstRead);
+        channel.firstRead = std::chrono::steady_clock::time_point();
+    }
+    IoSlice& prefix = pendingOutput[0];
+
+    // The scrollback holds exactly the output frames' payloads, less any
+    // capture time, so a client's count of the bytes it received is an
+    // offset into it
+    if (channel.scrollback) {
+        size_t skip = FRAME_HEADER_SIZE + (outputStreams ? OUTPUT_TIME_SIZE : 0);
+        channel.scrollback->append(prefix.data + skip, prefix.length - skip);
+        for (size_t i = 1; i < pendingOutput.size(); i++) {
+            channel.scrollback->append(pendingOutput[i].data, pendingOutput[i].length);
+        }
+    }
+    if (state != ACTIVE) {
+        for (size_t i = 0; i < pendingOutput.size(); i++) {
+            pendingOutput[i].buffer->release();
+        }
+        pendingOutput.clear();
+        channel.pendingBytes = 0;
+        return;
+    }
+    if (logEnabled(LOG_TRACE)) {
+        logOutput(channel);
+    }
+
+    // Hand the slices (and their references) to the send queue, unless
+    // they get compressed into a new frame
+    bool sendSlices = true;
+    if (!framed) {
+        for (size_t i = 0; i < pendingOutput.size(); i++) {
+            pushSlice(pendingOutput[i]);
+        }
+        pushCopy(END_OF_RESPONSE_MARKER, sizeof(END_OF_RESPONSE_MARKER) - 1);
+        sendSlices = false;
+    } else if (compressOutput) {
+        compressPieces.clear();
+        CompressInput timestamp = { prefix.data + FRAME_HEADER_SIZE, prefix.length - FRAME_HEADER_SIZE };
+        compressPieces.push_back(timestamp);
+        for (size_t i = 1; i < pendingOutput.size(); i++) {
+            CompressInput piece = { pendingOutput[i].data, pendingOutput[i].length };
+            compressPieces.push_back(piece);
+        }
+        if (compressor.compress(compressPieces.data(), compressPieces.size(), compressBuffer)) {
+            IoSlice header;
+            encodeFrameHeader(allocate(FRAME_HEADER_SIZE, header), FRAME_OUTPUT, channel.pendingStream,
+                FRAME_FLAG_COMPRESSED, (uint32_t)compressBuffer.length(), channel.id);
+            pushSlice(header);
+            pushCopy(compressBuffer.data(), compressBuffer.length());
+            for (size_t i = 0; i < pendingOutput.size(); i++) {
+                pendingOutput[i].buffer->release();
+            }
+            sendSlices = false;
+        }
+    }
+
+    if (sendSlices) {
+        // The header space was reserved up front, so the batch is sent as is
+        uint32_t payloadLength = (uint32_t)(prefix.length - FRAME_HEADER_SIZE + channel.pendingBytes);
+        encodeFrameHeader(const_cast<char*>(prefix.data), FRAME_OUTPUT, channel.pendingStream, 0, payloadLength, channel.id);
+        for (size_t i = 0; i < pendingOutput.size(); i++) {
+            pushSlice(pendingOutput[i]);
+        }
+    }
+
+    pendingOutput.clear();
+    channel.pendingBytes = 0;
+    startSend();
+}
+
+void ClientSession::reportQueueStats() {
+    // Only worth a line if the client ever fell behind
+    if (peakDepth < SEND_QUEUE_HIGH_WATER) {
+        return;
+    }
+    logMessage(LOG_INFO, "Session output queue peaked at %zu KB, client behind for %.1f s, %llu bytes dropped, %llu bytes spilled",
+        peakDepth / 1024, stalledSeconds, (unsigned long long)droppedBytes, (unsigned long long)spilledBytes);
+}
+
+void ClientSession::reportSendStats() {
+    if (bytesSent == 0) {
+        return;
+    }
+    double megabytes = (double)bytesSent / (1024.0 * 1024.0);
+    logMessage(LOG_INFO, "Session sent %.2f MB in %llu sends (%.1f sends/MB, avg %.0f bytes/send)",
+        megabytes, (unsigned long long)sendCalls, sendCalls / megabytes, (double)bytesSent / sendCalls);
+}
+
+void ClientSession::processInput() {
+    if (state == NEGOTIATING && !negotiate()) {
+        return;
+    }
+
+    if (framed) {
+        FrameHeader header;
+        const char* payload;
+        FrameReader::Result result = FrameReader::FRAME_INCOMPLETE;
+        while (state == ACTIVE && !exiting && (result = reader.nextFrame(header, payload)) == FrameReader::FRAME_READY) {
+            handleFrame(header, payload);
+        }
+        if (state == ACTIVE && !exiting && result == FrameReader::FRAME_INVALID) {
+            logMessage(LOG_WARNING, "Invalid frame from client");
+            close();
+        }
+    } else if (state == ACTIVE && !exiting && reader.bufferedBytes() > 0) {
+        // Legacy clients send one command per send()
+        std::string command(reader.bufferedData(), reader.bufferedBytes());
+        reader.consume(reader.bufferedBytes());
+        handleCommand(*channels[0], command);
+    }
+}
+
+void ClientSession::handleFrame(const FrameHeader& header, const char* payload) {
+    std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.find(header.channel);
+    Channel* channel = (it != channels.end()) ? it->second.get() : NULL;
+
+    if (header.type == FRAME_COMMAND) {
+        uint32_t id;
+        std::string command;
+        if (channel && trackCommands && decodeCommand(payload, header.length, id, command)) {
+            handleTrackedCommand(*channel, id, command);
+        } else if (!channel) {
+            queueSend(makeFrame(FRAME_CHANNEL_CLOSE, STREAM_CONTROL, "No such channel", 15, 0, header.channel));
+        }
+    } else if (header.type == FRAME_INPUT) {
+        if (channel && rawInput) {
+            handleKeystrokes(*channel, payload, header.length);
+        } else if (channel) {
+            handleCommand(*channel, std::string(payload, header.length));
+        } else {
+            // Closed while the input was on its way
+            queueSend(makeFrame(FRAME_CHANNEL_CLOSE, STREAM_CONTROL, "No such channel", 15, 0, header.channel));
+        }
+    } else if (header.type == FRAME_FILE_OPEN || header.type == FRAME_FILE_DATA || header.type == FRAME_FILE_CLOSE) {
+        if (fileTransfer) {
+            handleFileFrame(header, payload);
+        }
+    } else if (header.type == FRAME_SYNC) {
+        if (treeSync) {
+            handleSyncFrame(header, payload);
+        }
+    } else if (header.type == FRAME_SEARCH) {
+        if (searchable) {
+            handleSearchFrame(header, payload);
+        }
+    } else if (header.type == FRAME_SCREEN) {
+        if (screenSync) {
+            handleScreenFrame(header, payload);
+        }
+    } else if (!multiplexed) {
+        return;
+    } else if (header.type == FRAME_CHANNEL_OPEN) {
+        openChannel(header.channel);
+    } else if (header.type == FRAME_CHANNEL_CLOSE) {
+        // Channel 0 lasts as long as the connection; "exit" ends both
+        if (channel && channel->id != 0) {
+            closeChannel(*channel, "Closed by client");
+        }
+    } else if (header.type == FRAME_WINDOW) {
+        uint32_t bytes;
+        if (channel && decodeWindow(payload, header.length, bytes)) {
+            grantCredit(*channel, bytes);
+        }
+    }
+}
+
+void ClientSession::handleFileFrame(const FrameHeader& header, const char* payload) {
+    std::map<uint16_t, std::unique_ptr<FileTransfer>>::iterator it = transfers.find(header.channel);
+    FileTransfer* transfer = (it != transfers.end()) ? it->second.get() : NULL;
+
+    if (header.type == FRAME_FILE_OPEN) {
+        FileOpenPayload request;
+        if (transfer || !decodeFileOpen(payload, header.length, request)) {
+            queueSend(makeFileCloseFrame(header.channel, FILE_FAILED, 0, "Invalid transfer request"));
+        } else {
+            openTransfer(header.channel, request);
+        }
+        return;
+    }
+
+    // Frames for a transfer that has already ended were on their way
+    if (!transfer || transfer->cancelled) {
+        return;
+    }
+    if (header.type == FRAME_FILE_DATA && !transfer->sending) {
+        receiveFileData(*transfer, payload, header.length);
+    } else if (header.type == FRAME_FILE_DATA) {
+        // Download progress, which may open the window again
+        uint64_t offset;
+        const char* data;
+        size_t length;
+        if (decodeFileData(payload, header.length, offset, data, length) && offset <= transfer->offset &&
+            offset > transfer->acknowledged) {
+            transfer->acknowledged = offset;
+            if (!transfer->chunkQueued) {
+                queueFileChunk(*transfer);
+            }
+        }
+    } else if (header.type == FRAME_FILE_CLOSE) {
+        FileClosePayload close;
+        if (!decodeFileClose(payload, header.length, close)) {
+            close.status = FILE_FAILED;
+        }
+        if (transfer->sending || close.status != FILE_OK) {
+            // Answered, so the client knows nothing more is coming
+            endTransfer(*transfer, "Cancelled by the client");
+        } else {
+            finishUpload(*transfer, close);
+        }
+    }
+}
+
+uint32_t ClientSession::windowChecksum(FileTransfer& transfer, uint64_t end, bool& ok) {
+    // Of the chunk before a resume point, which is what both ends compare
+    uint64_t window = end < FILE_CHUNK_SIZE ? end : FILE_CHUNK_SIZE;
+    uint32_t adler = ADLER32_INIT;
+    IoBuffer* buffer = pool.acquire();
+    ok = transfer.checksumRange(end - window, window, buffer->data, IO_BUFFER_SIZE, adler);
+    buffer->release();
+    return adler;
+}
+
+void ClientSession::openTransfer(uint16_t id, const FileOpenPayload& request) {
+    std::unique_ptr<FileTransfer> transfer(new FileTransfer(id, request.direction == FILE_GET, request.path));
+    std::string error = request.path.empty() ? "No file name given" : "";
+    if (error.empty() && !transfer->open(error)) {
+        // 'error' says why
+    }
+    if (!error.empty()) {
+        logMessage(LOG_WARNING, "File transfer %u refused: %s", (unsigned)id, error.c_str());
+        queueSend(makeFileCloseFrame(id, FILE_FAILED, 0, error));
+        return;
+    }
+
+    // Pick up a partial copy, on either side, if its last chunk matches
+    FileOpenPayload reply;
+    reply.direction = request.direction;
+    reply.offset = 0;
+    reply.checksum = 0;
+    bool ok;
+    if (transfer->sending) {
+        transfer->size = transfer->fileSize();
+        if (request.offset > 0 && request.offset <= transfer->size &&
+            windowChecksum(*transfer, request.offset, ok) == request.checksum && ok) {
+            reply.offset = request.offset;
+            reply.checksum = request.checksum;
+        }
+    } else {
+        transfer->size = request.size;
+        uint64_t existing = transfer->fileSize();
+        if (existing > 0 && existing <= request.size) {
+            reply.checksum = windowChecksum(*transfer, existing, ok);
+            reply.offset = ok ? existing : 0;
+        }
+    }
+    reply.size = transfer->size;
+    transfer->start = reply.offset;
+    transfer->offset = reply.offset;
+    transfer->acknowledged = reply.offset;
+    queueSend(makeFileOpenFrame(id, reply));
+
+    logMessage(LOG_INFO, "Transfer %u: %s %s (%llu bytes), from offset %llu", (unsigned)id,
+        transfer->sending ? "sending" : "receiving", transfer->path.c_str(), (unsigned long long)transfer->size,
+        (unsigned long long)transfer->start);
+    FileTransfer& started = *transfer;
+    transfers[id] = std::move(transfer);
+    if (started.sending) {
+        queueFileChunk(started);
+    }
+}
+
+void ClientSession::queueFileChunk(FileTransfer& transfer) {
+    if (transfer.cancelled || state != ACTIVE) {
+        transfers.erase(transfer.id);
+        return;
+    }
+    if (transfer.offset >= transfer.size) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer.startTime).count();
+        logMessage(LOG_INFO, "Transfer %u: sent %s (%llu bytes in %.2f s)", (unsigned)transfer.id, transfer.path.c_str(),
+            (unsigned long long)(transfer.size - transfer.start), seconds);
+        queueSend(makeFileCloseFrame(transfer.id, FILE_OK, transfer.checksum));
+        countMetric(METRIC_FILE_TRANSFERS);
+        endTransfer(transfer, "");
+        return;
+    }
+
+    // The rest waits for the client to catch up
+    if (transfer.offset - transfer.acknowledged >= FILE_WINDOW) {
+        return;
+    }
+
+    // The checksum reads the chunk through the page cache; the socket gets
+    // it straight from the file. Only one chunk per transfer is queued at a
+    // time, so shell output never waits behind more than that.
+    size_t length = (size_t)std::min((uint64_t)FILE_CHUNK_SIZE, transfer.size - transfer.offset);
+    IoBuffer* buffer = pool.acquire();
+    bool ok = transfer.checksumRange(transfer.offset, length, buffer->data, IO_BUFFER_SIZE, transfer.checksum);
+    buffer->release();
+    if (!ok) {
+        endTransfer(transfer, "Unable to read " + transfer.path);
+        return;
+    }
+
+    IoSlice header;
+    encodeFileDataHeader(allocate(FRAME_HEADER_SIZE + FILE_DATA_PREFIX_SIZE, header), transfer.id, transfer.offset, length);
+    pushSlice(header);
+    pushFile(transfer, transfer.offset, length);
+    transfer.offset += length;
+    transfer.chunkQueued = true;
+    startSend();
+}
+
+void ClientSession::receiveFileData(FileTransfer& transfer, const char* payload, size_t payloadLength) {
+    uint64_t offset;
+    const char* data;
+    size_t length;
+    if (!decodeFileData(payload, payloadLength, offset, data, length)) {
+        endTransfer(transfer, "Invalid file data");
+        return;
+    }
+
+    // The client's copy didn't match ours, so it starts over
+    if (offset == 0 && transfer.offset != 0) {
+        transfer.start = 0;
+        transfer.offset = 0;
+        transfer.checksum = ADLER32_INIT;
+    }
+    if (offset != transfer.offset || length > transfer.size - offset) {
+        endTransfer(transfer, "Unexpected file data at offset " + std::to_string(offset));
+        return;
+    }
+    if (!transfer.writeAt(offset, data, length)) {
+        endTransfer(transfer, "Unable to write " + transfer.path);
+        return;
+    }
+    transfer.checksum = adler32(transfer.checksum, data, length);
+    transfer.offset += length;
+    countMetric(METRIC_FILE_BYTES_RECEIVED, length);
+}
+
+void ClientSession::finishUpload(FileTransfer& transfer, const FileClosePayload& close) {
+    if (transfer.offset != transfer.size) {
+        endTransfer(transfer, "Received " + std::to_string(transfer.offset) + " of " + std::to_string(transfer.size) + " bytes");
+    } else if (close.checksum != transfer.checksum) {
+        endTransfer(transfer, "Checksum mismatch");
+    } else if (!transfer.truncate(transfer.size)) {
+        // A longer file was there before
+        endTransfer(transfer, "Unable to write " + transfer.path);
+    } else {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer.startTime).count();
+        logMessage(LOG_INFO, "Transfer %u: received %s (%llu bytes in %.2f s)", (unsigned)transfer.id,
+            transfer.path.c_str(), (unsigned long long)(transfer.size - transfer.start), seconds);
+        queueSend(makeFileCloseFrame(transfer.id, FILE_OK, transfer.checksum));
+        countMetric(METRIC_FILE_TRANSFERS);
+        endTransfer(transfer, "");
+    }
+}
+
+void ClientSession::endTransfer(FileTransfer& transfer, const std::string& error) {
+    if (!error.empty()) {
+        logMessage(LOG_WARNING, "Transfer %u of %s failed: %s", (unsigned)transfer.id, transfer.path.c_str(), error.c_str());
+        queueSend(makeFileCloseFrame(transfer.id, FILE_FAILED, 0, error));
+    }
+
+    // A chunk still queued needs the file; it goes when that has been sent
+    if (transfer.chunkQueued) {
+        transfer.cancelled = true;
+    } else {
+        transfers.erase(transfer.id);
+    }
+}
+
+void ClientSession::abortTransfers() {
+    // The send queue is empty, so nothing still uses the files
+    if (!transfers.empty()) {
+        logMessage(LOG_INFO, "Abandoned %zu file transfers with the connection", transfers.size());
+        transfers.clear();
+    }
+}
+
+void ClientSession::handleSyncFrame(const FrameHeader& header, const char* payload) {
+    if (header.length < 1) {
+        return;
+    }
+    uint8_t message = (uint8_t)payload[0];
+    std::map<uint16_t, std::unique_ptr<TreeSync>>::iterator it = syncs.find(header.channel);
+    if (message != SYNC_BEGIN) {
+        // Frames for a sync that has already ended were on their way
+        if (it != syncs.end() && !it->second->handle(message, payload + 1, header.length - 1)) {
+            syncs.erase(it);
+        }
+        return;
+    }
+
+    // The tree lands relative to wherever the channel's shell is now
+    uint16_t channelId;
+    std::string directory;
+    std::map<uint16_t, std::unique_ptr<Channel>>::iterator channel;
+    if (it != syncs.end() || !decodeSyncBegin(payload + 1, header.length - 1, channelId, directory) ||
+        (channel = channels.find(channelId)) == channels.end()) {
+        SyncResultPayload result;
+        result.status = FILE_FAILED;
+        result.updated = 0;
+        result.written = 0;
+        result.message = "Invalid sync request";
+        queueSend(makeSyncFrame(header.channel, SYNC_RESULT, makeSyncResult(result)));
+        return;
+    }
+    std::filesystem::path root = std::filesystem::path(channel->second->shell->workingDirectory()) / directory;
+    syncs[header.channel].reset(new TreeSync(loop, header.channel, root.lexically_normal(), [this](std::string frame) {
+        queueSend(std::move(frame));
+    }));
+}
+
+void ClientSession::abortSyncs() {
+    // Their worker threads are stopped before they go
+    if (!syncs.empty()) {
+        logMessage(LOG_INFO, "Abandoned %zu directory syncs with the connection", syncs.size());
+        syncs.clear();
+    }
+}
+
+void ClientSession::handleSearchFrame(const FrameHeader& header, const char* payload) {
+    SearchRequest request;
+    if (!decodeSearchRequest(payload, header.length, request)) {
+        return;
+    }
+    std::unique_ptr<HistorySearch> search(new HistorySearch(header.channel, request));
+    std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.find(header.channel);
+    if (it == channels.end() || searches.size() >= SEARCH_MAX_QUEUED) {
+        std::vector<std::string> frames;
+        search->cancel(it == channels.end() ? "No such channel" : "Too many searches", frames);
+        for (size_t i = 0; i < frames.size(); i++) {
+            queueSend(std::move(frames[i]));
+        }
+        return;
+    }
+    searches.push_back(std::move(search));
+    scheduleSearch();
+}
+
+void ClientSession::scheduleSearch() {
+    if (searchPosted) {
+        return;
+    }
+    searchPosted = true;
+    addRef();
+    loop.post([this]() {
+        searchPosted = false;
+        runSearch();
+        release();
+    });
+}
+
+void ClientSession::runSearch() {
+    // A step at a time, while the client is taking the results; onSend
+    // schedules the next step once it has caught up
+    if (state != ACTIVE || searches.empty() || sendQueuedBytes > SEND_QUEUE_HIGH_WATER) {
+        return;
+    }
+    HistorySearch& search = *searches.front();
+    std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.find(search.channel);
+    std::vector<std::string> frames;
+    bool done = true;
+    if (it == channels.end()) {
+        search.cancel("Channel closed", frames);
+    } else {
+        done = search.step(*it->second->scrollback, frames);
+    }
+    for (size_t i = 0; i < frames.size(); i++) {
+        queueSend(std::move(frames[i]));
+    }
+    if (done) {
+        searches.pop_front();
+    }
+    if (!searches.empty()) {
+        scheduleSearch();
+    }
+}
+
+void ClientSession::abortSearches() {
+    if (!searches.empty()) {
+        logMessage(LOG_INFO, "Abandoned %zu searches with the connection", searches.size());
+        searches.clear();
+    }
+}
+
+bool ClientSession::negotiate() {
+    // Wait for enough bytes to tell a hello from a legacy command
+    if (reader.bufferedBytes() < 2) {
+        return false;
+    }
+
+    if (!looksLikeFrame(reader.bufferedData(), reader.bufferedBytes())) {
+        // Legacy client: what we received is its first command
+        logMessage(LOG_INFO, "No protocol hello, using legacy marker mode");
+        beginSession();
+        return true;
+    }
+
+    FrameHeader header;
+    const char* payload;
+    FrameReader::Result result = reader.nextFrame(header, payload);
+    if (result == FrameReader::FRAME_INCOMPLETE) {
+        return false;
+    }
+
+    HelloPayload hello;
+    if (result != FrameReader::FRAME_READY || header.type != FRAME_HELLO ||
+        !decodeHello(payload, header.length, hello) || hello.version < 1) {
+        logMessage(LOG_WARNING, "Invalid protocol hello from client");
+        close();
+        return false;
+    }
+
+    HelloPayload reply;
+    reply.version = PROTOCOL_VERSION;
+    reply.features = hello.features & SERVER_FEATURES;
+
+    // A session that already has a token is being reattached: the client
+    // must still ask for it
+    if (!token.empty()) {
+        if (!(reply.features & FEATURE_RESUME) || hello.token != token) {
+            logMessage(LOG_WARNING, "Invalid protocol hello from client");
+            close();
+            return false;
+        }
+        reply.token = token;
+        resumeSession(hello, reply);
+        return true;
+    }
+
+    // A token the registry didn't know (the session expired) gets a new
+    // session; the client sees the token change
+    framed = true;
+    compressOutput = (reply.features & FEATURE_COMPRESSION) != 0;
+    multiplexed = (reply.features & FEATURE_CHANNELS) != 0;
+    rawInput = (reply.features & FEATURE_RAW_INPUT) != 0;
+    fileTransfer = (reply.features & FEATURE_FILE_TRANSFER) != 0;
+    treeSync = (reply.features & FEATURE_SYNC) != 0;
+    outputStreams = (reply.features & FEATURE_OUTPUT_STREAMS) != 0;
+    trackCommands = (reply.features & FEATURE_COMMANDS) != 0;
+    searchable = (reply.features & FEATURE_SEARCH) != 0;
+    screenSync = rawInput && (reply.features & FEATURE_SCREEN_SYNC) != 0;
+    if (!screenSync) {
+        // Line mode output has no screen to keep
+        reply.features &= ~FEATURE_SCREEN_SYNC;
+    }
+    if (reply.features & FEATURE_RESUME) {
+        enableResume();
+        reply.token = token;
+    }
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        if (searchable && !it->second->scrollback) {
+            it->second->scrollback.reset(newScrollback());
+        }
+    }
+    if (!matchTerminal(*channels[0])) {
+        logMessage(LOG_ERROR, "Failed to attach shell to event loop: %lu", GetLastError());
+        close();
+        return false;
+    }
+    state = ACTIVE;
+    queueSend(makeHelloFrame(reply));
+
+    logMessage(LOG_INFO, "Client negotiated framed protocol v%u%s%s%s%s%s%s%s%s%s%s", (unsigned)reply.version,
+        compressOutput ? " with compression" : "", multiplexed ? " with channels" : "", rawInput ? " with raw input" : "",
+        fileTransfer ? " with file transfer" : "", treeSync ? " with sync" : "", outputStreams ? " with output streams" : "",
+        trackCommands ? " with tracked commands" : "", searchable ? " with search" : "",
+        screenSync ? " with screen sync" : "", token.empty() ? "" : (", resumable as " + describeToken(token)).c_str());
+    beginSession();
+    return true;
+}
+
+void ClientSession::enableResume() {
+    token = registry.add(this, loop);
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        it->second->scrollback.reset(newScrollback());
+    }
+}
+
+Scrollback* ClientSession::newScrollback() {
+    // A searchable history is usually much longer than a reconnect needs
+    size_t capacity = registry.scrollbackLimit();
+    if (searchable && registry.searchHistoryLimit() > capacity) {
+        capacity = registry.searchHistoryLimit();
+    }
+    return new Scrollback(capacity, searchable);
+}
+
+void ClientSession::resumeSession(const HelloPayload& hello, HelloPayload& reply) {
+    // Output produced since the reconnect is still unsent; put it in the
+    // scrollback so it is replayed in order
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        flushOutput(*it->second);
+    }
+    state = ACTIVE;
+    if (helloTimer) {
+        loop.cancelTimer(helloTimer);
+        helloTimer = 0;
+        release();
+    }
+
+    // Replay each channel from where the client's copy ends, or from the
+    // oldest output still held if that has been overwritten. Channels that
+    // closed meanwhile are missing from the reply.
+    std::map<uint16_t, uint64_t> received;
+    for (size_t i = 0; i < hello.offsets.size(); i++) {
+        received[hello.offsets[i].channel] = hello.offsets[i].offset;
+    }
+    std::map<uint16_t, uint64_t> lost;
+    uint64_t replayBytes = 0;
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel& channel = *it->second;
+        std::map<uint16_t, uint64_t>::iterator known = received.find(channel.id);
+        uint64_t from = (known != received.end()) ? known->second : 0;
+        if (from > channel.scrollback->end()) {
+            from = channel.scrollback->end();
+        }
+        uint64_t start = (from < channel.scrollback->begin()) ? channel.scrollback->begin() : from;
+        if (channel.id == 0 && screen) {
+            // Nothing to replay: the next update draws the screen as it is
+            start = channel.scrollback->end();
+            screen->reattach();
+        } else if (start > from) {
+            lost[channel.id] = start - from;
+        }
+        channel.replayOffset = start;
+        channel.replaying = start < channel.scrollback->end();
+        channel.credit = CHANNEL_WINDOW;
+        replayBytes += channel.scrollback->end() - start;
+
+        StreamOffset offset = { channel.id, start };
+        reply.offsets.push_back(offset);
+    }
+    queueSend(makeHelloFrame(reply));
+
+    resumes++;
+    countMetric(METRIC_RESUMES);
+    logMessage(LOG_INFO, "Client reattached to session %s, replaying %llu bytes on %zu channels", describeToken(token).c_str(),
+        (unsigned long long)replayBytes, channels.size());
+    for (std::map<uint16_t, uint64_t>::iterator it = lost.begin(); it != lost.end(); ++it) {
+        queueMessage(it->first, STREAM_CONTROL, getCurrentTimestamp() + "[" + std::to_string(it->second) +
+            " bytes of output were lost while disconnected]");
+    }
+
+    releaseBacklogs();
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        resumeReads(*it->second);
+    }
+    if (screen) {
+        updateScreen(false);
+    }
+}
+
+void ClientSession::beginSession() {
+    if (helloTimer) {
+        loop.cancelTimer(helloTimer);
+        helloTimer = 0;
+        release();
+    }
+    state = ACTIVE;
+
+    // A synced screen is greeted, and its shell started, once the client
+    // has said how big it is (handleScreenFrame)
+    if (screenSync) {
+        return;
+    }
+
+    // Send welcome message immediately
+    Channel& channel = *channels[0];
+    sendMessage(channel, STREAM_CONTROL, getCurrentTimestamp() + "Welcome to Remote Terminal Server!\n" +
+                                         getCurrentTimestamp() + "Shell session initialized.");
+
+    // Start streaming shell output
+    startChannel(channel);
+
+    // A legacy client's first command may already be buffered
+    if (!framed) {
+        processInput();
+    }
+}
+
+void ClientSession::handleCommand(Channel& channel, std::string command) {
+    // Remove trailing newline if present
+    if (!command.empty() && command.back() == '\n') {
+        command.pop_back();
+    }
+    if (!command.empty() && command.back() == '\r') {
+        command.pop_back();
+    }
+
+    if (channel.id == 0) {
+        logMessage(LOG_DEBUG, "Received command: %s", command.c_str());
+    } else {
+        logMessage(LOG_DEBUG, "Received command on channel %u: %s", (unsigned)channel.id, command.c_str());
+    }
+
+    // The response to a command is interactive output even if the previous
+    // one only just finished
+    channel.lastFlush = std::chrono::steady_clock::time_point();
+    countMetric(METRIC_COMMANDS);
+    channel.commandTime = std::chrono::steady_clock::now();
+    channel.awaitingOutput = true;
+    if (!channel.commandRunning) {
+        startCommand(channel, false, 0);
+    }
+
+    if (recording) {
+        std::string line = command + "\n";
+        recording->record(channel.id, STREAM_STDIN, captureTime(channel.commandTime), line.data(), line.length());
+    }
+
+    // Check for exit command. On other channels it just ends that shell,
+    // which closes the channel once its output pipe breaks.
+    if (channel.id == 0 && (command == "exit" || command == "quit")) {
+        exiting = true;
+
+        // Send the exit command to shell, then give it a moment for any
+        // final output before saying goodbye
+        std::string line = channel.shell->commandLine(command);
+        finish(queueShellInput(channel, line.data(), line.length()) ? 500 : 0);
+        return;
+    }
+
+    // Send the command to shell (non-blocking)
+    std::string line = channel.shell->commandLine(command);
+    if (!queueShellInput(channel, line.data(), line.length())) {
+        sendMessage(channel, STREAM_CONTROL, getCurrentTimestamp() + "Error: Failed to send command to shell");
+    }
+    // Note: Output will arrive through the shell pipe reads
+}
+
+void ClientSession::handleTrackedCommand(Channel& channel, uint32_t id, const std::string& command) {
+    // One at a time, so each result covers exactly its own command
+    if (channel.commandRunning) {
+        channel.queuedCommands.push_back(std::make_pair(id, command));
+        watchCommand(channel, COMMAND_QUIET_MS);
+        return;
+    }
+    startCommand(channel, true, id);
+    handleCommand(channel, command);
+}
+
+void ClientSession::startCommand(Channel& channel, bool tracked, uint32_t id) {
+    channel.commandRunning = true;
+    channel.commandTracked = tracked;
+    channel.commandId = id;
+    channel.commandStart = std::chrono::steady_clock::now();
+    channel.commandFirstOutput = std::chrono::steady_clock::time_point();
+    channel.commandBytes = 0;
+    channel.commandLastOutput = channel.commandStart;
+    watchCommand(channel, COMMAND_QUIET_MS);
+}
+
+void ClientSession::watchCommand(Channel& channel, DWORD delayMs) {
+    // Only a shell without prompt marks needs watching, and one timer covers
+    // however much output comes meanwhile
+    if (channel.marked || !channel.commandRunning || channel.commandTimer) {
+        return;
+    }
+    addRef();
+    Channel* target = &channel;
+    channel.commandTimer = loop.addTimer(delayMs, [this, target]() {
+        target->commandTimer = 0;
+        checkCommand(*target);
+        release();
+    });
+}
+
+void ClientSession::checkCommand(Channel& channel) {
+    if (channel.marked || !channel.commandRunning) {
+        return;
+    }
+    std::chrono::steady_clock::duration quiet = std::chrono::steady_clock::now() - channel.commandLastOutput;
+    if (quiet < std::chrono::milliseconds(COMMAND_QUIET_MS)) {
+        DWORD remainingMs = (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::milliseconds(COMMAND_QUIET_MS) - quiet).count() + 1;
+        watchCommand(channel, remainingMs);
+        return;
+    }
+    finishCommand(channel, COMMAND_UNKNOWN, 0);
+}
+
+void ClientSession::finishCommand(Channel& channel, uint8_t status, int exitCode) {
+    // A prompt nothing was waiting for: the user pressed enter on an empty
+    // line in a raw terminal, or started a nested shell
+    if (!channel.commandRunning) {
+        return;
+    }
+    channel.commandRunning = false;
+
+    // A new shell's first prompt only means it is ready
+    if (channel.commandStart != std::chrono::steady_clock::time_point()) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration wall = now - channel.commandStart;
+        std::chrono::steady_clock::duration firstOutput = channel.commandFirstOutput != std::chrono::steady_clock::time_point()
+            ? channel.commandFirstOutput - channel.commandStart : wall;
+        observeLatency(METRIC_COMMAND_TIME, wall);
+        if (status == COMMAND_EXITED && exitCode != 0) {
+            countMetric(METRIC_COMMANDS_FAILED);
+        }
+        std::string ending = status == COMMAND_EXITED ? " with status " + std::to_string(exitCode)
+                           : status == COMMAND_UNKNOWN ? " (no prompt, status unknown)" : "";
+        logMessage(LOG_DEBUG, "Command on channel %u finished%s in %.3f s, first output after %.3f s, %llu bytes",
+            (unsigned)channel.id, ending.c_str(),
+            std::chrono::duration<double>(wall).count(), std::chrono::duration<double>(firstOutput).count(),
+            (unsigned long long)channel.commandBytes);
+
+        if (channel.commandTracked) {
+            CommandResultPayload result;
+            result.id = channel.commandId;
+            result.status = status;
+            result.exitCode = exitCode;
+            result.wallMicroseconds = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(wall).count();
+            result.firstOutputMicroseconds = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(firstOutput).count();
+            result.outputBytes = channel.commandBytes;
+
+            // The result follows the command's output, even output that is
+            // being held back
+            std::string frame = makeCommandResultFrame(channel.id, result);
+            if (!channel.backlog.empty() || channel.spill || channel.replaying) {
+                channel.heldResults.push_back(std::move(frame));
+            } else {
+                flushOutput(channel);
+                queueSend(std::move(frame));
+            }
+        }
+    }
+
+    if (!channel.queuedCommands.empty()) {
+        std::pair<uint32_t, std::string> next = std::move(channel.queuedCommands.front());
+        channel.queuedCommands.pop_front();
+        handleTrackedCommand(channel, next.first, next.second);
+    }
+}
+
+bool ClientSession::sendHeldResults(Channel& channel) {
+    // Once the output ahead of them has gone
+    if (channel.heldResults.empty() || !channel.backlog.empty() || channel.spill || channel.replaying) {
+        return false;
+    }
+    flushOutput(channel);
+    for (size_t i = 0; i < channel.heldResults.size(); i++) {
+        queueSend(std::move(channel.heldResults[i]));
+    }
+    channel.heldResults.clear();
+    return true;
+}
+
+void ClientSession::handleKeystrokes(Channel& channel, const char* data, size_t length) {
+    // In the order they came, behind whatever the terminal hasn't taken yet
+    channel.lastFlush = std::chrono::steady_clock::time_point();
+    channel.commandTime = std::chrono::steady_clock::now();
+    channel.awaitingOutput = true;
+    if (recording) {
+        recording->record(channel.id, STREAM_STDIN, captureTime(channel.commandTime), data, length);
+    }
+    if (!queueShellInput(channel, data, length)) {
+        sendMessage(channel, STREAM_CONTROL, "Error: Failed to send input to shell");
+    }
+}
+
+void ClientSession::handleScreenFrame(const FrameHeader& header, const char* payload) {
+    uint8_t message;
+    const char* body;
+    size_t length;
+    if (header.channel != 0 || !decodeScreenFrame(payload, header.length, message, body, length)) {
+        return;
+    }
+
+    uint32_t sequence;
+    const char* data;
+    size_t dataLength;
+    if (message == SCREEN_ACK && screen && decodeScreenSequence(body, length, sequence, data, dataLength)) {
+        if (screen->acknowledge(sequence)) {
+            updateScreen(false);
+        }
+        return;
+    }
+    uint16_t rows;
+    uint16_t columns;
+    if (message != SCREEN_SIZE || !decodeScreenSize(body, length, rows, columns)) {
+        return;
+    }
+
+    // The shell's terminal takes the client's size, so full-screen programs
+    // lay themselves out for it. The screen starts over blank, and the
+    // program is told (SIGWINCH) to draw it again.
+    Channel& channel = *channels[0];
+    if (screen) {
+        if (screen->resize(rows, columns)) {
+            channel.shell->resize(screen->rows(), screen->columns());
+        }
+        updateScreen(false);
+        return;
+    }
+    screen.reset(new ScreenMirror(rows, columns));
+    channel.shell->resize(screen->rows(), screen->columns());
+    sendMessage(channel, STREAM_CONTROL, getCurrentTimestamp() + "Welcome to Remote Terminal Server!\n" +
+                                         getCurrentTimestamp() + "Shell session initialized.");
+    startChannel(channel);
+}
+
+void ClientSession::updateScreen(bool force) {
+    // One update in flight at a time, and at most one per SCREEN_UPDATE_MS:
+    // whatever the shell draws meanwhile is folded into the next one
+    if (state != ACTIVE || !screen) {
+        return;
+    }
+    bool timerCancelled = false;
+    if (force) {
+        // The timer's reference is dropped once the update has gone
+        if (screenTimer) {
+            loop.cancelTimer(screenTimer);
+            screenTimer = 0;
+            timerCancelled = true;
+        }
+    } else {
+        if (screen->inFlight() || !screen->hasChanges() || screenTimer) {
+            return;
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now < screen->nextUpdate()) {
+            DWORD delayMs = (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(screen->nextUpdate() - now).count() + 1;
+            addRef();
+            screenTimer = loop.addTimer(delayMs, [this]() {
+                screenTimer = 0;
+                updateScreen(false);
+                release();
+            });
+            return;
+        }
+    }
+    if (screen->hasChanges()) {
+        screen->makeUpdate(screenPayload);
+        if (compressOutput && compressor.compress(screenPayload.data(), screenPayload.length(), compressBuffer)) {
+            queueSend(makeFrame(FRAME_SCREEN, STREAM_STDOUT, compressBuffer.data(), compressBuffer.length(),
+                FRAME_FLAG_COMPRESSED, 0));
+        } else {
+            queueSend(makeFrame(FRAME_SCREEN, STREAM_STDOUT, screenPayload.data(), screenPayload.length(), 0, 0));
+        }
+    }
+    if (timerCancelled) {
+        release();
+    }
+}
+
+void ClientSession::finish(DWORD delayMs) {
+    // Says goodbye after 'delayMs' and closes once that has been sent
+    exiting = true;
+    addRef();
+    loop.addTimer(delayMs, [this]() {
+        sendMessage(*channels[0], STREAM_CONTROL, "Goodbye!");
+        if (screen) {
+            // The shell's last output and the goodbye can't wait for an ack
+            updateScreen(true);
+        }
+        if (rawInput) {
+            queueSend(makeFrame(FRAME_CHANNEL_CLOSE, STREAM_CONTROL, "Shell exited", 12, 0, 0));
+        }
+        closeWhenSent = true;
+        if (!sendPending) {
+            close();
+        }
+        release();
+    });
+}
+
+void ClientSession::close() {
+    if (state == CLOSING) {
+        return;
+    }
+    if (state == DETACHED) {
+        adjustGauge(METRIC_DETACHED_SESSIONS, -1);
+    }
+    state = CLOSING;
+    if (!token.empty()) {
+        registry.remove(token);
+    }
+
+    if (helloTimer) {
+        loop.cancelTimer(helloTimer);
+        helloTimer = 0;
+        release();
+    }
+    if (detachTimer) {
+        loop.cancelTimer(detachTimer);
+        detachTimer = 0;
+        release();
+    }
+    if (screenTimer) {
+        loop.cancelTimer(screenTimer);
+        screenTimer = 0;
+        release();
+    }
+
+    // Abort everything in flight; each aborted operation still completes on
+    // the loop and drops its reference
+    if (clientSocket != INVALID_SOCKET) {
+        loop.detach((IoHandle)clientSocket);
+        closesocket(clientSocket);
+        clientSocket = INVALID_SOCKET;
+    }
+    if (pendingSocket != INVALID_SOCKET) {
+        closesocket(pendingSocket);
+        pendingSocket = INVALID_SOCKET;
+    }
+    for (std::map<uint16_t, std::unique_ptr<Channel>>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel& channel = *it->second;
+        if (channel.flushTimer) {
+            loop.cancelTimer(channel.flushTimer);
+            channel.flushTimer = 0;
+            release();
+        }
+        if (channel.commandTimer) {
+            loop.cancelTimer(channel.commandTimer);
+            channel.commandTimer = 0;
+            release();
+        }
+        detachChannel(channel);
+    }
+
+    abortSyncs();
+    abortSearches();
+
+    // Drop the session's own reference
+    release();
+}
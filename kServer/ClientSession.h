@@ -0,0 +1,442 @@
+#pragma once
+
+#include "../platform.h"
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <vector>
+#include <chrono>
+#include "../common.h"
+#include "../FrameProtocol.h"
+#include "../Compression.h"
+#include "../SecureChannel.h"
+#include "EventLoop.h"
+#include "BufferPool.h"
+#include "PersistentShell.h"
+#include "ShellPool.h"
+#include "Scrollback.h"
+#include "SessionRegistry.h"
+#include "FileTransfer.h"
+#include "TreeSync.h"
+#include "HistorySearch.h"
+#include "SessionRecorder.h"
+#include "ScreenMirror.h"
+
+// Protocol features this server can enable when a client asks for them.
+// cmd.exe reads a pipe rather than a terminal, so raw keystrokes would be
+// neither echoed nor editable there, and there is no screen to sync.
+#ifdef _WIN32
+#define SERVER_FEATURES (FEATURE_COMPRESSION | FEATURE_CHANNELS | FEATURE_RESUME | FEATURE_FILE_TRANSFER | \
+                         FEATURE_SYNC | FEATURE_OUTPUT_STREAMS | FEATURE_COMMANDS | FEATURE_SEARCH)
+#else
+#define SERVER_FEATURES (FEATURE_COMPRESSION | FEATURE_CHANNELS | FEATURE_RESUME | FEATURE_RAW_INPUT | \
+                         FEATURE_FILE_TRANSFER | FEATURE_SYNC | FEATURE_OUTPUT_STREAMS | FEATURE_COMMANDS | \
+                         FEATURE_SEARCH | FEATURE_SCREEN_SYNC)
+#endif
+
+// Shells one connection may run at once, channel 0 included
+#define MAX_CHANNELS 64
+
+// Gather at most this many queued buffers into one send (<= IO_MAX_VECTORS)
+#define MAX_SEND_BUFFERS 64
+
+// TLS: queued output encrypted for one send, at most. Receives of
+// ciphertext land in a buffer of TLS_RECEIVE_SIZE.
+#define TLS_SEND_BATCH (256 * 1024)
+#define TLS_RECEIVE_SIZE (64 * 1024)
+
+// Output coalescing. The first output after an idle period goes out at once;
+// output that keeps coming within COALESCE_DELAY_MS of the last send is
+// batched until the delay expires or COALESCE_MAX_BYTES have accumulated.
+#define COALESCE_DELAY_MS 5
+#define COALESCE_MAX_BYTES (64 * 1024)
+
+// A shell that hasn't shown a prompt mark (PROMPT_MARK) has a prompt of its
+// own. Its commands are taken to have finished, status unknown, once their
+// output has been quiet this long.
+#define COMMAND_QUIET_MS 2000
+
+// Input for the shells is queued while their terminals are full. Once this
+// much is queued across a session's shells, the session stops receiving
+// from the client until they catch up, so TCP holds back the rest.
+#define INPUT_QUEUE_LIMIT (256 * 1024)
+
+// Output queued for the socket beyond this counts as the client falling
+// behind: newer shell output is held back unframed, where the session's
+// OutputQueueConfig decides what happens to it
+#define SEND_QUEUE_HIGH_WATER (256 * 1024)
+
+// What a session does once its queued output reaches the memory ceiling
+enum OverflowPolicy {
+    OVERFLOW_BLOCK,         // Stop reading the shells until the client catches up
+    OVERFLOW_DROP_OLDEST,   // Discard the oldest held output, leaving a marker
+    OVERFLOW_SPILL,         // Keep the excess in a temporary file
+};
+
+struct OutputQueueConfig {
+    size_t limitBytes;      // Ceiling on a session's queued output, at least 2 * SEND_QUEUE_HIGH_WATER
+    OverflowPolicy policy;
+};
+
+#define DEFAULT_OUTPUT_QUEUE_LIMIT (4 * 1024 * 1024)
+
+// Backpressure totals across all sessions, updated from every loop
+struct OutputQueueStats {
+    std::atomic<int64_t> queuedBytes;       // Output currently queued or held
+    std::atomic<int> stalledSessions;       // Sessions whose client isn't keeping up
+    std::atomic<uint64_t> stallMicroseconds;    // Time sessions have spent stalled
+    std::atomic<uint64_t> droppedBytes;
+    std::atomic<uint64_t> spilledBytes;
+
+    OutputQueueStats() : queuedBytes(0), stalledSessions(0), stallMicroseconds(0), droppedBytes(0), spilledBytes(0) {}
+};
+
+// One client connection and its shells. A session is pinned to a single
+// EventLoop and driven entirely by completions on it: socket receives and
+// sends, and reads from the shells' output pipes.
+//
+// With FEATURE_RESUME the session outlives its connection: when the client
+// goes away it detaches, keeps the shells running into each channel's
+// scrollback, and a reconnecting client with the session's token takes
+// over again on the same loop.
+//
+// Every outstanding operation and timer holds a reference; the session
+// deletes itself once it has been closed and the last one has completed.
+class ClientSession : public IoHandler {
+private:
+    enum State {
+        NEGOTIATING,    // Waiting for FRAME_HELLO (or the legacy timeout)
+        ACTIVE,
+        DETACHED,       // The client has gone; shells run on into the scrollback
+        CLOSING,
+    };
+
+    enum { SHELL_STDOUT, SHELL_STDERR, SHELL_STREAMS };
+
+    struct Channel;
+
+    // A piece of held output, and when the shell wrote it
+    struct HeldOutput {
+        IoSlice slice;
+        uint8_t stream;
+        std::chrono::steady_clock::time_point readTime;
+    };
+
+    struct PipeRead {
+        IoOperation operation;  // First, so a completed read leads back to its PipeRead
+        Channel* channel;
+        IoHandle hPipe;         // INVALID_IO_HANDLE if the shell has no such stream
+        IoBuffer* buffer;       // Reads land at buffer->tail()
+        bool pending;           // A read is in flight
+        bool paused;            // Not reposted until the client grants more credit
+    };
+
+    // The shell's stdin. Input arriving while a write is in flight waits in
+    // 'queued' and goes in the next one.
+    struct PipeWrite {
+        IoOperation operation;
+        Channel* channel;
+        IoHandle hPipe;
+        std::string writing;    // Written from by the loop: unchanged while 'pending'
+        size_t written;         // Of 'writing', by earlier partial writes
+        std::string queued;
+        bool pending;           // A write is in flight
+    };
+
+    // A shell and its output. Channel 0 is the shell the connection was
+    // accepted with; clients that negotiate FEATURE_CHANNELS can open more.
+    struct Channel {
+        uint16_t id;
+        std::unique_ptr<PersistentShell> shell;
+        PipeRead shellReads[SHELL_STREAMS];
+        PipeWrite shellInput;
+        bool closing;
+        int64_t credit;         // Shell output the client will still accept
+
+        // Shell output waiting to be sent, as slices of the buffers the pipes
+        // were read into. The first slice holds the frame header space and
+        // the timestamp or capture time, so a flush only has to fill in the
+        // header.
+        std::vector<IoSlice> pendingOutput;
+        size_t pendingBytes;    // Shell output in pendingOutput, excluding the first slice
+        uint8_t pendingStream;  // Of all of pendingOutput (always STREAM_STDOUT without FEATURE_OUTPUT_STREAMS)
+        uint64_t flushTimer;
+        std::chrono::steady_clock::time_point lastFlush;
+        std::chrono::steady_clock::time_point firstRead;    // Of the output in pendingOutput; zero for held output
+
+        // The last command, until the shell's first output after it
+        std::chrono::steady_clock::time_point commandTime;
+        bool awaitingOutput;
+
+        // The command line the shell is running, from when it was written
+        // until the mark (PROMPT_MARK) at the start of the next prompt.
+        // Lines sent meanwhile are input for it. A new shell's first prompt
+        // counts as one, with no start time.
+        bool commandRunning;
+        bool commandTracked;    // A FRAME_COMMAND, whose result goes to the client
+        uint32_t commandId;
+        std::chrono::steady_clock::time_point commandStart;
+        std::chrono::steady_clock::time_point commandFirstOutput;  // Zero until there is some
+        uint64_t commandBytes;
+        bool marked;            // The shell has shown a prompt mark
+        uint64_t commandTimer;  // Until a command without marks goes quiet
+        std::chrono::steady_clock::time_point commandLastOutput;
+        std::deque<std::pair<uint32_t, std::string>> queuedCommands;   // FRAME_COMMANDs waiting their turn
+        std::vector<std::string> heldResults;   // Result frames waiting for held output to go first
+        std::string markCarry[SHELL_STREAMS];   // A possible mark cut off at the end of the last read
+
+        // Output held back while the client isn't keeping up, oldest first:
+        // the in-memory backlog, then anything spilled to disk after it
+        std::deque<HeldOutput> backlog;
+        size_t backlogBytes;
+        FILE* spill;
+        uint64_t spillRead;     // Offsets into 'spill'
+        uint64_t spillWritten;
+        uint64_t droppedBytes;  // Dropped since the last marker was sent
+
+        // FEATURE_RESUME: everything framed as output, and how much of it
+        // is still to be resent to a client that has reattached. With
+        // FEATURE_SEARCH it is indexed, and the history searches read.
+        std::unique_ptr<Scrollback> scrollback;
+        uint64_t replayOffset;
+        bool replaying;
+    };
+
+    // A queued send: a referenced range of a pooled buffer, a message that
+    // was built as a string (control messages, the hello reply), or a range
+    // of a file being downloaded, which is sent on its own straight from
+    // the file
+    struct SendSegment {
+        IoBuffer* buffer;       // NULL when the bytes are in 'owned' or a file
+        const char* data;
+        size_t length;
+        std::string owned;
+        FileTransfer* transfer; // Non-NULL for a file range
+        uint64_t fileOffset;
+
+        const char* bytes() const { return buffer ? data : owned.data(); }
+        size_t size() const { return (buffer || transfer) ? length : owned.length(); }
+    };
+
+    EventLoop& loop;
+    BufferPool& pool;
+    SessionRegistry& registry;
+    ShellPool& shellPool;
+    const OutputQueueConfig& queueConfig;
+    OutputQueueStats& queueStats;
+    SOCKET clientSocket;
+    State state;
+    bool framed;
+    bool compressOutput;        // FEATURE_COMPRESSION negotiated
+    bool multiplexed;           // FEATURE_CHANNELS negotiated: more channels, flow control
+    bool rawInput;              // FEATURE_RAW_INPUT negotiated: keystrokes in, untimestamped output out
+    bool fileTransfer;          // FEATURE_FILE_TRANSFER negotiated
+    bool treeSync;              // FEATURE_SYNC negotiated
+    bool outputStreams;         // FEATURE_OUTPUT_STREAMS negotiated: a frame per stream, with capture times
+    bool trackCommands;         // FEATURE_COMMANDS negotiated
+    bool searchable;            // FEATURE_SEARCH negotiated: channels keep an indexed history
+    bool screenSync;            // FEATURE_SCREEN_SYNC negotiated: channel 0 goes out as screen updates
+    StreamCompressor compressor;
+    std::string compressBuffer;
+    int refCount;
+
+    FrameReader reader;
+    IoOperation recvOperation;
+    bool recvPending;
+    bool recvPaused;            // Not reposted until the shells take their queued input
+    size_t inputQueuedBytes;    // Across the shells' PipeWrites
+
+    IoOperation sendOperation;
+    std::vector<SendSegment> sendQueue;
+    size_t sendHead;            // First unsent segment in sendQueue
+    size_t sendOffset;          // Bytes of sendQueue[sendHead] already sent
+    bool sendPending;
+    bool closeWhenSent;
+    size_t sendQueuedBytes;     // Unsent bytes in sendQueue, not counting file ranges
+
+    // Backpressure state and counters, reported when the session closes
+    size_t backlogBytes;        // Held by all channels, in memory
+    int64_t reportedDepth;      // This session's share of queueStats.queuedBytes
+    bool stalled;               // The send queue is past SEND_QUEUE_HIGH_WATER
+    bool readsBlocked;          // OVERFLOW_BLOCK has stopped the shells
+    std::chrono::steady_clock::time_point stallStart;
+    size_t peakDepth;
+    double stalledSeconds;
+    uint64_t droppedBytes;
+    uint64_t spilledBytes;
+
+    std::map<uint16_t, std::unique_ptr<Channel>> channels;
+    std::vector<std::unique_ptr<Channel>> closedChannels;  // Waiting for their reads to drain
+
+    // FEATURE_FILE_TRANSFER: transfers by id. They last as long as the
+    // connection; a client that reconnects starts them again, from where
+    // its copy ends.
+    std::map<uint16_t, std::unique_ptr<FileTransfer>> transfers;
+
+    // FEATURE_SYNC: directory syncs by id, which like transfers end with
+    // the connection
+    std::map<uint16_t, std::unique_ptr<TreeSync>> syncs;
+
+    // FEATURE_SEARCH: searches run one at a time, a step per loop task,
+    // and end with the connection
+    std::deque<std::unique_ptr<HistorySearch>> searches;
+    bool searchPosted;          // A step is queued on the loop
+
+    // --record: everything the shells wrote and were sent, from the start
+    std::unique_ptr<SessionRecording> recording;
+
+    // FEATURE_SCREEN_SYNC: channel 0's screen, from the client's first
+    // SCREEN_SIZE on, and the timer holding back an update that would come
+    // too soon after the last
+    std::unique_ptr<ScreenMirror> screen;
+    uint64_t screenTimer;
+    std::string screenPayload;
+
+    // Small pieces (frame headers, timestamps, markers) are carved from here
+    IoBuffer* scratch;
+    std::vector<CompressInput> compressPieces;
+
+    // Send path counters, reported when the session closes
+    uint64_t bytesSent;
+    uint64_t sendCalls;
+    std::chrono::steady_clock::time_point sendStart;
+
+    uint64_t helloTimer;
+    bool exiting;
+
+    // TLS (--tls): the connection's encryption, the ciphertext of the send
+    // in flight, and how many queued bytes that carries. Receives land in
+    // secureInput and are decrypted into 'reader'.
+    std::unique_ptr<SecureChannel> secure;
+    std::vector<char> secureInput;
+    std::string sealed;
+    size_t sealedOffset;        // Already sent
+    size_t sealedPlain;
+    std::string sealBuffer;
+
+    // FEATURE_RESUME
+    std::string token;          // Empty until the client asks for resume
+    SOCKET pendingSocket;       // A reconnected client, waiting for the old connection's operations to drain
+    std::unique_ptr<SecureChannel> pendingSecure;   // Its TLS, if it has any
+    std::string pendingInput;   // What the accept thread decrypted of it: the hello and anything after
+    uint64_t detachTimer;
+    std::string replayBuffer;
+    uint64_t resumes;
+
+    ~ClientSession();
+    void addRef();
+    void release();
+
+    void postRecv();
+    void postSend();
+    void postShellRead(PipeRead& read);
+    void onRecv(DWORD bytes, DWORD status);
+    void onSend(DWORD bytes, DWORD status);
+    void onShellRead(PipeRead& read, DWORD bytes, DWORD status);
+    PipeWrite* findShellWrite(IoOperation* operation);
+    bool queueShellInput(Channel& channel, const char* data, size_t length);
+    void postShellWrite(PipeWrite& input);
+    void onShellWrite(PipeWrite& input, DWORD bytes, DWORD status);
+    void discardShellInput(PipeWrite& input);
+    void resumeRecv();
+    bool attachSocket();
+    void takeConnection();
+    bool decrypt(DWORD bytes);
+    bool sealQueue();
+    void disconnect();
+    void detach();
+    void discardSendQueue();
+    void adoptConnection();
+
+    Channel* createChannel(uint16_t id, std::unique_ptr<PersistentShell> shell);
+    bool attachChannel(Channel& channel);
+    void detachChannel(Channel& channel);
+    const char* shellTerminal() const;
+    bool matchTerminal(Channel& channel);
+    void startChannel(Channel& channel);
+    void openChannel(uint16_t id);
+    void closeChannel(Channel& channel, const std::string& reason);
+    void releaseChannel(Channel& channel);
+    void destroyClosedChannel(Channel& channel);
+    void grantCredit(Channel& channel, uint32_t bytes);
+    bool canRead(const Channel& channel) const;
+    void resumeReads(Channel& channel);
+
+    void processInput();
+    void handleFrame(const FrameHeader& header, const char* payload);
+    bool negotiate();
+    void enableResume();
+    void resumeSession(const HelloPayload& hello, HelloPayload& reply);
+    void beginSession();
+    void handleCommand(Channel& channel, std::string command);
+    void handleKeystrokes(Channel& channel, const char* data, size_t length);
+    void handleTrackedCommand(Channel& channel, uint32_t id, const std::string& command);
+    void startCommand(Channel& channel, bool tracked, uint32_t id);
+    void finishCommand(Channel& channel, uint8_t status, int exitCode);
+    void watchCommand(Channel& channel, DWORD delayMs);
+    void checkCommand(Channel& channel);
+    bool sendHeldResults(Channel& channel);
+    void readShellOutput(Channel& channel, PipeRead& read, size_t bytes);
+    void takeShellOutput(Channel& channel, uint8_t stream, IoBuffer* buffer, size_t length);
+    void handleFileFrame(const FrameHeader& header, const char* payload);
+    void openTransfer(uint16_t id, const FileOpenPayload& request);
+    void receiveFileData(FileTransfer& transfer, const char* payload, size_t length);
+    void finishUpload(FileTransfer& transfer, const FileClosePayload& close);
+    void queueFileChunk(FileTransfer& transfer);
+    void endTransfer(FileTransfer& transfer, const std::string& error);
+    void abortTransfers();
+    uint32_t windowChecksum(FileTransfer& transfer, uint64_t end, bool& ok);
+    void handleSyncFrame(const FrameHeader& header, const char* payload);
+    void abortSyncs();
+    void handleSearchFrame(const FrameHeader& header, const char* payload);
+    void scheduleSearch();
+    void runSearch();
+    void abortSearches();
+    void handleScreenFrame(const FrameHeader& header, const char* payload);
+    void updateScreen(bool force);
+    Scrollback* newScrollback();
+    void finish(DWORD delayMs);
+    char* allocate(size_t length, IoSlice& slice);
+    void pushSlice(const IoSlice& slice);
+    void pushCopy(const char* data, size_t length);
+    void pushFile(FileTransfer& transfer, uint64_t offset, size_t length);
+    void startSend();
+    void queueSend(std::string data);
+    void queueMessage(uint16_t channel, uint8_t stream, const std::string& message);
+    void sendMessage(Channel& channel, uint8_t stream, const std::string& message);
+    void beginOutput(Channel& channel, uint8_t stream, std::chrono::steady_clock::time_point readTime);
+    void appendOutput(Channel& channel, uint8_t stream, IoBuffer* buffer, size_t length);
+    void holdOutput(Channel& channel, uint8_t stream, IoBuffer* buffer, size_t length);
+    bool spillOutput(Channel& channel, uint8_t stream, std::chrono::steady_clock::time_point readTime, const char* data,
+                     size_t length);
+    bool unspillOutput(Channel& channel);
+    bool releaseBacklog(Channel& channel);
+    bool releaseReplay(Channel& channel);
+    void releaseBacklogs();
+    void updateQueueStats();
+    void logOutput(const Channel& channel);
+    void flushOutput(Channel& channel);
+    void reportSendStats();
+    void reportQueueStats();
+    void close();
+
+public:
+    ClientSession(EventLoop& loop, BufferPool& pool, SessionRegistry& registry, ShellPool& shellPool,
+                  const OutputQueueConfig& queueConfig, OutputQueueStats& queueStats, SOCKET clientSocket,
+                  std::unique_ptr<PersistentShell> shell, std::unique_ptr<SecureChannel> secure, const std::string& input);
+
+    // Must run on the session's loop thread. 'helloTimedOut' means the
+    // server has already waited HELLO_TIMEOUT_MS for a hello.
+    void start(bool helloTimedOut);
+
+    // Hands the session a reconnected client's socket, whose hello asked
+    // for this session, with its TLS and decrypted input if it came over
+    // TLS. Loop thread only; false, leaving 'secure' with the caller, if
+    // the session is closing.
+    bool reattach(SOCKET socket, std::unique_ptr<SecureChannel>&& secure, const std::string& input);
+
+    void onIoComplete(IoOperation* operation, DWORD bytesTransferred, DWORD status) override;
+};
@@ -0,0 +1,69 @@
+#include "EventLoop.h"
+
+// Task queue and timers, shared by the IOCP (EventLoopWin32.cpp) and epoll
+// (EventLoopPosix.cpp) backends
+
+void EventLoop::stop() {
+    if (!loopThread.joinable()) {
+        return;
+    }
+    post([this]() { stopping = true; });
+    loopThread.join();
+}
+
+void EventLoop::post(std::function<void()> task) {
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(taskMutex);
+        wasEmpty = pendingTasks.empty();
+        pendingTasks.push_back(std::move(task));
+    }
+    // One wakeup drains every task queued before the loop gets to it
+    if (wasEmpty) {
+        wake();
+    }
+}
+
+uint64_t EventLoop::addTimer(DWORD delayMs, std::function<void()> callback) {
+    uint64_t timerId = nextTimerId++;
+    timerQueue.insert(std::make_pair(Clock::now() + std::chrono::milliseconds(delayMs), timerId));
+    timerCallbacks[timerId] = std::move(callback);
+    return timerId;
+}
+
+void EventLoop::cancelTimer(uint64_t timerId) {
+    // The queue entry is skipped when it comes due
+    timerCallbacks.erase(timerId);
+}
+
+void EventLoop::runTasks() {
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(taskMutex);
+        tasks.swap(pendingTasks);
+    }
+    for (size_t i = 0; i < tasks.size(); i++) {
+        tasks[i]();
+    }
+}
+
+DWORD EventLoop::runTimers() {
+    while (!timerQueue.empty()) {
+        Clock::time_point now = Clock::now();
+        std::multimap<Clock::time_point, uint64_t>::iterator next = timerQueue.begin();
+        if (next->first > now) {
+            long long waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(next->first - now).count();
+            return (DWORD)(waitMs + 1);
+        }
+
+        uint64_t timerId = next->second;
+        timerQueue.erase(next);
+        std::map<uint64_t, std::function<void()>>::iterator callback = timerCallbacks.find(timerId);
+        if (callback != timerCallbacks.end()) {
+            std::function<void()> fire = std::move(callback->second);
+            timerCallbacks.erase(callback);
+            fire();
+        }
+    }
+    return INFINITE;
+}
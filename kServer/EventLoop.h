@@ -0,0 +1,140 @@
+#pragma once
+
+#include "../platform.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+// Most buffers one postSend can gather
+#define IO_MAX_VECTORS 64
+
+#ifdef _WIN32
+
+typedef OVERLAPPED IoOperation;
+typedef WSABUF IoVec;
+
+#else
+
+struct IoVec {
+    ULONG len;
+    char* buf;
+};
+
+// The POSIX stand-in for OVERLAPPED: one outstanding operation, identified
+// by its address when it completes
+struct IoOperation {
+    int kind;
+    int vectorCount;
+    struct iovec vectors[IO_MAX_VECTORS];
+    IoHandle file;          // postTransmit
+    uint64_t fileOffset;
+    size_t fileLength;
+};
+
+#endif
+
+// Receives completions for handles attached to an EventLoop. 'status' is zero
+// when the operation succeeded.
+class IoHandler {
+public:
+    virtual ~IoHandler() {}
+    virtual void onIoComplete(IoOperation* operation, DWORD bytesTransferred, DWORD status) = 0;
+};
+
+// One event loop serviced by a single thread: an I/O completion port on
+// Windows, epoll elsewhere (where operations are performed as soon as their
+// handle is ready and then completed the same way). Sockets and pipes
+// attached to a loop complete on that loop's thread only, so everything a
+// session owns is touched by one thread and needs no locking.
+class EventLoop {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+#ifdef _WIN32
+    HANDLE hCompletionPort;
+#else
+    // An attached handle and the operations waiting for it to become ready
+    struct Watch {
+        IoHandle handle;
+        IoHandler* handler;
+        IoOperation* reading;
+        IoOperation* writing;
+    };
+
+    struct Completion {
+        IoHandler* handler;
+        IoOperation* operation;
+        DWORD bytes;
+        DWORD status;
+    };
+
+    int epollFd;
+    int wakeFd;
+    std::map<IoHandle, std::unique_ptr<Watch>> watches;
+    std::vector<Completion> completions;    // Finished operations not yet dispatched
+    std::vector<Completion> dispatching;
+
+    bool startOperation(IoHandle handle, IoOperation* operation);
+    bool perform(Watch& watch, IoOperation* operation);
+    void complete(IoHandler* handler, IoOperation* operation, DWORD bytes, DWORD status);
+    void arm(Watch& watch);
+    void dispatchCompletions();
+#endif
+
+    std::thread loopThread;
+    std::mutex taskMutex;
+    std::vector<std::function<void()>> pendingTasks;
+    std::multimap<Clock::time_point, uint64_t> timerQueue;
+    std::map<uint64_t, std::function<void()>> timerCallbacks;
+    uint64_t nextTimerId;
+    bool stopping;
+
+    void loop();
+    void wake();
+    void runTasks();
+    DWORD runTimers(); // Fires due timers, returns ms until the next one
+
+public:
+    EventLoop();
+    ~EventLoop();
+
+    bool start();
+    void stop();
+
+    // Thread-safe
+    void post(std::function<void()> task);
+
+    // Loop thread only
+    uint64_t addTimer(DWORD delayMs, std::function<void()> callback);
+    void cancelTimer(uint64_t timerId);
+
+    // Asynchronous I/O, loop thread only. Each operation completes through
+    // the handle's IoHandler; a false return means it failed to start, with
+    // the error in GetLastError().
+    bool attach(IoHandle handle, IoHandler* handler);
+    bool postReceive(SOCKET socket, char* buffer, size_t length, IoOperation* operation);
+    bool postSend(SOCKET socket, const IoVec* buffers, size_t count, IoOperation* operation);
+    bool postRead(IoHandle pipe, char* buffer, size_t length, IoOperation* operation);
+
+    // Completes like a send, possibly with fewer bytes; 'buffer' must stay
+    // put until it does
+    bool postWrite(IoHandle pipe, const char* buffer, size_t length, IoOperation* operation);
+
+    // Sends 'length' bytes of 'file' from 'offset' without them passing
+    // through the process: TransmitFile, or sendfile on Linux. Completes
+    // like a send, possibly with fewer bytes.
+    bool postTransmit(SOCKET socket, IoHandle file, uint64_t offset, size_t length, IoOperation* operation);
+
+    // Aborts the handle's outstanding operations, which complete with an
+    // error status. Call before closing the handle.
+    void detach(IoHandle handle);
+};
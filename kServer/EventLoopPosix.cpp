@@ -0,0 +1,308 @@
+#include "EventLoop.h"
+#include "Log.h"
+#include <cstdio>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// Readiness events handled per epoll_wait call
+#define EVENT_BATCH 64
+
+enum OperationKind {
+    OPERATION_RECEIVE,
+    OPERATION_SEND,
+    OPERATION_READ,
+    OPERATION_WRITE,
+    OPERATION_TRANSMIT,
+};
+
+// Without sendfile, a transmit goes through a buffer this size
+#define TRANSMIT_BUFFER_SIZE (64 * 1024)
+
+EventLoop::EventLoop() : epollFd(-1), wakeFd(-1), nextTimerId(1), stopping(false) {
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    if (wakeFd >= 0) {
+        close(wakeFd);
+    }
+    if (epollFd >= 0) {
+        close(epollFd);
+    }
+}
+
+bool EventLoop::start() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || wakeFd < 0) {
+        logMessage(LOG_ERROR, "Failed to create event loop: %d", errno);
+        return false;
+    }
+
+    // The wakeup eventfd is the only watch without a Watch
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) != 0) {
+        logMessage(LOG_ERROR, "Failed to create event loop: %d", errno);
+        return false;
+    }
+
+    loopThread = std::thread(&EventLoop::loop, this);
+    return true;
+}
+
+void EventLoop::wake() {
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        // Already signalled: the counter only overflows if the loop is stuck
+    }
+}
+
+bool EventLoop::attach(IoHandle handle, IoHandler* handler) {
+    int flags = fcntl(handle, F_GETFL, 0);
+    if (flags < 0 || fcntl(handle, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return false;
+    }
+
+    std::unique_ptr<Watch> watch(new Watch());
+    watch->handle = handle;
+    watch->handler = handler;
+    watch->reading = NULL;
+    watch->writing = NULL;
+
+    // Watches are one-shot and only armed while an operation is waiting, so
+    // an idle handle (or one that has hung up) never wakes the loop
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.data.ptr = watch.get();
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, handle, &event) != 0) {
+        return false;
+    }
+    watches[handle] = std::move(watch);
+    return true;
+}
+
+bool EventLoop::postReceive(SOCKET socket, char* buffer, size_t length, IoOperation* operation) {
+    operation->kind = OPERATION_RECEIVE;
+    operation->vectorCount = 1;
+    operation->vectors[0].iov_base = buffer;
+    operation->vectors[0].iov_len = length;
+    return startOperation(socket, operation);
+}
+
+bool EventLoop::postSend(SOCKET socket, const IoVec* buffers, size_t count, IoOperation* operation) {
+    operation->kind = OPERATION_SEND;
+    operation->vectorCount = count < IO_MAX_VECTORS ? (int)count : IO_MAX_VECTORS;
+    for (int i = 0; i < operation->vectorCount; i++) {
+        operation->vectors[i].iov_base = buffers[i].buf;
+        operation->vectors[i].iov_len = buffers[i].len;
+    }
+    return startOperation(socket, operation);
+}
+
+bool EventLoop::postRead(IoHandle pipe, char* buffer, size_t length, IoOperation* operation) {
+    operation->kind = OPERATION_READ;
+    operation->vectorCount = 1;
+    operation->vectors[0].iov_base = buffer;
+    operation->vectors[0].iov_len = length;
+    return startOperation(pipe, operation);
+}
+
+bool EventLoop::postWrite(IoHandle pipe, const char* buffer, size_t length, IoOperation* operation) {
+    operation->kind = OPERATION_WRITE;
+    operation->vectorCount = 1;
+    operation->vectors[0].iov_base = const_cast<char*>(buffer);
+    operation->vectors[0].iov_len = length;
+    return startOperation(pipe, operation);
+}
+
+bool EventLoop::postTransmit(SOCKET socket, IoHandle file, uint64_t offset, size_t length, IoOperation* operation) {
+    operation->kind = OPERATION_TRANSMIT;
+    operation->vectorCount = 0;
+    operation->file = file;
+    operation->fileOffset = offset;
+    operation->fileLength = length;
+    return startOperation(socket, operation);
+}
+
+static ssize_t transmit(int socket, IoOperation* operation) {
+#ifdef __linux__
+    off_t offset = (off_t)operation->fileOffset;
+    return sendfile(socket, operation->file, &offset, operation->fileLength);
+#else
+    char buffer[TRANSMIT_BUFFER_SIZE];
+    size_t length = operation->fileLength < sizeof(buffer) ? operation->fileLength : sizeof(buffer);
+    ssize_t bytes = pread(operation->file, buffer, length, (off_t)operation->fileOffset);
+    return bytes <= 0 ? bytes : send(socket, buffer, (size_t)bytes, 0);
+#endif
+}
+
+bool EventLoop::startOperation(IoHandle handle, IoOperation* operation) {
+    std::map<IoHandle, std::unique_ptr<Watch>>::iterator it = watches.find(handle);
+    if (it == watches.end()) {
+        errno = EBADF;
+        return false;
+    }
+
+    // Try it right away; only wait for readiness if it would block. Either
+    // way the handler hears about it from the loop, never from inside this call.
+    Watch& watch = *it->second;
+    if (!perform(watch, operation)) {
+        if (operation->kind == OPERATION_SEND || operation->kind == OPERATION_WRITE || operation->kind == OPERATION_TRANSMIT) {
+            watch.writing = operation;
+        } else {
+            watch.reading = operation;
+        }
+        arm(watch);
+    }
+    return true;
+}
+
+bool EventLoop::perform(Watch& watch, IoOperation* operation) {
+    ssize_t result;
+    do {
+        if (operation->kind == OPERATION_SEND) {
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = operation->vectors;
+            message.msg_iovlen = operation->vectorCount;
+            result = sendmsg(watch.handle, &message, MSG_NOSIGNAL);
+        } else if (operation->kind == OPERATION_TRANSMIT) {
+            result = transmit(watch.handle, operation);
+        } else if (operation->kind == OPERATION_RECEIVE) {
+            result = recv(watch.handle, operation->vectors[0].iov_base, operation->vectors[0].iov_len, 0);
+        } else if (operation->kind == OPERATION_WRITE) {
+            result = write(watch.handle, operation->vectors[0].iov_base, operation->vectors[0].iov_len);
+        } else {
+            result = read(watch.handle, operation->vectors[0].iov_base, operation->vectors[0].iov_len);
+        }
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+
+    if (result < 0) {
+        // A pty master reports EIO once the shell has exited
+        complete(watch.handler, operation, 0, (DWORD)errno);
+    } else if (result == 0 && operation->kind == OPERATION_READ) {
+        // End of a pipe is an error, as ReadFile's ERROR_BROKEN_PIPE is
+        complete(watch.handler, operation, 0, EPIPE);
+    } else if (result == 0 && operation->kind == OPERATION_TRANSMIT) {
+        // The file got shorter since the transfer started
+        complete(watch.handler, operation, 0, EIO);
+    } else {
+        complete(watch.handler, operation, (DWORD)result, 0);
+    }
+    return true;
+}
+
+void EventLoop::complete(IoHandler* handler, IoOperation* operation, DWORD bytes, DWORD status) {
+    Completion completion;
+    completion.handler = handler;
+    completion.operation = operation;
+    completion.bytes = bytes;
+    completion.status = status;
+    completions.push_back(completion);
+}
+
+void EventLoop::arm(Watch& watch) {
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    if (watch.reading) {
+        event.events |= EPOLLIN;
+    }
+    if (watch.writing) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = &watch;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, watch.handle, &event);
+}
+
+void EventLoop::detach(IoHandle handle) {
+    std::map<IoHandle, std::unique_ptr<Watch>>::iterator it = watches.find(handle);
+    if (it == watches.end()) {
+        return;
+    }
+
+    Watch& watch = *it->second;
+    if (watch.reading) {
+        complete(watch.handler, watch.reading, 0, ECANCELED);
+    }
+    if (watch.writing) {
+        complete(watch.handler, watch.writing, 0, ECANCELED);
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, handle, NULL);
+    watches.erase(it);
+}
+
+void EventLoop::dispatchCompletions() {
+    // Handlers start new operations as they go; those land in 'completions'
+    // and are dispatched on the next pass
+    dispatching.swap(completions);
+    for (size_t i = 0; i < dispatching.size(); i++) {
+        dispatching[i].handler->onIoComplete(dispatching[i].operation, dispatching[i].bytes, dispatching[i].status);
+    }
+    dispatching.clear();
+}
+
+void EventLoop::loop() {
+    struct epoll_event events[EVENT_BATCH];
+
+    while (!stopping) {
+        DWORD timeoutMs = runTimers();
+
+        // Don't sleep while there are completions to deliver
+        int timeout = (timeoutMs == INFINITE) ? -1 : (int)timeoutMs;
+        if (!completions.empty()) {
+            timeout = 0;
+        }
+        int count = epoll_wait(epollFd, events, EVENT_BATCH, timeout);
+        if (count < 0) {
+            if (errno != EINTR) {
+                logMessage(LOG_ERROR, "epoll_wait failed with error: %d", errno);
+                break;
+            }
+            count = 0;
+        }
+
+        // Perform the operations whose handles became ready. No handler runs
+        // until the whole batch has been processed, so no Watch in it can be
+        // detached underneath us.
+        bool woken = false;
+        for (int i = 0; i < count; i++) {
+            Watch* watch = (Watch*)events[i].data.ptr;
+            if (!watch) {
+                uint64_t value;
+                if (read(wakeFd, &value, sizeof(value)) < 0) {
+                    // Nothing to drain: another batch already did
+                }
+                woken = true;
+                continue;
+            }
+
+            IoOperation* reading = watch->reading;
+            IoOperation* writing = watch->writing;
+            watch->reading = NULL;
+            watch->writing = NULL;
+            if (reading && !perform(*watch, reading)) {
+                watch->reading = reading;
+            }
+            if (writing && !perform(*watch, writing)) {
+                watch->writing = writing;
+            }
+            if (watch->reading || watch->writing) {
+                arm(*watch);
+            }
+        }
+
+        dispatchCompletions();
+        if (woken) {
+            runTasks();
+        }
+    }
+}
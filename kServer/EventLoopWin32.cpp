@@ -0,0 +1,116 @@
+#include "EventLoop.h"
+#include "Log.h"
+#include <cstdio>
+#include <mswsock.h>
+
+#pragma comment(lib, "mswsock.lib")
+
+// Completion key used for posted tasks; handlers are never null
+#define TASK_COMPLETION_KEY 0
+
+// Completions dequeued per GetQueuedCompletionStatusEx call
+#define COMPLETION_BATCH 64
+
+EventLoop::EventLoop() : hCompletionPort(NULL), nextTimerId(1), stopping(false) {
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    if (hCompletionPort) {
+        CloseHandle(hCompletionPort);
+    }
+}
+
+bool EventLoop::start() {
+    hCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (!hCompletionPort) {
+        logMessage(LOG_ERROR, "CreateIoCompletionPort failed with error: %lu", GetLastError());
+        return false;
+    }
+    loopThread = std::thread(&EventLoop::loop, this);
+    return true;
+}
+
+void EventLoop::wake() {
+    PostQueuedCompletionStatus(hCompletionPort, 0, TASK_COMPLETION_KEY, NULL);
+}
+
+bool EventLoop::attach(IoHandle handle, IoHandler* handler) {
+    return CreateIoCompletionPort(handle, hCompletionPort, (ULONG_PTR)handler, 0) != NULL;
+}
+
+bool EventLoop::postReceive(SOCKET socket, char* buffer, size_t length, IoOperation* operation) {
+    WSABUF wsaBuffer;
+    wsaBuffer.buf = buffer;
+    wsaBuffer.len = (ULONG)length;
+    DWORD flags = 0;
+    if (WSARecv(socket, &wsaBuffer, 1, NULL, &flags, operation, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        SetLastError(WSAGetLastError());
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::postSend(SOCKET socket, const IoVec* buffers, size_t count, IoOperation* operation) {
+    if (WSASend(socket, const_cast<IoVec*>(buffers), (DWORD)count, NULL, 0, operation, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        SetLastError(WSAGetLastError());
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::postRead(IoHandle pipe, char* buffer, size_t length, IoOperation* operation) {
+    return ReadFile(pipe, buffer, (DWORD)length, NULL, operation) || GetLastError() == ERROR_IO_PENDING;
+}
+
+bool EventLoop::postWrite(IoHandle pipe, const char* buffer, size_t length, IoOperation* operation) {
+    return WriteFile(pipe, buffer, (DWORD)length, NULL, operation) || GetLastError() == ERROR_IO_PENDING;
+}
+
+bool EventLoop::postTransmit(SOCKET socket, IoHandle file, uint64_t offset, size_t length, IoOperation* operation) {
+    // The file position comes from the OVERLAPPED. Client editions of
+    // Windows run two TransmitFile calls at a time and queue the rest.
+    operation->Offset = (DWORD)offset;
+    operation->OffsetHigh = (DWORD)(offset >> 32);
+    if (!TransmitFile(socket, file, (DWORD)length, 0, operation, NULL, 0) && WSAGetLastError() != WSA_IO_PENDING) {
+        SetLastError(WSAGetLastError());
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::detach(IoHandle handle) {
+    // The completion port association lasts as long as the handle; aborted
+    // operations still complete through it
+    CancelIoEx(handle, NULL);
+}
+
+void EventLoop::loop() {
+    OVERLAPPED_ENTRY entries[COMPLETION_BATCH];
+
+    while (!stopping) {
+        DWORD timeoutMs = runTimers();
+
+        ULONG removed = 0;
+        if (!GetQueuedCompletionStatusEx(hCompletionPort, entries, COMPLETION_BATCH, &removed, timeoutMs, FALSE)) {
+            if (GetLastError() != WAIT_TIMEOUT) {
+                logMessage(LOG_ERROR, "GetQueuedCompletionStatusEx failed with error: %lu", GetLastError());
+                break;
+            }
+            continue;
+        }
+
+        for (ULONG i = 0; i < removed; i++) {
+            if (entries[i].lpCompletionKey == TASK_COMPLETION_KEY) {
+                runTasks();
+                continue;
+            }
+            // Internal holds the NTSTATUS of the finished operation
+            IoHandler* handler = (IoHandler*)entries[i].lpCompletionKey;
+            OVERLAPPED* overlapped = entries[i].lpOverlapped;
+            handler->onIoComplete(overlapped, entries[i].dwNumberOfBytesTransferred, (DWORD)overlapped->Internal);
+        }
+    }
+}
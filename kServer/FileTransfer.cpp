@@ -0,0 +1,162 @@
+#include "FileTransfer.h"
+#include "../Checksum.h"
+#include <cstdio>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+FileTransfer::FileTransfer(uint16_t id, bool sending, const std::string& path) : file(INVALID_IO_HANDLE), id(id),
+    sending(sending), size(0), start(0), offset(0), acknowledged(0), checksum(ADLER32_INIT), chunkQueued(false), cancelled(false),
+    startTime(std::chrono::steady_clock::now()), path(path) {
+}
+
+#ifdef _WIN32
+
+FileTransfer::~FileTransfer() {
+    if (file != INVALID_IO_HANDLE) {
+        CloseHandle(file);
+    }
+}
+
+bool FileTransfer::open(std::string& error) {
+    HANDLE handle;
+    if (sending) {
+        handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    } else {
+        handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (handle == INVALID_HANDLE_VALUE) {
+        error = "Unable to open " + path + " (error " + std::to_string(GetLastError()) + ")";
+        return false;
+    }
+    file = handle;
+    return true;
+}
+
+uint64_t FileTransfer::fileSize() {
+    LARGE_INTEGER length;
+    return GetFileSizeEx(file, &length) ? (uint64_t)length.QuadPart : 0;
+}
+
+bool FileTransfer::readAt(uint64_t position, char* buffer, size_t length) {
+    // A synchronous handle still takes the position from an OVERLAPPED
+    while (length > 0) {
+        OVERLAPPED overlapped;
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = (DWORD)position;
+        overlapped.OffsetHigh = (DWORD)(position >> 32);
+        DWORD bytes = 0;
+        if (!ReadFile(file, buffer, (DWORD)length, &bytes, &overlapped) || bytes == 0) {
+            return false;
+        }
+        buffer += bytes;
+        position += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool FileTransfer::writeAt(uint64_t position, const char* data, size_t length) {
+    while (length > 0) {
+        OVERLAPPED overlapped;
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = (DWORD)position;
+        overlapped.OffsetHigh = (DWORD)(position >> 32);
+        DWORD bytes = 0;
+        if (!WriteFile(file, data, (DWORD)length, &bytes, &overlapped) || bytes == 0) {
+            return false;
+        }
+        data += bytes;
+        position += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool FileTransfer::truncate(uint64_t length) {
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)length;
+    return SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+#else
+
+FileTransfer::~FileTransfer() {
+    if (file != INVALID_IO_HANDLE) {
+        close(file);
+    }
+}
+
+bool FileTransfer::open(std::string& error) {
+    int fd = sending ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC) : ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = "Unable to open " + path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        error = path + " is not a regular file";
+        close(fd);
+        return false;
+    }
+    file = fd;
+    return true;
+}
+
+uint64_t FileTransfer::fileSize() {
+    struct stat info;
+    return fstat(file, &info) == 0 ? (uint64_t)info.st_size : 0;
+}
+
+bool FileTransfer::readAt(uint64_t position, char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = pread(file, buffer, length, (off_t)position);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        buffer += bytes;
+        position += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool FileTransfer::writeAt(uint64_t position, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = pwrite(file, data, length, (off_t)position);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        data += bytes;
+        position += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool FileTransfer::truncate(uint64_t length) {
+    return ftruncate(file, (off_t)length) == 0;
+}
+
+#endif
+
+bool FileTransfer::checksumRange(uint64_t position, uint64_t length, char* buffer, size_t bufferSize, uint32_t& adler) {
+    while (length > 0) {
+        size_t chunk = length < bufferSize ? (size_t)length : bufferSize;
+        if (!readAt(position, buffer, chunk)) {
+            return false;
+        }
+        adler = adler32(adler, buffer, chunk);
+        position += chunk;
+        length -= chunk;
+    }
+    return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../platform.h"
+#include <cstdint>
+#include <string>
+#include <chrono>
+
+// One file moving over a connection (FEATURE_FILE_TRANSFER), under the id
+// the client gave it. Downloads are sent from the file by the event loop
+// (TransmitFile or sendfile) a chunk at a time; uploads are written as
+// their frames arrive. Reads and writes here are ordinary blocking calls on
+// the session's loop thread, which the page cache keeps short.
+class FileTransfer {
+private:
+    IoHandle file;
+
+public:
+    uint16_t id;
+    bool sending;           // A download: the server sends the file
+    uint64_t size;          // Of the file (download) or what the client sends (upload)
+    uint64_t start;         // Offset the data started at
+    uint64_t offset;        // Next byte to queue (download) or expect (upload)
+    uint64_t acknowledged;  // Download: bytes the client has reported written
+    uint32_t checksum;      // Adler-32 from 'start' to 'offset'
+    bool chunkQueued;       // A download chunk is in the session's send queue
+    bool cancelled;         // Remove once the queued chunk has gone
+    std::chrono::steady_clock::time_point startTime;
+    std::string path;
+
+    FileTransfer(uint16_t id, bool sending, const std::string& path);
+    ~FileTransfer();
+
+    // Opens the file for reading (download) or for reading and writing,
+    // created if missing and not truncated (upload); 'error' says why not
+    bool open(std::string& error);
+    IoHandle handle() const { return file; }
+    uint64_t fileSize();
+
+    // Exactly 'length' bytes at 'offset', or false
+    bool readAt(uint64_t offset, char* buffer, size_t length);
+    bool writeAt(uint64_t offset, const char* data, size_t length);
+    bool truncate(uint64_t length);
+
+    // Adler-32 of the file's bytes in [offset, offset + length), read
+    // through 'buffer'
+    bool checksumRange(uint64_t offset, uint64_t length, char* buffer, size_t bufferSize, uint32_t& adler);
+};
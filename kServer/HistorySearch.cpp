@@ -0,0 +1,362 @@
+#include "HistorySearch.h"
+#include <algorithm>
+#include <cstring>
+
+// Bytes common in shell output, commonest last. A pattern is looked for by
+// the byte of it that comes earliest here, or isn't here at all, which
+// memchr stops at least often.
+static const char COMMON_BYTES[] = "ETAOINSRLCDHUMP=:/._->0123456789pmuhdclrsnioate \r\n";
+
+static size_t rarestByte(const std::string& pattern) {
+    size_t best = 0;
+    size_t bestRank = SIZE_MAX;
+    for (size_t i = 0; i < pattern.length(); i++) {
+        const char* common = strchr(COMMON_BYTES, pattern[i]);
+        size_t rank = (common && pattern[i] != '\0') ? (size_t)(common - COMMON_BYTES) + 1 : 0;
+        if (rank < bestRank) {
+            best = i;
+            bestRank = rank;
+        }
+    }
+    return best;
+}
+
+HistorySearch::HistorySearch(uint16_t channel, const SearchRequest& request)
+    : request(request), anchor(0), offset(0), stop(0), lineNumber(1), afterRemaining(0), started(false), channel(channel) {
+    result.status = FILE_OK;
+    result.complete = 1;
+    result.matches = 0;
+    result.firstLine = 0;
+    result.lastLine = 0;
+    result.scannedBytes = 0;
+    result.skippedBytes = 0;
+    result.microseconds = 0;
+    if (this->request.maxMatches == 0 || this->request.maxMatches > SEARCH_MAX_MATCHES) {
+        this->request.maxMatches = SEARCH_MAX_MATCHES;
+    }
+
+    const std::string& pattern = request.pattern;
+    bool ignoreCase = (request.flags & SEARCH_IGNORE_CASE) != 0;
+    if (pattern.empty() || pattern.find('\n') != std::string::npos) {
+        result.status = FILE_FAILED;
+        result.message = "A pattern is one line of text";
+    } else if (request.flags & SEARCH_REGEX) {
+        try {
+            std::regex::flag_type flags = std::regex::ECMAScript | std::regex::optimize;
+            expression = std::regex(pattern, ignoreCase ? flags | std::regex::icase : flags);
+        } catch (const std::regex_error& error) {
+            result.status = FILE_FAILED;
+            result.message = std::string("Invalid regular expression: ") + error.what();
+        }
+    } else {
+        needle = pattern;
+        for (size_t i = 0; ignoreCase && i < needle.length(); i++) {
+            needle[i] = (char)Scrollback::foldCase((unsigned char)needle[i]);
+        }
+        anchor = rarestByte(needle);
+
+        // The index folds case either way
+        for (size_t i = 0; i + 2 < pattern.length(); i++) {
+            trigrams.push_back(Scrollback::trigramBit(Scrollback::foldCase((unsigned char)pattern[i]),
+                Scrollback::foldCase((unsigned char)pattern[i + 1]), Scrollback::foldCase((unsigned char)pattern[i + 2])));
+        }
+    }
+}
+
+bool HistorySearch::step(Scrollback& history, std::vector<std::string>& frames) {
+    if (!started) {
+        started = true;
+        startTime = std::chrono::steady_clock::now();
+        offset = history.begin();
+        stop = history.end();
+        lineNumber = history.beginLine() + 1;
+        result.firstLine = lineNumber;
+        result.lastLine = history.endLine() + 1;
+        if (result.status != FILE_OK) {
+            finish(frames);
+            return true;
+        }
+    }
+
+    // Output that has fallen out of the history since the last step
+    if (offset < history.begin()) {
+        offset = history.begin();
+        lineNumber = history.beginLine() + 1;
+        partial.clear();
+        before.clear();
+        afterRemaining = 0;
+    }
+
+    size_t budget = SEARCH_STEP_BYTES;
+    while (offset < stop && budget > 0 && !full()) {
+        // A whole block at a time can be ruled out, and with it every line
+        // that ends in it. After one, the line its tail starts ends in the
+        // next block, so the tail is ruled out with that block or not read
+        // until it isn't.
+        Scrollback::BlockIndex block;
+        bool indexed = history.indexAt(offset, block);
+        if (indexed && offset != block.start) {
+            indexed = partial.empty() && block.lineEnd > 0 && offset == block.start + block.lineEnd &&
+                      history.indexAt(block.start + block.length, block);
+        }
+        if (indexed && skippable(history, block)) {
+            result.skippedBytes += block.start + block.lineEnd - offset;
+            lineNumber = block.lines + block.newlines + 1;
+            partial.clear();
+            before.clear();
+            offset = block.start + block.lineEnd;
+            budget -= std::min(budget, (size_t)SEARCH_SKIP_COST);
+            continue;
+        }
+
+        history.read(offset, (size_t)std::min<uint64_t>(budget, stop - offset), chunk);
+        if (chunk.empty()) {
+            break;
+        }
+        offset += chunk.length();
+        budget -= chunk.length();
+        result.scannedBytes += chunk.length();
+        consume(chunk.data(), chunk.length());
+        if (body.length() >= SEARCH_BATCH_BYTES) {
+            flushLines(frames);
+        }
+    }
+
+    if (offset < stop && !full()) {
+        flushLines(frames);
+        return false;
+    }
+
+    // The last line, which the shell may still be writing
+    if (!full() && !partial.empty()) {
+        handleLine(partial.data(), partial.length(), matches(partial.data(), partial.length()), true);
+        partial.clear();
+    }
+    finish(frames);
+    return true;
+}
+
+void HistorySearch::cancel(const std::string& reason, std::vector<std::string>& frames) {
+    if (!started) {
+        startTime = std::chrono::steady_clock::now();
+    }
+    result.status = FILE_FAILED;
+    result.message = reason;
+    finish(frames);
+}
+
+bool HistorySearch::skippable(const Scrollback& history, const Scrollback::BlockIndex& block) const {
+    if (trigrams.empty() || afterRemaining > 0 || block.newlines == 0 || mayContain(block)) {
+        return false;
+    }
+
+    // Context for a match in the next block may come from this one
+    Scrollback::BlockIndex next;
+    return request.context == 0 || (history.indexAt(block.start + block.length, next) && !mayContain(next));
+}
+
+bool HistorySearch::mayContain(const Scrollback::BlockIndex& block) const {
+    if (!block.signature) {
+        return true;
+    }
+    const uint64_t* bits = block.signature->data();
+    for (size_t i = 0; i < trigrams.size(); i++) {
+        if (!(bits[trigrams[i] / 64] & ((uint64_t)1 << (trigrams[i] % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void HistorySearch::consume(const char* data, size_t length) {
+    const char* end = data + length;
+    const char* first = (const char*)memchr(data, '\n', length);
+    if (!first) {
+        // A line longer than SEARCH_LINE_LIMIT is matched a piece at a time
+        partial.append(data, length);
+        if (partial.length() >= SEARCH_LINE_LIMIT) {
+            handleLine(partial.data(), partial.length(), matches(partial.data(), partial.length()), false);
+            partial.clear();
+        }
+        return;
+    }
+
+    const char* start = data;
+    if (!partial.empty()) {
+        partial.append(data, first - data);
+        handleLine(partial.data(), partial.length(), matches(partial.data(), partial.length()), true);
+        partial.clear();
+        start = first + 1;
+    }
+    const char* last = end - 1;
+    while (*last != '\n') {
+        last--;
+    }
+    if (start <= last && !full()) {
+        scanLines(start, last + 1 - start);
+    }
+    partial.assign(last + 1, end);
+}
+
+void HistorySearch::scanLines(const char* text, size_t length) {
+    // 'text' is whole lines. The pattern is looked for across all of them
+    // at once, and only the lines it turns up in are taken apart.
+    const char* end = text + length;
+    const char* haystack = text;
+    if ((request.flags & SEARCH_IGNORE_CASE) && !(request.flags & SEARCH_REGEX)) {
+        folded.resize(length);
+        for (size_t i = 0; i < length; i++) {
+            folded[i] = (char)Scrollback::foldCase((unsigned char)text[i]);
+        }
+        haystack = folded.data();
+    }
+
+    const char* p = text;
+    while (p < end && !full()) {
+        if (afterRemaining > 0) {
+            const char* newline = (const char*)memchr(p, '\n', end - p);
+            handleLine(p, newline - p, matches(p, newline - p, haystack + (p - text)), true);
+            p = newline + 1;
+            continue;
+        }
+        const char* line = findMatchingLine(p, end, haystack + (p - text));
+        remember(p, line);
+        if (line == end) {
+            break;
+        }
+        const char* newline = (const char*)memchr(line, '\n', end - line);
+        handleLine(line, newline - line, true, true);
+        p = newline + 1;
+    }
+}
+
+const char* HistorySearch::findMatchingLine(const char* text, const char* end, const char* haystack) {
+    if (request.flags & SEARCH_REGEX) {
+        while (text < end) {
+            const char* newline = (const char*)memchr(text, '\n', end - text);
+            if (regexMatches(text, newline - text)) {
+                return text;
+            }
+            text = newline + 1;
+        }
+        return end;
+    }
+
+    // Candidates for the pattern's least common byte, then the rest of it
+    size_t length = needle.length();
+    const char* scan = haystack;
+    const char* scanEnd = haystack + (end - text);
+    while ((size_t)(scanEnd - scan) >= length) {
+        const char* candidate = (const char*)memchr(scan + anchor, needle[anchor], (scanEnd - scan) - length + 1);
+        if (!candidate) {
+            break;
+        }
+        const char* start = candidate - anchor;
+        if (memcmp(start, needle.data(), length) == 0) {
+            const char* line = text + (start - haystack);
+            while (line > text && line[-1] != '\n') {
+                line--;
+            }
+            return line;
+        }
+        scan = start + 1;
+    }
+    return end;
+}
+
+bool HistorySearch::matches(const char* line, size_t length, const char* haystack) {
+    if (request.flags & SEARCH_REGEX) {
+        return regexMatches(line, length);
+    }
+    std::string lineFolded;
+    if (!haystack) {
+        lineFolded.assign(line, length);
+        for (size_t i = 0; (request.flags & SEARCH_IGNORE_CASE) && i < length; i++) {
+            lineFolded[i] = (char)Scrollback::foldCase((unsigned char)line[i]);
+        }
+        haystack = lineFolded.data();
+    }
+    return length >= needle.length() &&
+           std::search(haystack, haystack + length, needle.begin(), needle.end()) != haystack + length;
+}
+
+bool HistorySearch::regexMatches(const char* line, size_t length) const {
+    // A terminal's lines end in "\r\n", and '$' should match before both
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    return std::regex_search(line, line + length, expression);
+}
+
+void HistorySearch::handleLine(const char* line, size_t length, bool match, bool ends) {
+    if (match) {
+        for (size_t i = 0; i < before.size(); i++) {
+            sendLine(before[i].first, 0, before[i].second.data(), before[i].second.length());
+        }
+        before.clear();
+        sendLine(lineNumber, SEARCH_LINE_MATCH, line, length);
+        result.matches++;
+        afterRemaining = request.context;
+    } else if (afterRemaining > 0) {
+        sendLine(lineNumber, 0, line, length);
+        afterRemaining--;
+    } else if (request.context > 0) {
+        before.push_back(std::make_pair(lineNumber, std::string(line, std::min(length, (size_t)SEARCH_LINE_SHOWN))));
+        if (before.size() > request.context) {
+            before.pop_front();
+        }
+    }
+    if (ends) {
+        lineNumber++;
+    }
+}
+
+void HistorySearch::remember(const char* text, const char* end) {
+    // Lines that didn't match: counted, and the last few kept for context
+    size_t count = std::count(text, end, '\n');
+    size_t kept = std::min(count, (size_t)request.context);
+    if (count >= request.context) {
+        before.clear();
+    }
+    size_t first = before.size();
+    const char* lineEnd = end;
+    for (size_t i = 0; i < kept; i++) {
+        const char* start = lineEnd - 1;
+        while (start > text && start[-1] != '\n') {
+            start--;
+        }
+        size_t length = std::min((size_t)(lineEnd - 1 - start), (size_t)SEARCH_LINE_SHOWN);
+        before.insert(before.begin() + first, std::make_pair(lineNumber + count - 1 - i, std::string(start, length)));
+        lineEnd = start;
+    }
+    while (before.size() > request.context) {
+        before.pop_front();
+    }
+    lineNumber += count;
+}
+
+void HistorySearch::sendLine(uint64_t number, uint8_t flags, const char* line, size_t length) {
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    if (length > SEARCH_LINE_SHOWN) {
+        length = SEARCH_LINE_SHOWN;
+        flags |= SEARCH_LINE_CUT;
+    }
+    appendSearchLine(body, number, flags, line, length);
+}
+
+void HistorySearch::flushLines(std::vector<std::string>& frames) {
+    if (!body.empty()) {
+        frames.push_back(makeSearchFrame(channel, request.id, SEARCH_LINES, body));
+        body.clear();
+    }
+}
+
+void HistorySearch::finish(std::vector<std::string>& frames) {
+    flushLines(frames);
+    result.complete = (result.status == FILE_OK && !full()) ? 1 : 0;
+    result.microseconds =
+        (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+    frames.push_back(makeSearchFrame(channel, request.id, SEARCH_RESULT, makeSearchResult(result)));
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../FrameProtocol.h"
+#include "Scrollback.h"
+
+// Output read per step of a search, before the loop serves anything else;
+// ruling a block out counts as SEARCH_SKIP_COST
+#define SEARCH_STEP_BYTES (1024 * 1024)
+#define SEARCH_SKIP_COST 1024
+
+// The most matches one search may ask for, and searches one session may
+// have waiting
+#define SEARCH_MAX_MATCHES 100000
+#define SEARCH_MAX_QUEUED 8
+
+// Lines are matched in pieces of at most this length, and sent cut to
+// SEARCH_LINE_SHOWN
+#define SEARCH_LINE_LIMIT (64 * 1024)
+#define SEARCH_LINE_SHOWN 1024
+
+// SEARCH_LINES frames are sent once this much has been found
+#define SEARCH_BATCH_BYTES (64 * 1024)
+
+// One search (FEATURE_SEARCH) of a channel's history, under the id the
+// client gave it. It covers the history as it was when the search began
+// and runs in steps on the session's loop thread, so a search through
+// gigabytes doesn't hold up the other sessions on the loop; output that
+// falls out of the history between steps is passed over.
+//
+// A string pattern is found with memchr (vectorized by the C library) on
+// its least common byte and memcmp, over many lines at a time; blocks
+// whose trigram signature rules the pattern out are never read at all. A
+// regular expression is matched line by line with std::regex and can't
+// use the index.
+class HistorySearch {
+private:
+    SearchRequest request;
+    std::string needle;             // The pattern, case folded with SEARCH_IGNORE_CASE
+    size_t anchor;                  // Index of its least common byte
+    std::regex expression;
+    std::vector<uint32_t> trigrams; // Signature bits a block with a match must have
+
+    uint64_t offset;                // Next byte of the history to read
+    uint64_t stop;                  // Where the history ended when the search began
+    uint64_t lineNumber;            // Of the line 'partial' starts
+    std::string partial;            // A line whose end hasn't been read yet
+    std::string chunk;
+    std::string folded;             // Scratch for SEARCH_IGNORE_CASE
+
+    std::deque<std::pair<uint64_t, std::string>> before;   // The last lines that didn't match, for context
+    uint32_t afterRemaining;        // Context lines still to send after a match
+    std::string body;               // SEARCH_LINES not sent yet
+
+    SearchResultPayload result;
+    bool started;
+    std::chrono::steady_clock::time_point startTime;
+
+    bool full() const { return result.matches >= request.maxMatches; }
+    bool skippable(const Scrollback& history, const Scrollback::BlockIndex& block) const;
+    bool mayContain(const Scrollback::BlockIndex& block) const;
+    void consume(const char* data, size_t length);
+    void scanLines(const char* text, size_t length);
+    const char* findMatchingLine(const char* text, const char* end, const char* haystack);
+    bool matches(const char* line, size_t length, const char* haystack = NULL);
+    bool regexMatches(const char* line, size_t length) const;
+    void handleLine(const char* line, size_t length, bool match, bool ends);
+    void remember(const char* text, const char* end);
+    void sendLine(uint64_t number, uint8_t flags, const char* line, size_t length);
+    void flushLines(std::vector<std::string>& frames);
+    void finish(std::vector<std::string>& frames);
+
+public:
+    uint16_t channel;
+
+    HistorySearch(uint16_t channel, const SearchRequest& request);
+
+    uint32_t id() const { return request.id; }
+
+    // Reads up to SEARCH_STEP_BYTES more of 'history', appending the frames
+    // to send to 'frames'. True once the search is over and its
+    // SEARCH_RESULT is among them.
+    bool step(Scrollback& history, std::vector<std::string>& frames);
+
+    // Ends it early with what was found so far and a failed result
+    void cancel(const std::string& reason, std::vector<std::string>& frames);
+};
@@ -0,0 +1,153 @@
+#include "Log.h"
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+std::atomic<int> currentLogLevel(LOG_INFO);
+
+// Owns the queue and the thread that writes it out
+class LogWriter {
+private:
+    std::mutex mutex;
+    std::condition_variable wakeWriter;
+    std::condition_variable written;
+    std::vector<std::string> queue;
+    uint64_t queuedCount;       // Messages accepted since startup
+    uint64_t writtenCount;
+    uint64_t droppedCount;
+    bool stopping;
+    std::thread writerThread;
+
+    void run() {
+        std::vector<std::string> batch;
+        uint64_t reportedDrops = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wakeWriter.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                break;
+            }
+            batch.swap(queue);
+            uint64_t drops = droppedCount;
+            lock.unlock();
+
+            // The console is only touched here, outside the lock
+            for (size_t i = 0; i < batch.size(); i++) {
+                fwrite(batch[i].data(), 1, batch[i].length(), stdout);
+            }
+            if (drops != reportedDrops) {
+                fprintf(stdout, "(%llu log messages dropped)\n", (unsigned long long)(drops - reportedDrops));
+                reportedDrops = drops;
+            }
+            fflush(stdout);
+            size_t count = batch.size();
+            batch.clear();
+
+            lock.lock();
+            writtenCount += count;
+            written.notify_all();
+        }
+    }
+
+public:
+    LogWriter() : queuedCount(0), writtenCount(0), droppedCount(0), stopping(false) {
+        writerThread = std::thread(&LogWriter::run, this);
+    }
+
+    ~LogWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeWriter.notify_one();
+        writerThread.join();
+    }
+
+    void push(std::string line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.size() >= LOG_QUEUE_LIMIT) {
+            droppedCount++;
+            return;
+        }
+        queue.push_back(std::move(line));
+        queuedCount++;
+        if (queue.size() == 1) {
+            wakeWriter.notify_one();
+        }
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t target = queuedCount;
+        written.wait(lock, [this, target]() { return writtenCount >= target; });
+    }
+
+    uint64_t dropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return droppedCount;
+    }
+};
+
+static LogWriter& logWriter() {
+    // Started by the first message, stopped (after writing everything) at exit
+    static LogWriter writer;
+    return writer;
+}
+
+void setLogLevel(LogLevel level) {
+    currentLogLevel.store(level, std::memory_order_relaxed);
+}
+
+bool parseLogLevel(const char* name, LogLevel& level) {
+    static const char* names[] = { "error", "warning", "info", "debug", "trace" };
+    for (int i = 0; i <= LOG_TRACE; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void logMessage(LogLevel level, const char* format, ...) {
+    if (!logEnabled(level)) {
+        return;
+    }
+
+    // Most messages fit on the stack; longer ones are formatted again
+    // straight into the string
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    std::string line;
+    if ((size_t)length < sizeof(buffer)) {
+        line.reserve(length + 1);
+        line.assign(buffer, length);
+    } else {
+        line.resize(length);
+        va_start(args, format);
+        vsnprintf(&line[0], (size_t)length + 1, format, args);
+        va_end(args);
+    }
+    line += '\n';
+    logWriter().push(std::move(line));
+}
+
+void flushLog() {
+    logWriter().flush();
+}
+
+unsigned long long droppedLogMessages() {
+    return logWriter().dropped();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+
+// Server log. Messages are formatted by the thread that logs them and
+// written to stdout by a background thread, so a busy session never waits
+// on the console. Messages above the current level cost one load and a
+// compare; if the writer falls more than LOG_QUEUE_LIMIT messages behind,
+// newer ones are dropped (and counted) rather than buffered without bound.
+
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,       // Connections, sessions and periodic statistics (default)
+    LOG_DEBUG,      // Every command received
+    LOG_TRACE,      // Every output frame sent
+};
+
+#define LOG_QUEUE_LIMIT 4096
+
+#if defined(__GNUC__)
+#define LOG_FORMAT(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#define LOG_FORMAT(formatIndex, firstArg)
+#endif
+
+extern std::atomic<int> currentLogLevel;
+
+inline bool logEnabled(LogLevel level) {
+    return (int)level <= currentLogLevel.load(std::memory_order_relaxed);
+}
+
+void setLogLevel(LogLevel level);
+
+// Parses "error", "warning", "info", "debug" or "trace"
+bool parseLogLevel(const char* name, LogLevel& level);
+
+// Formats like printf; a newline is added. Any thread.
+void logMessage(LogLevel level, const char* format, ...) LOG_FORMAT(2, 3);
+
+// Blocks until everything logged so far has been written
+void flushLog();
+
+// Messages discarded because the writer was behind
+unsigned long long droppedLogMessages();
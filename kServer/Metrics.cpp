@@ -0,0 +1,169 @@
+#include "Metrics.h"
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct MetricInfo {
+    const char* name;
+    const char* help;
+};
+
+static const MetricInfo counterInfo[METRIC_COUNTERS] = {
+    { "kserver_received_bytes_total", "Bytes received from clients" },
+    { "kserver_sent_bytes_total", "Bytes sent to clients" },
+    { "kserver_recv_calls_total", "Socket receives completed" },
+    { "kserver_send_calls_total", "Socket sends completed" },
+    { "kserver_shell_reads_total", "Shell output pipe reads that returned data" },
+    { "kserver_shell_read_bytes_total", "Bytes read from shell output pipes" },
+    { "kserver_commands_total", "Commands received from clients" },
+    { "kserver_commands_failed_total", "Commands that finished with a nonzero exit status" },
+    { "kserver_connections_total", "Client connections accepted" },
+    { "kserver_sessions_started_total", "Sessions started" },
+    { "kserver_session_resumes_total", "Clients that reattached to a detached session" },
+    { "kserver_shell_pool_hits_total", "Sessions and channels given an idle pre-started shell" },
+    { "kserver_shell_pool_misses_total", "Sessions and channels that had to start a shell" },
+    { "kserver_file_transfers_total", "File transfers completed" },
+    { "kserver_file_sent_bytes_total", "File bytes sent to clients straight from the file" },
+    { "kserver_file_received_bytes_total", "File bytes received from clients" },
+    { "kserver_syncs_total", "Directory syncs finished" },
+    { "kserver_sync_files_total", "Files replaced or created by directory syncs" },
+    { "kserver_sync_received_bytes_total", "New file bytes received in sync deltas" },
+};
+
+static const MetricInfo gaugeInfo[METRIC_GAUGES] = {
+    { "kserver_sessions", "Sessions, attached or detached" },
+    { "kserver_detached_sessions", "Sessions waiting for their client to reconnect" },
+    { "kserver_shells", "Shell processes running" },
+    { "kserver_idle_shells", "Pre-started shells waiting for a session" },
+};
+
+static const MetricInfo histogramInfo[METRIC_HISTOGRAMS] = {
+    { "kserver_command_first_output_seconds", "Time from writing a command to the shell to reading its first output" },
+    { "kserver_command_seconds", "Time from writing a command to the shell to its next prompt" },
+    { "kserver_output_delay_seconds", "Time shell output waits between the pipe read and the socket send queue" },
+    { "kserver_send_seconds", "Time from posting a socket send to its completion" },
+};
+
+// Shards live as long as the process; threads are few and never replaced
+static std::mutex shardMutex;
+static std::vector<std::unique_ptr<MetricsShard>> shards;
+
+MetricsShard& localMetrics() {
+    static thread_local MetricsShard* shard = NULL;
+    if (!shard) {
+        std::unique_ptr<MetricsShard> created(new MetricsShard());
+        shard = created.get();
+        std::lock_guard<std::mutex> lock(shardMutex);
+        shards.push_back(std::move(created));
+    }
+    return *shard;
+}
+
+void observeLatency(MetricHistogram histogram, std::chrono::steady_clock::duration elapsed) {
+    uint64_t microseconds = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    size_t bucket = 0;
+    while (bucket < METRIC_BUCKETS && (1ull << bucket) < microseconds) {
+        bucket++;
+    }
+    MetricsShard::Histogram& target = localMetrics().histograms[histogram];
+    addLocal(target.buckets[bucket], (uint64_t)1);
+    addLocal(target.sumMicroseconds, microseconds);
+}
+
+uint64_t counterTotal(MetricCounter counter) {
+    std::lock_guard<std::mutex> lock(shardMutex);
+    uint64_t total = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+        total += shards[s]->counters[counter].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t gaugeTotal(MetricGauge gauge) {
+    std::lock_guard<std::mutex> lock(shardMutex);
+    int64_t total = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+        total += shards[s]->gauges[gauge].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+static void writeHeader(std::string& out, const char* name, const char* help, const char* type) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+static void writeValue(std::string& out, const char* name, const char* labels, double value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %.15g\n", name, labels, value);
+    out += line;
+}
+
+void writeGauge(std::string& out, const char* name, const char* help, double value) {
+    writeHeader(out, name, help, "gauge");
+    writeValue(out, name, "", value);
+}
+
+void writeCounter(std::string& out, const char* name, const char* help, double value) {
+    writeHeader(out, name, help, "counter");
+    writeValue(out, name, "", value);
+}
+
+void writeMetrics(std::string& out) {
+    // Sum the shards first, so the lock isn't held while formatting
+    uint64_t counters[METRIC_COUNTERS] = {};
+    int64_t gauges[METRIC_GAUGES] = {};
+    uint64_t buckets[METRIC_HISTOGRAMS][METRIC_BUCKETS + 1] = {};
+    uint64_t sums[METRIC_HISTOGRAMS] = {};
+    {
+        std::lock_guard<std::mutex> lock(shardMutex);
+        for (size_t s = 0; s < shards.size(); s++) {
+            const MetricsShard& shard = *shards[s];
+            for (int i = 0; i < METRIC_COUNTERS; i++) {
+                counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < METRIC_GAUGES; i++) {
+                gauges[i] += shard.gauges[i].load(std::memory_order_relaxed);
+            }
+            for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+                for (int b = 0; b <= METRIC_BUCKETS; b++) {
+                    buckets[h][b] += shard.histograms[h].buckets[b].load(std::memory_order_relaxed);
+                }
+                sums[h] += shard.histograms[h].sumMicroseconds.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        writeCounter(out, counterInfo[i].name, counterInfo[i].help, (double)counters[i]);
+    }
+    for (int i = 0; i < METRIC_GAUGES; i++) {
+        writeGauge(out, gaugeInfo[i].name, gaugeInfo[i].help, (double)gauges[i]);
+    }
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        const char* name = histogramInfo[h].name;
+        writeHeader(out, name, histogramInfo[h].help, "histogram");
+        std::string bucketName = std::string(name) + "_bucket";
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= METRIC_BUCKETS; b++) {
+            cumulative += buckets[h][b];
+            char labels[48];
+            if (b < METRIC_BUCKETS) {
+                snprintf(labels, sizeof(labels), "{le=\"%g\"}", (double)(1ull << b) / 1e6);
+            } else {
+                snprintf(labels, sizeof(labels), "{le=\"+Inf\"}");
+            }
+            writeValue(out, bucketName.c_str(), labels, (double)cumulative);
+        }
+        writeValue(out, (std::string(name) + "_sum").c_str(), "", sums[h] / 1e6);
+        writeValue(out, (std::string(name) + "_count").c_str(), "", (double)cumulative);
+    }
+}
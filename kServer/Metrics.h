@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Counters, gauges and latency histograms for the server's hot paths. Every
+// thread records into its own shard, which only that thread writes, so
+// recording is a relaxed load and store with no locked instruction and no
+// cache line shared between loops. Reading sums the shards.
+
+enum MetricCounter {
+    METRIC_BYTES_RECEIVED,      // From client sockets
+    METRIC_BYTES_SENT,
+    METRIC_RECV_CALLS,
+    METRIC_SEND_CALLS,
+    METRIC_SHELL_READS,         // Completed pipe reads with data
+    METRIC_SHELL_BYTES,
+    METRIC_COMMANDS,
+    METRIC_COMMANDS_FAILED,     // Finished with a nonzero exit status
+    METRIC_CONNECTIONS,         // Accepted
+    METRIC_SESSIONS_STARTED,
+    METRIC_RESUMES,
+    METRIC_SHELL_POOL_HITS,     // Sessions and channels given an idle shell
+    METRIC_SHELL_POOL_MISSES,   // ... that had to wait for one to start
+    METRIC_FILE_TRANSFERS,      // Completed, either direction
+    METRIC_FILE_BYTES_SENT,     // File data sent from the file (also in METRIC_BYTES_SENT)
+    METRIC_FILE_BYTES_RECEIVED,
+    METRIC_SYNCS,               // Directory syncs finished
+    METRIC_SYNC_FILES,          // Files a sync replaced or created
+    METRIC_SYNC_BYTES_RECEIVED, // New bytes in deltas (the rest came from the server's copies)
+    METRIC_COUNTERS
+};
+
+// Each thread's share may go negative (a session is created on the accept
+// thread and destroyed on its loop); only the sum means anything
+enum MetricGauge {
+    METRIC_SESSIONS,
+    METRIC_DETACHED_SESSIONS,
+    METRIC_SHELLS,
+    METRIC_IDLE_SHELLS,         // Waiting in the ShellPool (also in METRIC_SHELLS)
+    METRIC_GAUGES
+};
+
+enum MetricHistogram {
+    METRIC_COMMAND_LATENCY,     // Command written to the shell until its first output is read
+    METRIC_COMMAND_TIME,        // Command written to the shell until its next prompt
+    METRIC_OUTPUT_DELAY,        // Shell output read until it is queued on the socket
+    METRIC_SEND_TIME,           // Send posted until it completes
+    METRIC_HISTOGRAMS
+};
+
+// Bucket i of a histogram counts observations of at most 2^i microseconds
+// (up to about 16 s); one more bucket takes the rest
+#define METRIC_BUCKETS 25
+
+struct alignas(64) MetricsShard {
+    std::atomic<uint64_t> counters[METRIC_COUNTERS];
+    std::atomic<int64_t> gauges[METRIC_GAUGES];
+    struct Histogram {
+        std::atomic<uint64_t> buckets[METRIC_BUCKETS + 1];
+        std::atomic<uint64_t> sumMicroseconds;
+    } histograms[METRIC_HISTOGRAMS];
+};
+
+// The calling thread's shard, registered on first use
+MetricsShard& localMetrics();
+
+template <typename T>
+inline void addLocal(std::atomic<T>& value, T amount) {
+    // Only the owning thread writes, so no read-modify-write is needed
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+inline void countMetric(MetricCounter counter, uint64_t amount = 1) {
+    addLocal(localMetrics().counters[counter], amount);
+}
+
+inline void adjustGauge(MetricGauge gauge, int64_t delta) {
+    addLocal(localMetrics().gauges[gauge], delta);
+}
+
+void observeLatency(MetricHistogram histogram, std::chrono::steady_clock::duration elapsed);
+
+// Sums over threads, for a server running in-process (kBench suite)
+uint64_t counterTotal(MetricCounter counter);
+int64_t gaugeTotal(MetricGauge gauge);
+
+// Appends everything recorded so far, summed over threads, in the
+// Prometheus text format
+void writeMetrics(std::string& out);
+
+// For values kept elsewhere (buffer pool, output queues)
+void writeGauge(std::string& out, const char* name, const char* help, double value);
+void writeCounter(std::string& out, const char* name, const char* help, double value);
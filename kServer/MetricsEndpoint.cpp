@@ -0,0 +1,128 @@
+#include "MetricsEndpoint.h"
+#include "Log.h"
+#include <cstdio>
+#include <cstring>
+
+MetricsEndpoint::MetricsEndpoint() : listenSocket(INVALID_SOCKET), stopping(false) {
+}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    stop();
+}
+
+bool MetricsEndpoint::start(unsigned short port, std::function<std::string()> renderMetrics) {
+    render = renderMetrics;
+
+    listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket == INVALID_SOCKET) {
+        logMessage(LOG_ERROR, "Metrics socket failed with error: %d", WSAGetLastError());
+        return false;
+    }
+    disableInheritance(listenSocket);
+
+#ifndef _WIN32
+    int reuse = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+#endif
+
+    // Local only: the numbers say who is connected and how busy they are
+    struct sockaddr_in address;
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(listenSocket, 4) == SOCKET_ERROR) {
+        logMessage(LOG_ERROR, "Metrics endpoint failed to listen on port %u: %d", (unsigned)port, WSAGetLastError());
+        closesocket(listenSocket);
+        listenSocket = INVALID_SOCKET;
+        return false;
+    }
+
+    serverThread = std::thread(&MetricsEndpoint::run, this);
+    logMessage(LOG_INFO, "Metrics available at http://127.0.0.1:%u/metrics", (unsigned)port);
+    return true;
+}
+
+void MetricsEndpoint::stop() {
+    if (!serverThread.joinable()) {
+        return;
+    }
+    stopping = true;
+    serverThread.join();
+    closesocket(listenSocket);
+    listenSocket = INVALID_SOCKET;
+}
+
+void MetricsEndpoint::run() {
+    while (!stopping) {
+        // Wake up now and then to notice stop()
+        WSAPOLLFD fd;
+        fd.fd = listenSocket;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        int ready = WSAPoll(&fd, 1, 200);
+        if (ready == SOCKET_ERROR && WSAGetLastError() != WSAEINTR) {
+            logMessage(LOG_ERROR, "Metrics endpoint poll failed with error: %d", WSAGetLastError());
+            return;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        SOCKET client = accept(listenSocket, NULL, NULL);
+        if (client != INVALID_SOCKET) {
+            disableInheritance(client);
+            serve(client);
+            closesocket(client);
+        }
+    }
+}
+
+void MetricsEndpoint::serve(SOCKET socket) {
+    // Read up to the end of the request headers; nothing after them matters
+    char request[2048];
+    size_t received = 0;
+    while (received < sizeof(request) - 1) {
+        WSAPOLLFD fd;
+        fd.fd = socket;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        if (WSAPoll(&fd, 1, METRICS_REQUEST_TIMEOUT_MS) <= 0) {
+            return;
+        }
+        int bytes = recv(socket, request + received, (int)(sizeof(request) - 1 - received), 0);
+        if (bytes <= 0) {
+            return;
+        }
+        received += bytes;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+
+    std::string body;
+    const char* status = "200 OK";
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        body = render();
+    } else {
+        status = "404 Not Found";
+        body = "Try /metrics\n";
+    }
+
+    char header[192];
+    snprintf(header, sizeof(header),
+        "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        status, body.length());
+    std::string response = header + body;
+    size_t sent = 0;
+    while (sent < response.length()) {
+        int bytes = send(socket, response.data() + sent, (int)(response.length() - sent), 0);
+        if (bytes <= 0) {
+            return;
+        }
+        sent += bytes;
+    }
+    shutdown(socket, SD_SEND);
+}
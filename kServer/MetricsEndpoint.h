@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../platform.h"
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Longest a scraper may take to send its request
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+
+// Serves the server's metrics as Prometheus text over HTTP on a loopback
+// port (GET /metrics). It has its own thread and answers one request at a
+// time, so scraping never runs on an event loop.
+class MetricsEndpoint {
+private:
+    SOCKET listenSocket;
+    std::thread serverThread;
+    std::atomic<bool> stopping;
+    std::function<std::string()> render;
+
+    void run();
+    void serve(SOCKET socket);
+
+public:
+    MetricsEndpoint();
+    ~MetricsEndpoint();
+
+    // 'render' is called on the endpoint's thread for every scrape
+    bool start(unsigned short port, std::function<std::string()> render);
+    void stop();
+};
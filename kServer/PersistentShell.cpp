@@ -1,8 +1,23 @@
 #include "PersistentShell.h"
+#include "Log.h"
+#include "Metrics.h"
 #include <iostream>
 #include <cstdio>
 
-PersistentShell::PersistentShell(const std::string& workingDir) : shellActive(false) {
+// cmd.exe's usual prompt after the mark (PROMPT_MARK). cmd.exe can't show
+// %ERRORLEVEL% in a prompt, so the mark has no exit status.
+#define SHELL_PROMPT "$E]133;D$E\\$P$G"
+
+static bool setShellPrompt() {
+    // Inherited by every cmd.exe the server starts
+    return SetEnvironmentVariableA("PROMPT", SHELL_PROMPT) != 0;
+}
+
+PersistentShell::PersistentShell(const std::string& workingDir, const std::string& terminal)
+    : shellActive(false), terminalType(terminal) {
+    static bool promptSet = setShellPrompt();
+    (void)promptSet;
+
     // Initialize pipe handles
     hChildStdInRd = hChildStdInWr = NULL;
     hChildStdOutRd = hChildStdOutWr = NULL;
@@ -20,7 +35,7 @@ PersistentShell::PersistentShell(const std::string& workingDir) : shellActive(fa
     
     // Create the shell
     if (!initialize()) {
-        printf("Failed to initialize persistent shell\n");
+        logMessage(LOG_ERROR, "Failed to initialize persistent shell");
     }
 }
 
@@ -32,57 +47,70 @@ bool PersistentShell::isActive() const {
     return shellActive;
 }
 
-bool PersistentShell::sendCommand(const std::string& command) {
-    if (!shellActive) {
-        return false;
-    }
+bool PersistentShell::hasExited() const {
+    return shellActive && WaitForSingleObject(piProcInfo.hProcess, 0) == WAIT_OBJECT_0;
+}
+
+std::string PersistentShell::workingDirectory() const {
+    // cmd.exe keeps its directory to itself
+    return currentDirectory;
+}
+
+IoHandle PersistentShell::stdoutPipe() const {
+    return hChildStdOutRd;
+}
+
+IoHandle PersistentShell::stderrPipe() const {
+    return hChildStdErrRd;
+}
 
+IoHandle PersistentShell::stdinPipe() const {
+    return hChildStdInWr;
+}
+
+std::string PersistentShell::commandLine(const std::string& command) const {
     // Handle pwd command (show current directory) - send to shell
     std::string actualCommand = command;
     if (command == "pwd") {
         actualCommand = "cd";  // cmd.exe's cd without arguments shows current directory
     }
-
-    // Write command to shell's stdin
-    std::string cmdWithNewline = actualCommand + "\r\n";
-    DWORD dwWritten;
-    if (!WriteFile(hChildStdInWr, cmdWithNewline.c_str(), (DWORD)cmdWithNewline.length(), &dwWritten, NULL)) {
-        return false;
-    }
-    return true;
+    return actualCommand + "\r\n";
 }
 
-std::string PersistentShell::readAvailableOutput() {
-    if (!shellActive) {
-        return "";
-    }
+bool PersistentShell::resize(int, int) {
+    return false;
+}
 
-    std::string result;
-    char buffer[4096];
-    DWORD dwRead;
-    DWORD bytesAvailable = 0;
-
-    // Check stdout for available data
-    if (PeekNamedPipe(hChildStdOutRd, NULL, 0, NULL, &bytesAvailable, NULL) && bytesAvailable > 0) {
-        // Read available data (up to buffer size)
-        DWORD toRead = min(bytesAvailable, sizeof(buffer) - 1);
-        if (ReadFile(hChildStdOutRd, buffer, toRead, &dwRead, NULL) && dwRead > 0) {
-            buffer[dwRead] = '\0';
-            result += std::string(buffer);
-        }
+bool PersistentShell::createOverlappedPipe(HANDLE* readPipe, HANDLE* writePipe, SECURITY_ATTRIBUTES* saAttr,
+                                           bool overlappedWrite) {
+    // Anonymous pipes don't support overlapped I/O, so build the pair from a
+    // uniquely named pipe whose server's end, the read end or with
+    // 'overlappedWrite' the write end, is opened with FILE_FLAG_OVERLAPPED
+    static volatile LONG pipeSerial = 0;
+    char pipeName[MAX_PATH];
+    sprintf_s(pipeName, sizeof(pipeName), "\\\\.\\pipe\\kServer.%08lx.%08lx",
+        GetCurrentProcessId(), (unsigned long)InterlockedIncrement(&pipeSerial));
+
+    HANDLE* serverEnd = overlappedWrite ? writePipe : readPipe;
+    HANDLE* childEnd = overlappedWrite ? readPipe : writePipe;
+    *serverEnd = CreateNamedPipeA(pipeName,
+        (overlappedWrite ? PIPE_ACCESS_OUTBOUND : PIPE_ACCESS_INBOUND) | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, 4096, 4096, 0, saAttr);
+    if (*serverEnd == INVALID_HANDLE_VALUE) {
+        *serverEnd = NULL;
+        return false;
     }
 
-    // Check stderr for available data
-    if (PeekNamedPipe(hChildStdErrRd, NULL, 0, NULL, &bytesAvailable, NULL) && bytesAvailable > 0) {
-        // Read available data (up to buffer size)
-        DWORD toRead = min(bytesAvailable, sizeof(buffer) - 1);
-        if (ReadFile(hChildStdErrRd, buffer, toRead, &dwRead, NULL) && dwRead > 0) {
-            buffer[dwRead] = '\0';
-            result += std::string(buffer);
-        }
+    *childEnd = CreateFileA(pipeName, overlappedWrite ? GENERIC_READ : GENERIC_WRITE, 0, saAttr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (*childEnd == INVALID_HANDLE_VALUE) {
+        *childEnd = NULL;
+        CloseHandle(*serverEnd);
+        *serverEnd = NULL;
+        return false;
     }
-
-    return result;
+    return true;
 }
 
 bool PersistentShell::initialize() {
@@ -91,33 +119,33 @@ bool PersistentShell::initialize() {
     saAttr.bInheritHandle = TRUE;
     saAttr.lpSecurityDescriptor = NULL;
 
-    // Create pipes for stdin
-    if (!CreatePipe(&hChildStdInRd, &hChildStdInWr, &saAttr, 0)) {
-        printf("CreatePipe failed for stdin\n");
+    // Create pipes for stdin; the session writes to it through its EventLoop
+    if (!createOverlappedPipe(&hChildStdInRd, &hChildStdInWr, &saAttr, true)) {
+        logMessage(LOG_ERROR, "CreatePipe failed for stdin");
         return false;
     }
     if (!SetHandleInformation(hChildStdInWr, HANDLE_FLAG_INHERIT, 0)) {
-        printf("SetHandleInformation failed for stdin\n");
+        logMessage(LOG_ERROR, "SetHandleInformation failed for stdin");
         return false;
     }
 
     // Create pipes for stdout
-    if (!CreatePipe(&hChildStdOutRd, &hChildStdOutWr, &saAttr, 0)) {
-        printf("CreatePipe failed for stdout\n");
+    if (!createOverlappedPipe(&hChildStdOutRd, &hChildStdOutWr, &saAttr)) {
+        logMessage(LOG_ERROR, "CreatePipe failed for stdout");
         return false;
     }
     if (!SetHandleInformation(hChildStdOutRd, HANDLE_FLAG_INHERIT, 0)) {
-        printf("SetHandleInformation failed for stdout\n");
+        logMessage(LOG_ERROR, "SetHandleInformation failed for stdout");
         return false;
     }
 
     // Create pipes for stderr
-    if (!CreatePipe(&hChildStdErrRd, &hChildStdErrWr, &saAttr, 0)) {
-        printf("CreatePipe failed for stderr\n");
+    if (!createOverlappedPipe(&hChildStdErrRd, &hChildStdErrWr, &saAttr)) {
+        logMessage(LOG_ERROR, "CreatePipe failed for stderr");
         return false;
     }
     if (!SetHandleInformation(hChildStdErrRd, HANDLE_FLAG_INHERIT, 0)) {
-        printf("SetHandleInformation failed for stderr\n");
+        logMessage(LOG_ERROR, "SetHandleInformation failed for stderr");
         return false;
     }
 
@@ -144,7 +172,7 @@ bool PersistentShell::initialize() {
         &piProcInfo); // receives PROCESS_INFORMATION
 
     if (!bSuccess) {
-        printf("CreateProcess failed for cmd.exe\n");
+        logMessage(LOG_ERROR, "CreateProcess failed for cmd.exe");
         return false;
     }
 
@@ -157,25 +185,24 @@ bool PersistentShell::initialize() {
     hChildStdErrWr = NULL;
 
     shellActive = true;
-    printf("Persistent shell created\n");
+    adjustGauge(METRIC_SHELLS, 1);
+    logMessage(LOG_INFO, "Persistent shell created");
     return true;
 }
 
 void PersistentShell::cleanup() {
     if (!shellActive) return;
 
-    // Send exit command to terminate cmd.exe gracefully
+    // Closing stdin ends cmd.exe: the write end is overlapped, so there is no
+    // synchronous "exit" to send it
     if (hChildStdInWr) {
-        const char* exitCmd = "exit\r\n";
-        DWORD dwWritten;
-        WriteFile(hChildStdInWr, exitCmd, (DWORD)strlen(exitCmd), &dwWritten, NULL);
         CloseHandle(hChildStdInWr);
         hChildStdInWr = NULL;
     }
 
-    // Wait for process to terminate
+    // Don't wait for the process: this runs on an event loop thread, and
+    // cmd.exe exits on its own once it reads EOF on stdin
     if (piProcInfo.hProcess) {
-        WaitForSingleObject(piProcInfo.hProcess, 2000); // Wait up to 2 seconds
         CloseHandle(piProcInfo.hProcess);
         CloseHandle(piProcInfo.hThread);
     }
@@ -188,5 +215,6 @@ void PersistentShell::cleanup() {
     if (hChildStdErrWr) { CloseHandle(hChildStdErrWr); hChildStdErrWr = NULL; }
 
     shellActive = false;
-    printf("Persistent shell destroyed\n");
+    adjustGauge(METRIC_SHELLS, -1);
+    logMessage(LOG_INFO, "Persistent shell destroyed");
 } 
\ No newline at end of file
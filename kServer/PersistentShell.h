@@ -1,26 +1,84 @@
 #pragma once
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "../platform.h"
 #include <string>
 
+// Every prompt starts with the shell integration mark for a finished command
+// (OSC 133;D): PROMPT_MARK, then ';' and the last command's exit status
+// where the shell can give it (not cmd.exe), then BEL or ESC '\'. The
+// session takes the marks out of the output and uses them to tell when a
+// command has finished. A shell that sets its own prompt (a bash reading
+// ~/.bashrc) has no marks; the session falls back on its output going
+// quiet (COMMAND_QUIET_MS).
+#define PROMPT_MARK "\x1b]133;D"
+#define PROMPT_MARK_MAX 32      // Longest mark, status included
+
+// TERM for a shell on a pseudo-terminal. Line mode shows output as plain
+// text, so programs are told to leave out escape sequences; a raw terminal,
+// and the TerminalScreen behind screen sync, handle what an xterm's 256
+// colors, cursor movement and alternate screen need.
+#define SHELL_TERM_LINE "dumb"
+#define SHELL_TERM_RAW "xterm-256color"
+
+// A long-lived command shell for one client session: cmd.exe on Windows,
+// $KSERVER_SHELL (default /bin/sh) on a pseudo-terminal elsewhere.
 class PersistentShell {
 private:
+#ifdef _WIN32
     HANDLE hChildStdInRd, hChildStdInWr;
     HANDLE hChildStdOutRd, hChildStdOutWr;
     HANDLE hChildStdErrRd, hChildStdErrWr;
     PROCESS_INFORMATION piProcInfo;
+#else
+    int masterFd;       // pty master: the shell's stdin, stdout and stderr
+    int stderrFd;       // With $KSERVER_SPLIT_STDERR, a pipe that is the shell's stderr instead
+    pid_t childPid;
+#endif
     bool shellActive;
     std::string currentDirectory;
+    std::string terminalType;
 
     bool initialize();
     void cleanup();
+#ifdef _WIN32
+    bool createOverlappedPipe(HANDLE* readPipe, HANDLE* writePipe, SECURITY_ATTRIBUTES* saAttr, bool overlappedWrite = false);
+#endif
 
 public:
-    PersistentShell(const std::string& workingDir = "");
+    // 'terminal' is the TERM it is started with (SHELL_TERM_*), which
+    // cmd.exe has no use for
+    PersistentShell(const std::string& workingDir = "", const std::string& terminal = SHELL_TERM_LINE);
     ~PersistentShell();
 
     bool isActive() const;
-    bool sendCommand(const std::string& command);
-    std::string readAvailableOutput(); // New method for streaming
-}; 
\ No newline at end of file
+    const std::string& terminal() const { return terminalType; }
+
+    // True once a started shell has gone, e.g. one left idle in the
+    // ShellPool that was killed meanwhile
+    bool hasExited() const;
+
+    // What to write to the shell's stdin to run 'command' at its prompt
+    std::string commandLine(const std::string& command) const;
+
+    // Where the shell is now, as far as the server can tell: the process's
+    // directory where the system reports it, otherwise the one it started in
+    std::string workingDirectory() const;
+
+    // Sets the size of the shell's terminal, which tells the program in the
+    // foreground (SIGWINCH). cmd.exe reads pipes and has no size to set.
+    bool resize(int rows, int columns);
+
+    // Read ends of the shell's output. They can be attached to an EventLoop:
+    // overlapped pipes on Windows, non-blocking descriptors elsewhere. On a
+    // pty stderr shares the terminal (which keeps prompts and output in
+    // order), so stderrPipe() is INVALID_IO_HANDLE there unless
+    // $KSERVER_SPLIT_STDERR is set.
+    IoHandle stdoutPipe() const;
+    IoHandle stderrPipe() const;
+
+    // Write end of the shell's input, for EventLoop::postWrite: an
+    // overlapped pipe on Windows, and on a pty the terminal itself (the
+    // same descriptor as stdoutPipe()). Nothing else writes to it, so a
+    // shell that stops reading holds up only its own input.
+    IoHandle stdinPipe() const;
+};
\ No newline at end of file
@@ -0,0 +1,228 @@
+#include "PersistentShell.h"
+#include "Log.h"
+#include "Metrics.h"
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+// Shell started when KSERVER_SHELL is not set
+#define DEFAULT_SHELL "/bin/sh"
+
+// Like cmd.exe's prompt, so clients can tell when a command has finished,
+// after the mark (PROMPT_MARK) that tells the server
+#define SHELL_PROMPT "\033]133;D;$?\007$PWD> "
+
+// Most shells the server can have running at once and still reap; any
+// beyond are left as zombies when they exit
+#define SHELL_REAP_SLOTS 16384
+
+// The pids of running shells, 0 for a free slot. The SIGCHLD handler waits
+// for these and no others: other children of the process (kBench's ssh
+// tunnel) are waited for by whoever started them.
+static std::atomic<pid_t> shellPids[SHELL_REAP_SLOTS];
+static std::atomic<int> shellSlotsUsed(0);     // Every slot in use is below this
+
+static void reapShells() {
+    // Async-signal-safe: lock-free atomics and waitpid only
+    int used = shellSlotsUsed.load();
+    for (int i = 0; i < used; i++) {
+        pid_t pid = shellPids[i].load();
+        if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid) {
+            shellPids[i].store(0);
+        }
+    }
+}
+
+static void reapChildren(int) {
+    // Shells exit on their own once their session closes the pty; collect
+    // every one that has finished so none are left behind as zombies
+    int savedErrno = errno;
+    reapShells();
+    errno = savedErrno;
+}
+
+static void trackShell(pid_t pid) {
+    for (int i = 0; i < SHELL_REAP_SLOTS; i++) {
+        pid_t expected = 0;
+        if (shellPids[i].compare_exchange_strong(expected, pid)) {
+            int used = shellSlotsUsed.load();
+            while (used <= i && !shellSlotsUsed.compare_exchange_weak(used, i + 1)) {
+            }
+            // A shell that exited before it was tracked raised its SIGCHLD
+            // too early to be reaped by it
+            reapShells();
+            return;
+        }
+    }
+    logMessage(LOG_WARNING, "Too many shells to track; shell %d won't be reaped", (int)pid);
+}
+
+static bool installChildReaper() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = reapChildren;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGCHLD, &action, NULL) == 0;
+}
+
+PersistentShell::PersistentShell(const std::string& workingDir, const std::string& terminal)
+    : masterFd(-1), stderrFd(-1), childPid(-1), shellActive(false), terminalType(terminal) {
+    static bool reaperInstalled = installChildReaper();
+    (void)reaperInstalled;
+
+    // Set working directory
+    if (workingDir.empty()) {
+        char buffer[MAX_PATH];
+        GetCurrentDirectoryA(MAX_PATH, buffer);
+        currentDirectory = std::string(buffer);
+    } else {
+        currentDirectory = workingDir;
+    }
+
+    // Create the shell
+    if (!initialize()) {
+        logMessage(LOG_ERROR, "Failed to initialize persistent shell");
+    }
+}
+
+PersistentShell::~PersistentShell() {
+    cleanup();
+}
+
+bool PersistentShell::isActive() const {
+    return shellActive;
+}
+
+bool PersistentShell::hasExited() const {
+    // The terminal hangs up once the shell, its only other holder, exits
+    struct pollfd pfd;
+    pfd.fd = masterFd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    return shellActive && poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+std::string PersistentShell::workingDirectory() const {
+#ifdef __linux__
+    char buffer[PATH_MAX];
+    std::string link = "/proc/" + std::to_string(childPid) + "/cwd";
+    ssize_t length = shellActive ? readlink(link.c_str(), buffer, sizeof(buffer)) : -1;
+    if (length > 0) {
+        return std::string(buffer, (size_t)length);
+    }
+#endif
+    return currentDirectory;
+}
+
+IoHandle PersistentShell::stdoutPipe() const {
+    return masterFd;
+}
+
+IoHandle PersistentShell::stderrPipe() const {
+    return stderrFd;
+}
+
+IoHandle PersistentShell::stdinPipe() const {
+    return masterFd;
+}
+
+std::string PersistentShell::commandLine(const std::string& command) const {
+    return command + "\n";
+}
+
+bool PersistentShell::resize(int rows, int columns) {
+    if (!shellActive) {
+        return false;
+    }
+    struct winsize size;
+    memset(&size, 0, sizeof(size));
+    size.ws_row = (unsigned short)rows;
+    size.ws_col = (unsigned short)columns;
+    return ioctl(masterFd, TIOCSWINSZ, &size) == 0;
+}
+
+bool PersistentShell::initialize() {
+    // Opt-in: stderr through a pipe of its own, which a client can tell
+    // apart from stdout. The shell's prompt goes to stderr too, and nothing
+    // orders the pipe's output against the terminal's.
+    int errorPipe[2] = { -1, -1 };
+    const char* split = getenv("KSERVER_SPLIT_STDERR");
+    if (split && *split && pipe(errorPipe) != 0) {
+        logMessage(LOG_ERROR, "pipe failed for stderr: %d", errno);
+        errorPipe[0] = errorPipe[1] = -1;
+    }
+
+    childPid = forkpty(&masterFd, NULL, NULL, NULL);
+    if (childPid < 0) {
+        logMessage(LOG_ERROR, "forkpty failed: %d", errno);
+        masterFd = -1;
+        if (errorPipe[0] >= 0) {
+            close(errorPipe[0]);
+            close(errorPipe[1]);
+        }
+        return false;
+    }
+
+    if (childPid == 0) {
+        // Child: the pty slave is already stdin, stdout and stderr
+        if (errorPipe[1] >= 0) {
+            dup2(errorPipe[1], STDERR_FILENO);
+            close(errorPipe[0]);
+            close(errorPipe[1]);
+        }
+        if (chdir(currentDirectory.c_str()) != 0) {
+            fprintf(stderr, "Unable to change to %s\n", currentDirectory.c_str());
+        }
+
+        // The server ignores SIGPIPE, and ignored signals survive exec
+        signal(SIGPIPE, SIG_DFL);
+        setenv("PS1", SHELL_PROMPT, 1);
+        // Whatever the server's own terminal is, the client's is this
+        setenv("TERM", terminalType.c_str(), 1);
+
+        const char* shell = getenv("KSERVER_SHELL");
+        if (!shell || !*shell) {
+            shell = DEFAULT_SHELL;
+        }
+        execl(shell, shell, "-i", (char*)NULL);
+        fprintf(stderr, "Unable to start %s\n", shell);
+        _exit(127);
+    }
+
+    trackShell(childPid);
+
+    // Keep this session's terminal out of shells started later
+    fcntl(masterFd, F_SETFD, FD_CLOEXEC);
+    if (errorPipe[0] >= 0) {
+        close(errorPipe[1]);
+        stderrFd = errorPipe[0];
+        fcntl(stderrFd, F_SETFD, FD_CLOEXEC);
+    }
+
+    shellActive = true;
+    adjustGauge(METRIC_SHELLS, 1);
+    logMessage(LOG_INFO, "Persistent shell created");
+    return true;
+}
+
+void PersistentShell::cleanup() {
+    if (!shellActive) return;
+
+    // Hang up the terminal; the shell exits and the SIGCHLD handler reaps
+    // it. Don't wait here: this runs on an event loop thread.
+    kill(childPid, SIGHUP);
+    if (masterFd >= 0) { close(masterFd); masterFd = -1; }
+    if (stderrFd >= 0) { close(stderrFd); stderrFd = -1; }
+
+    shellActive = false;
+    adjustGauge(METRIC_SHELLS, -1);
+    logMessage(LOG_INFO, "Persistent shell destroyed");
+}
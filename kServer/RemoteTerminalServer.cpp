@@ -1,6 +1,53 @@
 #include "RemoteTerminalServer.h"
 
-RemoteTerminalServer::RemoteTerminalServer() : ListenSocket(INVALID_SOCKET), initialized(false) {
+RemoteTerminalServer::RemoteTerminalServer() : ListenSocket(INVALID_SOCKET), initialized(false), port(DEFAULT_PORT),
+    listenPort(0), stopping(false), reportedAcquires(0),
+    reportedQueueEvents(0), recordLimit(DEFAULT_RECORDING_LIMIT_BYTES), nextLoop(0), metricsPort(0),
+    nextHandshake(0) {
+    queueConfig.limitBytes = DEFAULT_OUTPUT_QUEUE_LIMIT;
+    queueConfig.policy = OVERFLOW_BLOCK;
+    tlsConfig.enabled = false;
+    tlsConfig.required = false;
+}
+
+void RemoteTerminalServer::setOutputQueue(const OutputQueueConfig& config) {
+    queueConfig = config;
+    if (queueConfig.limitBytes < 2 * SEND_QUEUE_HIGH_WATER) {
+        queueConfig.limitBytes = 2 * SEND_QUEUE_HIGH_WATER;
+    }
+}
+
+void RemoteTerminalServer::setResumeLimits(size_t scrollbackBytes, DWORD detachTimeoutMs) {
+    registry.setLimits(scrollbackBytes, detachTimeoutMs);
+}
+
+void RemoteTerminalServer::setSearchHistory(size_t historyBytes) {
+    registry.setSearchHistory(historyBytes);
+}
+
+void RemoteTerminalServer::setRecording(const std::string& directory, uint64_t limitBytes) {
+    recordDirectory = directory;
+    recordLimit = limitBytes;
+}
+
+void RemoteTerminalServer::setMetricsPort(unsigned short port) {
+    metricsPort = port;
+}
+
+void RemoteTerminalServer::setShellPool(size_t idlePerDirectory) {
+    shellPool.setSize(idlePerDirectory);
+}
+
+void RemoteTerminalServer::setTls(const TlsConfig& config) {
+    tlsConfig = config;
+}
+
+void RemoteTerminalServer::setPort(const std::string& listenOn) {
+    port = listenOn;
+}
+
+unsigned short RemoteTerminalServer::boundPort() const {
+    return listenPort;
 }
 
 RemoteTerminalServer::~RemoteTerminalServer() {
@@ -11,7 +58,7 @@ bool RemoteTerminalServer::initialize() {
     // Initialize Winsock
     int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (iResult != 0) {
-        printf("WSAStartup failed with error: %d\n", iResult);
+        logMessage(LOG_ERROR, "WSAStartup failed with error: %d", iResult);
         return false;
     }
 
@@ -24,9 +71,9 @@ bool RemoteTerminalServer::initialize() {
 
     // Resolve the server address and port
     struct addrinfo* result = NULL;
-    iResult = getaddrinfo(NULL, DEFAULT_PORT, &hints, &result);
+    iResult = getaddrinfo(NULL, port.c_str(), &hints, &result);
     if (iResult != 0) {
-        printf("getaddrinfo failed with error: %d\n", iResult);
+        logMessage(LOG_ERROR, "getaddrinfo failed with error: %d", iResult);
         WSACleanup();
         return false;
     }
@@ -34,16 +81,24 @@ bool RemoteTerminalServer::initialize() {
     // Create a SOCKET for the server to listen for client connections
     ListenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
     if (ListenSocket == INVALID_SOCKET) {
-        printf("socket failed with error: %d\n", WSAGetLastError());
+        logMessage(LOG_ERROR, "socket failed with error: %d", WSAGetLastError());
         freeaddrinfo(result);
         WSACleanup();
         return false;
     }
+    disableInheritance(ListenSocket);
+
+#ifndef _WIN32
+    // Allow a restarted server to bind while old connections are in
+    // TIME_WAIT (on Windows SO_REUSEADDR would let another process steal the port)
+    int reuse = 1;
+    setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+#endif
 
     // Setup the TCP listening socket
     iResult = bind(ListenSocket, result->ai_addr, (int)result->ai_addrlen);
     if (iResult == SOCKET_ERROR) {
-        printf("bind failed with error: %d\n", WSAGetLastError());
+        logMessage(LOG_ERROR, "bind failed with error: %d", WSAGetLastError());
         freeaddrinfo(result);
         closesocket(ListenSocket);
         WSACleanup();
@@ -52,182 +107,581 @@ bool RemoteTerminalServer::initialize() {
 
     freeaddrinfo(result);
 
+    struct sockaddr_in bound;
+    socklen_t boundLength = sizeof(bound);
+    if (getsockname(ListenSocket, (struct sockaddr*)&bound, &boundLength) == 0) {
+        listenPort = ntohs(bound.sin_port);
+    }
+
     iResult = listen(ListenSocket, SOMAXCONN);
     if (iResult == SOCKET_ERROR) {
-        printf("listen failed with error: %d\n", WSAGetLastError());
+        logMessage(LOG_ERROR, "listen failed with error: %d", WSAGetLastError());
+        closesocket(ListenSocket);
+        WSACleanup();
+        return false;
+    }
+
+    if (tlsConfig.enabled) {
+        std::string error;
+        tls.reset(new TlsServerContext());
+        if (!tls->initialize(tlsConfig.certificateFile, tlsConfig.keyFile, error)) {
+            logMessage(LOG_ERROR, "TLS unavailable: %s", error.c_str());
+            closesocket(ListenSocket);
+            WSACleanup();
+            return false;
+        }
+    }
+
+    if (!recordDirectory.empty()) {
+        recorder.reset(new SessionRecorder());
+        if (!recorder->start(recordDirectory, recordLimit)) {
+            closesocket(ListenSocket);
+            WSACleanup();
+            return false;
+        }
+        registry.setRecorder(recorder.get());
+    }
+
+    // One event loop per core multiplexes all client sockets and shell pipes
+    unsigned loopCount = std::thread::hardware_concurrency();
+    if (loopCount == 0) {
+        loopCount = 1;
+    }
+    for (unsigned i = 0; i < loopCount; i++) {
+        std::unique_ptr<EventLoop> loop(new EventLoop());
+        if (!loop->start()) {
+            closesocket(ListenSocket);
+            WSACleanup();
+            return false;
+        }
+        loops.push_back(std::move(loop));
+    }
+
+    loops[0]->post([this]() { schedulePoolReport(); });
+
+    if (tls && !startHandshakes()) {
+        closesocket(ListenSocket);
+        WSACleanup();
+        return false;
+    }
+
+    // Warm up shells for the directory sessions start in
+    char sServerCurDir[MAX_PATH];
+    GetCurrentDirectoryA(MAX_PATH, sServerCurDir);
+    shellPool.start(sServerCurDir);
+    if (metricsPort != 0 && !metricsEndpoint.start(metricsPort, [this]() { return renderMetrics(); })) {
         closesocket(ListenSocket);
         WSACleanup();
         return false;
     }
 
     initialized = true;
-    printf("Server initialized and listening on port %s\n", DEFAULT_PORT);
+    logMessage(LOG_INFO, "Server initialized and listening on port %u (%u event loops)", (unsigned)listenPort, loopCount);
+    static const char* policyNames[] = { "block", "drop oldest", "spill to disk" };
+    logMessage(LOG_INFO, "Output queue limit %zu KB per session, %s when full", queueConfig.limitBytes / 1024,
+        policyNames[queueConfig.policy]);
+    logMessage(LOG_INFO, "Keeping %zu idle shells ready per working directory", shellPool.size());
+    logMessage(LOG_INFO, "Detached sessions kept for %lu s with %zu KB of scrollback per shell",
+        (unsigned long)(registry.detachTimeout() / 1000), registry.scrollbackLimit() / 1024);
+    logMessage(LOG_INFO, "Searchable output history of %zu KB per shell", registry.searchHistoryLimit() / 1024);
+    if (recorder) {
+        logMessage(LOG_INFO, "Recording sessions in %s, keeping %llu MB", recordDirectory.c_str(),
+            (unsigned long long)(recordLimit / (1024 * 1024)));
+    }
+    if (tls) {
+        logMessage(LOG_INFO, "TLS %s, %s first; %scertificate fingerprint %s",
+            tlsConfig.required ? "required" : "accepted", aesHardware() ? "AES-GCM" : "ChaCha20",
+            tlsConfig.certificateFile.empty() ? "self-signed " : "", tls->fingerprint().c_str());
+    }
     return true;
 }
 
-std::string RemoteTerminalServer::getCurrentTimestamp() {
-    std::time_t rawtime;
-    std::time(&rawtime);
-    struct tm* timeinfo = std::localtime(&rawtime);
-    char buffer[100];
-    std::strftime(buffer, sizeof(buffer), "[%H:%M:%S] ", timeinfo);
-    return std::string(buffer);
-}
-
-void RemoteTerminalServer::continuousOutputMonitor(SOCKET clientSocket, PersistentShell& shell, std::atomic<bool>& shouldStop) {
-    printf("Output monitoring thread started\n");
-    
-    while (!shouldStop && shell.isActive()) {
-        // Read any available output from the shell (non-blocking)
-        std::string output = shell.readAvailableOutput();
-        
-        if (!output.empty()) {
-            // Add timestamp prefix to the output
-            std::string timestampedOutput = getCurrentTimestamp() + output + END_OF_RESPONSE_MARKER;
-            
-            // Send the output to client immediately
-            int sendResult = send(clientSocket, timestampedOutput.c_str(), (int)timestampedOutput.length(), 0);
-            if (sendResult == SOCKET_ERROR) {
-                printf("Failed to send output to client: %d\n", WSAGetLastError());
-                break;
+bool RemoteTerminalServer::routeClient(PendingClient& client, bool readable, bool expired) {
+    // Returns true once the connection has been handed on (or closed).
+    // Peeking leaves the hello for the session to read; a TLS client's is
+    // decrypted on its handshake thread and handed on with the connection.
+    FrameReader peek(HELLO_PEEK_SIZE);
+    int received = 0;
+    if (client.secure) {
+        if (readable && !receiveSecure(client)) {
+            closesocket(client.socket);
+            return true;
+        }
+        if (!client.secure->handshakeDone() || !client.output.empty()) {
+            if (!expired) {
+                return false;
             }
-            
-            // Log what we sent (but clean it up for display)
-            std::string cleanOutput = output;
-            while (!cleanOutput.empty() && (cleanOutput.back() == '\r' || cleanOutput.back() == '\n')) {
-                cleanOutput.pop_back();
+            logMessage(LOG_WARNING, "TLS client didn't finish its handshake");
+            closesocket(client.socket);
+            return true;
+        }
+        received = (int)(client.input.length() < HELLO_PEEK_SIZE ? client.input.length() : HELLO_PEEK_SIZE);
+        memcpy(peek.writePtr(), client.input.data(), received);
+        peek.commit(received);
+    } else if (readable || client.partial) {
+        received = recv(client.socket, peek.writePtr(), (int)peek.writeSpace(), MSG_PEEK);
+        if (received <= 0) {
+            // Gone before saying anything
+            closesocket(client.socket);
+            return true;
+        }
+        peek.commit(received);
+
+        if (tls && (unsigned char)peek.bufferedData()[0] == TLS_HANDSHAKE_RECORD) {
+            // The handshake has to finish before there is a hello to read,
+            // and takes round trips and public-key work the accept thread
+            // can't wait on
+            client.secure.reset(new SecureChannel(*tls));
+            client.partial = false;
+            client.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TLS_HANDSHAKE_TIMEOUT_MS);
+            handOff(client);
+            return true;
+        }
+    }
+    if (tlsConfig.required && !client.secure) {
+        logMessage(LOG_WARNING, "Turning away a client without TLS");
+        closesocket(client.socket);
+        return true;
+    }
+
+    // Legacy clients send a command first, or nothing at all. Decrypted
+    // input is consumed, so it isn't polled as partial: the socket only
+    // becomes readable with more.
+    if (received == 0 || (received >= 2 && !looksLikeFrame(peek.bufferedData(), peek.bufferedBytes()))) {
+        if (!expired && received < 2) {
+            client.partial = received > 0 && !client.secure;
+            return false;
+        }
+        startSession(*loops[nextLoop++ % loops.size()], client.socket, received == 0, std::move(client.secure),
+            client.input);
+        return true;
+    }
+
+    FrameHeader header;
+    const char* payload;
+    FrameReader::Result result = peek.nextFrame(header, payload);
+    if (result == FrameReader::FRAME_INCOMPLETE && !expired && (size_t)received < HELLO_PEEK_SIZE) {
+        client.partial = !client.secure;
+        return false;
+    }
+
+    HelloPayload hello;
+    if (result == FrameReader::FRAME_READY && header.type == FRAME_HELLO && decodeHello(payload, header.length, hello) &&
+        (hello.features & FEATURE_RESUME) && !hello.token.empty()) {
+        resumeClient(client.socket, hello.token, std::move(client.secure), client.input);
+    } else {
+        // New sessions are spread over the loops; the session itself deals
+        // with anything unexpected in the hello
+        startSession(*loops[nextLoop++ % loops.size()], client.socket, false, std::move(client.secure), client.input);
+    }
+    return true;
+}
+
+bool RemoteTerminalServer::startHandshakes() {
+    for (int i = 0; i < HANDSHAKE_THREADS; i++) {
+        std::unique_ptr<HandshakeThread> worker(new HandshakeThread());
+        worker->wake = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (worker->wake == INVALID_SOCKET) {
+            logMessage(LOG_ERROR, "Handshake wake socket failed with error: %d", WSAGetLastError());
+            return false;
+        }
+        disableInheritance(worker->wake);
+
+        struct sockaddr_in address;
+        ZeroMemory(&address, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        if (bind(worker->wake, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+            getsockname(worker->wake, (struct sockaddr*)&address, &addressLength) == SOCKET_ERROR ||
+            connect(worker->wake, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+            !setNonBlocking(worker->wake)) {
+            logMessage(LOG_ERROR, "Handshake wake socket failed with error: %d", WSAGetLastError());
+            closesocket(worker->wake);
+            return false;
+        }
+        worker->thread = std::thread(&RemoteTerminalServer::runHandshakes, this, std::ref(*worker));
+        handshakeThreads.push_back(std::move(worker));
+    }
+    return true;
+}
+
+void RemoteTerminalServer::handOff(PendingClient& client) {
+    // Accept thread. The handshake threads take turns.
+    HandshakeThread& worker = *handshakeThreads[nextHandshake++ % handshakeThreads.size()];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.added.push_back(std::move(client));
+    }
+    char wake = 0;
+    send(worker.wake, &wake, 1, 0);
+}
+
+void RemoteTerminalServer::runHandshakes(HandshakeThread& worker) {
+    // The connection's loop depends on its hello, and on Windows a socket
+    // can't change completion ports once attached, so the handshake can't
+    // be left to a loop. Each client's deadline is TLS_HANDSHAKE_TIMEOUT_MS
+    // for the handshake and its hello together.
+    std::vector<PendingClient> clients;
+    std::vector<WSAPOLLFD> fds;
+    while (!stopping) {
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            for (size_t i = 0; i < worker.added.size(); i++) {
+                clients.push_back(std::move(worker.added[i]));
+            }
+            worker.added.clear();
+        }
+
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point now = Clock::now();
+        int timeoutMs = -1;
+        fds.resize(1);
+        fds[0].fd = worker.wake;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (size_t i = 0; i < clients.size(); i++) {
+            WSAPOLLFD fd;
+            fd.fd = clients[i].socket;
+            fd.events = (short)(clients[i].output.empty() ? POLLIN : POLLIN | POLLOUT);
+            fd.revents = 0;
+            fds.push_back(fd);
+            int remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(clients[i].deadline - now).count();
+            if (remaining < 0) {
+                remaining = 0;
             }
-            if (!cleanOutput.empty()) {
-                printf("Sent output to client: %s\n", cleanOutput.c_str());
+            if (timeoutMs < 0 || remaining < timeoutMs) {
+                timeoutMs = remaining;
+            }
+        }
+
+        if (WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs) == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            logMessage(LOG_ERROR, "Handshake poll failed with error: %d", WSAGetLastError());
+            break;
+        }
+        if (fds[0].revents != 0) {
+            char drain[64];
+            while (recv(worker.wake, drain, sizeof(drain), 0) > 0) {
+            }
+        }
+
+        now = Clock::now();
+        for (size_t i = clients.size(); i-- > 0;) {
+            short revents = fds[i + 1].revents;
+            bool readable = (revents & ~POLLOUT) != 0;
+            bool expired = now >= clients[i].deadline;
+            if ((revents & POLLOUT) && !sendSecure(clients[i])) {
+                closesocket(clients[i].socket);
+                clients.erase(clients.begin() + i);
+            } else if ((readable || expired) && routeClient(clients[i], readable, expired)) {
+                clients.erase(clients.begin() + i);
             }
         }
-        
-        // Small sleep to prevent excessive CPU usage when no output is available
-        Sleep(50);
     }
-    
-    printf("Output monitoring thread ended\n");
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        closesocket(clients[i].socket);
+    }
 }
 
-void RemoteTerminalServer::handleClient(SOCKET ClientSocket) {
-    char recvbuf[DEFAULT_BUFLEN];
-    int recvbuflen = DEFAULT_BUFLEN;
+bool RemoteTerminalServer::receiveSecure(PendingClient& client) {
+    // Handshake thread
+    char buffer[DEFAULT_BUFLEN];
+    int received = recv(client.socket, buffer, sizeof(buffer), 0);
+    if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return true;
+    }
+    if (received <= 0) {
+        return false;
+    }
+    bool ok = client.secure->receive(buffer, received);
+    client.secure->takeOutput(client.output);
+    if (!sendSecure(client)) {
+        return false;
+    }
+    size_t length;
+    while ((length = client.secure->read(buffer, sizeof(buffer))) > 0) {
+        client.input.append(buffer, length);
+    }
+    if (!ok || client.secure->failed()) {
+        logMessage(LOG_WARNING, "TLS client dropped: %s", client.secure->error().c_str());
+        return false;
+    }
+    if (client.secure->handshakeDone() && client.input.empty()) {
+        logMessage(LOG_DEBUG, "TLS client connected (%s)", client.secure->describe().c_str());
+    }
+    return true;
+}
 
-    printf("Client connected\n");
+bool RemoteTerminalServer::sendSecure(PendingClient& client) {
+    // What the socket won't take yet goes once it polls writable
+    while (!client.output.empty()) {
+        int sent = send(client.socket, client.output.data(), (int)client.output.length(), 0);
+        if (sent == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            return true;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        client.output.erase(0, (size_t)sent);
+    }
+    return true;
+}
+
+void RemoteTerminalServer::resumeClient(SOCKET ClientSocket, const std::string& token, std::unique_ptr<SecureChannel> secure,
+                                        const std::string& input) {
+    // The session's sockets and pipes belong to its loop, so the new
+    // connection is handed to that loop rather than the session moving
+    EventLoop* loop = registry.loopFor(token);
+    if (!loop) {
+        logMessage(LOG_WARNING, "Client asked for unknown session %s, starting a new one", describeToken(token).c_str());
+        startSession(*loops[nextLoop++ % loops.size()], ClientSocket, false, std::move(secure), input);
+        return;
+    }
 
+    SecureChannel* channel = secure.release();
+    loop->post([this, loop, ClientSocket, token, channel, input]() {
+        std::unique_ptr<SecureChannel> secure(channel);
+        ClientSession* session = registry.find(token, *loop);
+        if (!session || !session->reattach(ClientSocket, std::move(secure), input)) {
+            // It expired on the way
+            logMessage(LOG_WARNING, "Session %s closed before the client reattached, starting a new one", describeToken(token).c_str());
+            startSession(*loop, ClientSocket, false, std::move(secure), input);
+        }
+    });
+}
+
+void RemoteTerminalServer::startSession(EventLoop& loop, SOCKET ClientSocket, bool helloTimedOut,
+                                        std::unique_ptr<SecureChannel> secure, const std::string& input) {
+    // Runs on the accept thread or a handshake thread, or on 'loop' when a
+    // reattach fell through.
     // Get initial working directory
     char sServerCurDir[MAX_PATH];
     GetCurrentDirectoryA(MAX_PATH, sServerCurDir);
 
-    // Create persistent shell for this client session
-    PersistentShell shell(sServerCurDir);
-    if (!shell.isActive()) {
-        printf("Failed to create persistent shell for client\n");
+    // An idle shell from the pool, or a new one if there is none
+    std::unique_ptr<PersistentShell> shell = shellPool.claim(sServerCurDir);
+    if (!shell->isActive()) {
+        logMessage(LOG_ERROR, "Failed to create persistent shell for client");
         std::string errorResponse = "Error: Failed to initialize shell session" END_OF_RESPONSE_MARKER;
+        if (secure && secure->write(errorResponse.data(), errorResponse.length())) {
+            errorResponse.clear();
+            secure->takeOutput(errorResponse);
+        }
         send(ClientSocket, errorResponse.c_str(), (int)errorResponse.length(), 0);
         closesocket(ClientSocket);
         return;
     }
 
-    // Send welcome message immediately
-    std::string welcomeMessage = getCurrentTimestamp() + "Welcome to Remote Terminal Server!\n" + 
-                               getCurrentTimestamp() + "Shell session initialized." + END_OF_RESPONSE_MARKER;
-    send(ClientSocket, welcomeMessage.c_str(), (int)welcomeMessage.length(), 0);
+    // Pin the session to the loop; from here on it is only touched by that
+    // loop's thread
+    ClientSession* session = new ClientSession(loop, bufferPool, registry, shellPool, queueConfig, queueStats,
+                                               ClientSocket, std::move(shell), std::move(secure), input);
+    loop.post([session, helloTimedOut]() { session->start(helloTimedOut); });
+}
+
+void RemoteTerminalServer::schedulePoolReport() {
+    // Runs on the first loop's thread
+    loops[0]->addTimer(POOL_REPORT_INTERVAL_MS, [this]() {
+        reportPoolStats();
+        reportQueueStats();
+        schedulePoolReport();
+    });
+}
+
+void RemoteTerminalServer::reportPoolStats() {
+    BufferPool::Stats stats = bufferPool.stats();
+    if (stats.acquires == reportedAcquires) {
+        return;
+    }
+    double acquiresPerSecond = (stats.acquires - reportedAcquires) * 1000.0 / POOL_REPORT_INTERVAL_MS;
+    reportedAcquires = stats.acquires;
+
+    logMessage(LOG_INFO, "Buffer pool: %.0f buffers/s, %zu in use, high water %zu KB of %zu KB reserved, %llu heap allocations",
+        acquiresPerSecond, stats.buffersInUse, stats.highWaterBytes / 1024, stats.reservedBytes / 1024,
+        (unsigned long long)stats.slabAllocations);
+}
 
-    // Start continuous output monitoring thread
-    std::atomic<bool> shouldStopMonitoring(false);
-    std::thread outputMonitorThread(&RemoteTerminalServer::continuousOutputMonitor, this, 
-                                   ClientSocket, std::ref(shell), std::ref(shouldStopMonitoring));
+void RemoteTerminalServer::reportQueueStats() {
+    // Quiet unless some client is behind or has been since the last report
+    uint64_t stallMicroseconds = queueStats.stallMicroseconds;
+    uint64_t droppedBytes = queueStats.droppedBytes;
+    uint64_t spilledBytes = queueStats.spilledBytes;
+    uint64_t events = stallMicroseconds + droppedBytes + spilledBytes;
+    int stalledSessions = queueStats.stalledSessions;
+    if (stalledSessions == 0 && events == reportedQueueEvents) {
+        return;
+    }
+    reportedQueueEvents = events;
 
+    logMessage(LOG_INFO, "Output queues: %lld KB queued, %d sessions behind, %.1f s behind in total, %llu KB dropped, %llu KB spilled",
+        (long long)(queueStats.queuedBytes / 1024), stalledSessions, stallMicroseconds / 1e6,
+        (unsigned long long)(droppedBytes / 1024), (unsigned long long)(spilledBytes / 1024));
+}
+
+std::string RemoteTerminalServer::renderMetrics() {
+    // Runs on the metrics endpoint's thread; everything read here is
+    // either atomic or locked
+    std::string out;
+    writeMetrics(out);
+
+    BufferPool::Stats pool = bufferPool.stats();
+    writeGauge(out, "kserver_buffers_in_use", "Pooled I/O buffers in use", (double)pool.buffersInUse);
+    writeGauge(out, "kserver_buffer_reserved_bytes", "Memory held by the buffer pool", (double)pool.reservedBytes);
+    writeCounter(out, "kserver_buffer_acquires_total", "Pooled I/O buffers handed out", (double)pool.acquires);
+
+    writeGauge(out, "kserver_output_queue_bytes", "Output queued or held for clients", (double)queueStats.queuedBytes);
+    writeGauge(out, "kserver_sessions_behind", "Sessions whose client isn't keeping up", (double)queueStats.stalledSessions);
+    writeCounter(out, "kserver_behind_seconds_total", "Time sessions have spent behind",
+        queueStats.stallMicroseconds / 1e6);
+    writeCounter(out, "kserver_dropped_bytes_total", "Output dropped for slow clients", (double)queueStats.droppedBytes);
+    writeCounter(out, "kserver_spilled_bytes_total", "Output spilled to disk for slow clients",
+        (double)queueStats.spilledBytes);
+    writeCounter(out, "kserver_log_messages_dropped_total", "Log messages discarded because the log writer was behind",
+        (double)droppedLogMessages());
+    return out;
+}
+
+void RemoteTerminalServer::run() {
+    if (!initialized) {
+        logMessage(LOG_ERROR, "Server not initialized");
+        return;
+    }
+
+    logMessage(LOG_INFO, "Waiting for client connections...");
+
+    // New connections wait here (for at most HELLO_TIMEOUT_MS) until their
+    // hello shows whether they belong to an existing session
+    std::vector<PendingClient> pending;
+    std::vector<WSAPOLLFD> fds;
+    std::vector<size_t> slots;  // Index in fds of each pending client, 0 if not polled
     while (true) {
-        // Receive data from client
-        int iResult = recv(ClientSocket, recvbuf, recvbuflen, 0);
-        if (iResult > 0) {
-            // Null-terminate the received data
-            recvbuf[iResult] = '\0';
-            std::string command(recvbuf);
-            
-            // Remove trailing newline if present
-            if (!command.empty() && command.back() == '\n') {
-                command.pop_back();
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point now = Clock::now();
+        int timeoutMs = -1;
+        fds.resize(1);
+        fds[0].fd = ListenSocket;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        slots.assign(pending.size(), 0);
+        for (size_t i = 0; i < pending.size(); i++) {
+            // A partly received hello keeps the socket readable, so it is
+            // checked again shortly instead of polled
+            if (!pending[i].partial) {
+                WSAPOLLFD fd;
+                fd.fd = pending[i].socket;
+                fd.events = POLLIN;
+                fd.revents = 0;
+                slots[i] = fds.size();
+                fds.push_back(fd);
             }
-            if (!command.empty() && command.back() == '\r') {
-                command.pop_back();
+            int remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(pending[i].deadline - now).count();
+            if (pending[i].partial && remaining > 10) {
+                remaining = 10;
             }
-
-            printf("Received command: %s\n", command.c_str());
-
-            // Check for exit command
-            if (command == "exit" || command == "quit") {
-                shouldStopMonitoring = true;
-                
-                // Send the exit command to shell
-                if (shell.sendCommand(command)) {
-                    // Wait a moment for any final output
-                    Sleep(500);
-                }
-                
-                std::string response = "Goodbye!" END_OF_RESPONSE_MARKER;
-                send(ClientSocket, response.c_str(), (int)response.length(), 0);
-                break;
+            if (remaining < 0) {
+                remaining = 0;
             }
-
-            // Send the command to shell (non-blocking)
-            if (!shell.sendCommand(command)) {
-                std::string errorResponse = getCurrentTimestamp() + "Error: Failed to send command to shell" + END_OF_RESPONSE_MARKER;
-                send(ClientSocket, errorResponse.c_str(), (int)errorResponse.length(), 0);
+            if (timeoutMs < 0 || remaining < timeoutMs) {
+                timeoutMs = remaining;
             }
-            // Note: Output will be handled by the monitoring thread
         }
-        else if (iResult == 0) {
-            printf("Client disconnected\n");
+
+        if (WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs) == SOCKET_ERROR) {
+            // Exiting shells raise SIGCHLD, which poll() isn't restarted after
+            if (WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            logMessage(LOG_ERROR, "poll failed with error: %d", WSAGetLastError());
             break;
         }
-        else {
-            printf("recv failed with error: %d\n", WSAGetLastError());
+        if (stopping) {
             break;
         }
-    }
 
-    // Stop the monitoring thread
-    shouldStopMonitoring = true;
-    if (outputMonitorThread.joinable()) {
-        outputMonitorThread.join();
+        now = Clock::now();
+        for (size_t i = pending.size(); i-- > 0;) {
+            bool readable = slots[i] != 0 && fds[slots[i]].revents != 0;
+            bool expired = now >= pending[i].deadline;
+            if ((readable || expired || pending[i].partial) && routeClient(pending[i], readable, expired)) {
+                pending.erase(pending.begin() + i);
+            }
+        }
+
+        if (fds[0].revents != 0) {
+            SOCKET ClientSocket = accept(ListenSocket, NULL, NULL);
+            if (ClientSocket == INVALID_SOCKET) {
+                logMessage(LOG_ERROR, "accept failed with error: %d", WSAGetLastError());
+                break;
+            }
+            logMessage(LOG_INFO, "Client connected");
+            countMetric(METRIC_CONNECTIONS);
+
+            // The shell must not inherit the socket, or closing it wouldn't
+            // end the connection. Nothing before the session may wait on it.
+            disableInheritance(ClientSocket);
+            setNonBlocking(ClientSocket);
+
+            pending.push_back(PendingClient(ClientSocket, now + std::chrono::milliseconds(HELLO_TIMEOUT_MS)));
+        }
     }
 
-    // Shell will be automatically destroyed when it goes out of scope
-    
-    closesocket(ClientSocket);
-    printf("Client connection closed\n");
+    for (size_t i = 0; i < pending.size(); i++) {
+        closesocket(pending[i].socket);
+    }
 }
 
-void RemoteTerminalServer::run() {
-    if (!initialized) {
-        printf("Server not initialized\n");
+void RemoteTerminalServer::stop() {
+    // Wake the accept thread with a connection of our own
+    stopping = true;
+    SOCKET wake = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (wake == INVALID_SOCKET) {
         return;
     }
+    struct sockaddr_in address;
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(listenPort);
+    connect(wake, (struct sockaddr*)&address, sizeof(address));
+    closesocket(wake);
+}
 
-    printf("Waiting for client connections...\n");
-
-    while (true) {
-        // Accept a client socket
-        SOCKET ClientSocket = accept(ListenSocket, NULL, NULL);
-        if (ClientSocket == INVALID_SOCKET) {
-            printf("accept failed with error: %d\n", WSAGetLastError());
-            break;
-        }
-
-        // Handle client in a separate thread
-        std::thread clientThread(&RemoteTerminalServer::handleClient, this, ClientSocket);
-        clientThread.detach(); // Let the thread run independently
+void RemoteTerminalServer::flushRecordings() {
+    if (recorder) {
+        recorder->flush();
     }
 }
 
 void RemoteTerminalServer::cleanup() {
+    metricsEndpoint.stop();
+
+    // Before the loops, which they start sessions on
+    stopping = true;
+    for (size_t i = 0; i < handshakeThreads.size(); i++) {
+        HandshakeThread& worker = *handshakeThreads[i];
+        char wake = 0;
+        send(worker.wake, &wake, 1, 0);
+        worker.thread.join();
+        closesocket(worker.wake);
+        for (size_t j = 0; j < worker.added.size(); j++) {
+            closesocket(worker.added[j].socket);
+        }
+    }
+    handshakeThreads.clear();
+
+    shellPool.stop();
     if (ListenSocket != INVALID_SOCKET) {
         closesocket(ListenSocket);
     }
+    for (size_t i = 0; i < loops.size(); i++) {
+        loops[i]->stop();
+    }
     if (initialized) {
         WSACleanup();
     }
+    flushLog();
 } 
\ No newline at end of file
@@ -1,39 +1,156 @@
 #pragma once
 
-#pragma comment(lib, "ws2_32.lib")
-
-#define WIN32_LEAN_AND_MEAN
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <iostream>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
+#include "../platform.h"
 #include <string>
 #include <memory>
 #include <thread>
+#include <vector>
+#include <chrono>
 #include <atomic>
 #include <mutex>
 #include <cstdio>
-#include <ctime>
 #include "../common.h"
+#include "../SecureChannel.h"
+#include "EventLoop.h"
+#include "BufferPool.h"
+#include "ClientSession.h"
 #include "PersistentShell.h"
+#include "SessionRegistry.h"
+#include "ShellPool.h"
+#include "SessionRecorder.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "MetricsEndpoint.h"
+
+// How often buffer pool and output queue usage is logged while there is
+// output traffic
+#define POOL_REPORT_INTERVAL_MS 10000
+
+// Enough of a new connection's first bytes to hold any resume hello
+#define HELLO_PEEK_SIZE 1024
+
+// Threads doing TLS handshakes, so a slow or stalled handshake never holds
+// up the accept thread
+#define HANDSHAKE_THREADS 2
+
+// Transport encryption (--tls). Without a certificate and key the server
+// makes a self-signed certificate for the run and logs its fingerprint.
+struct TlsConfig {
+    bool enabled;
+    bool required;          // Plain connections are turned away
+    std::string certificateFile;
+    std::string keyFile;
+};
 
 class RemoteTerminalServer {
 private:
     WSADATA wsaData;
     SOCKET ListenSocket;
     bool initialized;
+    std::string port;
+    unsigned short listenPort;          // As bound, when 'port' is "0"
+    std::atomic<bool> stopping;
+
+    // Shared by every session; declared first so it outlives the loops
+    BufferPool bufferPool;
+    uint64_t reportedAcquires;
+
+    // Read by every session, so set before initialize()
+    OutputQueueConfig queueConfig;
+    OutputQueueStats queueStats;
+    uint64_t reportedQueueEvents;
+
+    // Resumable sessions; set up before the loops start
+    SessionRegistry registry;
+
+    // Session recording (--record); off while the directory is empty.
+    // Sessions share the recorder, which lasts until the last of them has
+    // finished its recording.
+    std::string recordDirectory;
+    uint64_t recordLimit;
+    std::shared_ptr<SessionRecorder> recorder;
 
-    void continuousOutputMonitor(SOCKET clientSocket, PersistentShell& shell, std::atomic<bool>& shouldStop);
-    std::string getCurrentTimestamp();
-    void handleClient(SOCKET ClientSocket);
+    // Shells started ahead of the sessions that will take them
+    ShellPool shellPool;
+
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::atomic<size_t> nextLoop;      // New sessions start on the accept and handshake threads
+
+    // TLS clients are told apart from plain ones by their first byte
+    TlsConfig tlsConfig;
+    std::unique_ptr<TlsServerContext> tls;
+
+    // Scraped from its own thread; 0 leaves it off
+    unsigned short metricsPort;
+    MetricsEndpoint metricsEndpoint;
+
+    // An accepted connection whose hello hasn't been seen yet. Its session
+    // can only be picked once the hello says whether it is a reconnect.
+    // A TLS client is handed to a handshake thread, which reads its hello
+    // once the handshake is done.
+    struct PendingClient {
+        SOCKET socket;      // Non-blocking
+        std::chrono::steady_clock::time_point deadline;
+        bool partial;       // Some of the hello has arrived, the rest is awaited
+        std::unique_ptr<SecureChannel> secure;
+        std::string input;  // Decrypted so far
+        std::string output; // Handshake records the socket hasn't taken yet
+
+        PendingClient(SOCKET socket, std::chrono::steady_clock::time_point deadline)
+            : socket(socket), deadline(deadline), partial(false) {}
+    };
+
+    // Each polls its own TLS clients until their hellos are in. The accept
+    // thread adds clients and wakes it with a datagram to 'wake', a UDP
+    // socket connected to itself.
+    struct HandshakeThread {
+        std::thread thread;
+        SOCKET wake;
+        std::mutex mutex;
+        std::vector<PendingClient> added;
+    };
+    std::vector<std::unique_ptr<HandshakeThread>> handshakeThreads;
+    size_t nextHandshake;
+
+    bool routeClient(PendingClient& client, bool readable, bool expired);
+    bool startHandshakes();
+    void handOff(PendingClient& client);
+    void runHandshakes(HandshakeThread& worker);
+    bool receiveSecure(PendingClient& client);
+    bool sendSecure(PendingClient& client);
+    void resumeClient(SOCKET ClientSocket, const std::string& token, std::unique_ptr<SecureChannel> secure,
+                      const std::string& input);
+    void startSession(EventLoop& loop, SOCKET ClientSocket, bool helloTimedOut, std::unique_ptr<SecureChannel> secure,
+                      const std::string& input);
+    void schedulePoolReport();
+    void reportPoolStats();
+    void reportQueueStats();
+    std::string renderMetrics();
     void cleanup();
 
 public:
     RemoteTerminalServer();
     ~RemoteTerminalServer();
 
+    void setOutputQueue(const OutputQueueConfig& config);
+    void setResumeLimits(size_t scrollbackBytes, DWORD detachTimeoutMs);
+    void setSearchHistory(size_t historyBytes);
+    void setRecording(const std::string& directory, uint64_t limitBytes);
+    void setMetricsPort(unsigned short port);
+    void setShellPool(size_t idlePerDirectory);     // Any time; 0 turns it off
+    void setTls(const TlsConfig& config);
+    void setPort(const std::string& port);     // "0" picks a free one (kBench)
     bool initialize();
+    unsigned short boundPort() const;
     void run();
+
+    // Makes run() return. Any thread; sessions are left to their clients.
+    void stop();
+
+    // Blocks until every recording has been written as far as its
+    // sessions have got (kBench)
+    void flushRecordings();
 }; 
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include "ScreenMirror.h"
+#include <algorithm>
+#include "../FrameProtocol.h"
+
+ScreenMirror::ScreenMirror(int rows, int columns) : sequence(0), acknowledged(0), repaint(true) {
+    stats.writtenBytes = 0;
+    stats.updates = 0;
+    stats.updateBytes = 0;
+    resize(rows, columns);
+}
+
+bool ScreenMirror::resize(int rows, int columns) {
+    rows = std::min(std::max(rows, 1), SCREEN_MAX_ROWS);
+    columns = std::min(std::max(columns, 1), SCREEN_MAX_COLUMNS);
+    if (rows == screen.rows() && columns == screen.columns()) {
+        return false;
+    }
+    screen.resize(rows, columns);
+    repaint = true;
+    return true;
+}
+
+void ScreenMirror::write(const char* data, size_t length) {
+    screen.write(data, length);
+    stats.writtenBytes += length;
+}
+
+void ScreenMirror::writeMessage(const std::string& text) {
+    // As a raw client draws the ones it is sent (RemoteTerminalClient::writeTerminal)
+    std::string message = "\r\n";
+    for (size_t i = 0; i < text.length(); i++) {
+        if (text[i] == '\n') {
+            message += '\r';
+        }
+        message += text[i];
+    }
+    message += "\r\n";
+    screen.write(message.data(), message.length());
+}
+
+void ScreenMirror::makeUpdate(std::string& payload) {
+    beginScreenUpdate(payload, ++sequence);
+    if (repaint) {
+        // Every row, over whatever the client's console shows
+        screen.renderAll(payload);
+        repaint = false;
+    } else {
+        screen.render(payload);
+    }
+    lastUpdate = std::chrono::steady_clock::now();
+    stats.updates++;
+    stats.updateBytes += payload.length() - SCREEN_UPDATE_HEADER_SIZE;
+}
+
+bool ScreenMirror::acknowledge(uint32_t value) {
+    if (value != sequence || !inFlight()) {
+        return false;
+    }
+    acknowledged = value;
+    return true;
+}
+
+void ScreenMirror::reattach() {
+    acknowledged = sequence;
+    repaint = true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "../TerminalScreen.h"
+
+// Screen updates go out at most this often, however fast the shell writes
+// and the client acknowledges
+#define SCREEN_UPDATE_MS 16
+
+// Largest screen a client may ask for
+#define SCREEN_MAX_ROWS 1000
+#define SCREEN_MAX_COLUMNS 1000
+
+// Screen sync counters, reported when the session closes
+struct ScreenStats {
+    uint64_t writtenBytes;      // Shell output drawn on the screen
+    uint64_t updates;
+    uint64_t updateBytes;       // Before compression
+};
+
+// Channel 0's terminal screen for a client that asked for screen sync
+// (FEATURE_SCREEN_SYNC). The shell's output is drawn on a TerminalScreen
+// as it is read; an update is the damage since the previous one, as the
+// escape sequences that repaint it. Only one update is unacknowledged at a
+// time, and the connection keeps them in order, so the screen the damage
+// is relative to is always the one the client has drawn. Whatever the
+// shell draws and overdraws while an update is in flight costs nothing but
+// the memory of one screen.
+//
+// Loop thread only, like the session that owns it.
+class ScreenMirror {
+private:
+    TerminalScreen screen;
+    uint32_t sequence;          // Of the last update made
+    uint32_t acknowledged;      // The last the client has applied
+    bool repaint;               // The client's screen is unknown: draw all of it
+    std::chrono::steady_clock::time_point lastUpdate;
+    ScreenStats stats;
+
+public:
+    ScreenMirror(int rows, int columns);
+
+    // Clears the screen at the new size, clamped to SCREEN_MAX_*; false if
+    // the size is what it was
+    bool resize(int rows, int columns);
+    int rows() const { return screen.rows(); }
+    int columns() const { return screen.columns(); }
+
+    void write(const char* data, size_t length);
+
+    // A message from the server, on a line of its own
+    void writeMessage(const std::string& text);
+
+    bool hasChanges() const { return repaint || screen.isDamaged(); }
+    bool inFlight() const { return acknowledged != sequence; }
+
+    // When the next update may be made
+    std::chrono::steady_clock::time_point nextUpdate() const {
+        return lastUpdate + std::chrono::milliseconds(SCREEN_UPDATE_MS);
+    }
+
+    // Starts 'payload' as a SCREEN_UPDATE and appends the changes since the
+    // last update, which then counts as in flight
+    void makeUpdate(std::string& payload);
+
+    // False for anything but the update in flight
+    bool acknowledge(uint32_t sequence);
+
+    // A new connection: the update in flight is lost, and the client's
+    // screen has to be drawn from scratch
+    void reattach();
+
+    const ScreenStats& statistics() const { return stats; }
+};
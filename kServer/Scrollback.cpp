@@ -0,0 +1,201 @@
+#include "Scrollback.h"
+#include <algorithm>
+#include <cstring>
+#include "../Compression.h"
+
+// Blocks are sealed and replayed on the session's loop thread; each loop
+// shares one compressor between all of its channels
+static thread_local StreamCompressor blockCompressor;
+static thread_local StreamDecompressor blockDecompressor;
+
+Scrollback::Scrollback(size_t capacity, bool indexed)
+    : capacity(capacity), currentStart(0), storedBytes(0), decodedStart(UINT64_MAX), indexed(indexed), lineCount(0),
+      currentLines(0), tailTooLong(false), signatureBytes(0) {
+}
+
+void Scrollback::append(const char* data, size_t length) {
+    while (length > 0) {
+        if (current.capacity() < SCROLLBACK_BLOCK_SIZE) {
+            current.reserve(SCROLLBACK_BLOCK_SIZE);
+        }
+        size_t chunk = SCROLLBACK_BLOCK_SIZE - current.length();
+        if (chunk > length) {
+            chunk = length;
+        }
+        current.append(data, chunk);
+        if (indexed) {
+            lineCount += std::count(data, data + chunk, '\n');
+        }
+        data += chunk;
+        length -= chunk;
+        if (current.length() == SCROLLBACK_BLOCK_SIZE) {
+            seal();
+        }
+    }
+}
+
+void Scrollback::seal() {
+    Block block;
+    block.start = currentStart;
+    block.length = current.length();
+    block.lines = 0;
+    block.newlines = 0;
+    block.lineEnd = 0;
+    blockCompressor.reset();
+    if (indexed) {
+        indexBlock(block, current);
+    }
+    block.compressed = blockCompressor.compress(current.data(), current.length(), block.data);
+    if (!block.compressed) {
+        block.data.swap(current);
+    }
+    block.data.shrink_to_fit();
+    current.clear();
+    currentStart += block.length;
+
+    storedBytes += block.data.length();
+    signatureBytes += block.signature.size() * sizeof(uint64_t);
+    blocks.push_back(std::move(block));
+    while (storedBytes > capacity && !blocks.empty()) {
+        storedBytes -= blocks.front().data.length();
+        signatureBytes -= blocks.front().signature.size() * sizeof(uint64_t);
+        blocks.pop_front();
+    }
+}
+
+void Scrollback::indexBlock(Block& block, const std::string& raw) {
+    size_t lastNewline = raw.rfind('\n');
+    const char* last = (lastNewline != std::string::npos) ? raw.data() + lastNewline : NULL;
+    block.lines = currentLines;
+    block.newlines = (uint32_t)std::count(raw.begin(), raw.end(), '\n');
+    block.lineEnd = last ? (uint32_t)(last - raw.data() + 1) : 0;
+    currentLines += block.newlines;
+
+    // The lines that end in the block: the one carried over from the block
+    // before, then the block up to its last newline. Trigrams never span
+    // lines, as patterns don't.
+    if (last && !tailTooLong) {
+        block.signature.assign(SEARCH_SIGNATURE_BITS / 64, 0);
+        uint64_t* bits = block.signature.data();
+        unsigned char a = '\n';
+        unsigned char b = '\n';
+        const std::string* parts[2] = {&lineTail, &raw};
+        size_t lengths[2] = {lineTail.length(), block.lineEnd};
+        for (int part = 0; part < 2; part++) {
+            const unsigned char* text = (const unsigned char*)parts[part]->data();
+            for (size_t i = 0; i < lengths[part]; i++) {
+                unsigned char c = foldCase(text[i]);
+                if (a != '\n' && b != '\n' && c != '\n') {
+                    uint32_t bit = trigramBit(a, b, c);
+                    bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+                }
+                a = b;
+                b = c;
+            }
+        }
+    }
+
+    // What follows the last newline ends in a later block
+    if (last) {
+        lineTail.assign(last + 1, raw.data() + raw.length());
+        tailTooLong = false;
+    } else {
+        lineTail.append(raw);
+    }
+    if (lineTail.length() > SEARCH_CARRY_LIMIT) {
+        lineTail.clear();
+        tailTooLong = true;
+    }
+}
+
+uint64_t Scrollback::begin() const {
+    return blocks.empty() ? currentStart : blocks.front().start;
+}
+
+uint64_t Scrollback::end() const {
+    return currentStart + current.length();
+}
+
+void Scrollback::read(uint64_t offset, size_t maxLength, std::string& out) {
+    out.clear();
+    if (offset >= currentStart) {
+        size_t skip = (size_t)(offset - currentStart);
+        if (skip < current.length()) {
+            out.assign(current, skip, maxLength);
+        }
+        return;
+    }
+
+    // Sealed blocks are contiguous, so the one holding 'offset' is found
+    // by a binary search on their starts
+    size_t low = 0;
+    size_t high = blocks.size();
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (blocks[middle].start <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    const Block& block = blocks[low];
+
+    const char* data = block.data.data();
+    if (block.compressed) {
+        if (decodedStart != block.start) {
+            const char* decompressed;
+            size_t decompressedLength;
+            blockDecompressor.reset();
+            if (!blockDecompressor.decompress(block.data.data(), block.data.length(), decompressed, decompressedLength,
+                    block.length) || decompressedLength != block.length) {
+                return;
+            }
+            decoded.assign(decompressed, decompressedLength);
+            decodedStart = block.start;
+        }
+        data = decoded.data();
+    }
+
+    size_t skip = (size_t)(offset - block.start);
+    size_t length = block.length - skip < maxLength ? block.length - skip : maxLength;
+    out.assign(data + skip, length);
+
+    // Done with this block
+    if (skip + length == block.length) {
+        decoded.clear();
+        decoded.shrink_to_fit();
+        decodedStart = UINT64_MAX;
+    }
+}
+
+size_t Scrollback::memoryBytes() const {
+    return storedBytes + current.capacity() + decoded.capacity() + signatureBytes + lineTail.capacity();
+}
+
+uint64_t Scrollback::beginLine() const {
+    return blocks.empty() ? currentLines : blocks.front().lines;
+}
+
+bool Scrollback::indexAt(uint64_t offset, BlockIndex& index) const {
+    if (blocks.empty() || offset < blocks.front().start || offset >= currentStart) {
+        return false;
+    }
+    size_t low = 0;
+    size_t high = blocks.size();
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (blocks[middle].start <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    const Block& block = blocks[low];
+    index.start = block.start;
+    index.length = block.length;
+    index.lines = block.lines;
+    index.newlines = block.newlines;
+    index.lineEnd = block.lineEnd;
+    index.signature = block.signature.empty() ? NULL : &block.signature;
+    return true;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Raw output collected before a block is sealed (and compressed)
+#define SCROLLBACK_BLOCK_SIZE (32 * 1024)
+
+#define DEFAULT_SCROLLBACK_BYTES (1024 * 1024)
+
+// What a channel keeps for searching (FEATURE_SEARCH), if more than its
+// scrollback
+#define DEFAULT_SEARCH_HISTORY_BYTES (16 * 1024 * 1024)
+
+// Search index: bits in each block's trigram signature, and the longest
+// line carried into a block that is indexed with it
+#define SEARCH_SIGNATURE_SHIFT 13
+#define SEARCH_SIGNATURE_BITS (1 << SEARCH_SIGNATURE_SHIFT)
+#define SEARCH_CARRY_LIMIT 4096
+
+// The most recent shell output of one channel, kept so a client that
+// reconnects can be sent what it missed. Offsets count bytes of the
+// channel's output stream from the start of the session.
+//
+// Output is stored in blocks of SCROLLBACK_BLOCK_SIZE. A full block is
+// compressed on its own (when that pays off), so any block can be decoded
+// without the ones before it, and the oldest blocks are discarded once the
+// ring holds more than its capacity. Memory use is bounded by the capacity
+// plus one raw block, however much more the compressed blocks cover.
+//
+// An indexed scrollback is also a channel's search history. As each block
+// is sealed it records where its lines are and a signature of the
+// trigrams in the lines that end in it (ASCII case folded, one bit per
+// hashed trigram, SEARCH_SIGNATURE_BITS in all), so a search only has to
+// read blocks whose signature has every bit of its pattern's trigrams.
+// Line numbers count newlines from the start of the session.
+class Scrollback {
+public:
+    // What the index knows about a sealed block
+    struct BlockIndex {
+        uint64_t start;
+        size_t length;
+        uint64_t lines;         // Newlines before the block
+        uint32_t newlines;      // In it
+        uint32_t lineEnd;       // Just past its last newline (0 with none)
+        const std::vector<uint64_t>* signature;     // NULL if it can't rule anything out
+    };
+
+private:
+    struct Block {
+        uint64_t start;
+        size_t length;          // Raw bytes
+        bool compressed;
+        std::string data;
+
+        // Indexed only
+        uint64_t lines;
+        uint32_t newlines;
+        uint32_t lineEnd;
+        std::vector<uint64_t> signature;    // Empty if a line too long to index ends in the block
+    };
+
+    size_t capacity;
+    std::deque<Block> blocks;   // Sealed, oldest first
+    std::string current;        // The block being filled
+    uint64_t currentStart;
+    size_t storedBytes;         // In 'blocks'
+
+    // Decoded copy of the last block read, so a replay that reads a block
+    // in several pieces decompresses it once
+    uint64_t decodedStart;
+    std::string decoded;
+
+    bool indexed;
+    uint64_t lineCount;         // Newlines appended
+    uint64_t currentLines;      // Newlines before 'current'
+    std::string lineTail;       // Start of the line the last sealed block ended in
+    bool tailTooLong;           // Longer than SEARCH_CARRY_LIMIT
+    size_t signatureBytes;
+
+    void seal();
+    void indexBlock(Block& block, const std::string& raw);
+
+public:
+    Scrollback(size_t capacity, bool indexed = false);
+
+    void append(const char* data, size_t length);
+
+    uint64_t begin() const;     // Oldest offset still held
+    uint64_t end() const;       // Offset of the next byte to be appended
+
+    // Replaces 'out' with up to 'maxLength' bytes starting at 'offset',
+    // which must be within [begin(), end()]. Stops at a block boundary.
+    void read(uint64_t offset, size_t maxLength, std::string& out);
+
+    size_t memoryBytes() const;
+
+    // Indexed only. Newlines before begin() and in all, and the sealed
+    // block holding 'offset' (false if it is in the block being filled).
+    uint64_t beginLine() const;
+    uint64_t endLine() const { return lineCount; }
+    bool indexAt(uint64_t offset, BlockIndex& index) const;
+
+    // How the index folds case: ASCII letters only
+    static unsigned char foldCase(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+    }
+
+    // The signature bit of a trigram, case folded
+    static uint32_t trigramBit(unsigned char a, unsigned char b, unsigned char c) {
+        uint32_t trigram = ((uint32_t)a << 16) | ((uint32_t)b << 8) | c;
+        return (trigram * 2654435761u) >> (32 - SEARCH_SIGNATURE_SHIFT);
+    }
+};
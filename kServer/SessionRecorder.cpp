@@ -0,0 +1,344 @@
+#include "SessionRecorder.h"
+#include "Log.h"
+#include "../Checksum.h"
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+
+static uint64_t wallClockMicroseconds() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static std::string partName(uint64_t startTime, uint32_t serial, uint32_t part) {
+    // UTC, so the names sort by age whatever the time zone did meanwhile
+    std::chrono::sys_seconds seconds(std::chrono::seconds(startTime / 1000000));
+    std::chrono::sys_days day = std::chrono::floor<std::chrono::days>(seconds);
+    std::chrono::year_month_day date(day);
+    std::chrono::hh_mm_ss<std::chrono::seconds> time(seconds - day);
+    char name[64];
+    snprintf(name, sizeof(name), "%04d%02u%02u-%02d%02d%02d-%06u-%03u" RECORDING_EXTENSION, (int)date.year(),
+        (unsigned)date.month(), (unsigned)date.day(), (int)time.hours().count(), (int)time.minutes().count(),
+        (int)time.seconds().count(), serial, part);
+    return name;
+}
+
+SessionRecording::SessionRecording(std::shared_ptr<SessionRecorder> recorder, uint32_t serial)
+    : recorder(recorder), serial(serial), startTime(wallClockMicroseconds()), recordCount(0), firstTime(0), lastTime(0),
+      lostBytes(0) {
+}
+
+SessionRecording::~SessionRecording() {
+    {
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        recorder->recordings.erase(this);
+    }
+    recorder->submit(*this, true);
+}
+
+void SessionRecording::record(uint16_t channel, uint8_t stream, uint64_t time, const char* data, size_t length) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (records.empty()) {
+            firstTime = time;
+            started = std::chrono::steady_clock::now();
+            records.reserve(RECORDING_CHUNK_BYTES + RECORDING_RECORD_HEADER_SIZE + length);
+        }
+        appendRecordingRecord(records, time, channel, stream, data, length);
+        recordCount++;
+        lastTime = time;
+        if (records.length() < RECORDING_CHUNK_BYTES) {
+            return;
+        }
+    }
+    recorder->submit(*this, false);
+}
+
+SessionRecorder::SessionRecorder() : limitBytes(DEFAULT_RECORDING_LIMIT_BYTES), partLimit(RECORDING_PART_BYTES),
+    queuedBytes(0), submitted(0), completed(0), stopping(false), nextSerial(1), diskBytes(0), bytesRecorded(0),
+    bytesLost(0) {
+}
+
+SessionRecorder::~SessionRecorder() {
+    // Every recording has ended by now: each holds a reference
+    if (writerThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeWriter.notify_one();
+        writerThread.join();
+    }
+}
+
+bool SessionRecorder::start(const std::string& path, uint64_t limit) {
+    directory = path;
+    limitBytes = limit;
+    partLimit = std::max<uint64_t>(std::min<uint64_t>(RECORDING_PART_BYTES, limit / 8), RECORDING_CHUNK_BYTES);
+
+    // Parts left by earlier runs count towards the limit, and serial
+    // numbers carry on after theirs
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    std::filesystem::directory_iterator it(directory, error);
+    if (error) {
+        logMessage(LOG_ERROR, "Unable to record sessions in %s: %s", directory.c_str(), error.message().c_str());
+        return false;
+    }
+    for (; it != std::filesystem::directory_iterator(); it.increment(error)) {
+        std::string name = it->path().filename().string();
+        if (it->path().extension() != RECORDING_EXTENSION || !it->is_regular_file(error)) {
+            continue;
+        }
+        uint64_t size = it->file_size(error);
+        files[name] = size;
+        diskBytes += size;
+        uint32_t serial = (name.length() > 22) ? (uint32_t)strtoul(name.c_str() + 16, NULL, 10) : 0;
+        nextSerial = std::max(nextSerial, serial + 1);
+    }
+    enforceLimit();
+    writerThread = std::thread(&SessionRecorder::run, this);
+    return true;
+}
+
+std::unique_ptr<SessionRecording> SessionRecorder::startRecording() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<SessionRecording> recording(new SessionRecording(shared_from_this(), nextSerial++));
+    recordings.insert(recording.get());
+    if (recordings.size() == 1) {
+        wakeWriter.notify_one();
+    }
+    return recording;
+}
+
+SessionRecorder::Chunk SessionRecorder::takeChunk(SessionRecording& recording, bool last) {
+    // Caller holds recording.mutex
+    Chunk chunk;
+    chunk.serial = recording.serial;
+    chunk.startTime = recording.startTime;
+    chunk.records.swap(recording.records);
+    chunk.recordCount = recording.recordCount;
+    chunk.firstTime = recording.firstTime;
+    chunk.lastTime = recording.lastTime;
+    chunk.lostBytes = recording.lostBytes;
+    chunk.last = last;
+    recording.recordCount = 0;
+    recording.lostBytes = 0;
+    return chunk;
+}
+
+void SessionRecorder::submit(SessionRecording& recording, bool last) {
+    Chunk chunk;
+    {
+        std::lock_guard<std::mutex> lock(recording.mutex);
+        if (recording.records.empty() && !last) {
+            return;
+        }
+        chunk = takeChunk(recording, last);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    accept(std::move(chunk), last ? NULL : &recording);
+}
+
+void SessionRecorder::accept(Chunk chunk, SessionRecording* recording) {
+    // Caller holds 'mutex'. A writer that has fallen this far behind loses
+    // the chunk, and the recording's next one says how much went missing;
+    // the end of a recording is always taken, to complete its part.
+    if (queuedBytes + chunk.records.length() > RECORDING_QUEUE_LIMIT) {
+        bytesLost += chunk.records.length();
+        if (recording) {
+            std::lock_guard<std::mutex> lock(recording->mutex);
+            recording->lostBytes += chunk.lostBytes + chunk.records.length();
+            return;
+        }
+        chunk.records.clear();
+    }
+    queuedBytes += chunk.records.length();
+    queue.push_back(std::move(chunk));
+    submitted++;
+    if (queue.size() == 1) {
+        wakeWriter.notify_one();
+    }
+}
+
+void SessionRecorder::flushWaiting(std::chrono::steady_clock::time_point before) {
+    // Caller holds 'mutex'. Output that stops short of a full chunk is
+    // written anyway, so a recording is never more than a second or two
+    // behind its session.
+    for (std::set<SessionRecording*>::iterator it = recordings.begin(); it != recordings.end(); ++it) {
+        SessionRecording& recording = **it;
+        Chunk chunk;
+        {
+            std::lock_guard<std::mutex> lock(recording.mutex);
+            if (recording.records.empty() || recording.started > before) {
+                continue;
+            }
+            chunk = takeChunk(recording, false);
+        }
+        accept(std::move(chunk), &recording);
+    }
+}
+
+void SessionRecorder::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    flushWaiting(std::chrono::steady_clock::time_point::max());
+    uint64_t target = submitted;
+    wakeWriter.notify_one();
+    written.wait(lock, [this, target]() { return completed >= target; });
+}
+
+void SessionRecorder::run() {
+    std::vector<Chunk> batch;
+    uint64_t reportedLost = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        // Sessions with records waiting are looked at every RECORDING_FLUSH_MS;
+        // with none, the writer sleeps until there is work
+        if (recordings.empty()) {
+            wakeWriter.wait(lock, [this]() { return stopping || !queue.empty() || !recordings.empty(); });
+        } else {
+            wakeWriter.wait_for(lock, std::chrono::milliseconds(RECORDING_FLUSH_MS),
+                                [this]() { return stopping || !queue.empty(); });
+        }
+        flushWaiting(std::chrono::steady_clock::now() - std::chrono::milliseconds(RECORDING_FLUSH_MS));
+        if (queue.empty()) {
+            if (stopping) {
+                break;
+            }
+            continue;
+        }
+        batch.swap(queue);
+        queuedBytes = 0;
+        lock.unlock();
+
+        // The disk is only touched here, outside the lock
+        for (size_t i = 0; i < batch.size(); i++) {
+            write(batch[i]);
+        }
+        for (std::map<uint32_t, Part>::iterator it = parts.begin(); it != parts.end(); ++it) {
+            if (it->second.file) {
+                fflush(it->second.file);
+            }
+        }
+        enforceLimit();
+        if (bytesLost != reportedLost) {
+            logMessage(LOG_WARNING, "Recording fell behind, %llu bytes not recorded",
+                (unsigned long long)(bytesLost - reportedLost));
+            reportedLost = bytesLost;
+        }
+        size_t count = batch.size();
+        batch.clear();
+
+        lock.lock();
+        completed += count;
+        written.notify_all();
+    }
+}
+
+void SessionRecorder::write(Chunk& chunk) {
+    Part& part = parts[chunk.serial];
+    if (!chunk.records.empty()) {
+        // Each chunk is compressed on its own, so any of them can be read
+        // without the ones before it
+        compressor.reset();
+        bool packed = compressor.compress(chunk.records.data(), chunk.records.length(), compressed);
+        const std::string& stored = packed ? compressed : chunk.records;
+
+        if (part.file && part.size + RECORDING_CHUNK_HEADER_SIZE + stored.length() > partLimit) {
+            closePart(part);
+        }
+        if (!part.file && !openPart(chunk, part)) {
+            bytesLost += chunk.records.length();
+        } else {
+            RecordingChunk entry;
+            entry.fileOffset = part.size;
+            entry.storedLength = (uint32_t)stored.length();
+            entry.rawLength = (uint32_t)chunk.records.length();
+            entry.records = chunk.recordCount;
+            entry.firstTime = chunk.firstTime;
+            entry.lastTime = chunk.lastTime;
+            entry.recordOffset = part.recordBytes;
+            entry.lostBytes = chunk.lostBytes;
+            entry.checksum = adler32(ADLER32_INIT, chunk.records.data(), chunk.records.length());
+            entry.compressed = packed;
+            std::string header = makeRecordingChunkHeader(entry);
+            if (fwrite(header.data(), 1, header.length(), part.file) != header.length() ||
+                fwrite(stored.data(), 1, stored.length(), part.file) != stored.length()) {
+                logMessage(LOG_WARNING, "Unable to write %s, recording stopped", part.name.c_str());
+                bytesLost += chunk.records.length();
+                fclose(part.file);
+                part.file = NULL;
+            } else {
+                uint64_t length = header.length() + stored.length();
+                part.size += length;
+                part.recordBytes += chunk.records.length();
+                part.chunks.push_back(entry);
+                files[part.name] = part.size;
+                diskBytes += length;
+                bytesRecorded += chunk.records.length();
+            }
+        }
+    }
+    if (chunk.last) {
+        if (part.file) {
+            closePart(part);
+        }
+        parts.erase(chunk.serial);
+    }
+}
+
+bool SessionRecorder::openPart(const Chunk& chunk, Part& part) {
+    // Parts are numbered from 1 for each recording
+    part.header.startTime = chunk.startTime;
+    part.header.session = chunk.serial;
+    part.header.part++;
+    part.name = partName(part.header.startTime, part.header.session, part.header.part);
+    std::string path = (std::filesystem::path(directory) / part.name).string();
+    part.file = fopen(path.c_str(), "wb");
+    if (!part.file) {
+        logMessage(LOG_WARNING, "Unable to create %s", path.c_str());
+        return false;
+    }
+    std::string header = makeRecordingHeader(part.header);
+    if (fwrite(header.data(), 1, header.length(), part.file) != header.length()) {
+        fclose(part.file);
+        part.file = NULL;
+        return false;
+    }
+    part.size = header.length();
+    part.chunks.clear();
+    files[part.name] = part.size;
+    diskBytes += part.size;
+    return true;
+}
+
+void SessionRecorder::closePart(Part& part) {
+    // The index goes last, so a part cut off before it is still readable
+    std::string index = makeRecordingIndex(part.chunks, part.size);
+    if (fwrite(index.data(), 1, index.length(), part.file) == index.length()) {
+        part.size += index.length();
+        diskBytes += index.length();
+        files[part.name] = part.size;
+    }
+    fclose(part.file);
+    part.file = NULL;
+    part.chunks.clear();
+}
+
+void SessionRecorder::enforceLimit() {
+    // Oldest first, leaving alone the parts still being written
+    std::map<std::string, uint64_t>::iterator it = files.begin();
+    while (diskBytes > limitBytes && it != files.end()) {
+        bool open = false;
+        for (std::map<uint32_t, Part>::iterator part = parts.begin(); part != parts.end() && !open; ++part) {
+            open = part->second.file && part->second.name == it->first;
+        }
+        std::error_code error;
+        if (open || !std::filesystem::remove(std::filesystem::path(directory) / it->first, error)) {
+            ++it;
+            continue;
+        }
+        diskBytes -= it->second;
+        it = files.erase(it);
+    }
+}
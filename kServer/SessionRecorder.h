@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <set>
+#include <thread>
+#include <vector>
+#include "../Recording.h"
+#include "../Compression.h"
+
+// Records are handed to the writer in chunks of about this much, or once
+// the oldest of them is RECORDING_FLUSH_MS old
+#define RECORDING_CHUNK_BYTES (64 * 1024)
+#define RECORDING_FLUSH_MS 1000
+
+// A part is closed and the next one started at this size (or an eighth of
+// the disk limit, if that is smaller)
+#define RECORDING_PART_BYTES (64 * 1024 * 1024)
+
+// Chunks waiting for the writer, at most; beyond this they are lost, and
+// the next chunk written says how much
+#define RECORDING_QUEUE_LIMIT (64 * 1024 * 1024)
+
+// Disk used by all recordings unless --record-limit says otherwise
+#define DEFAULT_RECORDING_LIMIT_BYTES (1024ull * 1024 * 1024)
+
+class SessionRecorder;
+
+// One session's recording. The session's loop thread appends records to a
+// chunk in memory, which costs a copy of the bytes and an uncontended
+// lock; full chunks go to the recorder's writer thread, which compresses
+// and writes them.
+class SessionRecording {
+private:
+    std::shared_ptr<SessionRecorder> recorder;
+    uint32_t serial;
+    uint64_t startTime;
+
+    // Taken by the writer thread too, for chunks that have been waiting
+    // RECORDING_FLUSH_MS
+    std::mutex mutex;
+    std::string records;
+    uint32_t recordCount;
+    uint64_t firstTime;
+    uint64_t lastTime;
+    std::chrono::steady_clock::time_point started;  // When 'records' got its first record
+    uint64_t lostBytes;         // Not accepted by the writer since the last chunk it took
+
+    SessionRecording(const SessionRecording&) = delete;
+    SessionRecording& operator=(const SessionRecording&) = delete;
+
+    friend class SessionRecorder;
+
+public:
+    SessionRecording(std::shared_ptr<SessionRecorder> recorder, uint32_t serial);
+
+    // The last chunk is written and the part completed
+    ~SessionRecording();
+
+    // Output from a shell, or input sent to it (STREAM_STDIN), at 'time'
+    // (microseconds since 1970)
+    void record(uint16_t channel, uint8_t stream, uint64_t time, const char* data, size_t length);
+};
+
+// Writes every session's recording (--record <directory>) from one thread,
+// and keeps the directory within its disk limit by deleting the oldest
+// parts. A part is named after its session's start time, serial number and
+// part number, so sorting the names sorts them by age.
+class SessionRecorder : public std::enable_shared_from_this<SessionRecorder> {
+private:
+    struct Chunk {
+        uint32_t serial;
+        uint64_t startTime;     // Of the session
+        std::string records;
+        uint32_t recordCount;
+        uint64_t firstTime;
+        uint64_t lastTime;
+        uint64_t lostBytes;
+        bool last;              // The recording has ended
+    };
+
+    // A recording's current part, writer thread only
+    struct Part {
+        FILE* file;             // NULL between parts
+        std::string name;
+        RecordingHeader header;
+        uint64_t size;
+        uint64_t recordBytes;   // In the whole recording so far
+        std::vector<RecordingChunk> chunks;
+
+        Part() : file(NULL), size(0), recordBytes(0) {
+            header.startTime = 0;
+            header.session = 0;
+            header.part = 0;
+        }
+    };
+
+    std::string directory;
+    uint64_t limitBytes;
+    uint64_t partLimit;
+
+    std::mutex mutex;
+    std::condition_variable wakeWriter;
+    std::condition_variable written;
+    std::vector<Chunk> queue;
+    size_t queuedBytes;
+    uint64_t submitted;         // Chunks queued since startup
+    uint64_t completed;         // Chunks written (or given up on)
+    bool stopping;
+    std::set<SessionRecording*> recordings;
+    uint32_t nextSerial;
+    std::thread writerThread;
+
+    // Writer thread only
+    std::map<uint32_t, Part> parts;
+    std::map<std::string, uint64_t> files;      // Every part in the directory, by name, with its size
+    uint64_t diskBytes;
+    StreamCompressor compressor;
+    std::string compressed;
+
+    std::atomic<uint64_t> bytesRecorded;
+    std::atomic<uint64_t> bytesLost;
+
+    friend class SessionRecording;
+    static Chunk takeChunk(SessionRecording& recording, bool last);
+    void submit(SessionRecording& recording, bool last);
+    void accept(Chunk chunk, SessionRecording* recording);
+    void flushWaiting(std::chrono::steady_clock::time_point before);
+    void run();
+    void write(Chunk& chunk);
+    bool openPart(const Chunk& chunk, Part& part);
+    void closePart(Part& part);
+    void enforceLimit();
+
+public:
+    SessionRecorder();
+    ~SessionRecorder();
+
+    // Starts the writer; false, logged, if the directory can't be used
+    bool start(const std::string& directory, uint64_t limitBytes);
+
+    // A new session's recording, under a serial number of its own
+    std::unique_ptr<SessionRecording> startRecording();
+
+    // Blocks until every chunk handed over so far has been written (kBench)
+    void flush();
+
+    uint64_t recordedBytes() const { return bytesRecorded; }
+    uint64_t lostBytes() const { return bytesLost; }
+    const std::string& path() const { return directory; }
+};
@@ -0,0 +1,86 @@
+#include "SessionRegistry.h"
+#include "../FrameProtocol.h"
+#include "Scrollback.h"
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+SessionRegistry::SessionRegistry()
+    : scrollbackBytes(DEFAULT_SCROLLBACK_BYTES), detachTimeoutMs(DEFAULT_DETACH_TIMEOUT_MS), historyBytes(DEFAULT_SEARCH_HISTORY_BYTES),
+      sessionRecorder(NULL) {
+}
+
+void SessionRegistry::setLimits(size_t scrollback, DWORD detachTimeout) {
+    scrollbackBytes = scrollback;
+    detachTimeoutMs = detachTimeout;
+}
+
+size_t SessionRegistry::scrollbackLimit() const {
+    return scrollbackBytes;
+}
+
+DWORD SessionRegistry::detachTimeout() const {
+    return detachTimeoutMs;
+}
+
+void SessionRegistry::setSearchHistory(size_t history) {
+    historyBytes = history;
+}
+
+size_t SessionRegistry::searchHistoryLimit() const {
+    return historyBytes;
+}
+
+void SessionRegistry::setRecorder(SessionRecorder* recorder) {
+    sessionRecorder = recorder;
+}
+
+SessionRecorder* SessionRegistry::recorder() const {
+    return sessionRecorder;
+}
+
+std::string SessionRegistry::add(ClientSession* session, EventLoop& loop) {
+    // The token is all a client needs to take over the shells, so it must
+    // not be guessable
+    static std::random_device random;
+    std::string token(SESSION_TOKEN_SIZE, '\0');
+    std::lock_guard<std::mutex> lock(mutex);
+    do {
+        for (size_t i = 0; i < token.length(); i += 4) {
+            uint32_t value = random();
+            memcpy(&token[i], &value, 4);
+        }
+    } while (sessions.count(token));
+    Entry entry = { session, &loop };
+    sessions[token] = entry;
+    return token;
+}
+
+void SessionRegistry::remove(const std::string& token) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sessions.erase(token);
+}
+
+EventLoop* SessionRegistry::loopFor(const std::string& token) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, Entry>::iterator it = sessions.find(token);
+    return it != sessions.end() ? it->second.loop : NULL;
+}
+
+ClientSession* SessionRegistry::find(const std::string& token, EventLoop& loop) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, Entry>::iterator it = sessions.find(token);
+    return (it != sessions.end() && it->second.loop == &loop) ? it->second.session : NULL;
+}
+
+size_t SessionRegistry::count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return sessions.size();
+}
+
+std::string describeToken(const std::string& token) {
+    char text[9];
+    snprintf(text, sizeof(text), "%02x%02x%02x%02x", (unsigned char)token[0], (unsigned char)token[1],
+        (unsigned char)token[2], (unsigned char)token[3]);
+    return text;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../platform.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+class ClientSession;
+class EventLoop;
+class SessionRecorder;
+
+// How long a session whose client has gone keeps its shells running
+#define DEFAULT_DETACH_TIMEOUT_MS (60 * 60 * 1000)
+
+// Resumable sessions (FEATURE_RESUME), by token. The accept thread looks up
+// which loop a reconnecting client's session lives on; the session itself
+// is only touched on that loop.
+class SessionRegistry {
+private:
+    struct Entry {
+        ClientSession* session;
+        EventLoop* loop;
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Entry> sessions;
+
+    // Read by every session, so set before the server starts
+    size_t scrollbackBytes;
+    DWORD detachTimeoutMs;
+    size_t historyBytes;
+    SessionRecorder* sessionRecorder;
+
+public:
+    SessionRegistry();
+
+    void setLimits(size_t scrollbackBytes, DWORD detachTimeoutMs);
+    size_t scrollbackLimit() const;
+    DWORD detachTimeout() const;
+
+    // FEATURE_SEARCH: what each shell keeps to search, if more than its
+    // scrollback
+    void setSearchHistory(size_t historyBytes);
+    size_t searchHistoryLimit() const;
+
+    // --record: where new sessions are recorded; NULL (the default) for
+    // nowhere
+    void setRecorder(SessionRecorder* recorder);
+    SessionRecorder* recorder() const;
+
+    // Registers a session and returns its new token
+    std::string add(ClientSession* session, EventLoop& loop);
+    void remove(const std::string& token);
+
+    // Any thread. NULL if no session has the token.
+    EventLoop* loopFor(const std::string& token);
+
+    // The session's loop thread only: the session can't go away meanwhile
+    ClientSession* find(const std::string& token, EventLoop& loop);
+
+    size_t count();
+};
+
+// Token prefix for log lines
+std::string describeToken(const std::string& token);
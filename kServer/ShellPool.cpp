@@ -0,0 +1,139 @@
+#include "ShellPool.h"
+#include "Log.h"
+#include "Metrics.h"
+#include <vector>
+
+ShellPool::ShellPool() : target(DEFAULT_SHELL_POOL_SIZE), stopping(false) {
+}
+
+ShellPool::~ShellPool() {
+    stop();
+}
+
+void ShellPool::setSize(size_t idlePerDirectory) {
+    // Closed outside the lock, so claims don't wait on it
+    std::vector<std::unique_ptr<PersistentShell>> surplus;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        target = idlePerDirectory;
+        for (auto it = idle.begin(); it != idle.end(); ++it) {
+            while (it->second.size() > target) {
+                surplus.push_back(std::move(it->second.back()));
+                it->second.pop_back();
+                adjustGauge(METRIC_IDLE_SHELLS, -1);
+            }
+        }
+    }
+    wakeRefill.notify_one();
+}
+
+size_t ShellPool::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return target;
+}
+
+void ShellPool::start(const std::string& workingDir) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle[Key(workingDir, SHELL_TERM_LINE)];
+        stopping = false;
+    }
+    refillThread = std::thread(&ShellPool::refill, this);
+}
+
+void ShellPool::stop() {
+    if (!refillThread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeRefill.notify_one();
+    refillThread.join();
+
+    for (auto it = idle.begin(); it != idle.end(); ++it) {
+        adjustGauge(METRIC_IDLE_SHELLS, -(int64_t)it->second.size());
+    }
+    idle.clear();
+}
+
+void ShellPool::refill() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        // The first directory and terminal short of shells
+        auto it = idle.begin();
+        while (it != idle.end() && it->second.size() >= target) {
+            ++it;
+        }
+        if (it == idle.end()) {
+            wakeRefill.wait(lock);
+            continue;
+        }
+        Key key = it->first;
+
+        // Starting the process is the slow part this thread is here for
+        lock.unlock();
+        std::unique_ptr<PersistentShell> shell(new PersistentShell(key.first, key.second));
+        lock.lock();
+        if (!shell->isActive()) {
+            wakeRefill.wait_for(lock, std::chrono::milliseconds(SHELL_POOL_RETRY_MS), [this]() { return stopping; });
+            continue;
+        }
+        std::deque<std::unique_ptr<PersistentShell>>& shells = idle[key];
+        if (shells.size() < target) {
+            shells.push_back(std::move(shell));
+            adjustGauge(METRIC_IDLE_SHELLS, 1);
+            continue;
+        }
+
+        // The pool shrank meanwhile
+        lock.unlock();
+        shell.reset();
+        lock.lock();
+    }
+}
+
+std::unique_ptr<PersistentShell> ShellPool::claim(const std::string& workingDir, const std::string& terminal) {
+    std::string directory = workingDir;
+    if (directory.empty()) {
+        char buffer[MAX_PATH];
+        GetCurrentDirectoryA(MAX_PATH, buffer);
+        directory = buffer;
+    }
+
+    std::unique_ptr<PersistentShell> shell;
+    std::vector<std::unique_ptr<PersistentShell>> exited;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Key key(directory, terminal);
+        auto it = idle.find(key);
+        if (it != idle.end()) {
+            // Oldest first, so none sits idle for long
+            while (!shell && !it->second.empty()) {
+                std::unique_ptr<PersistentShell> candidate = std::move(it->second.front());
+                it->second.pop_front();
+                adjustGauge(METRIC_IDLE_SHELLS, -1);
+                if (candidate->hasExited()) {
+                    exited.push_back(std::move(candidate));
+                } else {
+                    shell = std::move(candidate);
+                }
+            }
+        } else if (target > 0 && refillThread.joinable() && idle.size() < SHELL_POOL_MAX_DIRECTORIES) {
+            // Keep this one warm from now on
+            idle[key];
+        }
+    }
+    wakeRefill.notify_one();
+
+    if (!exited.empty()) {
+        logMessage(LOG_WARNING, "Discarded %zu idle shells that had exited", exited.size());
+    }
+    if (shell) {
+        countMetric(METRIC_SHELL_POOL_HITS);
+        return shell;
+    }
+    countMetric(METRIC_SHELL_POOL_MISSES);
+    return std::unique_ptr<PersistentShell>(new PersistentShell(directory, terminal));
+}
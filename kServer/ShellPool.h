@@ -0,0 +1,58 @@
+#pragma once
+
+#include "../platform.h"
+#include "PersistentShell.h"
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+// Idle shells kept ready per working directory unless --shell-pool says
+// otherwise
+#define DEFAULT_SHELL_POOL_SIZE 4
+
+// Directories (and terminal types) beyond this many start their shells on
+// demand only
+#define SHELL_POOL_MAX_DIRECTORIES 8
+
+// Pause after a shell fails to start before the pool tries again
+#define SHELL_POOL_RETRY_MS 1000
+
+// Shells started ahead of time, so a new session or channel can take one
+// instead of waiting for a process to start. Every shell gets the server's
+// environment, so the working directory and the terminal type it was
+// started for are all that tell them apart; each pair asked for is kept
+// topped up by the pool's own thread.
+class ShellPool {
+private:
+    std::mutex mutex;
+    std::condition_variable wakeRefill;
+    typedef std::pair<std::string, std::string> Key;    // Directory, terminal type
+    std::map<Key, std::deque<std::unique_ptr<PersistentShell>>> idle;
+    size_t target;          // Idle shells per directory; 0 turns the pool off
+    bool stopping;
+    std::thread refillThread;
+
+    void refill();
+
+public:
+    ShellPool();
+    ~ShellPool();
+
+    // Any thread. Shrinking closes the surplus idle shells.
+    void setSize(size_t idlePerDirectory);
+    size_t size();
+
+    // Starts the refill thread, warming up 'workingDir' first
+    void start(const std::string& workingDir);
+    void stop();
+
+    // Any thread. An idle shell for the directory (the server's own if
+    // empty) and terminal type, or else one started right here; check
+    // isActive().
+    std::unique_ptr<PersistentShell> claim(const std::string& workingDir = "", const std::string& terminal = SHELL_TERM_LINE);
+};
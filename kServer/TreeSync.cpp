@@ -0,0 +1,327 @@
+#include "TreeSync.h"
+#include "Log.h"
+#include "Metrics.h"
+
+// Suffix of the file a target is rebuilt into before it replaces the target
+#define SYNC_TEMPORARY_SUFFIX ".ksync-tmp"
+
+// A file list entry must stay inside the synced directory
+static bool isTreePath(const std::string& text) {
+    std::filesystem::path path(text);
+    if (text.empty() || text.find('\0') != std::string::npos || path.is_absolute() || path.has_root_name() ||
+        path.has_root_directory()) {
+        return false;
+    }
+    for (std::filesystem::path::iterator it = path.begin(); it != path.end(); ++it) {
+        if (*it == "..") {
+            return false;
+        }
+    }
+    return true;
+}
+
+TreeSync::TreeSync(EventLoop& loop, uint16_t id, const std::filesystem::path& root, std::function<void(std::string frame)> send)
+    : loop(loop), send(send), root(root), scanning(false), nextFile(0), cancelled(false), updated(0), written(0), failed(0),
+      startTime(std::chrono::steady_clock::now()), id(id) {
+}
+
+TreeSync::~TreeSync() {
+    stopWorkers();
+    while (!rebuilds.empty()) {
+        closeRebuild(rebuilds.begin()->first, false);
+    }
+}
+
+void TreeSync::stopWorkers() {
+    // Batches already posted find nothing to deliver to
+    if (link) {
+        link->deliver = nullptr;
+    }
+    cancelled = true;
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+}
+
+bool TreeSync::handle(uint8_t message, const char* body, size_t length) {
+    std::string error;
+    if (message == SYNC_FILES && !scanning) {
+        std::vector<SyncFile> files;
+        if (!decodeSyncFiles(body, length, files)) {
+            error = "Invalid file list";
+        }
+        for (size_t i = 0; i < files.size() && error.empty(); i++) {
+            if (!isTreePath(files[i].path)) {
+                error = "Invalid path " + files[i].path;
+                break;
+            }
+            Entry entry;
+            entry.file = files[i];
+            entry.state = FILE_LISTED;
+            entry.basisBlockSize = 0;
+            entry.basisSize = 0;
+            entries.push_back(entry);
+        }
+    } else if (message == SYNC_SCAN && !scanning) {
+        std::error_code failure;
+        scanning = true;
+        if (!std::filesystem::create_directories(root, failure) && !std::filesystem::is_directory(root)) {
+            error = "Unable to create " + root.string();
+        } else {
+            scan();
+        }
+    } else if (message == SYNC_DELTA && scanning) {
+        if (!applyDelta(body, length)) {
+            error = "Unexpected delta";
+        }
+    } else if (message == SYNC_COMMIT && scanning) {
+        if (!commit(body, length)) {
+            error = "Unexpected commit";
+        }
+    } else if (message != SYNC_END) {
+        error = "Unexpected sync message " + std::to_string((unsigned)message);
+    }
+    if (message != SYNC_END && error.empty()) {
+        return true;
+    }
+
+    // Files the client never finished stay as they were
+    stopWorkers();
+    while (!rebuilds.empty()) {
+        closeRebuild(rebuilds.begin()->first, false);
+    }
+    if (error.empty() && failed > 0) {
+        error = firstError;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (error.empty()) {
+        logMessage(LOG_INFO, "Sync %u: %s, updated %u of %zu files (%llu bytes) in %.3f s", (unsigned)id,
+            root.string().c_str(), updated, entries.size(), (unsigned long long)written, seconds);
+    } else {
+        logMessage(LOG_WARNING, "Sync %u of %s failed: %s", (unsigned)id, root.string().c_str(), error.c_str());
+    }
+    countMetric(METRIC_SYNCS);
+
+    SyncResultPayload result;
+    result.status = error.empty() ? FILE_OK : FILE_FAILED;
+    result.updated = updated;
+    result.written = written;
+    result.message = error;
+    send(makeSyncFrame(id, SYNC_RESULT, makeSyncResult(result)));
+    return false;
+}
+
+void TreeSync::scan() {
+    if (entries.empty()) {
+        return;
+    }
+    link = std::make_shared<Link>();
+    link->deliver = [this](Batch& batch) {
+        deliver(batch);
+    };
+    int threads = syncThreads(entries.size());
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&TreeSync::signFiles, this);
+    }
+}
+
+void TreeSync::signFiles() {
+    // Worker thread. Files are taken one at a time, so a few large ones
+    // don't leave the other threads idle; 'entries' doesn't change while
+    // they run.
+    std::shared_ptr<Link> target = link;
+    Batch batch;
+    while (!cancelled) {
+        size_t index = nextFile++;
+        if (index < entries.size()) {
+            FileSignature signature;
+            signFile((uint32_t)index, signature);
+            appendFileSignature(batch.body, signature);
+            signature.blocks.clear();
+            batch.files.push_back(signature);
+        }
+        if (!batch.files.empty() && (index >= entries.size() || batch.body.length() >= SYNC_BATCH_BYTES)) {
+            loop.post([target, batch]() mutable {
+                if (target->deliver) {
+                    target->deliver(batch);
+                }
+            });
+            batch = Batch();
+        }
+        if (index >= entries.size()) {
+            break;
+        }
+    }
+}
+
+void TreeSync::signFile(uint32_t index, FileSignature& signature) {
+    const SyncFile& file = entries[index].file;
+    std::filesystem::path target = root / std::filesystem::path(file.path);
+    signature.file = index;
+
+    // Same size and write time: what the last sync left there
+    std::error_code error;
+    if (std::filesystem::is_regular_file(target, error)) {
+        uint64_t size = std::filesystem::file_size(target, error);
+        std::filesystem::file_time_type time = std::filesystem::last_write_time(target, error);
+        if (!error && size == file.size && syncWriteTime(time) == file.writeTime) {
+            signature.blockSize = 0;
+            signature.size = size;
+            return;
+        }
+        FILE* basis = error ? NULL : fopen(target.string().c_str(), "rb");
+        if (basis) {
+            bool ok = computeSignature(basis, size, cancelled, signature);
+            fclose(basis);
+            if (ok) {
+                return;
+            }
+        }
+    }
+
+    // No copy to start from: the client sends all of it
+    signature.blockSize = syncBlockSize(0);
+    signature.size = 0;
+    signature.blocks.clear();
+}
+
+void TreeSync::deliver(Batch& batch) {
+    for (size_t i = 0; i < batch.files.size(); i++) {
+        Entry& entry = entries[batch.files[i].file];
+        entry.basisBlockSize = batch.files[i].blockSize;
+        entry.basisSize = batch.files[i].size;
+        entry.state = batch.files[i].blockSize == 0 ? FILE_DONE : FILE_SIGNED;
+    }
+    send(makeSyncFrame(id, SYNC_SIGNATURES, batch.body));
+}
+
+TreeSync::Rebuild* TreeSync::startRebuild(uint32_t index) {
+    Entry& entry = entries[index];
+    if (entry.state == FILE_WRITING) {
+        return &rebuilds[index];
+    }
+    std::filesystem::path target = root / std::filesystem::path(entry.file.path);
+    std::error_code error;
+    std::filesystem::create_directories(target.parent_path(), error);
+
+    Rebuild rebuild;
+    rebuild.basis = NULL;
+    rebuild.temporary = target;
+    rebuild.temporary += SYNC_TEMPORARY_SUFFIX;
+    if (entry.basisSize > 0 && !(rebuild.basis = fopen(target.string().c_str(), "rb"))) {
+        fail(index, "Unable to read " + entry.file.path);
+        return NULL;
+    }
+    rebuild.output = fopen(rebuild.temporary.string().c_str(), "wb");
+    if (!rebuild.output) {
+        if (rebuild.basis) {
+            fclose(rebuild.basis);
+        }
+        fail(index, "Unable to write " + entry.file.path);
+        return NULL;
+    }
+    rebuild.applier.reset(new DeltaApplier(rebuild.basis, entry.basisSize, entry.basisBlockSize, rebuild.output));
+    entry.state = FILE_WRITING;
+    Rebuild& started = rebuilds[index];
+    started = std::move(rebuild);
+    return &started;
+}
+
+bool TreeSync::applyDelta(const char* body, size_t length) {
+    uint32_t index;
+    if (!decodeSyncFileHeader(body, length, index) || index >= entries.size() ||
+        (entries[index].state != FILE_SIGNED && entries[index].state != FILE_WRITING &&
+         entries[index].state != FILE_BROKEN)) {
+        return false;
+    }
+    Entry& entry = entries[index];
+    Rebuild* rebuild = entry.state == FILE_BROKEN ? NULL : startRebuild(index);
+    if (!rebuild) {
+        return true;
+    }
+    DeltaApplier& applier = *rebuild->applier;
+    uint64_t literal = applier.literalBytes;
+    if (!applier.apply(body + 4, length - 4) || applier.written > entry.file.size) {
+        fail(index, "Unable to rebuild " + entry.file.path);
+        return true;
+    }
+    countMetric(METRIC_SYNC_BYTES_RECEIVED, applier.literalBytes - literal);
+    return true;
+}
+
+bool TreeSync::commit(const char* body, size_t length) {
+    uint32_t index;
+    uint64_t hash;
+    if (!decodeSyncCommit(body, length, index, hash) || index >= entries.size() ||
+        (entries[index].state != FILE_SIGNED && entries[index].state != FILE_WRITING &&
+         entries[index].state != FILE_BROKEN)) {
+        return false;
+    }
+    Entry& entry = entries[index];
+
+    // An empty file has no delta, so it starts here
+    Rebuild* rebuild = entry.state == FILE_BROKEN ? NULL : startRebuild(index);
+    if (!rebuild) {
+        return true;
+    }
+    if (rebuild->applier->written != entry.file.size || rebuild->applier->digest() != hash) {
+        fail(index, "Checksum mismatch for " + entry.file.path);
+    } else if (!closeRebuild(index, true)) {
+        fail(index, "Unable to replace " + entry.file.path);
+    } else {
+        entry.state = FILE_DONE;
+        updated++;
+        written += entry.file.size;
+        countMetric(METRIC_SYNC_FILES);
+    }
+    return true;
+}
+
+bool TreeSync::closeRebuild(uint32_t index, bool keep) {
+    std::map<uint32_t, Rebuild>::iterator it = rebuilds.find(index);
+    if (it == rebuilds.end()) {
+        return false;
+    }
+    Rebuild& rebuild = it->second;
+    const SyncFile& file = entries[index].file;
+    std::filesystem::path target = root / std::filesystem::path(file.path);
+    if (rebuild.basis) {
+        fclose(rebuild.basis);
+    }
+    bool ok = fclose(rebuild.output) == 0 && keep;
+
+    // The new copy keeps the old one's permissions (an executable script
+    // stays executable) and takes the client's write time, which is what
+    // the next sync compares
+    std::error_code error;
+    if (ok) {
+        std::filesystem::file_status status = std::filesystem::status(target, error);
+        if (!error && std::filesystem::exists(status)) {
+            std::filesystem::permissions(rebuild.temporary, status.permissions(), error);
+        }
+        std::filesystem::rename(rebuild.temporary, target, error);
+        ok = !error;
+        if (ok) {
+            std::filesystem::last_write_time(target, syncFileTime(file.writeTime), error);
+        }
+    }
+    if (!ok) {
+        std::filesystem::remove(rebuild.temporary, error);
+    }
+    rebuilds.erase(it);
+    return ok;
+}
+
+void TreeSync::fail(uint32_t index, const std::string& error) {
+    Entry& entry = entries[index];
+    if (entry.state == FILE_WRITING) {
+        closeRebuild(index, false);
+    }
+    entry.state = FILE_BROKEN;
+    failed++;
+    if (firstError.empty()) {
+        firstError = error;
+    }
+    logMessage(LOG_WARNING, "Sync %u: %s", (unsigned)id, error.c_str());
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../platform.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../FrameProtocol.h"
+#include "../DeltaSync.h"
+#include "EventLoop.h"
+
+// The server's end of one directory sync (FEATURE_SYNC), under the id the
+// client gave it. Signatures of the files already there are computed by a
+// few worker threads, so a large tree is read on several cores while the
+// loop goes on serving; they hand each batch to the loop, which sends it.
+// Deltas are applied on the loop thread as their frames arrive, into a
+// temporary file beside each target that replaces it once its hash checks
+// out.
+class TreeSync {
+private:
+    enum FileState {
+        FILE_LISTED,        // Signature not sent yet
+        FILE_SIGNED,
+        FILE_WRITING,       // A delta has started arriving
+        FILE_DONE,
+        FILE_BROKEN,        // Failed; the rest of its frames are ignored
+    };
+
+    struct Entry {
+        SyncFile file;
+        FileState state;
+        uint32_t basisBlockSize;
+        uint64_t basisSize;
+    };
+
+    // A file being rebuilt
+    struct Rebuild {
+        FILE* basis;
+        FILE* output;
+        std::filesystem::path temporary;
+        std::unique_ptr<DeltaApplier> applier;
+    };
+
+    // What the workers post to the loop: a SYNC_SIGNATURES body and the
+    // block size and size of each file in it
+    struct Batch {
+        std::string body;
+        std::vector<FileSignature> files;  // Without their blocks
+    };
+
+    // Lets queued batches find the sync, until it goes
+    struct Link {
+        std::function<void(Batch&)> deliver;
+    };
+
+    EventLoop& loop;
+    std::function<void(std::string frame)> send;
+    std::filesystem::path root;
+    std::vector<Entry> entries;
+    std::map<uint32_t, Rebuild> rebuilds;
+    bool scanning;
+
+    std::vector<std::thread> workers;
+    std::atomic<size_t> nextFile;
+    std::atomic<bool> cancelled;
+    std::shared_ptr<Link> link;
+
+    uint32_t updated;
+    uint64_t written;
+    uint32_t failed;
+    std::string firstError;
+    std::chrono::steady_clock::time_point startTime;
+
+    void scan();
+    void signFiles();
+    void signFile(uint32_t index, FileSignature& signature);
+    void deliver(Batch& batch);
+    Rebuild* startRebuild(uint32_t index);
+    bool applyDelta(const char* body, size_t length);
+    bool commit(const char* body, size_t length);
+    bool closeRebuild(uint32_t index, bool keep);
+    void fail(uint32_t index, const std::string& error);
+    void stopWorkers();
+
+public:
+    uint16_t id;
+
+    // 'send' queues a frame for the client; it is only called on the loop
+    // thread
+    TreeSync(EventLoop& loop, uint16_t id, const std::filesystem::path& root, std::function<void(std::string frame)> send);
+    ~TreeSync();
+
+    const std::filesystem::path& directory() const { return root; }
+
+    // A client message after SYNC_BEGIN. False once the sync is over and
+    // its SYNC_RESULT has been sent (SYNC_END, or a request that makes no
+    // sense), when the sync can be destroyed.
+    bool handle(uint8_t message, const char* body, size_t length);
+};
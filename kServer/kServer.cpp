@@ -1,17 +1,120 @@
 #include <iostream>
+#include <cstdlib>
+#include <string>
 #include "RemoteTerminalServer.h"
 
-int main() {
+static void printUsage() {
+    printf("Usage: kServer [--queue-limit <KB>] [--overflow block|drop|spill] [--scrollback <KB>] [--detach-timeout <s>]\n");
+    printf("               [--log-level error|warning|info|debug|trace] [--metrics-port <port>]\n");
+    printf("               [--shell-pool <idle shells>] [--search-history <KB>]\n");
+    printf("               [--record <directory>] [--record-limit <MB>]\n");
+    printf("               [--tls] [--tls-cert <pem> --tls-key <pem>] [--tls-required]\n");
+}
+
+int main(int argc, char* argv[]) {
     printf("Remote Terminal Server Starting...\n");
 
+    // How much output a session may queue for a slow client, and what
+    // happens past that
+    OutputQueueConfig queueConfig;
+    queueConfig.limitBytes = DEFAULT_OUTPUT_QUEUE_LIMIT;
+    queueConfig.policy = OVERFLOW_BLOCK;
+
+    // What a resumable session keeps for a client that has dropped off
+    size_t scrollbackBytes = DEFAULT_SCROLLBACK_BYTES;
+    DWORD detachTimeoutMs = DEFAULT_DETACH_TIMEOUT_MS;
+
+    // What each shell keeps for clients to search, compressed
+    size_t searchHistoryBytes = DEFAULT_SEARCH_HISTORY_BYTES;
+
+    // Off unless asked for: the stats endpoint listens on loopback only
+    unsigned short metricsPort = 0;
+
+    // Shells started ahead of time per working directory; 0 starts each
+    // session's shell when it connects
+    size_t shellPoolSize = DEFAULT_SHELL_POOL_SIZE;
+
+    // Sessions are recorded only when given a directory, which is kept
+    // within the limit by deleting the oldest recordings
+    std::string recordDirectory;
+    uint64_t recordLimitBytes = DEFAULT_RECORDING_LIMIT_BYTES;
+
+    // Encryption is offered alongside plain connections unless required;
+    // any of the options turns it on
+    TlsConfig tlsConfig;
+    tlsConfig.enabled = false;
+    tlsConfig.required = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--queue-limit" && i + 1 < argc) {
+            queueConfig.limitBytes = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "block") {
+                queueConfig.policy = OVERFLOW_BLOCK;
+            } else if (policy == "drop") {
+                queueConfig.policy = OVERFLOW_DROP_OLDEST;
+            } else if (policy == "spill") {
+                queueConfig.policy = OVERFLOW_SPILL;
+            } else {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--scrollback" && i + 1 < argc) {
+            scrollbackBytes = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (arg == "--search-history" && i + 1 < argc) {
+            searchHistoryBytes = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (arg == "--detach-timeout" && i + 1 < argc) {
+            detachTimeoutMs = (DWORD)strtoul(argv[++i], NULL, 10) * 1000;
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            LogLevel level;
+            if (!parseLogLevel(argv[++i], level)) {
+                printUsage();
+                return 1;
+            }
+            setLogLevel(level);
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            metricsPort = (unsigned short)strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--shell-pool" && i + 1 < argc) {
+            shellPoolSize = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordDirectory = argv[++i];
+        } else if (arg == "--record-limit" && i + 1 < argc) {
+            recordLimitBytes = (uint64_t)strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+        } else if (arg == "--tls") {
+            tlsConfig.enabled = true;
+        } else if (arg == "--tls-cert" && i + 1 < argc) {
+            tlsConfig.enabled = true;
+            tlsConfig.certificateFile = argv[++i];
+        } else if (arg == "--tls-key" && i + 1 < argc) {
+            tlsConfig.enabled = true;
+            tlsConfig.keyFile = argv[++i];
+        } else if (arg == "--tls-required") {
+            tlsConfig.enabled = true;
+            tlsConfig.required = true;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
     RemoteTerminalServer server;
-    
+    server.setOutputQueue(queueConfig);
+    server.setResumeLimits(scrollbackBytes, detachTimeoutMs);
+    server.setSearchHistory(searchHistoryBytes);
+    server.setMetricsPort(metricsPort);
+    server.setShellPool(shellPoolSize);
+    server.setTls(tlsConfig);
+    if (!recordDirectory.empty()) {
+        server.setRecording(recordDirectory, recordLimitBytes);
+    }
+
     if (!server.initialize()) {
-        printf("Failed to initialize server\n");
+        logMessage(LOG_ERROR, "Failed to initialize server");
         return 1;
     }
 
     server.run();
-    
+
     return 0;
 }
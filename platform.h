@@ -0,0 +1,123 @@
+#pragma once
+
+// Portability layer shared by the client, server and benchmark. On Windows
+// this is just the Winsock and Win32 headers; elsewhere the handful of Win32
+// names the sources use are mapped onto their POSIX counterparts, so the
+// socket code is shared rather than duplicated.
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+// A pipe or socket that can be attached to an EventLoop
+typedef HANDLE IoHandle;
+#define INVALID_IO_HANDLE NULL
+
+// Keeps a socket out of the shells started by the server
+inline void disableInheritance(SOCKET socket) {
+    SetHandleInformation((HANDLE)socket, HANDLE_FLAG_INHERIT, 0);
+}
+
+// Sends and receives that would wait fail with WSAEWOULDBLOCK instead
+inline bool setNonBlocking(SOCKET socket) {
+    u_long enabled = 1;
+    return ioctlsocket(socket, FIONBIO, &enabled) == 0;
+}
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+typedef int SOCKET;
+typedef int IoHandle;
+typedef int BOOL;
+typedef unsigned long DWORD;
+typedef unsigned long ULONG;
+typedef struct pollfd WSAPOLLFD;
+
+struct WSADATA {
+    int unused;
+};
+
+#define TRUE 1
+#define FALSE 0
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define INVALID_IO_HANDLE (-1)
+#define INFINITE 0xFFFFFFFFul
+#define MAX_PATH PATH_MAX
+#define SD_SEND SHUT_WR
+#define SD_BOTH SHUT_RDWR
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAEINTR EINTR
+#define MAKEWORD(low, high) ((unsigned short)(((low) & 0xFF) | (((high) & 0xFF) << 8)))
+
+inline int WSAStartup(unsigned short, WSADATA*) {
+    // A peer that goes away must show up as a send error, not SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+inline int WSACleanup() {
+    return 0;
+}
+
+inline int WSAGetLastError() {
+    return errno;
+}
+
+inline DWORD GetLastError() {
+    return (DWORD)errno;
+}
+
+inline int closesocket(SOCKET socket) {
+    return close(socket);
+}
+
+inline int WSAPoll(WSAPOLLFD* fds, ULONG count, int timeoutMs) {
+    return poll(fds, (nfds_t)count, timeoutMs);
+}
+
+inline void ZeroMemory(void* destination, size_t length) {
+    memset(destination, 0, length);
+}
+
+inline int localtime_s(struct tm* result, const time_t* time) {
+    return localtime_r(time, result) ? 0 : errno;
+}
+
+inline DWORD GetCurrentDirectoryA(DWORD length, char* buffer) {
+    return getcwd(buffer, length) ? (DWORD)strlen(buffer) : 0;
+}
+
+// Keeps a socket out of the shells started by the server
+inline void disableInheritance(SOCKET socket) {
+    fcntl(socket, F_SETFD, FD_CLOEXEC);
+}
+
+// Sends and receives that would wait fail with WSAEWOULDBLOCK instead
+inline bool setNonBlocking(SOCKET socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+#endif